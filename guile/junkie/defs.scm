@@ -309,9 +309,9 @@
 (define*-public (start-resizer-thread  #:key
                                 (min-collision-avg 4)   ; collision average under which we will make hash tables bigger
                                 (max-collision-avg 16)  ; collision average above which we will make hash tables smaller
-                                (min-hash-size     11)  ; minimal hash table size under which we won't venture
-                                (max-hash-size     353) ; maximal etc
-                                ; So by default we can happily store 353*16*2=11k different sockets between two given hosts
+                                (min-hash-size     16)  ; minimal hash table size under which we won't venture (sizes are powers of 2)
+                                (max-hash-size     512) ; maximal etc
+                                ; So by default we can happily store 512*16*2=16k different sockets between two given hosts
                                 (period            60)) ; how many seconds we wait between two measurments (it's important to wait for the stats to settle)
   (let* ((limiter (make-mux-hash-controller
                     min-collision-avg max-collision-avg min-hash-size max-hash-size))
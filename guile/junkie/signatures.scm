@@ -8,6 +8,9 @@
 
 (nm:reset-register-types)
 
+; Signatures which payload must start with some known bytes also give them in a list of
+; prefixes, so that they are not even tried on other payloads.
+
 (add-proto-signature "SSLv2" 1 'medium
                      (nm:compile
                        type:bool '(tcp) '(and ((nb-bytes rest) >= 3)
@@ -24,7 +27,8 @@
                                               ((rest @ 1) == 3)
                                               (or
                                                 ((rest @ 2) == 1) ; TLS v3.1
-                                                ((rest @ 2) == 0))))) ; TLS v3.0
+                                                ((rest @ 2) == 0)))) ; TLS v3.0
+                     '("\x16\x03" "\x17\x03"))
 
 (add-proto-signature "Bittorrent" 4 'medium
                      (nm:compile
@@ -74,7 +78,8 @@
                                                     (str-in-bytes rest "user-agent: gnucleus")
                                                     (str-in-bytes rest "user-agent: gnotella")
                                                     (str-in-bytes rest "user-agent: limewire")
-                                                    (str-in-bytes rest "user-agent: imesh"))))))
+                                                    (str-in-bytes rest "user-agent: imesh")))))
+                     '("gnd" "gnutella" "get /"))
 
 (add-proto-signature "RTP" 6 'medium
                      (nm:compile
@@ -82,7 +87,8 @@
                                               ((udp.dst-port & 1) == 0)
                                               ; ^\x80[\x01-"`-\x7f\x80-\xa2\xe0-\xff]?..........*\x80
                                               ((nb-bytes rest) >= 11)
-                                              ((rest @ 0) == #x80)))) ; the rest does not worth the trouble
+                                              ((rest @ 0) == #x80))) ; the rest does not worth the trouble
+                     '("\x80"))
 
 ; Discovery of HTTP payload
 (add-proto-signature "HTTP" 7 'medium
@@ -95,7 +101,8 @@
                                              (starts-with rest "PUT ")
                                              (starts-with rest "OPTIONS ")
                                              (starts-with rest "TRACE ")
-                                             (starts-with rest "DELETE "))))
+                                             (starts-with rest "DELETE ")))
+                     '("HTTP/1" "GET " "HEAD " "POST " "CONNECT " "PUT " "OPTIONS " "TRACE " "DELETE "))
 
 ; Discovery of FTP payload
 (add-proto-signature "FTP" 8 'medium
@@ -108,7 +115,8 @@
                                              (starts-with rest "STOR ")
                                              (starts-with rest "STOU ")
                                              (starts-with rest "FEAT ")
-                                             (starts-with rest "OPTS "))))
+                                             (starts-with rest "OPTS ")))
+                     '("PASV " "RETR " "STOR " "STOU " "FEAT " "OPTS "))
 
 ; Discovery of SIP payload
 (add-proto-signature "SIP" 9 'medium
@@ -118,7 +126,8 @@
                                              (starts-with rest "REGISTER ")
                                              (starts-with rest "ACK ")
                                              (starts-with rest "OPTIONS ")
-                                             (starts-with rest "CANCEL "))))
+                                             (starts-with rest "CANCEL ")))
+                     '("INVITE " "SIP/2.0" "REGISTER " "ACK " "OPTIONS " "CANCEL "))
 
 ; Discovery of MGCP payload
 (add-proto-signature "MGCP" 10 'medium
@@ -129,18 +138,21 @@
                                              (starts-with rest "DLCX ")
                                              (starts-with rest "EPCF ")
                                              (starts-with rest "CRCX ")
-                                             (starts-with rest "RSIP "))))
+                                             (starts-with rest "RSIP ")))
+                     '("NTFY " "RQNT " "MDCX " "DLCX " "EPCF " "CRCX " "RSIP "))
 
 ; Chat services
 (add-proto-signature "IRC" 11 'low
                      (nm:compile
                        type:bool '(tcp) '(and ((nb-bytes rest) >= 8)
-                                              ((firsts 5 rest) == #(#x4e #x49 #x43 #x4b #x20))))) ; "NICK "
+                                              ((firsts 5 rest) == #(#x4e #x49 #x43 #x4b #x20)))) ; "NICK "
+                     '("NICK "))
 
 (add-proto-signature "Jabber" 12 'low
                      (nm:compile
                        type:bool '(tcp) '(and ((nb-bytes rest) >= 14)
-                                              ((firsts 14 rest) == #(#x3c #x73 #x74 #x72 #x65 #x61 #x6d #x3a #x73 #x74 #x72 #x65 #x61 #x6d)))))
+                                              ((firsts 14 rest) == #(#x3c #x73 #x74 #x72 #x65 #x61 #x6d #x3a #x73 #x74 #x72 #x65 #x61 #x6d))))
+                     '("<stream:stream"))
 
 
 ; Other, mostly windows related
@@ -155,7 +167,8 @@
                                               ((rest @ 9) == 48)
                                               ((rest @ 10) >= 48) ; then from 0
                                               ((rest @ 10) <= 57) ; to 9
-                                              ((rest @ 11) == 10)))) ; then \n
+                                              ((rest @ 11) == 10))) ; then \n
+                     '("RFB 00"))
 
 ; Detection of Netbios session for smb over tcp
 (add-proto-signature "Netbios" 14 'low
@@ -165,7 +178,8 @@
                                               ((rest @ 4) == #xff)
                                               ((rest @ 5) == #x53) ; S
                                               ((rest @ 6) == #x4d) ; M
-                                              ((rest @ 7) == #x42)))) ; B
+                                              ((rest @ 7) == #x42))) ; B
+                     '("\x00"))
 
 (add-proto-signature "PCanywhere" 15 'medium
                      (nm:compile
@@ -188,7 +202,8 @@
                                               ((rest @ 4) <= #xfe)
                                               ((rest @ 6) == #xff)
                                               ((rest @ 7) >= #xfb)
-                                              ((rest @ 7) <= #xfe))))
+                                              ((rest @ 7) <= #xfe)))
+                     '("\xff"))
 
 (add-proto-signature "BGP" 18 'medium
                      (nm:compile
@@ -199,17 +214,20 @@
                                                        ((rest @ 18) <= 4))
                                                   (and ((rest @ 18) == 1)
                                                        ((rest @ 19) >= 3)
-                                                       ((rest @ 19) <= 4))))))
+                                                       ((rest @ 19) <= 4)))))
+                     '("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"))
 
 (add-proto-signature "IMAP" 19 'low
                      (nm:compile
                        type:bool '(tcp) '(and ((nb-bytes rest) >= 4)
-                                              (starts-with rest "* OK"))))
+                                              (starts-with rest "* OK")))
+                     '("* OK"))
 
 (add-proto-signature "POP" 20 'low
                      (nm:compile
                        type:bool '(tcp) '(and ((nb-bytes rest) > 7)
-                                              (starts-with rest "+OK POP"))))
+                                              (starts-with rest "+OK POP")))
+                     '("+OK POP"))
 
 (add-proto-signature "NTP" 21 'low
                      (nm:compile
@@ -259,7 +277,8 @@
                                                       (starts-with rest "EHLO ")))
                                              (starts-with rest "MAIL FROM:")
                                              (starts-with rest "RCPT TO:")
-                                             (starts-with rest "VRFY "))))
+                                             (starts-with rest "VRFY ")))
+                     '("HELO " "EHLO " "MAIL FROM:" "RCPT TO:" "VRFY "))
 
 
 ; Sql signatures
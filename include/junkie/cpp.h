@@ -14,6 +14,7 @@
  * - unused_, to avoid some warnings,
  * - a_la_printf_, to check parameters according to a format string,
  * - packed_, to pack data structures.
+ * - aligned_, to align data structures (on cache lines for instance).
  * - sentinel_, to check a variadic list is NULL terminated
  *
  * Of these, only the last one must be implemented in a way or another
@@ -30,6 +31,7 @@
 #   define unused_ __attribute__((__unused__))
 #   define a_la_printf_(str_i, arg_i) __attribute__((__format__(__printf__, str_i, arg_i)))
 #   define packed_ __attribute__((__packed__))
+#   define aligned_(n) __attribute__((__aligned__(n)))
 #   define sentinel_ __attribute__((__sentinel__))
 #else
 #   define pure_
@@ -41,6 +43,7 @@
 #   define unused_
 #   define a_la_printf_
 #   define packed_
+#   define aligned_(n)
 #   define sentinel_
 #endif
 
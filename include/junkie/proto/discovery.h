@@ -2,7 +2,9 @@
 // vim:sw=4 ts=4 sts=4 expandtab
 #ifndef DISCOVERY_H_120717
 #define DISCOVERY_H_120717
+#include <stdbool.h>
 #include <junkie/proto/proto.h>
+#include <junkie/tools/ip_addr.h>
 #include <junkie/cpp.h>
 
 /** @file
@@ -16,6 +18,12 @@
  *   thus pass it to the proper parser (and qualify the conntracker)
  * - discover that it's for a proto we do not parse, and append a new proto_info
  *   containing this discovery.
+ *
+ * Since the discovery would otherwise be run again on every packet of a flow
+ * it cannot classify, transport parsers give up on a flow after a while
+ * (see discovery_failed()). The servers given up on are remembered for some
+ * time, so that new flows to them skip the discovery altogether (see
+ * discovery_skip()).
  */
 
 extern struct proto *proto_discovery;
@@ -33,6 +41,23 @@ struct discovery_proto_info {
     } protocol;
 };
 
+/// Per flow state of the discovery, for transport parsers that keep some per flow state.
+struct discovery_flow {
+    unsigned nb_fails;  ///< How many payloads the discovery failed to classify
+    size_t nb_bytes;    ///< Their total size
+};
+
+void discovery_flow_ctor(struct discovery_flow *);
+
+/// Tells the discovery failed to classify a payload of a flow to this server.
+/** @returns true if it's time to give up the discovery for this flow.
+ * Notice flow can be NULL if the transport parser keeps no state per flow (then
+ * it's the server that's given up on). */
+bool discovery_failed(struct discovery_flow *, unsigned ip_proto, struct ip_addr const *srv_addr, uint16_t srv_port, size_t payload, struct timeval const *now);
+
+/// @returns true if the discovery recently gave up on one end of this new flow, which should then not bother with it.
+bool discovery_skip(unsigned ip_proto, struct ip_addr const addr[2], uint16_t const port[2], struct timeval const *now);
+
 void discovery_init(void);
 void discovery_fini(void);
 
@@ -0,0 +1,103 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef FLOW_CACHE_H_261018
+#define FLOW_CACHE_H_261018
+#include <stdbool.h>
+#include <stdint.h>
+#include <junkie/config.h>
+#include <junkie/proto/proto.h>
+#include <junkie/proto/ip.h>    // for struct ip_key
+#include <junkie/proto/port_muxer.h>    // for struct port_key
+#include <junkie/tools/timeval.h>
+
+/** @file
+ * @brief A per thread cache of the subparsers of established flows
+ *
+ * For a TCP (or UDP) packet, the IP parser looks for its subparser keyed on
+ * the addresses, then the TCP parser looks for its subparser keyed on the
+ * ports. The flow cache maps the full 5-tuple, as seen by a given IP parser
+ * (and thus for a given device/VLAN when these are not collapsed), straight to
+ * both subparsers, so that later packets of the same flow need only one
+ * lookup, in a small direct mapped table private to the sniffing thread.
+ *
+ * It works like this:
+ *
+ * - the IP parser calls flow_cache_ctx_ctor() before its own lookup, which
+ *   returns the IP subparser if the flow is in the cache (and remembers the
+ *   transport subparser);
+ * - the IP parser then calls flow_cache_ctx_push() just before parsing its
+ *   payload, and flow_cache_ctx_dtor() right after;
+ * - in between, the transport parser calls flow_cache_lookup() instead of
+ *   mux_subparser_lookup(), and flow_cache_store() once it found its
+ *   subparser the slow way.
+ *
+ * Cache entries own a ref to both subparsers, so that they can be checked
+ * safely: an entry is valid as long as both subparsers are still indexed (a
+ * subparser is deindexed when it's timeouted or killed for any reason) and the
+ * transport subparser still has the same key. Stale entries are dropped when
+ * met, and every second the timebounder thread drops the stale entries of all
+ * caches so that deindexed subparsers are not kept alive much longer than
+ * before.
+ */
+
+struct flow_cache;
+struct flow_cache_entry;
+
+/// The 5-tuple, as found in the packet (ie. not ordered)
+struct flow_key {
+    struct ip_key ip;
+    uint16_t port[2];
+} packed_;
+
+/// A flow going from an IP parser to its transport parser.
+/** Lives on the IP parser stack. */
+struct flow_cache_ctx {
+    struct flow_cache_ctx *prev;        ///< Enclosing flow, if any (for tunnels)
+    struct flow_key key;
+    struct flow_cache *cache;           ///< The cache of this thread
+    struct flow_cache_entry *entry;     ///< The cache entry for this flow (NULL if the flow is not cachable)
+    struct mux_subparser *ip_sub;       ///< The IP subparser for this flow, once pushed (the ref is owned by the IP parser)
+    struct mux_subparser *l4_sub;       ///< A ref to the transport subparser if found in the cache
+    unsigned way;                       ///< The way of the IP subparser (valid once found or pushed)
+    bool pushed;
+};
+
+/// Look for a flow in the cache.
+/** @returns a new ref to the IP subparser if the flow is known (then ctx->way is set as well),
+ * and NULL otherwise (in which case nothing is owned by the ctx and it's not required to
+ * destruct it). */
+struct mux_subparser *flow_cache_ctx_ctor(
+    struct flow_cache_ctx *,
+    struct mux_parser *ip_parser,       ///< The IP parser this packet goes through
+    struct ip_key const *,              ///< As found in the packet
+    uint8_t const *payload,             ///< The IP payload, where the ports are read from
+    size_t cap_len,                     ///< The captured IP payload size
+    struct timeval const *now
+);
+
+/// Make this flow the current one for the transport parsers.
+void flow_cache_ctx_push(struct flow_cache_ctx *, struct mux_subparser *ip_sub, unsigned way);
+
+/// Release the flow and make the previous one current again.
+void flow_cache_ctx_dtor(struct flow_cache_ctx *);
+
+/// For the transport parsers: find their subparser from the current flow.
+/** @returns a new ref to the subparser, or NULL. */
+struct mux_subparser *flow_cache_lookup(
+    struct mux_parser *l4_parser,       ///< The transport parser
+    uint16_t sport, uint16_t dport,     ///< As found in the packet
+    struct timeval const *now
+);
+
+/// For the transport parsers: store the subparser they found for the current flow.
+void flow_cache_store(
+    struct mux_parser *l4_parser,       ///< The transport parser
+    uint16_t sport, uint16_t dport,     ///< As found in the packet
+    struct mux_subparser *l4_sub,       ///< The subparser for this flow
+    struct port_key const *             ///< The key l4_sub is indexed with
+);
+
+void flow_cache_init(void);
+void flow_cache_fini(void);
+
+#endif
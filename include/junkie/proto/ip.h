@@ -39,7 +39,7 @@ struct ip_proto_info {
         IP_DONTFRAG,            ///< If the received packet has the dont_frag flag set (and so was not fragmented)
         IP_FRAGMENT,            ///< If this is a fragment
         IP_REASSEMBLED,         ///< If this was reassembled
-    } fragmentation;            ///< Only set if v4
+    } fragmentation;            ///< For v6, only IP_NOFRAG, IP_FRAGMENT or IP_REASSEMBLED
     unsigned id;                ///< Identification field (usefull for OS detection) (only set if v4)
     uint8_t traffic_class;      ///< aka. TOS for IPv4
 };
@@ -53,6 +53,16 @@ char const *ip_info_2_str(struct proto_info const *);
 char const *ip_proto_2_str(unsigned protocol);
 unsigned ip_key_ctor(struct ip_key *, unsigned protocol, struct ip_addr const *, struct ip_addr const *);
 
+/// Whether IP fragments are reassembled (the "ip-reassembly" parameter)
+extern bool ip_reassembly_enabled;
+
+/// Add a fragment of an IPv4 or IPv6 datagram to the reassembly table.
+/** Once the datagram is complete its payload is given to the parser of this subparser,
+ * and the subscribers are called for each fragment.
+ * @returns PROTO_OK if the fragment was kept (or used), or PROTO_PARSE_ERR if the caller must
+ * advertise it as is. */
+enum proto_parse_status ip_reassembly_add(struct mux_subparser *, struct ip_proto_info *, uint32_t id, unsigned offset, bool more_frags, uint8_t const *payload, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet);
+
 /// A proto that wants to register itself for receiving IP payload for some protocol must define this
 struct ip_subproto {
     LIST_ENTRY(ip_subproto) entry;  ///< Entry in the list of IP subprotos
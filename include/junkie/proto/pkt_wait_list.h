@@ -7,6 +7,8 @@
 #include <junkie/tools/queue.h>
 #include <junkie/tools/timeval.h>
 #include <junkie/tools/mutex.h>
+#include <junkie/tools/timebound.h>
+#include <junkie/tools/frame_buf.h>
 #include <junkie/proto/proto.h>
 
 /** @file
@@ -31,7 +33,10 @@
  * proto_info structures from the stack to the heap, taking care of the
  * pointers in them.  Another problem, easier to solve but probably more
  * expensive, is that due to the way the kernel sends the packets to libpcap we
- * also need to copy the packet itself.
+ * also need to keep the packet itself, which we do by holding a ref to a
+ * frame_buf (see frame_buf.h) so that the frame is copied at most once
+ * whatever the number of packets waiting in it, and not at all when the
+ * capture layer already has it in a frame_buf.
  *
  * That's why we will try to only push the packets in the waiting list when
  * this is strictly required (or equivalently, the enqueue function will first
@@ -41,19 +46,23 @@
  * Additionally, a queued packet can be set to wait for another waiting list
  * reaching a given offset. This is useful for TCP since we do not want to parse
  * in a direction ahead in time of the other direction.
+ *
+ * Finally, a parser may tell that it does not care about the bytes following
+ * the packet it's given, up to some offset (for instance, the rest of a body it
+ * does not inspect), with pkt_wait_list_skip(). Then the packets that fall in
+ * this range are not kept until the missing ones are received: the missing
+ * bytes are signaled at once as a gap and the packet is parsed right away.
  */
 
 /// A Waiting Packet.
-/** When a packet is enqueued on a waiting list, it is first copied out of the
- * pcap mmap, then all the proto_info description must also be copied out of
- * the stack. We also must preserve all the parameters that are required to
+/** When a packet is enqueued on a waiting list, we first get a ref to a copy
+ * of it out of the pcap mmap, then all the proto_info description must also
+ * be copied out of the stack (in the same memory block than the pkt_wait). We also must preserve all the parameters that are required to
  * eventually call proto_parse, when the missing packets will be received.
  * Everything must be freed when the pkt_wait is deleted, and the subparser
  * must be called whatever the fate of this pkt_wait (parsed, timeouted,
  * deleted in any way...). */
 struct pkt_wait {
-    /// Entry in the pkt_wait_list
-    LIST_ENTRY(pkt_wait) entry;
     /// Where in the "stream" this packet is located. When offset = list->next_offset, then the packet is parsable.
     unsigned offset;
     /// Next expected offset following this packet
@@ -76,23 +85,38 @@ struct pkt_wait {
     /** The callback must not be called when the packet is put on hold, until :
      * - the head of the packet list is complete and the first packets are dequeued;
      * - the list is deleted, for instance when timeouted. */
-    /// Current proto_info at the time when the packet was put on hold
+    /// Copy of (part of) the current proto_info stack at the time when the packet was put on hold (allocated with the pkt_wait)
     struct proto_info *parent;
     /// Current way at the time when the packet was put on hold
     unsigned way;
-    /// The copy of the total captured packet
-    uint8_t packet[];
+    /// The ref to the copy of the total captured packet
+    struct frame_buf *buf;
+    /// The total captured packet (within buf)
+    uint8_t const *packet;
+    /// What was taken from the reassembly budget for this packet (see reassembly.h)
+    size_t budget;
+    /// How many levels of the pkt_wait_list skip list this packet is on
+    unsigned nb_levels;
+    /// The next packet in the pkt_wait_list for each of these levels (next[0] being the very next one)
+    struct pkt_wait *next[];
 };
 
+/// Max number of levels of the skip lists of pkt_wait (enough for 4^8 packets)
+#define PKT_WAIT_MAX_LEVELS 8
+
 struct pkt_wl_config {
     struct pkt_wl_config_list {
         /// The list of struct pkt_wait_list in no particular order (but on 10 different lists, considered for timeout at 1s interval - a low tech way to timeout incrementaly)
         LIST_HEAD(pkt_wait_list_list, pkt_wait_list) list[10];
         /// The mutex that protects the above list
         struct supermutex mutex;
-        /// the max timestamp of packet addition in any of these waiting lists (used to give current time to timeouter thread)
+        /// the max timestamp of packet addition in any of these waiting lists (used to give current time to the ticker)
         struct timeval last_used;
-    } lists[CPU_MAX*11];
+        /// The non empty waiting lists of the above lists, least recently given a packet first (for eviction, see reassembly.h)
+        TAILQ_HEAD(pkt_wait_list_lru, pkt_wait_list) lru;
+        /// Index of next list to be timeouted, when this one belongs to a parser thread (see below)
+        unsigned next_to;
+    } lists[CPU_MAX*11];   ///< When flow_affinity is set, the first CPU_MAX belong to the parser threads (one each)
     /// Index of next list to be timeouted (1s interval between these lists)
     unsigned next_to;
     /// Entry in the list of all pkt_wl_configs
@@ -115,9 +139,11 @@ struct pkt_wl_config {
     bool allow_partial;
     /// Timeout (s)
     unsigned timeout;
-    /// A thread to timeout WLs more aggressively (otherwise pending packets on a WL which receive no more traffic would have to wait until its parent destruction)
-    bool has_timeouter;             ///< Flag used for thread destruction
-    pthread_t timeouter_pth;        ///< Only set if has_timeouter
+    /// How many proto_infos of its stack a kept packet keeps, besides the capture one (0 for all, see proto_info_stack_copy())
+    unsigned nb_kept_infos;
+    /// To timeout WLs more aggressively (otherwise pending packets on a WL which receive no more traffic would have to wait until its parent destruction)
+    /// and to evict the least recently used ones when we are short of reassembly budget
+    struct timebound_ticker ticker;
 };
 
 void pkt_wl_config_ctor(
@@ -127,7 +153,8 @@ void pkt_wl_config_ctor(
     unsigned nb_pkts_max,           ///< Max number of pending packets (0 for unlimited)
     size_t payload_max,             ///< Max pending payload (0 for unlimited)
     unsigned timeout,               ///< Timeout these pkt_wait_lists after this number of seconds (0 for no timeout)
-    bool allow_partial              ///< Should we parse packets as soon as possible or wait for a full PDU?
+    bool allow_partial,             ///< Should we parse packets as soon as possible or wait for a full PDU?
+    unsigned nb_kept_infos          ///< How many of the innermost proto_infos of kept packets are kept (0 for all)
 );
 
 void pkt_wl_config_dtor(struct pkt_wl_config *);
@@ -137,24 +164,33 @@ void pkt_wl_config_dtor(struct pkt_wl_config *);
  * order, until the missing bits are received. Top of the list packets are
  * dequeued as soon as their position in the stream match the waited one, and
  * inserted in the list according to their location in the stream.
+ * The list is a skip list so that inserting a packet in a long list (for
+ * instance in a large TCP window) costs O(log n). Packets which content is
+ * entirely covered by a previous one (such as retransmissions) are not
+ * inserted but advertised at once (as they would be when reached).
  * We do also store a ref to the intended subparser despite the pkt_wait_lists
  * being stored in a mux_subparser leading to it, both for simplicity and
  * generality. */
 struct pkt_wait_list {
-    /// The list of pkt_wait
-    LIST_HEAD(pkt_waits, pkt_wait) pkts;
+    /// The skip list of pkt_wait, ordered by offset then arrival (pkts[0] being the first packet, if any)
+    struct pkt_wait *pkts[PKT_WAIT_MAX_LEVELS];
     /// The global configuration for this pkt_wait_list (never changes during the lifetime of the object)
     struct pkt_wl_config *config;
     /// The list into this config where this pkt_list is queued
     struct pkt_wl_config_list *list;
     /// And the entry in this list
     LIST_ENTRY(pkt_wait_list) entry;
+    /// Entry in the LRU of this list (if in_lru, ie. if we hold some packets)
+    TAILQ_ENTRY(pkt_wait_list) lru_entry;
+    bool in_lru;
     /// Current number of pending packets
     unsigned nb_pkts;
     /// Current pending payload
     size_t tot_payload;
     /// The offset we are currently waiting for to resume parsing
     unsigned next_offset;
+    /// The parser does not care about the bytes before this offset (see pkt_wait_list_skip())
+    unsigned skip_offset;
     /// The proto to build parser if necessary
     struct proto **proto;
     /// A pointer to the parser ref this packet is intended to
@@ -237,6 +273,35 @@ enum proto_parse_status pkt_wait_list_flush(
 /// Removes a packet from a list, without calling the subparser.
 void pkt_wait_del(struct pkt_wait *, struct pkt_wait_list *);
 
+/// What the parser called with some bytes of a stream asked to skip.
+/** Whoever gives a parser some bytes of a stream (the waiting lists, or TCP
+ * when it does not need them) pushes one of these around the call. */
+struct pkt_wait_skip {
+    struct pkt_wait_skip *prev;     ///< The enclosing one, if any
+    struct parser const *parser;    ///< The parser that's called
+    unsigned end_offset;            ///< The offset following the bytes given to this parser
+    bool skip;                      ///< Set if the parser asked to skip some bytes
+    unsigned skip_offset;           ///< Then, the offset up to which it does not care
+};
+
+void pkt_wait_skip_push(struct pkt_wait_skip *, struct parser const *, unsigned end_offset);
+
+/// Forget about this skip context (must be the last pushed).
+/** @returns true if the parser asked to skip up to skip_offset. */
+bool pkt_wait_skip_pop(struct pkt_wait_skip *);
+
+/// For parsers: tell that the nb_bytes following the current packet are of no interest.
+/** This is only a hint: the parser may still receive these bytes (but
+ * otherwise it will receive a gap instead, in order). It's ignored unless the
+ * parser was given these bytes from a stream (so that nb_bytes means
+ * something). */
+void pkt_wait_list_skip(struct parser const *, size_t nb_bytes);
+
+/// Timeout the waiting lists of the calling parser thread (to be called every second when flow_affinity is set).
+/** Then, the timebounder thread does not timeout (nor evict) these waiting
+ * lists itself since this would parse the flows of this thread. */
+void pkt_wait_lists_timeout_mine(void);
+
 void pkt_wait_list_init(void);
 void pkt_wait_list_fini(void);
 
@@ -19,10 +19,14 @@
 #include <junkie/tools/mutex.h>
 #include <junkie/tools/queue.h>
 
+struct port_muxer_table;
+
 /// A list of port_muxer structs
 struct port_muxer_list {
     struct mutex mutex;
     TAILQ_HEAD(port_muxers, port_muxer) muxers;
+    unsigned version;               ///< Incremented whenever muxers changes
+    struct port_muxer_table *table; ///< For port_muxer_find(), rebuilt when outdated
 };
 
 void port_muxer_list_ctor(struct port_muxer_list *, char const *name);
@@ -43,6 +47,8 @@ struct port_muxer *port_muxer_new(struct port_muxer_list *, uint16_t port_min, u
 void port_muxer_del(struct port_muxer *, struct port_muxer_list *);
 
 /** Retrieve the lastly inserted proto handling one of these ports.
+ * Lookups use a table mapping each port to its first muxer, so they take no lock
+ * (unless the list changed since the table was built).
  * FIXME: add a pointer to the lastly returned proto and return the next one (in a cursor fashion)
  */
 struct proto *port_muxer_find(struct port_muxer_list *, uint16_t port1, uint16_t port2);
@@ -16,6 +16,8 @@
 #include <junkie/tools/mutex.h>
 #include <junkie/tools/ref.h>
 #include <junkie/tools/bench.h>
+#include <junkie/tools/wheel.h>
+#include <junkie/tools/counter.h>
 
 /** @file
  * @brief Packet inspection
@@ -172,6 +174,8 @@ struct proto {
         char const *(*info_2_str)(struct proto_info const *);
         /// Return the start address and size of an overloaded proto_info (used to copy it, see pkt_wait_list)
         void const *(*info_addr)(struct proto_info const *, size_t *);
+        /// Size of the parsers parser_new() allocates with parser_alloc(), if it does for each flow (0 otherwise)
+        size_t parser_size;
     } const *ops;
     char const *name;       ///< Protocol name, used mainly for pretty-printing
     bool enabled;           ///< so that we can disable/enable a protocol at runtime
@@ -189,8 +193,8 @@ struct proto {
         PROTO_CODE_TDS, PROTO_CODE_TDS_MSG, PROTO_CODE_RPC,
         PROTO_CODE_MAX
     } code;                 ///< Numeric code used for instance to serialize these events
-    uint64_t nb_frames;     ///< How many times we called this parse (count frames only if this parser is never called more than once on a frame)
-    uint64_t nb_bytes;      ///< How many bytes this proto had on wire
+    /// Statistics counters, incremented by all parsing threads (see enum proto_counter)
+    struct counters counters;
     /// How many parsers of this proto exists
     unsigned nb_parsers;
     /// Entry in the list of all registered protos
@@ -199,12 +203,20 @@ struct proto {
     unsigned fuzzed_times;
     /// Hook to be called back for each packet involving this proto
     struct hook hook;
-    /// Mutex to protect the mutable values of this proto (entry, parsers, nb_parsers, nb_frames, subscribers list)
+    /// Mutex to protect the mutable values of this proto (entry, parsers, nb_parsers, subscribers list)
     struct mutex lock;
     /// Some benchmark counters
     struct bench_event parsing; // measure time spent parsing this protocol
 };
 
+/// The counters of a proto
+enum proto_counter {
+    PROTO_NB_FRAMES,        ///< How many times we called this parse (count frames only if this parser is never called more than once on a frame)
+    PROTO_NB_BYTES,         ///< How many bytes this proto had on wire
+    MUX_NB_LOOKUPS,         ///< For mux_protos: Nb lookups in the hashes since last change of hash size
+    MUX_NB_COLLISIONS,      ///< For mux_protos: Nb collisions in the hashes since last change of hash size
+};
+
 /// The list of registered protos
 extern LIST_HEAD(protos, proto) protos;
 
@@ -267,6 +279,25 @@ char const *proto_info_2_str(struct proto_info const *);
 /** Use it if you do not overload proto_info (?) */
 void const *proto_info_addr(struct proto_info const *, size_t *);
 
+/// Copies of proto_info stacks.
+/** There is no such thing as a destructor for proto_info, since they are
+ * constructed on the stack. To keep a stack for later (to parse a packet
+ * later on, for instance) it is copied into a single block of memory.
+ * Only the nb_kept last proto_infos (the ones closest to the copied one) and
+ * the root one (with the capture informations the per packet subscribers are
+ * looking for) are kept, or all of them if nb_kept is 0. */
+#define PROTO_INFO_ALIGN 8  ///< Each copied proto_info is aligned on this (they are made of integers, pointers and timevals)
+
+/// @returns the size of the block required by proto_info_stack_copy().
+size_t proto_info_stack_size(struct proto_info const *, unsigned nb_kept);
+
+/// Copy a proto_info stack into a block of memory (taking a ref to each parser).
+/** @returns the copy of the given proto_info, which starts the block. */
+struct proto_info *proto_info_stack_copy(struct proto_info const *, void *block, unsigned nb_kept);
+
+/// Release the parsers of a copied proto_info stack (but not the memory).
+void proto_info_stack_release(struct proto_info *);
+
 /// Helper for metric modules.
 /** @returns the last proto_info owned by the given proto, or NULL if not found.
  */
@@ -352,6 +383,17 @@ void parser_dtor(
 /// Return a name for this parser (suitable for debugging)
 char const *parser_name(struct parser const *parser);
 
+/// Allocate memory for a parser.
+/** Same as objalloc_nice(), except that when the parser is created by
+ * mux_subparser_and_parser_new() it's allocated in the same block of memory
+ * than the subparser (see mux_subparser_alloc()), provided it fits in the
+ * proto_ops.parser_size of its proto.
+ * Parsers allocated with this must then be freed with parser_free(). */
+void *parser_alloc(struct proto *, size_t size, char const *requestor);
+
+/// Free the memory allocated by parser_alloc().
+void parser_free(void *);
+
 /// Declare a new ref on a parser.
 /** @note Its ok to ref NULL.
  * @returns a new reference to a parser (actually, the same parser is returned with its ref_count incremented) */
@@ -428,24 +470,25 @@ struct mux_proto {
         struct mux_subparser *(*subparser_new)(struct mux_parser *mux_parser, struct parser *child,
                 struct proto *requestor, void const *key, struct timeval const *now);
         void (*subparser_del)(struct mux_subparser *mux_subparser);
+        /// Size of the subparsers (without key) subparser_new() allocates with mux_subparser_alloc()
+        size_t subparser_size;
     } ops;
     size_t key_size;                ///< The size of the key used to multiplex
     /// Following 3 fields are protected by proto->lock
     LIST_ENTRY(mux_proto) entry;    ///< Entry in the list of mux protos
-    unsigned hash_size;             ///< The required size for the hash used to store subparsers
+    unsigned hash_size;             ///< The required size for the hash used to store subparsers (always a power of 2)
     unsigned nb_max_children;       ///< The max number of subparsers (after which old ones are deleted)
     uint64_t nb_infanticide;        ///< Nb children that were deleted because of the previous limitation
-    uint64_t nb_collisions;         ///< Nb collisions in the hashes since last change of hash size
-    uint64_t nb_lookups;            ///< Nb lookups in the hashes since last change of hash size
     uint64_t nb_timeouts;           ///< Nb subparsers timeouted from the hashes (ie. not how many parsers of this proto were timeouted!)
-    time_t last_used;               ///< last time we had traffic (used to give time to timeouter thread)
+    time_t last_used;               ///< last time we had traffic (used to give time to the timeouter)
     /** A pool of mutexes so that we have enough for all the subparsers hash lines
      * but not one per hash line (would require too much memory). Also, we turn this
-     * into profit by having only a few timeout queues that can be visited often in order
-     * to timeout subparsers quickly. */
+     * into profit by having only a few timing wheels (protected by these mutexes)
+     * to timeout subparsers. The wheel ticks are the seconds of the last time
+     * a subparser could have been used to survive, ie. now - mux_timeout. */
     struct per_mutex {
         struct mutex mutex;
-        TAILQ_HEAD(timeout_queue, mux_subparser) timeout_queue;
+        struct wheel timeouts;
     } mutexes[CPU_MAX];
 };
 
@@ -460,7 +503,7 @@ void mux_proto_ctor(
     char const *name,               ///< Protocol name
     enum proto_code code,           ///< Protocol Id
     size_t key_size,                ///< Size of the key used to identify subparsers
-    unsigned hash_size              ///< Hash size for storing the subparsers
+    unsigned hash_size              ///< Hash size for storing the subparsers (rounded up to a power of 2)
 );
 
 /// Destruct a mux_proto
@@ -489,11 +532,11 @@ struct proto *proto_of_scm_name(SCM name);
  * @note Remember to add the packed_ attribute to your keys ! */
 struct mux_subparser {
     struct ref ref;                         ///< Note that being stored in parent's hash does count as a reference
-    TAILQ_ENTRY(mux_subparser) to_entry;    ///< Its entry in its timeout queue (sorted in least recently used first)
-    STAILQ_ENTRY(mux_subparser) h_entry;    ///< Its entry in the hash (sorted in more recently used first - so that lookups are faster)
+    struct wheel_timer to_timer;            ///< Its timer in its timing wheel (armed at last_used+1)
+    STAILQ_ENTRY(mux_subparser) h_entry;    ///< Its entry in the hash (most recently created first, lookups do not reorder it)
     struct proto *proto;                    ///< The actual proto
     struct parser *parser;                  ///< The actual parser
-    struct timeval last_used;               ///< Last time we call it's parse method
+    time_t last_used;                       ///< Last time we call it's parse method (written without lock by lookups)
     struct proto *requestor;                ///< The proto that requested its creation
     struct mux_parser *mux_parser;          ///< Backlink to our mux_parser
     struct mux_proto *mux_proto;            ///< Backlink to our mux_proto, for when mux_parser cannot be used (see mux_subparser_del_as_ref())
@@ -540,9 +583,21 @@ struct mux_parser {
 size_t mux_parser_size(unsigned hash_size);
 
 /** If you overload struct mux_subparser, you might want to use this to allocate your
- * custom mux_subparser since its length depends on the key size. */
+ * custom mux_subparser since its length depends on the key size.
+ *
+ * When called from mux_subparser_and_parser_new(), the subparser and its child
+ * parser (if allocated with parser_alloc()) are placed in a single block
+ * of memory (a "flow block") sized after the subparser_size and parser_size
+ * declared by the protos, so that all the state of a flow (including the parser's
+ * small inline buffers, such as those of streambufs) is contiguous and costs
+ * one allocation only. The block is freed once both are.
+ *
+ * Memory obtained from this must be freed with mux_subparser_free(). */
 void *mux_subparser_alloc(struct mux_parser *mux_parser, size_t size_without_key);
 
+/// Free the memory allocated by mux_subparser_alloc().
+void mux_subparser_free(void *);
+
 /// Create a mux_subparser for a given parser
 struct mux_subparser *mux_subparser_new(
     struct mux_parser *mux_parser,  ///< The parent of the requested subparser
@@ -582,7 +637,11 @@ void mux_subparser_dtor(
 );
 
 /// Search (and optionally create) a subparser
-/* Note: in both cases a new ref is returned. */
+/** Note: in both cases a new ref is returned.
+ * Successful lookups do not take any lock: the hash list is walked while new
+ * subparsers may be inserted concurrently, which is safe as long as the caller
+ * is in the multi region (as all parsers are), since then no subparser can be
+ * freed under our feet (see ref.h). Only misses take the list mutex. */
 struct mux_subparser *mux_subparser_lookup(
     struct mux_parser *parser,  ///< Look for a subparser of this mux_parser
     struct proto *create_proto, ///< If not found, create a new one that implements this proto
@@ -598,6 +657,10 @@ void mux_subparser_change_key(
     void const *key                     ///< The new key
 );
 
+/// Record that this subparser was just used (so that it's not timeouted).
+/** mux_subparser_lookup() does this already. */
+void mux_subparser_touch(struct mux_subparser *, struct timeval const *now);
+
 /// Declare a new ref on a mux_subparser.
 struct mux_subparser *mux_subparser_ref(struct mux_subparser *);
 
@@ -0,0 +1,41 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef REASSEMBLY_H_261018
+#define REASSEMBLY_H_261018
+#include <stdbool.h>
+#include <stddef.h>
+#include <junkie/config.h>
+
+/** @file
+ * @brief Global budget for the memory kept for reassembly
+ *
+ * Each waiting list and streambuf has its own limits, but nothing would bound
+ * the memory they keep all together for millions of flows (such as a flood
+ * of half open connections sending junk data). So they all take the memory
+ * they keep from a global budget (the "reassembly-budget" parameter):
+ *
+ * - above the budget, no more memory is taken: waiting lists then parse
+ *   packets without keeping them and streambufs fail to buffer (and so their
+ *   parser is reported as failing);
+ * - above 3/4 of the budget, waiting lists that were not given a packet for the
+ *   longest time are forced to parse what they hold (with gaps), once per
+ *   second, until we are below 3/4 of the budget again.
+ */
+
+/// Take size bytes from the budget.
+/** @returns false if this would exceed the budget (then nothing is taken). */
+bool reassembly_take(size_t size);
+
+/// Give back what was taken.
+void reassembly_give(size_t size);
+
+/// How many bytes should be released to be back under 3/4 of the budget.
+size_t reassembly_excess(void);
+
+/// Count holders that were forced to release what they kept.
+void reassembly_evicted(size_t size);
+
+void reassembly_init(void);
+void reassembly_fini(void);
+
+#endif
@@ -34,21 +34,28 @@
  * maximum buffer size).
  */
 
+/// Owned buffers up to this size are stored in the streambuf itself (and thus in the parser)
+#define STREAMBUF_INLINE_SIZE 128
+
 struct streambuf {
     parse_fun *parse;       ///< The user parse function
     size_t max_size;        ///< The max buffered size
-    struct mutex *mutex;    ///< Protect the buffers
+    struct mutex *mutex;    ///< Protect the buffers (unless flow_affinity)
+    struct flow_owner owner;///< To check flow affinity
     /// We want actually one buffer for each direction
     struct streambuf_unidir {
         uint8_t const *buffer;          ///< The buffer itself.
         size_t cap_len;                 ///< The size of the buffer. must be 0 if !buffer.
         size_t wire_len;                ///< The size seen on wire
         /** The offset where to start parsing from (don't store a pointer to buffer since buffer will be reallocated).
-         * Note that restart_offset is allowed to be outside of the buffer (in case you intend to skip a portion of payload). */
+         * Note that restart_offset is allowed to be outside of the buffer (in case you intend to skip a portion of payload,
+         * which is then not waited for, see pkt_wait_list_skip()). */
         size_t restart_offset;
         bool buffer_is_malloced;        ///< True if the buffer was malloced, false if it references the original packet. unset if !buffer.
+        size_t alloc_size;              ///< If buffer_is_malloced, the size of the buffer (which may be more than cap_len)
         size_t wait_offset;             ///< How many data it needs before parsing
         struct timeval last_received_tv;///< Time of the last received non gap packet
+        uint8_t inline_buf[STREAMBUF_INLINE_SIZE];  ///< Storage for small owned buffers, to save a malloc
     } dir[2];
 };
 
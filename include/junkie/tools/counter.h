@@ -0,0 +1,63 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef COUNTER_H_261018
+#define COUNTER_H_261018
+#include <stdint.h>
+#include <junkie/config.h>
+#include <junkie/cpp.h>
+
+/** @file
+ * @brief Statistics counters incremented by all the parsing threads.
+ *
+ * Counters that are incremented for every packet by whatever thread (such as
+ * the number of frames parsed by a proto) would have their cache line bounce
+ * from CPU to CPU if they were merely shared, even with atomic additions.
+ * Instead, each thread adds into its own slot of the counters, each slot being
+ * alone in its cache line, and the counters are the sum of all the slots.
+ * Reading them is thus much slower than incrementing them.
+ *
+ * Slots are given to threads as they first increment a counter, and given
+ * back when they exit. When all the slots are taken, the remaining threads
+ * share a last slot using atomic additions.
+ */
+
+#define CACHE_LINE_SIZE 64
+#define COUNTERS_MAX (CACHE_LINE_SIZE / sizeof(uint64_t))   ///< How many counters in a set
+
+/// A set of up to COUNTERS_MAX counters.
+struct counters {
+    struct counters_slot {
+        uint64_t values[COUNTERS_MAX];
+    } aligned_(CACHE_LINE_SIZE) slots[CPU_MAX+1];   ///< The last one is shared
+    uint64_t base[COUNTERS_MAX];    ///< Value at the last reset
+};
+
+void counters_ctor(struct counters *);
+
+/// @returns the slot of the calling thread (the first call to this function gives it one)
+unsigned counters_slot_alloc(void);
+
+extern __thread unsigned counters_my_slot;  ///< Slot number + 1 of the calling thread, or 0 if none yet
+
+inline void counters_add(struct counters *counters, unsigned c, uint64_t v)
+{
+    unsigned slot = counters_my_slot;
+    slot = likely_(slot) ? slot - 1 : counters_slot_alloc();
+    if (likely_(slot < CPU_MAX)) {
+        counters->slots[slot].values[c] += v;
+    } else {
+#       ifdef __GNUC__
+        (void)__sync_add_and_fetch(&counters->slots[slot].values[c], v);
+#       else    // well, don't put to much trust in this then
+        counters->slots[slot].values[c] += v;
+#       endif
+    }
+}
+
+/// @returns the value of a counter since its last reset (not atomic with regard to concurrent additions).
+uint64_t counters_read(struct counters const *, unsigned c);
+
+/// Set this counter back to 0.
+void counters_reset(struct counters *, unsigned c);
+
+#endif
@@ -0,0 +1,62 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef FRAME_BUF_H_261018
+#define FRAME_BUF_H_261018
+#include <stddef.h>
+#include <stdint.h>
+#include <junkie/config.h>
+
+/** @file
+ * @brief Refcounted copies of the captured frames.
+ *
+ * Parsers that must keep a frame for later (such as the packet waiting lists)
+ * cannot keep a pointer to it, since it lives in the capture buffer or on the
+ * stack. Instead of copying it each time, they ask for a ref to a frame_buf
+ * holding it.
+ *
+ * Whoever gives a frame to the parsers (the capture layer, or a waiting list
+ * calling its parser with a packet it kept) pushes a frame_buf_ctx telling
+ * where the frame is and, if it's already in a frame_buf, which one. Then
+ * frame_buf_hold() merely returns a new ref to this frame_buf, or makes one
+ * (once for all the holders of that frame).
+ */
+
+struct frame_buf {
+    unsigned ref_count;
+    size_t size;
+    uint8_t data[];
+};
+
+/// Copy these bytes into a new frame_buf (with a single ref).
+struct frame_buf *frame_buf_new(uint8_t const *data, size_t size);
+
+/// @returns a new ref to this frame_buf.
+struct frame_buf *frame_buf_ref(struct frame_buf *);
+
+/// Release a ref (and the frame_buf with the last one), and set the pointer to NULL.
+void frame_buf_unref(struct frame_buf **);
+
+/// The frame being parsed by a thread. Lives on the caller's stack.
+struct frame_buf_ctx {
+    struct frame_buf_ctx *prev; ///< The frame that was being parsed before this one, if any
+    uint8_t const *data;
+    size_t size;
+    struct frame_buf *buf;      ///< A ref to the frame_buf holding data, if any yet
+    uint8_t const *in_buf;      ///< Where data is within buf
+};
+
+/// Tell frame_buf_hold() about the frame we are about to parse.
+/** @param buf a ref to the frame_buf that already holds data (the ctx owns it), or NULL */
+void frame_buf_ctx_push(struct frame_buf_ctx *, uint8_t const *data, size_t size, struct frame_buf *buf);
+
+/// Forget about this frame (must be the last pushed) and release its ref.
+void frame_buf_ctx_pop(struct frame_buf_ctx *);
+
+/// Get a ref to a frame_buf holding these bytes.
+/** If they lie within a frame given by a frame_buf_ctx then its frame_buf is
+ * shared (and created if required), otherwise they are copied in a new one.
+ * @param copy where to store the location of data in the frame_buf
+ * @returns a new ref, or NULL if no memory is left. */
+struct frame_buf *frame_buf_hold(uint8_t const *data, size_t size, uint8_t const **copy);
+
+#endif
@@ -3,6 +3,9 @@
 #ifndef HASH_H_100922
 #define HASH_H_100922
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <junkie/cpp.h>
 #include <junkie/tools/queue.h>
 #include <junkie/tools/objalloc.h>
 #include <junkie/tools/miscmacs.h>
@@ -40,7 +43,7 @@ struct name_ { \
 #define HASH_SIZE(hash) (hash)->base.size
 
 #define HASH_INIT(hash, size_, name_) do { \
-    (hash)->base.nb_lists = 1 + size_ / HASH_LENGTH_GOOD; \
+    (hash)->base.nb_lists = hash_pow2(1 + (size_) / HASH_LENGTH_GOOD); \
     (hash)->base.nb_lists_min = (hash)->base.nb_lists; \
     (hash)->lists = objalloc((hash)->base.nb_lists * sizeof(*(hash)->lists), name_); \
     (hash)->base.size = 0; \
@@ -68,7 +71,9 @@ struct name_ { \
         LIST_FOREACH_SAFE(var, (hash)->lists+__hash_l, field, tvar)
 
 #define HASH_FUNC(key) hashfun(key, sizeof(*(key)))
-#define HASH_LIST(hash, key) ((hash)->lists + (HASH_FUNC(key) % (hash)->base.nb_lists))
+/// nb_lists is always a power of 2 so that we can mask instead of dividing
+#define HASH_IDX(h, nb_lists) ((h) & ((nb_lists) - 1U))
+#define HASH_LIST(hash, key) ((hash)->lists + HASH_IDX(HASH_FUNC(key), (hash)->base.nb_lists))
 
 #define HASH_FOREACH_SAME_KEY(var, hash, key, key_field, field) \
     ASSERT_COMPILE(sizeof(*(key)) == sizeof((var)->key_field)); \
@@ -101,7 +106,7 @@ struct name_ { \
 #define HASH_TRY_REHASH(hash, key_field, field) do { \
     unsigned const avg_length = HASH_AVG_LENGTH(hash); \
     if ((avg_length < HASH_LENGTH_MIN && (hash)->base.nb_lists > (hash)->base.nb_lists_min) || avg_length > HASH_LENGTH_MAX) { \
-        unsigned new_nb_lists = 1 + (hash)->base.max_size / HASH_LENGTH_GOOD; \
+        unsigned new_nb_lists = hash_pow2(1 + (hash)->base.max_size / HASH_LENGTH_GOOD); \
         __typeof__((hash)->lists) new_lists = objalloc(new_nb_lists * sizeof(*(hash)->lists), (hash)->base.name); \
         if (! new_lists) break; \
         SLOG(LOG_INFO, "Rehashing hash %s from %u to %u lists (%u max entries)", (hash)->base.name, (hash)->base.nb_lists, new_nb_lists, (hash)->base.max_size); \
@@ -109,7 +114,7 @@ struct name_ { \
         __typeof__((hash)->lists[0].lh_first) elm, tmp; \
         HASH_FOREACH_SAFE(elm, hash, field, tmp) { \
             LIST_REMOVE(elm, field); \
-            LIST_INSERT_HEAD(new_lists + (HASH_FUNC(&elm->key_field) % new_nb_lists), elm, field); \
+            LIST_INSERT_HEAD(new_lists + HASH_IDX(HASH_FUNC(&elm->key_field), new_nb_lists), elm, field); \
         } \
         objfree((hash)->lists); \
         (hash)->lists = new_lists; \
@@ -120,17 +125,94 @@ struct name_ { \
 } while (0)
 
 /*
- * And in case you need one, a simple and fast (for small keys) hash function:
+ * And in case you need one, a fast (word at a time) and seeded hash function.
+ *
+ * This is a variant of wyhash: keys are read 8 bytes at a time and folded
+ * with a 64x64->128 bits multiplication. The seed is drawn at random once per
+ * process (in hash_init()) so that an attacker cannot forge colliding keys
+ * (such as 5-tuples) in advance. Thus, never store hash values anywhere they
+ * could outlive the process!
  */
 
+/// The per process random seed (set once and for all by the first hash_init())
+extern uint64_t hash_seed;
+
+/// @returns the smallest power of 2 greater or equal to n (and at least 1), up to 2^31
+static inline unsigned hash_pow2(unsigned n)
+{
+    unsigned const max = 1U << (sizeof(unsigned)*8 - 1);
+    if (n >= max) return max;   // or p would wrap to 0 below
+    unsigned p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+#   ifdef __SIZEOF_INT128__
+    __uint128_t const r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#   else
+    uint64_t const ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t const rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t const t = rl + (rm0 << 32);
+    uint64_t lo = t + (rm1 << 32);
+    uint64_t const c = (t < rl) + (lo < t);
+    uint64_t const hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo ^ hi;
+#   endif
+}
+
+static inline uint64_t hash_read64(uint8_t const *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read32(uint8_t const *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+
 static inline uint_least32_t hashfun(void const *k_, size_t len)
 {
     uint8_t const *k = k_;
-    uint_least32_t h = 5381;
-    while (len --) {
-        h = (h << 5) + h + *k++; /* h*33 + *k++; */
+    uint64_t seed = hash_seed ^ HASH_P0;
+    uint64_t a, b;
+
+    if (likely_(len <= 16)) {
+        if (len >= 8) {
+            a = hash_read64(k);
+            b = hash_read64(k + len - 8);   // may overlap with a
+        } else if (len >= 4) {
+            a = hash_read32(k);
+            b = hash_read32(k + len - 4);
+        } else if (len > 0) {
+            a = ((uint64_t)k[0] << 16) | ((uint64_t)k[len >> 1] << 8) | k[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t rem = len;
+        do {
+            seed = hash_mum(hash_read64(k) ^ HASH_P1, hash_read64(k + 8) ^ seed);
+            k += 16;
+            rem -= 16;
+        } while (rem > 16);
+        a = hash_read64(k + rem - 16);
+        b = hash_read64(k + rem - 8);
     }
-    return h;
+
+    uint64_t const h = hash_mum(HASH_P2 ^ len, hash_mum(a ^ HASH_P1, b ^ seed));
+    return (uint_least32_t)(h ^ (h >> 32));
 }
 
 // For compatibility with previous versions:
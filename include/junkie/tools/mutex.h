@@ -4,6 +4,8 @@
 #define MUTEX_H_100914
 #include <pthread.h>
 #include <errno.h>
+#include <assert.h>
+#include <stdbool.h>
 #include <junkie/config.h>
 #include <junkie/cpp.h>
 #include <junkie/tools/queue.h>
@@ -71,20 +73,67 @@ void mutex_fini(void);
     for (bool first__ = true ; first__ || (pthread_mutex_unlock(lock), false) ; first__ = false)
 
 /*
- * Supermutexes - recursive, deadlock protected locks.
+ * Flow affinity - elision of the locks protecting per flow state.
  */
 
-struct supermutex_user_lock {
-    unsigned rec_count;             /// how many time do I own this lock. Not protected, only the actual user can read/write this
-    struct supermutex *supermutex;  /// set if I'm owning or waiting this lock, ie the list entry is valid. only written by actual user with supermutex_meta_lock (so can be read by others with supermutex_meta_lock).
-    LIST_ENTRY(supermutex_user_lock) entry; /// in the supermutex->holders list, protected by supermutex_meta_lock
-    struct supermutex_user *user;   /// backlink
+/** Set when each flow is parsed by a single thread (see the "parser-threads"
+ * parameter), in which case the state of a flow (TCP subparser, streambuf...)
+ * needs no lock. It's set once and for all before the first packet is parsed. */
+extern bool flow_affinity;
+
+/// Declare the calling thread as the parser thread number idx.
+void set_parser_thread(unsigned idx);
+/// @returns the index of the calling parser thread, or UNSET if it's not a parser thread.
+unsigned get_parser_thread(void);
+
+/// Remembers which parser thread a flow belongs to, to check flow affinity.
+struct flow_owner {
+    unsigned thread;    ///< Index of the first parser thread that locked this flow (UNSET until then)
 };
 
+void flow_owner_ctor(struct flow_owner *);
+
+/// @returns false if flow_affinity is set and this flow was already parsed by another parser thread.
+/** Other threads (the doomer, the timebounder...) are never blamed: they must
+ * only touch flows that can no longer be reached by the parsers. */
+bool flow_owner_check(struct flow_owner *);
+
+/// Lock the mutex protecting some per flow state, unless flows are affine.
+inline void flow_lock(struct mutex *mutex, struct flow_owner *owner)
+{
+    if (flow_affinity) {
+        bool const owned = flow_owner_check(owner); // also takes ownership of new flows
+        assert(owned);
+        (void)owned;
+    } else {
+        mutex_lock(mutex);
+    }
+}
+
+inline void flow_unlock(struct mutex *mutex)
+{
+    if (! flow_affinity) mutex_unlock(mutex);
+}
+
+/*
+ * Supermutexes - recursive, deadlock protected locks.
+ *
+ * Each supermutex knows its owner, and each thread knows which supermutex it's
+ * waiting for, if any. Locking a free supermutex (or one we already own) thus
+ * requires nothing but the supermutex itself. Only when a thread is about to
+ * block does it follow the chain from the owner of the supermutex it wants to
+ * the supermutex this owner is waiting for, and so on, looking for itself.
+ * Threads about to block serialize on a single global lock for this, so that
+ * the last one to close a cycle sees it.
+ */
+
+struct supermutex_user;
+
 /// A supermutex is a mutex wich allow recursive lock while preventing deadlocks
 struct supermutex {
     struct mutex mutex;
-    LIST_HEAD(supermutex_user_locks, supermutex_user_lock) holders;   // List of threads that are waiting for this supermutex + the one that holds it, protected by supermutex_meta_lock
+    struct supermutex_user *owner;  ///< The thread owning it, if any. Written by the owner only, read by blocking threads
+    unsigned rec_count;             ///< How many times the owner locked it. Only the owner reads/writes this
 };
 
 void supermutex_ctor(struct supermutex *, char const *name);
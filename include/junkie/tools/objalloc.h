@@ -27,6 +27,21 @@ void *objalloc_nice(size_t entry_size, char const *requestor);
 /** Free an object previously alloced with objalloc (or friends) */
 void objfree(void *);
 
+/** Objects can also be carved out of a bigger one (the carver), so that they share
+ * its memory. A carved object is freed with objfree() like any other, and the carver
+ * is actually released once it and all the objects carved out of it were objfreed.
+ * Returns a carver of the given size (denied if we are overweight, as objalloc_nice). */
+void *objalloc_carver(size_t size, char const *requestor);
+
+/** Room to leave in a carver for an object of given size (which is
+ * not more than what objalloc would take). */
+size_t objalloc_carved_size(size_t size);
+
+/** Carve an object out of a carver, which room (see objalloc_carved_size()) starts at
+ * the given offset (a multiple of the size of a pointer).
+ * Carving several objects at overlapping offsets is the caller's bug. */
+void *objalloc_carve(void *carver, size_t offset);
+
 /** objalloc version of strdup */
 char *objalloc_strdup(char const *);
 
@@ -81,6 +81,30 @@ static inline void *ref(struct ref *ref)
     return ref;
 }
 
+/// Like ref(), but fails (returning NULL) instead of raising the count from 0.
+/** Useful for lockless readers that may meet an object which last ref was just dropped:
+ * it will not be freed before next mono region but must not be resurrected. */
+static inline void *ref_unless_zero(struct ref *ref)
+{
+    if (! ref) return NULL;
+
+#   ifdef __GNUC__
+    unsigned c;
+    do {
+        c = *(unsigned volatile *)&ref->count;
+        if (c == 0) return NULL;
+    } while (! __sync_bool_compare_and_swap(&ref->count, c, c + 1));
+#   else
+    mutex_lock(&ref->mutex);
+    bool const dead = ref->count == 0;
+    if (! dead) ref->count ++;
+    mutex_unlock(&ref->mutex);
+    if (dead) return NULL;
+#   endif
+
+    return ref;
+}
+
 SLIST_HEAD(refs, ref) death_row;
 struct mutex death_row_mutex;
 
@@ -7,25 +7,34 @@
 #include <junkie/tools/queue.h>
 #include <junkie/tools/mutex.h>
 #include <junkie/tools/timeval.h>
+#include <junkie/tools/wheel.h>
+#include <junkie/tools/bench.h>
 
 /** @file
- * @brief Objects that are destructed after some period of inactivity.
+ * @brief The timeout service: objects that are destructed after some period of inactivity.
  *
- * Essentially, a timebound object queue is a pool of TAILQ_HEADs and mutexes,
- * sorted with least recently used object last, a deletor function and a
- * timeouter thread.
+ * A single thread (the timebounder) wakes up every second for the whole
+ * process and:
  *
- * The timeout is configurable via a parameter that's created from the name of
- * the timebound.
+ * - advances the timing wheels of all the timebound pools;
+ * - runs all the registered tickers, for modules that need to timeout their
+ *   objects in their own way (mux subparsers, packet waiting lists...).
  *
- * Each timebound object is then nothing more than an entry in the TAILQ of
- * its pool.
+ * Time is event time, ie. the timestamps of the packets, not the wall clock:
+ * timebound pools use the most recent timestamp given to timebound_touch() or
+ * timebound_ctor().
  *
- * Note that we may insert a timebound object in anyone of the pool entry.
- * We use a mere round robin to keep entries evenly loaded.
+ * A timebound pool is a set of buckets (shards), each one being a timing wheel
+ * protected by its own mutex, a deletor function and a timeout that's usually
+ * an ext_param. We insert a timebound object in any one of the buckets, using a
+ * mere round robin to keep buckets evenly loaded.
  *
- * Also, instead of a thread per pool we'd rather have a single thread running
- * every seconds and scanning all pools according to it's own timeout value.
+ * Each timebound object is then nothing more than a timer in the wheel of its
+ * bucket, armed once and armed again whenever it fires for an object that was
+ * touched since. Touching an object thus merely records the time.
+ *
+ * See also timeouter.h for the same thing without lock nor thread, for objects
+ * owned by a single parser.
  */
 
 struct timebound;
@@ -39,23 +48,24 @@ struct timebound_pool {
     void (*del)(struct timebound *);    ///< Deletor for timebound objects held here this pool
     LIST_ENTRY(timebound_pool) entry;   ///< One timebounder thread to rule them all
     unsigned next_bucket;               ///< Round robin affectation of object to buckets. Not protected by lock, don't care
+    uint64_t nb_timeouts;               ///< How many objects were timeouted so far
+    struct bench_event timeouting;      ///< How long it takes to timeout this pool
     struct timebound_bucket {
-        struct mutex mutex;             ///< Protects this list
-        TAILQ_HEAD(timebounds, timebound) list; ///< Least recently used first
+        struct mutex mutex;             ///< Protects this wheel
+        struct wheel wheel;             ///< Ticks are the last_used seconds that are not recent enough to survive
     } buckets[CPU_MAX*2];
 };
 
 void timebound_pool_ctor(struct timebound_pool *, char const *name, unsigned const *timeout, void (*del)(struct timebound *));
 void timebound_pool_dtor(struct timebound_pool *);
 
-/** A timebound object is merely an entry in the object queue.  We need the
- * deletor of the object, which is then supposed to destruct us (but can also
- * deindex the object, destruct other part of it, and so on). */
+/** A timebound object is merely a timer in the pool.  We need the deletor of
+ * the object, which is then supposed to destruct us (but can also deindex the
+ * object, destruct other part of it, and so on). */
 struct timebound {
-    TAILQ_ENTRY(timebound) entry;
-    time_t last_used;                   ///< Not timeval to save space
+    struct wheel_timer timer;
+    time_t last_used;                   ///< Not timeval to save space (written without lock)
     struct timebound_bucket *bucket;    ///< Backlink to find the relevant mutex
-    bool monitored;                     ///< Set if this object is still in a bucket
 };
 
 void timebound_ctor(struct timebound *, struct timebound_pool *, struct timeval const *now);
@@ -63,6 +73,20 @@ void timebound_dtor(struct timebound *);
 
 void timebound_touch(struct timebound *, struct timeval const *now);
 
+/** A ticker is a function that the timebounder thread calls every second.
+ * Destructing a ticker waits for it to return, and thus it must not destruct
+ * itself. */
+struct timebound_ticker {
+    char const *name;                   ///< Also the name of the bench event, so must be static
+    void (*tick)(struct timebound_ticker *);
+    LIST_ENTRY(timebound_ticker) entry;
+    bool running;                       ///< Set while the timebounder runs it (protected by the tickers mutex)
+    struct bench_event ticking;         ///< How long it takes to run this ticker
+};
+
+void timebound_ticker_ctor(struct timebound_ticker *, char const *name, void (*tick)(struct timebound_ticker *));
+void timebound_ticker_dtor(struct timebound_ticker *);
+
 void timebound_init(void);
 void timebound_fini(void);
 
@@ -6,6 +6,16 @@
 #include <stdlib.h>
 #include <junkie/tools/queue.h>
 #include <junkie/tools/timeval.h>
+#include <junkie/tools/wheel.h>
+
+/** @file
+ * @brief Timeout objects without lock nor thread.
+ *
+ * Same principle as timebound.h (a timing wheel which ticks are the seconds of
+ * last use, and timers armed again only when they fire for an object that was
+ * used since) but for objects that are owned by a single parser, that times
+ * them out from time to time with timeouter_pool_timeout() while parsing.
+ */
 
 struct timeouter_pool;
 struct timeouter;
@@ -13,7 +23,7 @@ typedef void del_by_timeout (struct timeouter_pool *timeouter_pool, struct timeo
 
 struct timeouter_pool {
     unsigned const *timeout;                 ///< So that it's easy to take this timeout from an ext_param
-    TAILQ_HEAD(timeouters, timeouter) list;  ///< Least recently used last
+    struct wheel wheel;                      ///< Ticks are the last_used seconds that are not recent enough to survive
     del_by_timeout *del; ///< Deletor for timeouter objects held here this pool
     void *userdata;
 };
@@ -25,9 +35,8 @@ void timeouter_pool_ctor(struct timeouter_pool *,
 void timeouter_pool_dtor(struct timeouter_pool *);
 
 struct timeouter {
-    TAILQ_ENTRY(timeouter) entry;
+    struct wheel_timer timer;
     time_t last_used;                       ///< Not timeval to save space
-    struct timeouter_pool *timeouter_pool;  ///< Backlink to remove from pool
 };
 
 void timeouter_ctor(struct timeouter_pool *, struct timeouter *, struct timeval const *now);
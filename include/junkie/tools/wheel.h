@@ -0,0 +1,101 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef WHEEL_H_261018
+#define WHEEL_H_261018
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <junkie/tools/queue.h>
+
+/** @file
+ * @brief Hierarchical timing wheel
+ *
+ * A timing wheel stores timers according to their expiry tick (the unit of
+ * which is chosen by the user - seconds for most of junkie's timeouts) into
+ * WHEEL_LEVELS levels of WHEEL_SLOTS slots each. Level 0 has a slot per tick,
+ * level 1 a slot per WHEEL_SLOTS ticks, and so on. Adding or removing a timer
+ * is O(1), and advancing the wheel costs only the number of timers that
+ * actually expire (plus the occasional cascade of a higher level slot into the
+ * lower levels).
+ *
+ * The wheel does not lock anything; its user must protect it.
+ *
+ * A typical use for timeouting objects which last use is merely recorded with
+ * a timestamp is to arm the timer once, and when it fires check whether the
+ * object was used since, in which case the timer is merely armed again.
+ */
+
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1U << WHEEL_SLOT_BITS)
+#define WHEEL_LEVELS 4
+/// Timers that are further away than this are stored at the max distance (and will be moved when their slot expires)
+#define WHEEL_MAX_DELAY ((1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1)
+
+struct wheel_timer {
+    LIST_ENTRY(wheel_timer) entry;  ///< In its slot (entry.le_prev is NULL when the timer is not armed)
+    uint64_t expiry;                ///< The tick at which this timer expires
+    unsigned level;                 ///< The level of the slot it's in
+};
+
+struct wheel {
+    uint64_t now;                   ///< All timers expiring before this tick were fired already
+    bool cascaded;                  ///< Higher levels were already cascaded for tick now
+    bool firing;                    ///< Set while the slot for tick now is being fired
+    unsigned count;                 ///< Number of armed timers
+    uint64_t max_expiry;            ///< Max expiry of all timers armed since construction or last reset (useful to detect when time goes backward)
+    unsigned level_count[WHEEL_LEVELS]; ///< Number of armed timers per level
+    LIST_HEAD(wheel_slot, wheel_timer) slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/// Construct a wheel which current time is now
+void wheel_ctor(struct wheel *, uint64_t now);
+
+/// Destruct a wheel. All timers are merely forgotten.
+void wheel_dtor(struct wheel *);
+
+static inline void wheel_timer_ctor(struct wheel_timer *timer)
+{
+    timer->entry.le_prev = NULL;
+    timer->expiry = 0;
+    timer->level = 0;
+}
+
+static inline bool wheel_timer_is_armed(struct wheel_timer const *timer)
+{
+    return timer->entry.le_prev != NULL;
+}
+
+/// Arm a timer (which must not be armed already).
+/** If the expiry is already past (ie. before wheel->now), the timer will fire at tick wheel->now. */
+void wheel_add(struct wheel *, struct wheel_timer *, uint64_t expiry);
+
+/// Disarm a timer (it's OK to disarm a timer that's not armed).
+void wheel_del(struct wheel *, struct wheel_timer *);
+
+/// Callback for expired timers (timer is already disarmed when called, and can be armed again)
+typedef void wheel_cb(struct wheel_timer *, void *userdata);
+
+/// Fire all the timers that expired at or before the given tick.
+/** Timers armed by the callback with an expiry in the past will be fired on
+ * next tick only.
+ * @param max_fired the max number of timers to fire (0 for no limit), so that
+ * the caller can release its lock from time to time.
+ * @return the number of timers fired. If it's max_fired then there might be
+ * more to fire. */
+unsigned wheel_advance(struct wheel *, uint64_t now, unsigned max_fired, wheel_cb *, void *userdata);
+
+/// Fire all timers whatever their expiry, then restart the wheel at given tick.
+/** Timers armed by the callback are relative to the new time.
+ * This is useful when the clock driving the wheel went back in time.
+ * @return the number of timers fired. */
+unsigned wheel_reset(struct wheel *, uint64_t now, wheel_cb *, void *userdata);
+
+/// Fire all the timers that expired at or before cutoff, the way timeouts are usually done.
+/** Same as wheel_advance(), unless some timers expire after horizon (meaning
+ * that the clock went backward) or the wheel lags far behind cutoff (in which
+ * case it would cascade for nothing), in which cases the wheel is reset at
+ * cutoff+1 (see wheel_reset()).
+ * @return the number of timers fired. */
+unsigned wheel_timeout(struct wheel *, uint64_t cutoff, uint64_t horizon, unsigned max_fired, wheel_cb *, void *userdata);
+
+#endif
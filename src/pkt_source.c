@@ -18,6 +18,7 @@
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <stdint.h>
@@ -25,17 +26,23 @@
 #include <ctype.h>
 #include <assert.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <pcap.h>
 #include <libguile.h>
 #include "pkt_source.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/frame_buf.h"
 #include "junkie/tools/tempstr.h"
 #include "junkie/tools/mutex.h"
 #include "junkie/tools/queue.h"
 #include "junkie/tools/ref.h"
+#include "junkie/tools/hash.h"
+#include "junkie/tools/miscmacs.h"
 #include "junkie/proto/cap.h"
 #include "junkie/proto/proto.h"
 #include "junkie/proto/deduplication.h"
+#include "junkie/proto/pkt_wait_list.h"
 #include "junkie/tools/ext.h"
 #include "plugins.h"
 #include "nettrack.h"
@@ -105,6 +112,282 @@ static char const *pkt_source_guile_name(struct pkt_source *pkt_source)
 
 static struct bench_event waiting_for_multi;
 
+// buf is the ref to the frame_buf holding the frame data, if any (which we release)
+static void parse_frame(struct frame *frame, struct frame_buf *buf)
+{
+#   ifdef WITH_GIANT_LOCK
+    mutex_lock(&giant_lock);
+#   endif
+
+    assert(cap_parser);
+
+    uint64_t start_wait = bench_event_start();
+    enter_multi_region();
+    bench_event_stop(&waiting_for_multi, start_wait);
+
+    struct frame_buf_ctx frame_ctx;
+    frame_buf_ctx_push(&frame_ctx, frame->data, frame->cap_len, buf);
+    (void)proto_parse(cap_parser, NULL, 0, (uint8_t *)frame, frame->cap_len, frame->wire_len, &frame->tv, frame->cap_len, frame->data);
+    frame_buf_ctx_pop(&frame_ctx);
+
+    leave_protected_region();
+
+#   ifdef WITH_GIANT_LOCK
+    mutex_unlock(&giant_lock);
+#   endif
+}
+
+/*
+ * Parser threads
+ *
+ * By default each sniffer thread parses the packets it reads, and any flow
+ * can be parsed by several threads at once. When parser-threads is set, the
+ * sniffers merely dispatch the packets to that many parser threads according
+ * to a symmetric hash of the IP addresses, so that all packets of a flow
+ * (including its fragments and whatever is tunneled into it) are parsed by the
+ * same thread, and flow_affinity is set so that the parsers skip the locks
+ * protecting their per flow state.
+ */
+
+static unsigned nb_parser_threads = 0;
+EXT_PARAM_RW(nb_parser_threads, "parser-threads", uint, "Number of threads parsing the packets read by the sniffers, each one parsing its own share of the flows (0 to parse from the sniffer threads). Must be set before the first packet source is opened.")
+
+static bool parsers_started;    // Set when the first pkt_source is opened (protected by pkt_sources_lock)
+static unsigned nb_parsers;     // Number of parser threads actually running (set once with parsers_started)
+static volatile sig_atomic_t parsers_quit;
+
+// A copy of a frame, waiting for a parser thread
+struct queued_frame {
+    struct frame frame;
+    struct pkt_source *pkt_source;  // non const version of frame.pkt_source
+    struct frame_buf *buf;          // holds frame.data, and can be kept by the parsers
+};
+
+static struct parser_thread {
+    pthread_t pth;
+    unsigned idx;
+    pthread_mutex_t mutex;  // protects the queue (cannot use a struct mutex with a condition)
+    pthread_cond_t not_empty, not_full;
+#   define PARSER_QUEUE_LEN 4096
+    struct queued_frame *queue[PARSER_QUEUE_LEN];
+    unsigned head, length;
+} parser_threads[CPU_MAX];
+
+// Returns a hash of the IP addresses that does not depend on the direction (or 0 for non IP frames)
+static uint32_t frame_flow_hash(uint8_t const *packet, size_t cap_len)
+{
+    // We go through VLAN tags, but we do not bother for other encapsulations (then flows are merely not spread)
+    size_t offset = 12;
+    unsigned ethertype;
+    do {
+        if (offset + 2 > cap_len) return 0;
+        ethertype = READ_U16N(packet + offset);
+        offset += ethertype == 0x8100 || ethertype == 0x88a8 || ethertype == 0x9100 ? 4 : 2;
+    } while (ethertype == 0x8100 || ethertype == 0x88a8 || ethertype == 0x9100);
+
+    uint8_t const *addr;
+    size_t addr_len;
+    switch (ethertype) {
+        case 0x0800:    // IPv4
+            if (offset + 20 > cap_len) return 0;
+            addr = packet + offset + 12;
+            addr_len = 4;
+            break;
+        case 0x86dd:    // IPv6
+            if (offset + 40 > cap_len) return 0;
+            addr = packet + offset + 8;
+            addr_len = 16;
+            break;
+        default:
+            return 0;
+    }
+
+    uint8_t key[32];
+    bool const swap = memcmp(addr, addr + addr_len, addr_len) > 0;
+    memcpy(key + (swap ? addr_len : 0), addr, addr_len);
+    memcpy(key + (swap ? 0 : addr_len), addr + addr_len, addr_len);
+    return hashfun(key, 2 * addr_len);
+}
+
+static void parser_thread_push(struct parser_thread *pt, struct queued_frame *qf)
+{
+    WITH_PTH_MUTEX(&pt->mutex) {
+        while (pt->length >= NB_ELEMS(pt->queue) && !parsers_quit) {
+            pthread_cond_wait(&pt->not_full, &pt->mutex);
+        }
+        if (pt->length < NB_ELEMS(pt->queue)) {
+            pt->queue[(pt->head + pt->length) % NB_ELEMS(pt->queue)] = qf;
+            pt->length ++;
+            pthread_cond_signal(&pt->not_empty);
+            qf = NULL;
+        }
+    }
+
+    if (qf) {   // the parser threads are quitting
+        frame_buf_unref(&qf->buf);
+#       ifdef __GNUC__
+        (void)__sync_sub_and_fetch(&qf->pkt_source->nb_queued, 1);
+#       else
+        qf->pkt_source->nb_queued --;
+#       endif
+        objfree(qf);
+    }
+}
+
+// Returns NULL if nothing was received within a second (or at once when quitting)
+static struct queued_frame *parser_thread_pop(struct parser_thread *pt)
+{
+    struct queued_frame *qf = NULL;
+    WITH_PTH_MUTEX(&pt->mutex) {
+        if (pt->length == 0 && !parsers_quit) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec ++;
+            (void)pthread_cond_timedwait(&pt->not_empty, &pt->mutex, &until);
+        }
+        if (pt->length > 0) {
+            qf = pt->queue[pt->head];
+            pt->head = (pt->head + 1) % NB_ELEMS(pt->queue);
+            pt->length --;
+            pthread_cond_signal(&pt->not_full);
+        }
+    }
+    return qf;
+}
+
+// Copy the frame (which lives in the pcap buffer) and send it to the parser thread of its flow
+static void dispatch_frame(struct pkt_source *pkt_source, struct frame const *frame)
+{
+    struct queued_frame *qf = objalloc(sizeof(*qf), "queued frames");
+    if (! qf) return;
+    qf->buf = frame_buf_new(frame->data, frame->cap_len);
+    if (! qf->buf) {
+        objfree(qf);
+        return;
+    }
+    qf->frame = *frame;
+    qf->frame.data = qf->buf->data;
+    qf->pkt_source = pkt_source;
+
+#   ifdef __GNUC__
+    (void)__sync_add_and_fetch(&pkt_source->nb_queued, 1);
+#   else
+    pkt_source->nb_queued ++;
+#   endif
+
+    parser_thread_push(parser_threads + frame_flow_hash(frame->data, frame->cap_len) % nb_parsers, qf);
+}
+
+static void *parser_thread(void *pt_)
+{
+    struct parser_thread *pt = pt_;
+    set_thread_name(tempstr_printf("J-parse[%u]", pt->idx));
+    set_parser_thread(pt->idx);
+
+    time_t last_timeout = time(NULL);
+    while (1) {
+        struct queued_frame *qf = parser_thread_pop(pt);
+        if (! qf && parsers_quit) break;    // quit once all queued frames are parsed
+        if (qf) {
+            struct pkt_source *pkt_source = qf->pkt_source;
+            parse_frame(&qf->frame, qf->buf);
+            objfree(qf);
+#           ifdef __GNUC__
+            (void)__sync_sub_and_fetch(&pkt_source->nb_queued, 1);
+#           else
+            pkt_source->nb_queued --;
+#           endif
+        }
+
+        // The timebounder does not timeout the packets waiting in our flows
+        time_t const now = time(NULL);
+        if (now != last_timeout) {
+            last_timeout = now;
+            enter_multi_region();
+            pkt_wait_lists_timeout_mine();
+            leave_protected_region();
+        }
+    }
+
+    return NULL;
+}
+
+static void *start_guile_parser(void *pt_)
+{
+    return scm_with_guile(parser_thread, pt_);
+}
+
+// Caller must own pkt_sources_lock
+static void parser_threads_start(void)
+{
+    // Flows that were parsed with locks cannot be parsed without
+    if (parsers_started) return;
+    parsers_started = true;
+
+    unsigned nb;
+    WITH_EXT_LOCK(nb_parser_threads, nb = nb_parser_threads);
+    if (0 == nb) return;
+    if (nb > NB_ELEMS(parser_threads)) nb = NB_ELEMS(parser_threads);
+
+    SLOG(LOG_INFO, "Starting %u parser threads", nb);
+    flow_affinity = true;   // before any packet is parsed
+    for (unsigned p = 0; p < nb; p++) {
+        struct parser_thread *pt = parser_threads + p;
+        pt->idx = p;
+        pt->head = pt->length = 0;
+        pthread_mutex_init(&pt->mutex, NULL);
+        pthread_cond_init(&pt->not_empty, NULL);
+        pthread_cond_init(&pt->not_full, NULL);
+        int err = pthread_create(&pt->pth, NULL, start_guile_parser, pt);
+        if (err) {
+            SLOG(LOG_CRIT, "Cannot start parser thread: %s", strerror(err));
+            abort();    // we may already have started other parser threads that own some flows
+        }
+    }
+    nb_parsers = nb;
+}
+
+// Parse what's queued then stop the parser threads
+static void parser_threads_stop(void)
+{
+    parsers_quit = 1;
+    for (unsigned p = 0; p < nb_parsers; p++) {
+        struct parser_thread *pt = parser_threads + p;
+        WITH_PTH_MUTEX(&pt->mutex) {
+            pthread_cond_broadcast(&pt->not_empty);
+            pthread_cond_broadcast(&pt->not_full);
+        }
+        pthread_join(pt->pth, NULL);
+        while (pt->length > 0) {
+            frame_buf_unref(&pt->queue[pt->head]->buf);
+            objfree(pt->queue[pt->head]);
+            pt->head = (pt->head + 1) % NB_ELEMS(pt->queue);
+            pt->length --;
+        }
+        pthread_cond_destroy(&pt->not_full);
+        pthread_cond_destroy(&pt->not_empty);
+        pthread_mutex_destroy(&pt->mutex);
+    }
+}
+
+// Wait until the parser threads are done with the packets of this pkt_source
+static void pkt_source_wait_queued(struct pkt_source *pkt_source)
+{
+    while (!parsers_quit &&
+#       ifdef __GNUC__
+        __sync_fetch_and_add(&pkt_source->nb_queued, 0) > 0
+#       else
+        pkt_source->nb_queued > 0
+#       endif
+    ) {
+        usleep(1000);
+    }
+}
+
+/*
+ * The sniffer callback
+ */
+
 static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header, const u_char *packet)
 {
     if (want_exit) return;
@@ -142,19 +425,11 @@ static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header,
         return;
     }
 
-#   ifdef WITH_GIANT_LOCK
-    mutex_lock(&giant_lock);
-#   endif
-
-    assert(cap_parser);
-
-    uint64_t start_wait = bench_event_start();
-    enter_multi_region();
-    bench_event_stop(&waiting_for_multi, start_wait);
-
-    (void)proto_parse(cap_parser, NULL, 0, (uint8_t *)&frame, frame.cap_len, frame.wire_len, &frame.tv, frame.cap_len, frame.data);
-
-    leave_protected_region();
+    if (nb_parsers > 0) {
+        dispatch_frame(pkt_source, &frame);
+    } else {
+        parse_frame(&frame, NULL);
+    }
 
     if (pkt_count > 0) {
         if (0 ==
@@ -165,10 +440,6 @@ static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header,
 #           endif
         ) want_exit = 1; // we cannot call exit from pcap callback (since we cannot destroy this pkt_source from pcap callback)
     }
-
-#   ifdef WITH_GIANT_LOCK
-    mutex_unlock(&giant_lock);
-#   endif
 }
 
 static void pkt_source_del(struct pkt_source *);
@@ -350,6 +621,7 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
     pkt_source->filter = filter ? objalloc_strdup(filter) : NULL;
     pkt_source->sniffer_fun = sniffer;
     pkt_source->digests = digest_queue_get(dev_id); // if we can't have a deduplicator, let's go without one!
+    pkt_source->nb_queued = 0;
 
     mutex_lock(&pkt_sources_lock);
     if (want_exit) {
@@ -362,6 +634,8 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
         if (0 == strcmp(name, other->name) && other->instance >= pkt_source->instance) pkt_source->instance = other->instance+1;
     }
 
+    parser_threads_start();
+
     pkt_source->dev_id = dev_id;
     LIST_INSERT_HEAD(&pkt_sources, pkt_source, entry);
 
@@ -540,6 +814,8 @@ static uint64_t tot_dropped, tot_recved;
 
 static void pkt_source_del(struct pkt_source *pkt_source)
 {
+    pkt_source_wait_queued(pkt_source);
+
     // Dump some stats
     struct pcap_stat stats;
     bool const have_stats = 0 == pcap_stats(pkt_source->pcap_handle, &stats);
@@ -785,6 +1061,7 @@ void pkt_source_init(void)
     filter_sym            = scm_permanent_object(scm_from_latin1_symbol("filter"));
 
     ext_param_quit_when_done_init();
+    ext_param_nb_parser_threads_init();
     ext_param_default_bpf_filter_init();
     log_category_pkt_sources_init();
 
@@ -847,6 +1124,10 @@ void pkt_source_fini(void)
 {
     if (--inited) return;
 
+    // Even when we do not bother deleting everything, queued frames must be parsed
+    want_exit = 1;
+    parser_threads_stop();
+
 #   ifdef DELETE_ALL_AT_EXIT
     mutex_lock(&pkt_sources_lock);
     terminating = want_exit = 1;
@@ -885,6 +1166,7 @@ void pkt_source_fini(void)
 
     log_category_pkt_sources_fini();
     ext_param_quit_when_done_fini();
+    ext_param_nb_parser_threads_fini();
     ext_param_default_bpf_filter_fini();
     mutex_dtor(&pkt_sources_lock);
 
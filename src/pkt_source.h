@@ -36,6 +36,7 @@ struct pkt_source {
     uint8_t dev_id;
     char *filter;                   ///< Packet filter expression in use for this device (for reference only)
     struct digest_queue *digests;   ///< Digests queue used for deduplication on this pkt_source
+    unsigned nb_queued;             ///< Number of packets waiting for a parser thread (must read 0 before this pkt_source can be deleted)
 };
 
 /** Now the frame structure that will be given to the cap parser, since
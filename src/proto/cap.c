@@ -119,7 +119,7 @@ void cap_init(void)
         .info_2_str  = cap_info_2_str,
         .info_addr   = cap_info_addr
     };
-    mux_proto_ctor(&mux_proto_cap, &ops, &mux_proto_ops, "Capture", PROTO_CODE_CAP, sizeof(iface_unset)/* device_id */, 11);
+    mux_proto_ctor(&mux_proto_cap, &ops, &mux_proto_ops, "Capture", PROTO_CODE_CAP, sizeof(iface_unset)/* device_id */, 16);
 }
 
 void cap_fini(void)
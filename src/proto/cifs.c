@@ -1489,6 +1489,7 @@ static void cifs_parser_dtor(struct cifs_parser *cifs_parser)
     HASH_FOREACH_SAFE(s, &cifs_parser->multiplex_state_hash, multiplex_state_entry, tmp) {
         multiplex_state_del(&cifs_parser->timeouter_pool, &cifs_parser->multiplex_state_hash, s);
     }
+    timeouter_pool_dtor(&cifs_parser->timeouter_pool);
     HASH_DEINIT(&cifs_parser->multiplex_state_hash);
     parser_dtor(&cifs_parser->parser);
 }
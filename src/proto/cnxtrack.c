@@ -2,12 +2,14 @@
 // vim:sw=4 ts=4 sts=4 expandtab
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <junkie/cpp.h>
 #include <junkie/proto/cnxtrack.h>
 #include <junkie/tools/hash.h>
 #include <junkie/tools/mutex.h>
 #include <junkie/tools/ext.h>
 #include <junkie/tools/log.h>
+#include <junkie/tools/timebound.h>
 #include "junkie/tools/objalloc.h"
 
 #undef LOG_CAT
@@ -15,47 +17,125 @@
 
 LOG_CATEGORY_DEF(cnxtrack);
 
-static TAILQ_HEAD(cnxtrack_ips, cnxtrack_ip) cnxtrack_ips;   // all cnxtrack_ips ordered most recently used first
-static HASH_TABLE(cnxtrack_ips_h, cnxtrack_ip) cnxtrack_ips_h;  // the hash of all defined cnxtrack_ips
+/* Tracked connections are spread over several shards, each with its own lock,
+ * so that lookups from different sniffing threads rarely contend.
+ *
+ * Exact expectations (both peers fully known) are indexed on the ordered
+ * 5-tuple, so that a single probe finds them whatever the direction of the
+ * packet. Wildcard expectations (lacking the address and/or the port of the
+ * second peer) are indexed on the first peer only, which is always known, so
+ * that all the wildcards for a given server are found with one probe per end
+ * of the packet. Exact entries are sharded on the whole 5-tuple while wildcard
+ * entries are sharded on their known peer.
+ *
+ * Timeouts and rehashes are run by the timebounder thread. */
+
+#define CNXTRACK_NB_SHARDS 16   // must be a power of 2
+
+static struct cnxtrack_shard {
+    struct mutex mutex;     // protects everything in this shard
+    TAILQ_HEAD(cnxtrack_ips, cnxtrack_ip) used;                 // all cnxtrack_ips of this shard, ordered most recently used first
+    HASH_TABLE(cnxtrack_exact_h, cnxtrack_ip) exact;            // the exact cnxtrack_ips, keyed on the ordered 5-tuple
+    HASH_TABLE(cnxtrack_wild_h, cnxtrack_ip) wild;              // the wildcard cnxtrack_ips, keyed on their known peer
+    struct timeval last_now;    // timestamp of the last lookup or insertion, to give time to the ticker
+} cnxtrack_shards[CNXTRACK_NB_SHARDS];
 
 static int64_t cnxtrack_timeout = 1000000; /* microseconds */
 EXT_PARAM_RW(cnxtrack_timeout, "connection-tracking-timeout", int64, "After how many microseconds an unused tracked connection must be forgotten");
 
 struct ip_addr cnxtrack_ip_addr_unknown;
-struct mutex cnxtracker_lock;   // protects cnxtrack_ips list and hash
+static struct timebound_ticker cnxtrack_timeouter;
+
+/// The ordered 5-tuple, for exact matches
+struct cnxtrack_exact_key {
+    struct ip_addr addr[2];
+    uint16_t port[2];
+    uint8_t protocol;
+} packed_;
+
+/// A single peer, for wildcard matches
+struct cnxtrack_peer_key {
+    struct ip_addr addr;
+    uint16_t port;
+    uint8_t protocol;
+} packed_;
 
 struct cnxtrack_ip {
     TAILQ_ENTRY(cnxtrack_ip) used_entry; // in the list of cnxtrack_ip ordered by last_used
-    HASH_ENTRY(cnxtrack_ip) h_entry;    // in the hash list of collisions
-    struct cnxtrack_ip_key {
-        struct ip_key ip;
-        struct port_key port;
-    } packed_ key;
+    HASH_ENTRY(cnxtrack_ip) h_entry;    // in the hash list of collisions (of shard->exact or shard->wild)
+    struct cnxtrack_shard *shard;
+    bool wildcard;                      // if set, key.peer is used and the other peer is in other_addr/other_port
+    union {
+        struct cnxtrack_exact_key exact;
+        struct cnxtrack_peer_key peer;
+    } key;
+    struct ip_addr other_addr;          // for wildcards, the second peer's address or ADDR_UNKNOWN
+    uint16_t other_port;                // for wildcards, the second peer's port or PORT_UNKNOWN
     struct proto *proto;
     struct proto *requestor;
     bool reuse;
     struct timeval last_used;
 };
 
+static void exact_key_ctor(struct cnxtrack_exact_key *key, unsigned ip_proto, struct ip_addr const *ip_a, uint16_t port_a, struct ip_addr const *ip_b, uint16_t port_b)
+{
+    memset(key, 0, sizeof(*key));
+    key->protocol = ip_proto;
+    int const c = ip_addr_cmp(ip_a, ip_b);
+    unsigned const way = c > 0 || (c == 0 && port_a > port_b);
+    key->addr[way] = *ip_a;
+    key->port[way] = port_a;
+    key->addr[!way] = *ip_b;
+    key->port[!way] = port_b;
+}
+
+static void peer_key_ctor(struct cnxtrack_peer_key *key, unsigned ip_proto, struct ip_addr const *ip, uint16_t port)
+{
+    memset(key, 0, sizeof(*key));
+    key->protocol = ip_proto;
+    key->addr = *ip;
+    key->port = port;
+}
+
+// Not ip_addr_eq(), which fails on the unset family of ADDR_UNKNOWN
+static bool addr_is_unknown(struct ip_addr const *addr)
+{
+    return 0 == memcmp(addr, ADDR_UNKNOWN, sizeof(*addr));
+}
+
+// Use the high bits of the hash, the low ones are used by the shard's hashes
+#define SHARD_OF(key) (cnxtrack_shards + (HASH_FUNC(key) >> 24) % CNXTRACK_NB_SHARDS)
+
 static int cnxtrack_ip_ctor(struct cnxtrack_ip *ct, unsigned ip_proto, struct ip_addr const *ip_a, uint16_t port_a, struct ip_addr const *ip_b, uint16_t port_b, bool reuse, struct proto *proto, struct timeval const *now, struct proto *requestor)
 {
     SLOG(LOG_DEBUG, "Construct cnxtrack_ip@%p for proto %u, %s:%"PRIu16"->%s:%"PRIu16" for %s",
         ct, ip_proto, ip_addr_2_str(ip_a), port_a, ip_addr_2_str(ip_b), port_b, proto->name);
 
-    ct->key.ip.protocol = ip_proto;
-    ct->key.ip.addr[0] = *ip_a;
-    ct->key.ip.addr[1] = *ip_b;
-    ct->key.port.port[0] = port_a;
-    ct->key.port.port[1] = port_b;
+    ct->wildcard = port_b == PORT_UNKNOWN || addr_is_unknown(ip_b);
+    if (ct->wildcard) {
+        peer_key_ctor(&ct->key.peer, ip_proto, ip_a, port_a);
+        ct->other_addr = *ip_b;
+        ct->other_port = port_b;
+        ct->shard = SHARD_OF(&ct->key.peer);
+    } else {
+        exact_key_ctor(&ct->key.exact, ip_proto, ip_a, port_a, ip_b, port_b);
+        ct->shard = SHARD_OF(&ct->key.exact);
+    }
     ct->proto = proto;
     ct->requestor = requestor;
     ct->reuse = reuse;
     ct->last_used = *now;
 
-    mutex_lock(&cnxtracker_lock);
-    TAILQ_INSERT_HEAD(&cnxtrack_ips, ct, used_entry);
-    HASH_INSERT(&cnxtrack_ips_h, ct, &ct->key, h_entry);
-    mutex_unlock(&cnxtracker_lock);
+    struct cnxtrack_shard *shard = ct->shard;
+    mutex_lock(&shard->mutex);
+    TAILQ_INSERT_HEAD(&shard->used, ct, used_entry);
+    if (ct->wildcard) {
+        HASH_INSERT(&shard->wild, ct, &ct->key.peer, h_entry);
+    } else {
+        HASH_INSERT(&shard->exact, ct, &ct->key.exact, h_entry);
+    }
+    shard->last_now = *now;
+    mutex_unlock(&shard->mutex);
 
     return 0;
 }
@@ -71,13 +151,18 @@ struct cnxtrack_ip *cnxtrack_ip_new(unsigned ip_proto, struct ip_addr const *ip_
     return ct;
 }
 
-// Caller must own cnxtracker_lock
+// Caller must own ct->shard->mutex
 static void cnxtrack_ip_dtor(struct cnxtrack_ip *ct)
 {
     SLOG(LOG_DEBUG, "Destruct cnxtrack_ip@%p", ct);
 
-    HASH_REMOVE(&cnxtrack_ips_h, ct, h_entry);
-    TAILQ_REMOVE(&cnxtrack_ips, ct, used_entry);
+    struct cnxtrack_shard *shard = ct->shard;
+    if (ct->wildcard) {
+        HASH_REMOVE(&shard->wild, ct, h_entry);
+    } else {
+        HASH_REMOVE(&shard->exact, ct, h_entry);
+    }
+    TAILQ_REMOVE(&shard->used, ct, used_entry);
 }
 
 static void cnxtrack_ip_del_locked(struct cnxtrack_ip *ct)
@@ -88,41 +173,112 @@ static void cnxtrack_ip_del_locked(struct cnxtrack_ip *ct)
 
 void cnxtrack_ip_del(struct cnxtrack_ip *ct)
 {
-    mutex_lock(&cnxtracker_lock);
+    struct cnxtrack_shard *shard = ct->shard;
+    mutex_lock(&shard->mutex);
     cnxtrack_ip_del_locked(ct);
-    mutex_unlock(&cnxtracker_lock);
+    mutex_unlock(&shard->mutex);
 }
 
 /*
  * Lookup
  */
 
-// Caller must own cnxtracker_lock
-static void cnxtrack_ip_timeout(struct timeval const *now)
+static bool cnxtrack_ip_expired(struct cnxtrack_ip const *ct, struct timeval const *now)
+{
+    return timeval_sub(now, &ct->last_used) > cnxtrack_timeout;
+}
+
+// Caller must own shard->mutex
+static void cnxtrack_ip_timeout(struct cnxtrack_shard *shard, struct timeval const *now)
 {
     struct cnxtrack_ip *ct;
-    while (NULL != (ct = TAILQ_LAST(&cnxtrack_ips, cnxtrack_ips))) {
-        if (timeval_sub(now, &ct->last_used) <= cnxtrack_timeout) break;
+    while (NULL != (ct = TAILQ_LAST(&shard->used, cnxtrack_ips))) {
+        if (! cnxtrack_ip_expired(ct, now)) break;
         SLOG(LOG_DEBUG, "Timeouting cnxtrack_ip@%p", ct);
         cnxtrack_ip_del_locked(ct);
     }
 }
 
-// caller must own cnxtracker_lock
-static struct cnxtrack_ip *ll_lookup(unsigned ip_proto, struct ip_addr const *ip_a, uint16_t port_a, struct ip_addr const *ip_b, uint16_t port_b)
+// Run every second by the timebounder thread
+static void cnxtrack_timeouter_tick(struct timebound_ticker unused_ *ticker)
+{
+    // Shards that were not used recently must not keep their entries for longer
+    struct timeval now;
+    timeval_reset(&now);
+    for (unsigned s = 0; s < NB_ELEMS(cnxtrack_shards); s++) {
+        struct cnxtrack_shard *shard = cnxtrack_shards + s;
+        mutex_lock(&shard->mutex);
+        timeval_set_max(&now, &shard->last_now);
+        mutex_unlock(&shard->mutex);
+    }
+
+    for (unsigned s = 0; s < NB_ELEMS(cnxtrack_shards); s++) {
+        struct cnxtrack_shard *shard = cnxtrack_shards + s;
+        mutex_lock(&shard->mutex);
+        if (timeval_is_set(&now)) cnxtrack_ip_timeout(shard, &now);
+        HASH_TRY_REHASH(&shard->exact, key.exact, h_entry);
+        HASH_TRY_REHASH(&shard->wild, key.peer, h_entry);
+        mutex_unlock(&shard->mutex);
+    }
+}
+
+// caller must own ct->shard->mutex. Returns ct unless it has expired (then it's deleted)
+static struct cnxtrack_ip *check_expired(struct cnxtrack_ip *ct, struct timeval const *now)
+{
+    if (! cnxtrack_ip_expired(ct, now)) return ct;
+    // The ticker did not catch up with it yet
+    SLOG(LOG_DEBUG, "Timeouting cnxtrack_ip@%p", ct);
+    cnxtrack_ip_del_locked(ct);
+    return NULL;
+}
+
+// caller must own shard->mutex
+static struct cnxtrack_ip *exact_lookup(struct cnxtrack_shard *shard, struct cnxtrack_exact_key const *key, struct timeval const *now)
 {
-    struct cnxtrack_ip_key key = {
-        .ip = {
-            .protocol = ip_proto,
-            .addr = { *ip_a, *ip_b },
-        },
-        .port = {
-            .port = { port_a, port_b },
-        },
-    };
     struct cnxtrack_ip *ct;
-    HASH_LOOKUP(ct, &cnxtrack_ips_h, &key, key, h_entry);
-    return ct;
+    HASH_LOOKUP(ct, &shard->exact, key, key.exact, h_entry);
+    return ct ? check_expired(ct, now) : NULL;
+}
+
+/* Look for the best wildcard entry for a cnx between peer and other_addr:other_port.
+ * Following the preference of the original lookup order, an entry lacking only
+ * the address is better (rank 1) than an entry lacking only the port (rank 2),
+ * which is better than an entry lacking both (rank 3).
+ * caller must own shard->mutex */
+static struct cnxtrack_ip *wild_lookup(struct cnxtrack_shard *shard, struct cnxtrack_peer_key const *peer, struct ip_addr const *other_addr, uint16_t other_port, struct timeval const *now, unsigned *rank)
+{
+    struct cnxtrack_ip *best = NULL;
+    *rank = UINT_MAX;
+
+    struct cnxtrack_ip *ct, *tmp;
+    HASH_FOREACH_SAME_KEY_SAFE(ct, &shard->wild, peer, key.peer, h_entry, tmp) {
+        if (0 != memcmp(peer, &ct->key.peer, sizeof(*peer))) continue;
+        if (! check_expired(ct, now)) continue;
+        bool const addr_unknown = addr_is_unknown(&ct->other_addr);
+        bool const port_unknown = ct->other_port == PORT_UNKNOWN;
+        unsigned r;
+        if (addr_unknown && port_unknown) {
+            r = 3;
+        } else if (addr_unknown) {
+            if (ct->other_port != other_port) continue;
+            r = 1;
+        } else {
+            if (! ip_addr_eq(&ct->other_addr, other_addr)) continue;
+            r = 2;
+        }
+        if (r < *rank) {
+            best = ct;
+            *rank = r;
+        }
+    }
+
+    return best;
+}
+
+// Racy, but harmless: an entry added concurrently is as if it was added right after the lookup
+static bool shard_wild_empty(struct cnxtrack_shard const *shard)
+{
+    return HASH_EMPTY(&shard->wild);
 }
 
 struct proto *cnxtrack_ip_lookup(unsigned ip_proto, struct ip_addr const *ip_a, uint16_t port_a, struct ip_addr const *ip_b, uint16_t port_b, struct timeval const *now, struct proto **requestor)
@@ -132,44 +288,50 @@ struct proto *cnxtrack_ip_lookup(unsigned ip_proto, struct ip_addr const *ip_a,
     SLOG(LOG_DEBUG, "Lookup tracked cnx for proto %u, %s:%"PRIu16"->%s:%"PRIu16,
         ip_proto, ip_addr_2_str(ip_a), port_a, ip_addr_2_str(ip_b), port_b);
 
-    mutex_lock(&cnxtracker_lock);
-
-    // Maybe rehash the hash?
-    static time_t last_rehash = 0; // timestamp (seconds) of the last rehash
-    if (now->tv_sec > last_rehash) {
-        last_rehash = now->tv_sec;
-        HASH_TRY_REHASH(&cnxtrack_ips_h, key, h_entry);
+    // Ok, look for an exact match first (in both directions at once)
+    struct cnxtrack_exact_key exact_key;
+    exact_key_ctor(&exact_key, ip_proto, ip_a, port_a, ip_b, port_b);
+    struct cnxtrack_shard *shards[2] = { SHARD_OF(&exact_key), NULL };
+    unsigned nb_shards = 0;
+    struct cnxtrack_ip *ct = NULL;
+
+    if (! HASH_EMPTY(&shards[0]->exact)) {  // racy, but harmless (see shard_wild_empty)
+        nb_shards = 1;
+        mutex_lock(&shards[0]->mutex);
+        shards[0]->last_now = *now;
+        ct = exact_lookup(shards[0], &exact_key, now);
+        if (ct) goto done;
+        mutex_unlock(&shards[0]->mutex);
+        nb_shards = 0;
     }
 
-    // Clean
-    cnxtrack_ip_timeout(now);
+    // Then for a wildcard expectation of either peer
+    struct cnxtrack_peer_key peer_a, peer_b;
+    peer_key_ctor(&peer_a, ip_proto, ip_a, port_a);
+    peer_key_ctor(&peer_b, ip_proto, ip_b, port_b);
+    struct cnxtrack_shard *shard_a = SHARD_OF(&peer_a);
+    struct cnxtrack_shard *shard_b = SHARD_OF(&peer_b);
+    bool const try_a = ! shard_wild_empty(shard_a);
+    bool const try_b = ! shard_wild_empty(shard_b);
+    if (! try_a && ! try_b) goto done;  // I'm afraid we don't know this stream
+
+    // Lock both shards (in a consistent order) so that we can choose between both peers
+    if (try_a) shards[nb_shards++] = shard_a;
+    if (try_b && shard_b != shard_a) shards[nb_shards++] = shard_b;
+    if (nb_shards == 2 && shards[0] > shards[1]) {
+        struct cnxtrack_shard *tmp = shards[0];
+        shards[0] = shards[1];
+        shards[1] = tmp;
+    }
+    for (unsigned s = 0; s < nb_shards; s++) {
+        mutex_lock(&shards[s]->mutex);
+        shards[s]->last_now = *now;
+    }
 
-    // Ok, look for an exact match first
-    struct cnxtrack_ip *ct;
-    ct = ll_lookup(ip_proto, ip_a, port_a, ip_b, port_b);
-    if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, ip_a, port_a);
-    if (ct) goto done;
-
-    // Maybe we lacked one IP address?
-    ct = ll_lookup(ip_proto, ip_a, port_a, &cnxtrack_ip_addr_unknown, port_b);
-    if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, &cnxtrack_ip_addr_unknown, port_a);
-    if (ct) goto done;
-
-    // Maybe we lacked one port then?
-    ct = ll_lookup(ip_proto, ip_a, port_a, ip_b, PORT_UNKNOWN);
-    if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, ip_a, PORT_UNKNOWN);
-    if (ct) goto done;
-
-    // It's becoming problematic. Maybe we had only one peer then?
-    ct = ll_lookup(ip_proto, ip_a, port_a, &cnxtrack_ip_addr_unknown, PORT_UNKNOWN);
-    if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, &cnxtrack_ip_addr_unknown, PORT_UNKNOWN);
-    if (ct) goto done;
-
-    // I'm afraid we don't know this stream. so many hash searches for nothing...
+    unsigned rank_a = UINT_MAX, rank_b = UINT_MAX;
+    struct cnxtrack_ip *ct_a = try_a ? wild_lookup(shard_a, &peer_a, ip_b, port_b, now, &rank_a) : NULL;
+    struct cnxtrack_ip *ct_b = try_b ? wild_lookup(shard_b, &peer_b, ip_a, port_a, now, &rank_b) : NULL;
+    ct = rank_b < rank_a ? ct_b : ct_a;
 
 done:
     if (ct) {
@@ -177,8 +339,8 @@ done:
         if (requestor) *requestor = ct->requestor;
         if (ct->reuse) {
             // promote at head of used list
-            TAILQ_REMOVE(&cnxtrack_ips, ct, used_entry);
-            TAILQ_INSERT_HEAD(&cnxtrack_ips, ct, used_entry);
+            TAILQ_REMOVE(&ct->shard->used, ct, used_entry);
+            TAILQ_INSERT_HEAD(&ct->shard->used, ct, used_entry);
             // and touch
             ct->last_used = *now;
         } else {
@@ -187,7 +349,7 @@ done:
         }
     }
 
-    mutex_unlock(&cnxtracker_lock);
+    while (nb_shards--) mutex_unlock(&shards[nb_shards]->mutex);
     return proto;
 }
 
@@ -204,36 +366,51 @@ void cnxtrack_init(void)
     mutex_init();
     hash_init();
     objalloc_init();
+    timebound_init();
 
     log_category_cnxtrack_init();
     ext_param_cnxtrack_timeout_init();
 
-    mutex_ctor(&cnxtracker_lock, "cnxtracker");
     memset(&cnxtrack_ip_addr_unknown, 0, sizeof(cnxtrack_ip_addr_unknown));
-    TAILQ_INIT(&cnxtrack_ips);
-    HASH_INIT(&cnxtrack_ips_h, 1000 /* initial value of how many cnx we expect to track at a given time */, "Connection Tracking for IP");
+    for (unsigned s = 0; s < NB_ELEMS(cnxtrack_shards); s++) {
+        struct cnxtrack_shard *shard = cnxtrack_shards + s;
+        mutex_ctor(&shard->mutex, "cnxtracker");
+        TAILQ_INIT(&shard->used);
+        // 1000 is the initial value of how many cnx we expect to track at a given time
+        HASH_INIT(&shard->exact, 1000 / CNXTRACK_NB_SHARDS, "Connection Tracking for IP (exact)");
+        HASH_INIT(&shard->wild, 1000 / CNXTRACK_NB_SHARDS, "Connection Tracking for IP (wildcards)");
+        timeval_reset(&shard->last_now);
+    }
+    timebound_ticker_ctor(&cnxtrack_timeouter, "timeout tracked connections", cnxtrack_timeouter_tick);
 }
 
 void cnxtrack_fini(void)
 {
     if (--inited) return;
 
+    timebound_ticker_dtor(&cnxtrack_timeouter);
+
 #   ifdef DELETE_ALL_AT_EXIT
-    struct cnxtrack_ip *ct;
-    mutex_lock(&cnxtracker_lock);
-    while (NULL != (ct = TAILQ_FIRST(&cnxtrack_ips))) {
-        cnxtrack_ip_del_locked(ct);
-    }
-    mutex_unlock(&cnxtracker_lock);
+    for (unsigned s = 0; s < NB_ELEMS(cnxtrack_shards); s++) {
+        struct cnxtrack_shard *shard = cnxtrack_shards + s;
+        struct cnxtrack_ip *ct;
+        mutex_lock(&shard->mutex);
+        while (NULL != (ct = TAILQ_FIRST(&shard->used))) {
+            cnxtrack_ip_del_locked(ct);
+        }
+        mutex_unlock(&shard->mutex);
 
-    HASH_DEINIT(&cnxtrack_ips_h);
+        HASH_DEINIT(&shard->exact);
+        HASH_DEINIT(&shard->wild);
 
-    mutex_dtor(&cnxtracker_lock);
+        mutex_dtor(&shard->mutex);
+    }
 #   endif
 
     ext_param_cnxtrack_timeout_fini();
     log_category_cnxtrack_fini();
 
+    timebound_fini();
     objalloc_fini();
     hash_fini();
     mutex_fini();
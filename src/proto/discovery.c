@@ -19,16 +19,23 @@
  */
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include <inttypes.h>
 #include "junkie/cpp.h"
 #include "junkie/tools/ext.h"
 #include "junkie/tools/log.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/miscmacs.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/hash.h"
+#include "junkie/tools/counter.h"
 #include "junkie/netmatch.h"
 #include "junkie/proto/cnxtrack.h"
 #include "junkie/proto/tcp.h"
 #include "junkie/proto/udp.h"
+#include "junkie/proto/ip.h"
+#include "junkie/proto/port_muxer.h"
 #include "junkie/proto/discovery.h"
 
 #undef LOG_CAT
@@ -79,9 +86,17 @@ struct proto_signature {
     struct discovery_protocol protocol;
     struct netmatch_filter filter;
     struct proto *actual_proto;
+    // If any, the payload must start with one of these for the filter to match
+    unsigned nb_prefixes;
+    struct sig_prefix {
+        size_t len;
+        uint8_t *bytes;
+    } *prefixes;
 };
 
-static int proto_signature_ctor(struct proto_signature *sig, uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname)
+static void prefilter_rebuild(void);
+
+static int proto_signature_ctor(struct proto_signature *sig, uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname, unsigned nb_prefixes, struct sig_prefix const *prefixes)
 {
     SLOG(LOG_DEBUG, "Constructing proto_signature@%p", sig);
     sig->protocol.id = proto_id;
@@ -90,18 +105,39 @@ static int proto_signature_ctor(struct proto_signature *sig, uint16_t proto_id,
     if (0 != netmatch_filter_ctor(&sig->filter, filter_libname)) {
         return -1;
     }
+    sig->nb_prefixes = 0;
+    sig->prefixes = NULL;
+    if (nb_prefixes > 0) {
+        sig->prefixes = objalloc(nb_prefixes * sizeof(*sig->prefixes), "proto_signature prefixes");
+        if (! sig->prefixes) goto err1;
+        for (; sig->nb_prefixes < nb_prefixes; sig->nb_prefixes++) {
+            struct sig_prefix *const prefix = sig->prefixes + sig->nb_prefixes;
+            prefix->len = prefixes[sig->nb_prefixes].len;
+            prefix->bytes = objalloc(MAX(prefix->len, 1), "proto_signature prefixes");
+            if (! prefix->bytes) goto err2;
+            memcpy(prefix->bytes, prefixes[sig->nb_prefixes].bytes, prefix->len);
+        }
+    }
     // Look for a proper proto with same name to handle this payload
     sig->actual_proto = proto_of_name(proto_name);
     if (sig->actual_proto) SLOG(LOG_INFO, "Signature for %s migh trigger proper parser", proto_name);
     LIST_INSERT_HEAD(&proto_signatures, sig, entry);
+    prefilter_rebuild();
     return 0;
+
+err2:
+    while (sig->nb_prefixes--) objfree(sig->prefixes[sig->nb_prefixes].bytes);
+    objfree(sig->prefixes);
+err1:
+    netmatch_filter_dtor(&sig->filter);
+    return -1;
 }
 
-static struct proto_signature *proto_signature_new(uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname)
+static struct proto_signature *proto_signature_new(uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname, unsigned nb_prefixes, struct sig_prefix const *prefixes)
 {
     struct proto_signature *sig = objalloc(sizeof(*sig), "proto_signature");
     if (! sig) return NULL;
-    if (0 != proto_signature_ctor(sig, proto_id, proto_name, trust, filter_libname)) {
+    if (0 != proto_signature_ctor(sig, proto_id, proto_name, trust, filter_libname, nb_prefixes, prefixes)) {
         objfree(sig);
         return NULL;
     }
@@ -114,6 +150,8 @@ static void proto_signature_dtor(struct proto_signature *sig)
     SLOG(LOG_DEBUG, "Destructing proto_signature@%p", sig);
     LIST_REMOVE(sig, entry);
     netmatch_filter_dtor(&sig->filter);
+    for (unsigned p = 0; p < sig->nb_prefixes; p++) objfree(sig->prefixes[p].bytes);
+    if (sig->prefixes) objfree(sig->prefixes);
 }
 
 static void proto_signature_del(struct proto_signature *sig)
@@ -123,6 +161,183 @@ static void proto_signature_del(struct proto_signature *sig)
 }
 #endif
 
+/*
+ * Prefilter
+ *
+ * Running every signature on every unknown payload costs a lot. Signatures
+ * can come with the prefixes one of which the payload must start with for the
+ * signature to match. All these prefixes are compiled into a trie so that a
+ * single pass over the first bytes of the payload selects the few signatures
+ * worth running (plus those without prefixes, which are always run).
+ */
+
+struct prefilter {
+    struct prefilter *prev;         // retired prefilters are kept until exit since some parser might still be using them
+    unsigned nb_sigs;
+    unsigned nb_words;              // size of the candidate bitmaps
+    struct proto_signature **sigs;  // all signatures, in lookup order
+    uint64_t *unanchored;           // bitmap of the signatures without prefixes
+    size_t max_depth;               // length of the longest prefix
+    unsigned nb_nodes;
+    struct prefilter_node {
+        unsigned first_child, next_sibling; // index in nodes (0 for none, since node 0 is the root)
+        unsigned first_end;         // 1 + index in ends of the first signature which prefix ends here (0 if none)
+        uint8_t byte;
+    } *nodes;
+    struct prefilter_end {
+        unsigned sig;               // index in sigs
+        unsigned next;              // 1 + index in ends of the next signature which prefix ends on the same node (0 if none)
+    } *ends;
+    unsigned root[256];             // index in nodes of the child of the root for each byte (0 if none)
+};
+
+static struct prefilter *prefilter;    // the one in use
+static struct prefilter *retired_prefilters;
+
+static unsigned prefilter_child(struct prefilter const *pf, unsigned node, uint8_t byte)
+{
+    if (node == 0) return pf->root[byte];
+    for (unsigned c = pf->nodes[node].first_child; c; c = pf->nodes[c].next_sibling) {
+        if (pf->nodes[c].byte == byte) return c;
+    }
+    return 0;
+}
+
+static void prefilter_add(struct prefilter *pf, unsigned sig_idx, struct sig_prefix const *prefix, unsigned *nb_ends)
+{
+    if (prefix->len == 0) {    // matches everything
+        pf->unanchored[sig_idx / 64] |= 1ULL << (sig_idx % 64);
+        return;
+    }
+
+    unsigned node = 0;
+    for (size_t d = 0; d < prefix->len; d++) {
+        uint8_t const byte = prefix->bytes[d];
+        unsigned c = prefilter_child(pf, node, byte);
+        if (! c) {
+            c = pf->nb_nodes ++;
+            pf->nodes[c] = (struct prefilter_node){ .byte = byte };
+            if (node == 0) {
+                pf->root[byte] = c;
+            } else {
+                pf->nodes[c].next_sibling = pf->nodes[node].first_child;
+                pf->nodes[node].first_child = c;
+            }
+        }
+        node = c;
+    }
+
+    pf->ends[*nb_ends] = (struct prefilter_end){ .sig = sig_idx, .next = pf->nodes[node].first_end };
+    pf->nodes[node].first_end = ++ *nb_ends;
+    pf->max_depth = MAX(pf->max_depth, prefix->len);
+}
+
+static void prefilter_del(struct prefilter *pf)
+{
+    objfree(pf->sigs);
+    objfree(pf->unanchored);
+    objfree(pf->nodes);
+    objfree(pf->ends);
+    objfree(pf);
+}
+
+static struct prefilter *prefilter_new(void)
+{
+    unsigned nb_sigs = 0, nb_prefixes = 0;
+    size_t nb_bytes = 0;
+    struct proto_signature *sig;
+    LIST_FOREACH(sig, &proto_signatures, entry) {
+        nb_sigs ++;
+        nb_prefixes += sig->nb_prefixes;
+        for (unsigned p = 0; p < sig->nb_prefixes; p++) nb_bytes += sig->prefixes[p].len;
+    }
+
+    struct prefilter *pf = objalloc(sizeof(*pf), "discovery prefilter");
+    if (! pf) return NULL;
+    pf->nb_sigs = nb_sigs;
+    pf->nb_words = MAX((nb_sigs + 63) / 64, 1);
+    pf->max_depth = 0;
+    pf->nb_nodes = 1;   // the root
+    memset(pf->root, 0, sizeof(pf->root));
+    // Allocate for the worst case (no prefix sharing anything with another)
+    pf->sigs = objalloc(MAX(nb_sigs, 1) * sizeof(*pf->sigs), "discovery prefilter");
+    pf->unanchored = objalloc(pf->nb_words * sizeof(*pf->unanchored), "discovery prefilter");
+    pf->nodes = objalloc((1 + nb_bytes) * sizeof(*pf->nodes), "discovery prefilter");
+    pf->ends = objalloc(MAX(nb_prefixes, 1) * sizeof(*pf->ends), "discovery prefilter");
+    if (! pf->sigs || ! pf->unanchored || ! pf->nodes || ! pf->ends) {
+        if (pf->sigs) objfree(pf->sigs);
+        if (pf->unanchored) objfree(pf->unanchored);
+        if (pf->nodes) objfree(pf->nodes);
+        if (pf->ends) objfree(pf->ends);
+        objfree(pf);
+        return NULL;
+    }
+    memset(pf->unanchored, 0, pf->nb_words * sizeof(*pf->unanchored));
+    pf->nodes[0] = (struct prefilter_node){ .byte = 0 };
+
+    unsigned s = 0, nb_ends = 0;
+    LIST_FOREACH(sig, &proto_signatures, entry) {
+        pf->sigs[s] = sig;
+        if (sig->nb_prefixes == 0) {
+            pf->unanchored[s / 64] |= 1ULL << (s % 64);
+        } else {
+            for (unsigned p = 0; p < sig->nb_prefixes; p++) prefilter_add(pf, s, sig->prefixes + p, &nb_ends);
+        }
+        s ++;
+    }
+
+    SLOG(LOG_DEBUG, "New prefilter for %u signatures, %u prefixes (%u nodes)", nb_sigs, nb_prefixes, pf->nb_nodes);
+    return pf;
+}
+
+// Called whenever the signature list changes
+static void prefilter_rebuild(void)
+{
+    struct prefilter *pf = prefilter_new();
+    if (! pf) {
+        SLOG(LOG_ERR, "Cannot build discovery prefilter, new signatures will be ignored");
+        return;
+    }
+    __sync_synchronize();   // pf must be complete before any parser sees it
+    struct prefilter *prev = __sync_lock_test_and_set(&prefilter, pf);
+    if (prev) {
+        prev->prev = retired_prefilters;
+        retired_prefilters = prev;
+    }
+}
+
+// Returns the first signature matching this payload, or NULL
+static struct proto_signature *prefilter_lookup(struct prefilter const *pf, struct proto_info *parent, uint8_t const *packet, size_t cap_len)
+{
+    uint64_t candidates[pf->nb_words];
+    memcpy(candidates, pf->unanchored, sizeof(candidates));
+
+    size_t const depth = MIN(cap_len, pf->max_depth);
+    unsigned node = 0;
+    for (size_t d = 0; d < depth; d++) {
+        node = prefilter_child(pf, node, packet[d]);
+        if (! node) break;
+        for (unsigned e = pf->nodes[node].first_end; e; e = pf->ends[e-1].next) {
+            unsigned const s = pf->ends[e-1].sig;
+            candidates[s / 64] |= 1ULL << (s % 64);
+        }
+    }
+
+    // Try the candidates in lookup order
+    struct npc_register rest = { .size = cap_len, .value = (uintptr_t)packet };
+    for (unsigned w = 0; w < pf->nb_words; w++) {
+        uint64_t bits = candidates[w];
+        while (bits) {
+            unsigned const s = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            struct proto_signature *sig = pf->sigs[s];
+            if (0 != sig->filter.match_fun(parent, rest, sig->filter.regfile, sig->filter.regfile)) return sig;
+        }
+    }
+
+    return NULL;
+}
+
 static SCM high_sym, medium_sym, low_sym;
 
 static SCM scm_from_trust(enum discovery_trust t)
@@ -137,7 +352,7 @@ static SCM scm_from_trust(enum discovery_trust t)
 
 
 static struct ext_function sg_add_proto_signature;
-static SCM g_add_proto_signature(SCM name_, SCM id_, SCM trust_, SCM filter_)
+static SCM g_add_proto_signature(SCM name_, SCM id_, SCM trust_, SCM filter_, SCM prefixes_)
 {
     scm_dynwind_begin(0);
     char *name = scm_to_locale_string(name_);
@@ -157,7 +372,15 @@ static SCM g_add_proto_signature(SCM name_, SCM id_, SCM trust_, SCM filter_)
     char *libname = scm_to_locale_string(filter_);
     scm_dynwind_free(libname);
 
-    struct proto_signature *sig = proto_signature_new(id, name, trust, libname);
+    unsigned const nb_prefixes = SCM_UNBNDP(prefixes_) ? 0 : scm_to_uint(scm_length(prefixes_));
+    struct sig_prefix prefixes[MAX(nb_prefixes, 1)];
+    for (unsigned p = 0; p < nb_prefixes; p++, prefixes_ = scm_cdr(prefixes_)) {
+        // Each char of the string stands for a byte
+        prefixes[p].bytes = (uint8_t *)scm_to_latin1_stringn(scm_car(prefixes_), &prefixes[p].len);
+        scm_dynwind_free(prefixes[p].bytes);
+    }
+
+    struct proto_signature *sig = proto_signature_new(id, name, trust, libname, nb_prefixes, prefixes);
     if (! sig) {
         scm_throw(scm_from_latin1_symbol("cannot-create-signature"), SCM_EOL);
     }
@@ -194,6 +417,203 @@ static SCM g_proto_signature_stats(SCM name_)
 }
 
 
+/*
+ * Unknown servers
+ *
+ * A small direct mapped cache of the servers the discovery failed to
+ * classify, so that new flows to the ones it gave up on skip the discovery
+ * for a while.
+ */
+
+static unsigned discovery_max_packets = 10;
+EXT_PARAM_RW(discovery_max_packets, "discovery-max-packets", uint, "After how many unclassified payloads the discovery gives up on a flow/server (0 for no limit).")
+static unsigned discovery_max_bytes = 10000;
+EXT_PARAM_RW(discovery_max_bytes, "discovery-max-bytes", uint, "After how many bytes of unclassified payload the discovery gives up on a flow/server (0 for no limit).")
+static unsigned unknown_servers_timeout = 300;
+EXT_PARAM_RW(unknown_servers_timeout, "discovery-unknown-servers-timeout", uint, "For how many seconds new flows to a server the discovery gave up on skip the discovery (0 to never skip).")
+
+enum unknown_servers_counter {
+    UNKNOWN_SERVERS_HITS,               // how many times the discovery was skipped because of a server it gave up on
+    UNKNOWN_SERVERS_FALSE_NEGATIVES,    // how many servers the discovery gave up on were classified later on
+};
+static struct counters unknown_servers_counters;
+
+#define UNKNOWN_SERVERS_SIZE 1024
+#define UNKNOWN_SERVERS_PROBE 64    // one hit out of this many runs the discovery anyway, so that we notice false negatives
+
+static struct unknown_server {
+    struct ip_addr addr;
+    uint16_t port;
+    uint8_t ip_proto;
+    bool given_up;
+    unsigned nb_fails;      // unclassified payloads to this server
+    size_t nb_bytes;
+    time_t last_fail;       // 0 if the slot is free
+} unknown_servers[UNKNOWN_SERVERS_SIZE];
+
+static struct mutex unknown_servers_locks[64];  // slot s is protected by lock s % 64
+static __thread unsigned unknown_servers_nb_skips;  // to choose which hits to probe (per thread, so that no cache line bounces)
+
+static unsigned unknown_server_slot(unsigned ip_proto, struct ip_addr const *addr, uint16_t port)
+{
+    uint32_t h = hashfun(&addr->u, addr->family == AF_INET ? sizeof(addr->u.v4) : sizeof(addr->u.v6));
+    h ^= (port * 2654435761U) ^ ip_proto;
+    return h % UNKNOWN_SERVERS_SIZE;
+}
+
+static struct mutex *unknown_server_lock(unsigned slot)
+{
+    return unknown_servers_locks + slot % NB_ELEMS(unknown_servers_locks);
+}
+
+// Caller must own the slot lock
+static bool unknown_server_is(struct unknown_server const *srv, unsigned ip_proto, struct ip_addr const *addr, uint16_t port, struct timeval const *now)
+{
+    return
+        srv->last_fail != 0 &&
+        now->tv_sec <= srv->last_fail + (time_t)unknown_servers_timeout &&
+        srv->port == port && srv->ip_proto == ip_proto &&
+        0 == ip_addr_cmp(&srv->addr, addr);
+}
+
+static bool over_limits(unsigned nb_fails, size_t nb_bytes)
+{
+    return
+        (discovery_max_packets > 0 && nb_fails >= discovery_max_packets) ||
+        (discovery_max_bytes > 0 && nb_bytes >= discovery_max_bytes);
+}
+
+void discovery_flow_ctor(struct discovery_flow *flow)
+{
+    flow->nb_fails = 0;
+    flow->nb_bytes = 0;
+}
+
+bool discovery_failed(struct discovery_flow *flow, unsigned ip_proto, struct ip_addr const *srv_addr, uint16_t srv_port, size_t payload, struct timeval const *now)
+{
+    bool give_up = false;
+    if (flow) {
+        flow->nb_fails ++;
+        flow->nb_bytes += payload;
+        give_up = over_limits(flow->nb_fails, flow->nb_bytes);
+    }
+
+    if (unknown_servers_timeout == 0) return give_up;
+
+    unsigned const s = unknown_server_slot(ip_proto, srv_addr, srv_port);
+    struct unknown_server *srv = unknown_servers + s;
+    struct mutex *lock = unknown_server_lock(s);
+    mutex_lock(lock);
+    if (! unknown_server_is(srv, ip_proto, srv_addr, srv_port, now)) {
+        // Take over this slot
+        srv->addr = *srv_addr;
+        srv->port = srv_port;
+        srv->ip_proto = ip_proto;
+        srv->given_up = false;
+        srv->nb_fails = 0;
+        srv->nb_bytes = 0;
+    }
+    srv->nb_fails ++;
+    srv->nb_bytes += payload;
+    srv->last_fail = now->tv_sec;
+    if (give_up || over_limits(srv->nb_fails, srv->nb_bytes)) {
+        if (! srv->given_up) SLOG(LOG_DEBUG, "Giving up discovery for server %s:%"PRIu16, ip_addr_2_str(srv_addr), srv_port);
+        srv->given_up = true;
+        give_up = true;
+    }
+    mutex_unlock(lock);
+
+    return give_up;
+}
+
+static bool server_given_up(unsigned ip_proto, struct ip_addr const *addr, uint16_t port, struct timeval const *now)
+{
+    unsigned const s = unknown_server_slot(ip_proto, addr, port);
+    struct unknown_server const *srv = unknown_servers + s;
+    struct mutex *lock = unknown_server_lock(s);
+    mutex_lock(lock);
+    bool const ret = unknown_server_is(srv, ip_proto, addr, port, now) && srv->given_up;
+    mutex_unlock(lock);
+    return ret;
+}
+
+bool discovery_skip(unsigned ip_proto, struct ip_addr const addr[2], uint16_t const port[2], struct timeval const *now)
+{
+    if (unknown_servers_timeout == 0) return false;
+
+    // We do not know which end is the server, but clients ends are unlikely to be found there
+    if (! server_given_up(ip_proto, addr+1, port[1], now) && ! server_given_up(ip_proto, addr+0, port[0], now)) return false;
+
+    if (0 == unknown_servers_nb_skips++ % UNKNOWN_SERVERS_PROBE) {
+        SLOG(LOG_DEBUG, "Running discovery anyway to check for false negatives");
+        return false;
+    }
+    counters_add(&unknown_servers_counters, UNKNOWN_SERVERS_HITS, 1);
+    return true;
+}
+
+// Returns the server end of the flow this payload belongs to
+static bool parent_server(struct proto_info const *parent, unsigned *ip_proto, struct ip_addr const **addr, uint16_t *port)
+{
+    unsigned srv;
+    switch (parent->parser->proto->code) {
+        case PROTO_CODE_TCP:;
+            struct tcp_proto_info const *tcp = DOWNCAST(parent, info, tcp_proto_info);
+            *ip_proto = IPPROTO_TCP;
+            srv = tcp->to_srv;
+            *port = tcp->key.port[srv];
+            break;
+        case PROTO_CODE_UDP:;
+            struct udp_proto_info const *udp = DOWNCAST(parent, info, udp_proto_info);
+            *ip_proto = IPPROTO_UDP;
+            srv = comes_from_client(udp->key.port, false, false);
+            *port = udp->key.port[srv];
+            break;
+        default:
+            return false;
+    }
+
+    ASSIGN_INFO_OPT2(ip, ip6, parent);
+    if (! ip) ip = ip6;
+    if (! ip) return false;
+    *addr = ip->key.addr + srv;
+    return true;
+}
+
+// Forget about the server of a payload that was classified
+static void server_classified(struct proto_info const *parent, struct timeval const *now)
+{
+    if (unknown_servers_timeout == 0) return;
+
+    unsigned ip_proto;
+    struct ip_addr const *addr;
+    uint16_t port;
+    if (! parent_server(parent, &ip_proto, &addr, &port)) return;
+
+    unsigned const s = unknown_server_slot(ip_proto, addr, port);
+    struct unknown_server *srv = unknown_servers + s;
+    struct mutex *lock = unknown_server_lock(s);
+    mutex_lock(lock);
+    if (unknown_server_is(srv, ip_proto, addr, port, now)) {
+        if (srv->given_up) {
+            SLOG(LOG_DEBUG, "Server %s:%"PRIu16" was given up on but was classified", ip_addr_2_str(addr), port);
+            counters_add(&unknown_servers_counters, UNKNOWN_SERVERS_FALSE_NEGATIVES, 1);
+        }
+        srv->last_fail = 0;
+    }
+    mutex_unlock(lock);
+}
+static SCM unknown_servers_hits_sym;
+static SCM unknown_servers_false_negatives_sym;
+
+static struct ext_function sg_discovery_stats;
+static SCM g_discovery_stats(void)
+{
+    return scm_list_2(
+        scm_cons(unknown_servers_hits_sym, scm_from_uint64(counters_read(&unknown_servers_counters, UNKNOWN_SERVERS_HITS))),
+        scm_cons(unknown_servers_false_negatives_sym, scm_from_uint64(counters_read(&unknown_servers_counters, UNKNOWN_SERVERS_FALSE_NEGATIVES))));
+}
+
 /*
  * Parse
  */
@@ -203,12 +623,13 @@ static enum proto_parse_status discovery_parse(struct parser *parser, struct pro
     // Don't handle the gap and don't advertise parent
     if (!packet) return PROTO_OK;
 
-    // iter on all filters until one matches
-    struct proto_signature *sig;
-    struct npc_register rest = { .size = cap_len, .value = (uintptr_t)packet };
-    LIST_LOOKUP(sig, &proto_signatures, entry, 0 != sig->filter.match_fun(parent, rest, sig->filter.regfile, sig->filter.regfile));
+    // iter on all candidate filters until one matches
+    struct prefilter const *pf = prefilter;
+    if (! pf) return PROTO_PARSE_ERR;
+    struct proto_signature *sig = prefilter_lookup(pf, parent, packet, cap_len);
 
     if (! sig) return PROTO_PARSE_ERR;
+    server_classified(parent, now);
     SLOG(LOG_DEBUG, "Discovered protocol %s (which actual parser is %s)", sig->protocol.name, sig->actual_proto ? sig->actual_proto->name : "unknown");
     struct proto *sub_proto = sig->actual_proto;
 
@@ -275,7 +696,16 @@ static struct port_muxer udp_port_muxer;
 void discovery_init(void)
 {
     log_category_proto_discovery_init();
+    hash_init();
     LIST_INIT(&proto_signatures);
+    prefilter = retired_prefilters = NULL;
+    ext_param_discovery_max_packets_init();
+    ext_param_discovery_max_bytes_init();
+    ext_param_unknown_servers_timeout_init();
+    counters_ctor(&unknown_servers_counters);
+    for (unsigned l = 0; l < NB_ELEMS(unknown_servers_locks); l++) {
+        mutex_ctor(unknown_servers_locks+l, "unknown servers");
+    }
 
     static struct proto_ops const ops = {
         .parse       = discovery_parse,
@@ -294,19 +724,27 @@ void discovery_init(void)
     proto_id_sym      = scm_permanent_object(scm_from_latin1_symbol("id"));
     proto_trust_sym   = scm_permanent_object(scm_from_latin1_symbol("trust"));
     proto_libname_sym = scm_permanent_object(scm_from_latin1_symbol("libname"));
+    unknown_servers_hits_sym = scm_permanent_object(scm_from_latin1_symbol("unknown-servers-hits"));
+    unknown_servers_false_negatives_sym = scm_permanent_object(scm_from_latin1_symbol("unknown-servers-false-negatives"));
 
     ext_function_ctor(&sg_add_proto_signature,
-        "add-proto-signature", 4, 0, 0, g_add_proto_signature,  // TODO: additional optional parameter indicating what regular parser to run next
-        "(add-proto-signature name id trust netmatch-filter): add this filter for given name/id with given trust level\n"
+        "add-proto-signature", 4, 1, 0, g_add_proto_signature,  // TODO: additional optional parameter indicating what regular parser to run next
+        "(add-proto-signature name id trust netmatch-filter [prefixes]): add this filter for given name/id with given trust level\n"
         "   notice the id is unused internally, any number will do.\n"
         "   trust can be either 'high, 'medium or 'low.\n"
-        "   netmatch-filter is the name of a sofile containing a \"match\" function (as returned by netmatch compiler)\n");
+        "   netmatch-filter is the name of a sofile containing a \"match\" function (as returned by netmatch compiler)\n"
+        "   prefixes is an optional list of strings one of which the payload must start with for the filter to match\n"
+        "   (each char standing for a byte), so that the filter is not even tried on other payloads.\n");
     ext_function_ctor(&sg_proto_signatures,
         "proto-signatures", 0, 0, 0, g_proto_signatures,
         "(proto-signatures): list all currently defined protocol signatures.\n");
     ext_function_ctor(&sg_proto_signature_stats,
         "proto-signature-stats", 1, 0, 0, g_proto_signature_stats,
         "(proto-signature-stats name): display the definition and some stats about this signature.\n");
+    ext_function_ctor(&sg_discovery_stats,
+        "discovery-stats", 0, 0, 0, g_discovery_stats,
+        "(discovery-stats): how many times the discovery was skipped because of a server it gave up on\n"
+        "   (unknown-servers-hits) and how many of these servers were classified later on (unknown-servers-false-negatives).\n");
 }
 
 void discovery_fini(void)
@@ -316,10 +754,23 @@ void discovery_fini(void)
     while (NULL != (sig = LIST_FIRST(&proto_signatures))) {
         proto_signature_del(sig);
     }
+    if (prefilter) prefilter_del(prefilter);
+    while (retired_prefilters) {
+        struct prefilter *pf = retired_prefilters;
+        retired_prefilters = pf->prev;
+        prefilter_del(pf);
+    }
 
     port_muxer_dtor(&udp_port_muxer, &udp_port_muxers);
     port_muxer_dtor(&tcp_port_muxer, &tcp_port_muxers);
     uniq_proto_dtor(&uniq_proto_discovery);
+    for (unsigned l = 0; l < NB_ELEMS(unknown_servers_locks); l++) {
+        mutex_dtor(unknown_servers_locks+l);
+    }
 #   endif
+    ext_param_unknown_servers_timeout_fini();
+    ext_param_discovery_max_bytes_fini();
+    ext_param_discovery_max_packets_fini();
+    hash_fini();
     log_category_proto_discovery_fini();
 }
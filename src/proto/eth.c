@@ -272,7 +272,7 @@ void eth_init(void)
         .info_2_str  = eth_info_2_str,
         .info_addr   = eth_info_addr
     };
-    mux_proto_ctor(&mux_proto_eth, &ops, &mux_proto_ops, "Ethernet", PROTO_CODE_ETH, sizeof(vlan_unset) /* vlan_id */, 11);
+    mux_proto_ctor(&mux_proto_eth, &ops, &mux_proto_ops, "Ethernet", PROTO_CODE_ETH, sizeof(vlan_unset) /* vlan_id */, 16);
     LIST_INIT(&eth_subprotos);
 }
 
@@ -0,0 +1,328 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2014, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "junkie/cpp.h"
+#include "junkie/tools/miscmacs.h"
+#include "junkie/tools/log.h"
+#include "junkie/tools/ext.h"
+#include "junkie/tools/hash.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/objalloc.h"
+#include "junkie/tools/timebound.h"
+#include "junkie/proto/flow_cache.h"
+
+#undef LOG_CAT
+#define LOG_CAT flow_cache_log_category
+
+LOG_CATEGORY_DEF(flow_cache);
+
+static bool flow_cache_enabled = true;
+EXT_PARAM_RW(flow_cache_enabled, "flow-cache", bool, "Whether the subparsers of established TCP/UDP flows are cached by each sniffing thread.");
+
+// Must be a power of 2
+#define FLOW_CACHE_SIZE 1024
+
+struct flow_cache {
+    LIST_ENTRY(flow_cache) entry;       ///< In the list of all flow caches
+    struct mutex mutex;                 ///< Protects the entries (taken by the owner thread and the timebounder)
+    struct flow_cache_ctx *top;         ///< The current flow (used by the owner thread only)
+    uint64_t nb_hits, nb_misses;        ///< Only for debugging
+    struct flow_cache_entry {
+        struct flow_key key;
+        struct port_key l4_key;         ///< The key l4_sub was indexed with
+        unsigned way;                   ///< The way of the IP subparser for this flow
+        struct mux_subparser *ip_sub;   ///< NULL if the entry is unused
+        struct mux_subparser *l4_sub;
+    } entries[FLOW_CACHE_SIZE];
+};
+
+static pthread_key_t flow_cache_key;
+static struct mutex flow_caches_mutex;  // protects flow_caches
+static LIST_HEAD(flow_caches, flow_cache) flow_caches;
+static struct timebound_ticker flow_cache_purger;
+
+/*
+ * Entries
+ */
+
+// Caller must own cache->mutex
+static void flow_cache_entry_clear(struct flow_cache_entry *e)
+{
+    if (! e->ip_sub) return;
+    mux_subparser_unref(&e->ip_sub);
+    mux_subparser_unref(&e->l4_sub);
+}
+
+// Tells whether the cached subparsers are still the ones the slow lookups would find
+static bool flow_cache_entry_is_valid(struct flow_cache_entry const *e)
+{
+    assert(e->ip_sub && e->l4_sub);
+    return
+        (unsigned volatile)e->ip_sub->h_idx != NOT_HASHED &&
+        (unsigned volatile)e->l4_sub->h_idx != NOT_HASHED &&
+        e->l4_sub->parser != NULL &&
+        0 == memcmp(e->l4_sub->key, &e->l4_key, sizeof(e->l4_key));
+}
+
+/*
+ * Per thread caches
+ */
+
+static void flow_cache_del(void *cache_)
+{
+    struct flow_cache *cache = cache_;
+    SLOG(LOG_DEBUG, "Deleting flow_cache@%p (%"PRIu64" hits, %"PRIu64" misses)", cache, cache->nb_hits, cache->nb_misses);
+
+    WITH_LOCK(&flow_caches_mutex) {
+        LIST_REMOVE(cache, entry);
+    }
+    WITH_LOCK(&cache->mutex) {
+        for (unsigned e = 0; e < NB_ELEMS(cache->entries); e++) {
+            flow_cache_entry_clear(cache->entries + e);
+        }
+    }
+    mutex_dtor(&cache->mutex);
+    objfree(cache);
+}
+
+static struct flow_cache *flow_cache_get(void)
+{
+    struct flow_cache *cache = pthread_getspecific(flow_cache_key);
+    if (likely_(cache)) return cache;
+
+    cache = objalloc_nice(sizeof(*cache), "flow caches");
+    if (! cache) return NULL;
+    SLOG(LOG_DEBUG, "New flow_cache@%p", cache);
+
+    mutex_ctor(&cache->mutex, "flow cache");
+    cache->top = NULL;
+    cache->nb_hits = cache->nb_misses = 0;
+    for (unsigned e = 0; e < NB_ELEMS(cache->entries); e++) {
+        cache->entries[e].ip_sub = cache->entries[e].l4_sub = NULL;
+    }
+    WITH_LOCK(&flow_caches_mutex) {
+        LIST_INSERT_HEAD(&flow_caches, cache, entry);
+    }
+    (void)pthread_setspecific(flow_cache_key, cache);
+
+    return cache;
+}
+
+/*
+ * Flow contexts
+ */
+
+struct mux_subparser *flow_cache_ctx_ctor(struct flow_cache_ctx *ctx, struct mux_parser *ip_parser, struct ip_key const *ip_key, uint8_t const *payload, size_t cap_len, struct timeval const *now)
+{
+    ctx->prev = NULL;
+    ctx->entry = NULL;
+    ctx->cache = NULL;
+    ctx->ip_sub = NULL;
+    ctx->l4_sub = NULL;
+    ctx->way = 0;
+    ctx->pushed = false;
+
+    if (! flow_cache_enabled) return NULL;
+    if (ip_key->protocol != IPPROTO_TCP && ip_key->protocol != IPPROTO_UDP) return NULL;
+    if (cap_len < 4) return NULL;   // both TCP and UDP start with the ports
+
+    ctx->cache = flow_cache_get();
+    if (! ctx->cache) return NULL;
+
+    memset(&ctx->key, 0, sizeof(ctx->key));    // so that we can memcmp and hash it
+    ctx->key.ip = *ip_key;
+    ctx->key.port[0] = READ_U16N(payload);
+    ctx->key.port[1] = READ_U16N(payload + 2);
+    ctx->entry = ctx->cache->entries + (hashfun(&ctx->key, sizeof(ctx->key)) & (FLOW_CACHE_SIZE - 1));
+
+    struct mux_subparser *ip_sub = NULL;
+    struct flow_cache_entry *const e = ctx->entry;
+    mutex_lock(&ctx->cache->mutex);
+    if (e->ip_sub) {
+        if (! flow_cache_entry_is_valid(e)) {
+            SLOG(LOG_DEBUG, "Dropping stale flow cache entry@%p", e);
+            flow_cache_entry_clear(e);
+        } else if (e->ip_sub->mux_parser == ip_parser && 0 == memcmp(&e->key, &ctx->key, sizeof(ctx->key))) {
+            ip_sub = mux_subparser_ref(e->ip_sub);
+            ctx->l4_sub = mux_subparser_ref(e->l4_sub);
+            ctx->way = e->way;
+        }
+    }
+    mutex_unlock(&ctx->cache->mutex);
+
+    if (ip_sub) {
+        ctx->cache->nb_hits ++;
+        mux_subparser_touch(ip_sub, now);
+    } else {
+        ctx->cache->nb_misses ++;
+    }
+
+    return ip_sub;
+}
+
+void flow_cache_ctx_push(struct flow_cache_ctx *ctx, struct mux_subparser *ip_sub, unsigned way)
+{
+    ctx->ip_sub = ip_sub;
+    ctx->way = way;
+    if (! ctx->cache) return;
+
+    ctx->prev = ctx->cache->top;
+    ctx->cache->top = ctx;
+    ctx->pushed = true;
+}
+
+void flow_cache_ctx_dtor(struct flow_cache_ctx *ctx)
+{
+    if (ctx->pushed) {
+        assert(ctx->cache->top == ctx);
+        ctx->cache->top = ctx->prev;
+        ctx->pushed = false;
+    }
+    if (ctx->l4_sub) mux_subparser_unref(&ctx->l4_sub);
+}
+
+// Return the current flow, if it's the one of this transport parser
+static struct flow_cache_ctx *flow_cache_current(struct mux_parser *l4_parser, uint16_t sport, uint16_t dport)
+{
+    if (! flow_cache_enabled) return NULL;
+
+    struct flow_cache *cache = pthread_getspecific(flow_cache_key);
+    if (! cache) return NULL;
+    struct flow_cache_ctx *ctx = cache->top;
+    if (! ctx || ! ctx->entry) return NULL;
+
+    // The IP parser may have called another parser than us (for instance if we are parsing a packet from a waiting list)
+    if (ctx->ip_sub->parser != &l4_parser->parser) return NULL;
+    if (ctx->key.port[0] != sport || ctx->key.port[1] != dport) return NULL;
+
+    return ctx;
+}
+
+struct mux_subparser *flow_cache_lookup(struct mux_parser *l4_parser, uint16_t sport, uint16_t dport, struct timeval const *now)
+{
+    struct flow_cache_ctx *ctx = flow_cache_current(l4_parser, sport, dport);
+    if (! ctx || ! ctx->l4_sub) return NULL;
+
+    // Transfer the ref to our caller
+    struct mux_subparser *l4_sub = ctx->l4_sub;
+    ctx->l4_sub = NULL;
+    mux_subparser_touch(l4_sub, now);
+
+    return l4_sub;
+}
+
+void flow_cache_store(struct mux_parser *l4_parser, uint16_t sport, uint16_t dport, struct mux_subparser *l4_sub, struct port_key const *l4_key)
+{
+    struct flow_cache_ctx *ctx = flow_cache_current(l4_parser, sport, dport);
+    if (! ctx) return;
+
+    SLOG(LOG_DEBUG, "Caching flow entry@%p for subparsers %p, %p", ctx->entry, ctx->ip_sub, l4_sub);
+
+    struct flow_cache_entry *const e = ctx->entry;
+    mutex_lock(&ctx->cache->mutex);
+    flow_cache_entry_clear(e);
+    e->key = ctx->key;
+    e->l4_key = *l4_key;
+    e->way = ctx->way;
+    e->ip_sub = mux_subparser_ref(ctx->ip_sub);
+    e->l4_sub = mux_subparser_ref(l4_sub);
+    mutex_unlock(&ctx->cache->mutex);
+}
+
+/*
+ * Purge stale entries every second, so that cached subparsers are not kept alive after they were deindexed
+ */
+
+static void flow_cache_purge_tick(struct timebound_ticker unused_ *ticker)
+{
+    bool const all = ! flow_cache_enabled;
+    unsigned nb_purged = 0;
+
+    WITH_LOCK(&flow_caches_mutex) {
+        struct flow_cache *cache;
+        LIST_FOREACH(cache, &flow_caches, entry) {
+            WITH_LOCK(&cache->mutex) {
+                for (unsigned e = 0; e < NB_ELEMS(cache->entries); e++) {
+                    struct flow_cache_entry *const entry = cache->entries + e;
+                    if (! entry->ip_sub) continue;
+                    if (all || ! flow_cache_entry_is_valid(entry)) {
+                        flow_cache_entry_clear(entry);
+                        nb_purged ++;
+                    }
+                }
+            }
+        }
+    }
+
+    SLOG(LOG_DEBUG, "Purged %u flow cache entries", nb_purged);
+}
+
+/*
+ * Init
+ */
+
+static unsigned inited;
+void flow_cache_init(void)
+{
+    if (inited++) return;
+    log_init();
+    ext_init();
+    mutex_init();
+    hash_init();
+    objalloc_init();
+    timebound_init();
+
+    log_category_flow_cache_init();
+    ext_param_flow_cache_enabled_init();
+
+    mutex_ctor(&flow_caches_mutex, "flow caches");
+    LIST_INIT(&flow_caches);
+    (void)pthread_key_create(&flow_cache_key, flow_cache_del);
+    timebound_ticker_ctor(&flow_cache_purger, "purge flow caches", flow_cache_purge_tick);
+}
+
+void flow_cache_fini(void)
+{
+    if (--inited) return;
+
+    timebound_ticker_dtor(&flow_cache_purger);
+
+#   ifdef DELETE_ALL_AT_EXIT
+    struct flow_cache *cache;
+    while (NULL != (cache = LIST_FIRST(&flow_caches))) {
+        flow_cache_del(cache);
+    }
+    (void)pthread_key_delete(flow_cache_key);
+    mutex_dtor(&flow_caches_mutex);
+#   endif
+
+    ext_param_flow_cache_enabled_fini();
+    log_category_flow_cache_fini();
+
+    timebound_fini();
+    objalloc_fini();
+    hash_fini();
+    mutex_fini();
+    ext_fini();
+    log_fini();
+}
@@ -29,6 +29,7 @@
 #include "junkie/proto/tcp.h"
 #include "junkie/proto/http.h"
 #include "junkie/proto/streambuf.h"
+#include "junkie/proto/pkt_wait_list.h"
 #include "junkie/cpp.h"
 #include "junkie/tools/log.h"
 #include "proto/httper.h"
@@ -230,11 +231,11 @@ static int http_parser_ctor(struct http_parser *http_parser, struct proto *proto
 
 static struct parser *http_parser_new(struct proto *proto)
 {
-    struct http_parser *http_parser = objalloc_nice(sizeof(*http_parser), "HTTP parsers");
+    struct http_parser *http_parser = parser_alloc(proto, sizeof(*http_parser), "HTTP parsers");
     if (! http_parser) return NULL;
 
     if (-1 == http_parser_ctor(http_parser, proto)) {
-        objfree(http_parser);
+        parser_free(http_parser);
         return NULL;
     }
 
@@ -253,7 +254,7 @@ static void http_parser_del(struct parser *parser)
 {
     struct http_parser *http_parser = DOWNCAST(parser, parser, http_parser);
     http_parser_dtor(http_parser);
-    objfree(http_parser);
+    parser_free(http_parser);
 }
 
 /*
@@ -498,46 +499,42 @@ static int http_extract_client_ip(unsigned unused_ field, struct liner *liner, v
     return 0;
 }
 
+static struct httper_command const commands[] = {
+    [HTTP_METHOD_GET]      = { STRING_AND_LEN("GET"),      http_set_method },
+    [HTTP_METHOD_HEAD]     = { STRING_AND_LEN("HEAD"),     http_set_method },
+    [HTTP_METHOD_POST]     = { STRING_AND_LEN("POST"),     http_set_method },
+    [HTTP_METHOD_CONNECT]  = { STRING_AND_LEN("CONNECT"),  http_set_method },
+    [HTTP_METHOD_PUT]      = { STRING_AND_LEN("PUT"),      http_set_method },
+    [HTTP_METHOD_OPTIONS]  = { STRING_AND_LEN("OPTIONS"),  http_set_method },
+    [HTTP_METHOD_TRACE]    = { STRING_AND_LEN("TRACE"),    http_set_method },
+    [HTTP_METHOD_DELETE]   = { STRING_AND_LEN("DELETE"),   http_set_method },
+    [HTTP_METHOD_DELETE+1] = { STRING_AND_LEN("HTTP/1.1"), http_extract_code },
+    [HTTP_METHOD_DELETE+2] = { STRING_AND_LEN("HTTP/1.0"), http_extract_code },
+};
+static struct httper_field const fields[] = {
+    { STRING_AND_LEN("content-length"),    http_extract_content_length },
+    { STRING_AND_LEN("content-type"),      http_extract_content_type },
+    { STRING_AND_LEN("transfer-encoding"), http_extract_transfert_encoding },
+    { STRING_AND_LEN("host"),              http_extract_host },
+    { STRING_AND_LEN("user-agent"),        http_extract_user_agent },
+    { STRING_AND_LEN("referrer"),          http_extract_referrer },
+    { STRING_AND_LEN("referer"),           http_extract_referrer },
+    { STRING_AND_LEN("server"),            http_extract_server },
+    { STRING_AND_LEN("x-requested-with"),  http_extract_requested_with },
+    { STRING_AND_LEN("accept"),            http_extract_accept },
+    { STRING_AND_LEN("origin"),            http_extract_origin },
+    { STRING_AND_LEN("content-encoding"),  http_extract_content_encoding },
+    { STRING_AND_LEN("x-forwarded-for"),   http_extract_client_ip },
+    { STRING_AND_LEN("x-real-ip"),         http_extract_client_ip },
+};
+
+static struct httper httper;   // lookup tables built at init
+
 static enum proto_parse_status http_parse_header(struct http_parser *http_parser, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
     assert(http_parser->state[way].phase == HEAD);
 
     // Sanity checks + Parse
-    static struct httper_command const commands[] = {
-        [HTTP_METHOD_GET]      = { STRING_AND_LEN("GET"),      http_set_method },
-        [HTTP_METHOD_HEAD]     = { STRING_AND_LEN("HEAD"),     http_set_method },
-        [HTTP_METHOD_POST]     = { STRING_AND_LEN("POST"),     http_set_method },
-        [HTTP_METHOD_CONNECT]  = { STRING_AND_LEN("CONNECT"),  http_set_method },
-        [HTTP_METHOD_PUT]      = { STRING_AND_LEN("PUT"),      http_set_method },
-        [HTTP_METHOD_OPTIONS]  = { STRING_AND_LEN("OPTIONS"),  http_set_method },
-        [HTTP_METHOD_TRACE]    = { STRING_AND_LEN("TRACE"),    http_set_method },
-        [HTTP_METHOD_DELETE]   = { STRING_AND_LEN("DELETE"),   http_set_method },
-        [HTTP_METHOD_DELETE+1] = { STRING_AND_LEN("HTTP/1.1"), http_extract_code },
-        [HTTP_METHOD_DELETE+2] = { STRING_AND_LEN("HTTP/1.0"), http_extract_code },
-    };
-    static struct httper_field const fields[] = {
-        { STRING_AND_LEN("content-length"),    http_extract_content_length },
-        { STRING_AND_LEN("content-type"),      http_extract_content_type },
-        { STRING_AND_LEN("transfer-encoding"), http_extract_transfert_encoding },
-        { STRING_AND_LEN("host"),              http_extract_host },
-        { STRING_AND_LEN("user-agent"),        http_extract_user_agent },
-        { STRING_AND_LEN("referrer"),          http_extract_referrer },
-        { STRING_AND_LEN("referer"),           http_extract_referrer },
-        { STRING_AND_LEN("server"),            http_extract_server },
-        { STRING_AND_LEN("x-requested-with"),  http_extract_requested_with },
-        { STRING_AND_LEN("accept"),            http_extract_accept },
-        { STRING_AND_LEN("origin"),            http_extract_origin },
-        { STRING_AND_LEN("content-encoding"),  http_extract_content_encoding },
-        { STRING_AND_LEN("x-forwarded-for"),   http_extract_client_ip },
-        { STRING_AND_LEN("x-real-ip"),         http_extract_client_ip },
-    };
-    static struct httper const httper = {
-        .nb_commands = NB_ELEMS(commands),
-        .commands = commands,
-        .nb_fields = NB_ELEMS(fields),
-        .fields = fields
-    };
-
     struct http_proto_info info;
     http_proto_info_ctor(&info, &http_parser->state[way].first, http_parser->state[way].pkts);    // we init the proto_info once validated
 
@@ -682,6 +679,13 @@ static enum proto_parse_status http_parse_body(struct http_parser *http_parser,
         assert(http_parser->state[way].remaining_content >= body_part);
         http_parser->state[way].remaining_content -= body_part;
         SLOG(LOG_DEBUG, "%zu bytes of body left", http_parser->state[way].remaining_content);
+        // If nobody is interested in the body, the rest of it need not be reordered (racy read, but that's only a hint)
+        if (
+            body_part == wire_len && http_parser->state[way].remaining_content > 0 &&
+            LIST_EMPTY(&http_body_hook.subscribers)
+        ) {
+            pkt_wait_list_skip(&http_parser->parser, http_parser->state[way].remaining_content);
+        }
     }
 
     /* FIXME: if remaining_content == CONTENT_UP_TO_END, we won't be able to advertize
@@ -877,13 +881,15 @@ void http_init(void)
 
     hook_ctor(&http_head_hook, "HTTP head");
     hook_ctor(&http_body_hook, "HTTP body");
+    httper_ctor(&httper, NB_ELEMS(commands), commands, NB_ELEMS(fields), fields);
 
     static struct proto_ops const ops = {
         .parse       = http_parse,
         .parser_new  = http_parser_new,
         .parser_del  = http_parser_del,
         .info_2_str  = http_info_2_str,
-        .info_addr   = http_info_addr
+        .info_addr   = http_info_addr,
+        .parser_size = sizeof(struct http_parser),
     };
     proto_ctor(&proto_http_, &ops, "HTTP", PROTO_CODE_HTTP);
     port_muxer_ctor(&tcp_port_muxer, &tcp_port_muxers, 80, 80, proto_http);
@@ -18,7 +18,10 @@
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <assert.h>
+#include <inttypes.h>
 #include "junkie/cpp.h"
 #include "junkie/tools/log.h"
 #include "junkie/tools/miscmacs.h"
@@ -29,6 +32,88 @@
 #undef LOG_CAT
 #define LOG_CAT proto_http_log_category
 
+/*
+ * Lookup tables
+ */
+
+// Case insensitive hash of a field name (FNV-1a on lowercased chars, starting from seed)
+static unsigned field_hash(uint32_t seed, char const *name, size_t len)
+{
+    uint32_t h = seed;
+    for (size_t c = 0; c < len; c++) {
+        h = (h ^ ((uint8_t)name[c] | 0x20)) * 16777619U;
+    }
+    return h % HTTPER_FIELDS_HASH_SIZE;
+}
+
+// Try to fill fields_hash with this seed, returning false on collision
+static bool fields_hash_try(struct httper *httper, uint32_t seed)
+{
+    memset(httper->fields_hash, 0, sizeof(httper->fields_hash));
+    for (unsigned f = 0; f < httper->nb_fields; f++) {
+        struct httper_field const *const field = httper->fields + f;
+        uint8_t *const slot = httper->fields_hash + field_hash(seed, field->name, field->len);
+        if (*slot) {
+            struct httper_field const *const other = httper->fields + *slot - 1;
+            // The same name twice: the first one wins, as it used to
+            if (other->len == field->len && 0 == strncasecmp(other->name, field->name, field->len)) continue;
+            return false;
+        }
+        *slot = f + 1;
+    }
+    httper->fields_seed = seed;
+    return true;
+}
+
+void httper_ctor(struct httper *httper, unsigned nb_commands, struct httper_command const *commands, unsigned nb_fields, struct httper_field const *fields)
+{
+    assert(nb_commands <= HTTPER_MAX_COMMANDS);
+    assert(nb_fields < 256);    // so that 1 + index fits in fields_hash
+
+    httper->nb_commands = nb_commands;
+    httper->commands = commands;
+    httper->nb_fields = nb_fields;
+    httper->fields = fields;
+
+    // Chain the commands by first char, preserving their order (see note about common prefixes in httper_parse())
+    memset(httper->first_command, 0, sizeof(httper->first_command));
+    for (unsigned c = nb_commands; c--; ) {
+        assert(commands[c].len > 0);
+        uint8_t const first = commands[c].name[0];
+        httper->next_command[c] = httper->first_command[first];
+        httper->first_command[first] = c + 1;
+    }
+
+    // Look for a seed that makes field_hash perfect for these fields
+    httper->fields_hashed = false;
+    for (uint32_t seed = 2166136261U, t = 0; t < 10000; seed++, t++) {
+        if (fields_hash_try(httper, seed)) {
+            SLOG(LOG_DEBUG, "Perfect hash for %u fields found after %"PRIu32" tries", nb_fields, t+1);
+            httper->fields_hashed = true;
+            return;
+        }
+    }
+    SLOG(LOG_WARNING, "Cannot find a perfect hash for %u fields, will look for them one by one", nb_fields);
+}
+
+// Returns the index of the field named like this (case insensitively), or -1
+static int field_lookup(struct httper const *httper, char const *name, size_t len)
+{
+    if (httper->fields_hashed) {
+        unsigned const f = httper->fields_hash[field_hash(httper->fields_seed, name, len)];
+        if (! f) return -1;
+        struct httper_field const *const field = httper->fields + f - 1;
+        if (field->len != len || 0 != strncasecmp(field->name, name, len)) return -1;
+        return f - 1;
+    }
+
+    for (unsigned f = 0; f < httper->nb_fields; f++) {
+        struct httper_field const *const field = httper->fields + f;
+        if (field->len == len && 0 == strncasecmp(field->name, name, len)) return f;
+    }
+    return -1;
+}
+
 /*
  * Parse Command
  *
@@ -45,8 +130,14 @@ enum proto_parse_status httper_parse(struct httper const *httper, size_t *head_s
     struct liner liner, tokenizer;
     bool found = false;
 
-    for (unsigned c = 0; c < httper->nb_commands; c++) {
-        struct httper_command const *const cmd = httper->commands + c;
+    if (packet_len == 0) {
+        if (expected_bytes) *expected_bytes = 1;
+        return PROTO_TOO_SHORT;
+    }
+
+    // Only try the commands starting with the same char
+    for (unsigned c = httper->first_command[packet[0]]; c; c = httper->next_command[c-1]) {
+        struct httper_command const *const cmd = httper->commands + c-1;
 
         // Start by looking for the command before tokenizing (tokenizing takes too much time on random traffic)
         if (0 != strncmp(cmd->name, (char const *)packet, MIN(packet_len, cmd->len))) continue;
@@ -65,7 +156,7 @@ no_command:
         }
         SLOG(LOG_DEBUG, "Found command %s", cmd->name);
         liner_next(&tokenizer);
-        int ret = cmd->cb(c, &tokenizer, user_data);
+        int ret = cmd->cb(c-1, &tokenizer, user_data);
         if (ret) return PROTO_PARSE_ERR;
 
         found = true;
@@ -109,17 +200,10 @@ no_command:
             // Tokenize the header line
             liner_init(&tokenizer, &delim_colons, liner.start, liner_tok_length(&liner));
 
-            field_idx = -1;
-            for (unsigned f = 0; f < httper->nb_fields; f++) {
-                struct httper_field const *field = httper->fields + f;
-
-                if (liner_tok_length(&tokenizer) < field->len) continue;
-                if (0 != strncasecmp(field->name, tokenizer.start, liner_tok_length(&tokenizer))) continue;
-
-                SLOG(LOG_DEBUG, "Found field %s", field->name);
+            field_idx = field_lookup(httper, tokenizer.start, liner_tok_length(&tokenizer));
+            if (field_idx >= 0) {
+                SLOG(LOG_DEBUG, "Found field %s", httper->fields[field_idx].name);
                 liner_next(&tokenizer);
-                field_idx = f;
-                break;
             }
         }
         field_end = liner.start + liner.tok_size;   // save end of line position in field_end
@@ -3,6 +3,7 @@
 #ifndef HTTPER_H_100505
 #define HTTPER_H_100505
 #include <stdint.h>
+#include <stdbool.h>
 #include "proto/liner.h"
 
 struct httper {
@@ -20,8 +21,19 @@ struct httper {
         size_t len;
         int (*cb)(unsigned field, struct liner *, void *);  // returns -1 for parse error
     } const *fields;
+    // Built by httper_ctor() so that each line costs one hash and one compare:
+#   define HTTPER_MAX_COMMANDS 32
+    uint8_t first_command[256];     // for each char, 1 + the index of the first command starting with it (0 if none)
+    uint8_t next_command[HTTPER_MAX_COMMANDS];  // 1 + the index of the next command starting with the same char (0 if none)
+#   define HTTPER_FIELDS_HASH_SIZE 256
+    bool fields_hashed;             // false if no perfect hash was found (then fields are looked for one by one)
+    uint32_t fields_seed;           // the seed that makes field_hash() perfect for these fields
+    uint8_t fields_hash[HTTPER_FIELDS_HASH_SIZE];   // 1 + the index of the field with this hash (0 if none)
 };
 
+/// Build the lookup tables for these commands and fields
+void httper_ctor(struct httper *, unsigned nb_commands, struct httper_command const *, unsigned nb_fields, struct httper_field const *);
+
 /// @returns PROTO_PARSE_ERR if none of the given command was found
 /// @returns PROTO_OK if a complete header was available
 /// @returns PROTO_TOO_SHORT if the header was not complete
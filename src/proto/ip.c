@@ -29,10 +29,14 @@
 #include "junkie/tools/tempstr.h"
 #include "junkie/tools/objalloc.h"
 #include "junkie/tools/ext.h"
+#include "junkie/tools/hash.h"
+#include "junkie/tools/timebound.h"
 #include "junkie/proto/proto.h"
 #include "junkie/proto/eth.h"
 #include "junkie/proto/ip.h"
+#include "junkie/proto/flow_cache.h"
 #include "junkie/proto/pkt_wait_list.h"
+#include "junkie/proto/reassembly.h"
 #include "proto/ip_hdr.h"
 
 #undef LOG_CAT
@@ -40,10 +44,7 @@
 
 LOG_CATEGORY_DEF(proto_ip);
 
-#define IP_HASH_SIZE 30011 /* with a max collision rate of 16 we can store 30k*16*2=approx 1M simultaneous IP addr pairs */
-
-static bool reassembly_enabled = true;
-EXT_PARAM_RW(reassembly_enabled, "ip-reassembly", bool, "Whether IP fragments reassembly is enabled or not.")
+#define IP_HASH_SIZE 32768 /* with a max collision rate of 16 we can store 32k*16*2=approx 1M simultaneous IP addr pairs */
 
 /*
  * Tools
@@ -226,144 +227,252 @@ void ip_subproto_dtor(struct ip_subproto *ip_subproto)
 }
 
 /*
- * Parse
+ * Reassembly
+ *
+ * The fragments of IPv4 and IPv6 datagrams are kept in a table keyed on (src, dst, protocol, id),
+ * spread over several shards with a lock each (as in cnxtrack.c). Each datagram has its own
+ * waiting list of fragments, and a ref to the parser its payload is intended to. This parser is
+ * not given to the waiting list before the datagram is complete, so that whatever forces the list
+ * to advance (for instance the reassembly budget) only advertises the fragments.
+ * Once complete, the payload is copied once into a buffer sized from the last fragment.
+ *
+ * The fragments are kept in the waiting lists, so they are taken from the reassembly budget
+ * (see reassembly.h). Datagrams which reassembly started more than ip-reassembly-timeout seconds
+ * ago are dropped by the ticker (or when met), which also drops the oldest datagrams while
+ * we are above the soft budget. Dropped datagrams have their fragments advertised as they are.
  */
 
-static struct mutex_pool ip_locks;
-
-// We overload the mux_subparser to fit the pkt_wait_list required for IP reassembly
-struct ip_subparser {
-    /* We may have a list per IP id, but we do not want to create a pkt_list whenever a new id is encountered.
-     * So we only creates a list if either the MoreFrag flag is set or the offset is > 0 (ie for first to last fragments).
-     * Also, we check in the list iff this condition holds.
-     * Each IP subparser can have at most 4 packets reassembled simultaneously, which should be more than
-     * enought in all 'normal' situations. */
-    /* Also, as an additional rule, we must not send fragments to the subparser before the packet is fully
-     * reassembled, otherwise the subparser could receive the first fragment of id X then the first fragment
-     * of id Y, which make no sense. */
-    struct ip_reassembly {
-        uint16_t in_use:1;
-        uint16_t constructed:1;     // always 1 when in_use
-        uint16_t got_last:1;        // set when we received the fragment without more_fragments flag
-        uint16_t id;                // only valid when in_use flag is set
-        unsigned end_offset;        // only valid when got_last flag is set
-        struct pkt_wait_list wl;    // only constructed when constructed flag is set
-    } reassembly[4];
-    struct mutex *mutex;            // To protect the reassembly machinery
-    struct mux_subparser mux_subparser;
-};
+#define IP_REASSEMBLY_NB_SHARDS 16  // must be a power of 2
 
-static int ip_subparser_ctor(struct ip_subparser *ip_subparser, struct mux_parser *mux_parser, struct parser *child, struct proto *requestor, void const *key, struct timeval const *now)
-{
-    SLOG(LOG_DEBUG, "Construct an IP mux_subparser @%p", ip_subparser);
-    CHECK_LAST_FIELD(ip_subparser, mux_subparser, struct mux_subparser);
+bool ip_reassembly_enabled = true;
+EXT_PARAM_RW(ip_reassembly_enabled, "ip-reassembly", bool, "Whether IP fragments reassembly is enabled or not.")
 
-    for (unsigned r = 0; r < NB_ELEMS(ip_subparser->reassembly); r++) {
-        ip_subparser->reassembly[r].in_use = 0;
-        ip_subparser->reassembly[r].constructed = 0;
-        ip_subparser->reassembly[r].got_last = 0;
-    }
+static unsigned ip_reassembly_timeout = 5;
+EXT_PARAM_RW(ip_reassembly_timeout, "ip-reassembly-timeout", uint, "After how many seconds an incomplete IP datagram is dropped (0 for never).")
 
-    ip_subparser->mutex = mutex_pool_anyone(&ip_locks);
+static struct pkt_wl_config ip_reassembly_config;
+static struct timebound_ticker ip_reassembly_timeouter;
+
+struct ip_reassembly_key {
+    struct ip_addr addr[2];     // source and destination (all fragments of a datagram go the same way)
+    uint32_t id;                // 16 bits for IPv4, 32 for IPv6
+    uint8_t protocol;
+} packed_;
+
+struct ip_reassembly {
+    HASH_ENTRY(ip_reassembly) h_entry;
+    TAILQ_ENTRY(ip_reassembly) age_entry;   // in the list of datagrams of its shard, or in a list of dropped datagrams
+    struct ip_reassembly_shard *shard;
+    struct ip_reassembly_key key;
+    bool got_last;              // set when we received the fragment without more_fragments flag
+    unsigned end_offset;        // only valid when got_last is set
+    struct timeval started;     // when we received the first fragment
+    struct parser *parser;      // the parser the payload is intended to (we own a ref)
+    struct proto *wl_proto;     // the proto and parser given to the waiting list (unset until the datagram is complete)
+    struct parser *wl_parser;
+    struct pkt_wait_list wl;
+};
 
-    // Now that everything is ready, make this subparser public
-    if (0 != mux_subparser_ctor(&ip_subparser->mux_subparser, mux_parser, child, requestor, key, now)) {
-        return -1;
-    }
+TAILQ_HEAD(ip_reassemblies, ip_reassembly);
+
+static struct ip_reassembly_shard {
+    struct mutex mutex;     // protects everything in this shard
+    struct ip_reassemblies by_age;                          // all the datagrams of this shard, most recently started first
+    HASH_TABLE(ip_reassembly_h, ip_reassembly) datagrams;   // the same, keyed on (src, dst, protocol, id)
+    struct timeval last_now;    // timestamp of the last fragment, to give time to the ticker
+} ip_reassembly_shards[IP_REASSEMBLY_NB_SHARDS];
 
-    return 0;
+#define REASSEMBLY_SHARD_OF(key) (ip_reassembly_shards + (HASH_FUNC(key) >> 24) % IP_REASSEMBLY_NB_SHARDS)
+
+static void ip_reassembly_key_ctor(struct ip_reassembly_key *key, struct ip_proto_info const *info, uint32_t id)
+{
+    memset(key, 0, sizeof(*key));   // this struct uses some system wide structs that are not packed
+    key->addr[0] = info->key.addr[0];
+    key->addr[1] = info->key.addr[1];
+    key->id = id;
+    key->protocol = info->key.protocol;
 }
 
-static struct mux_subparser *ip_subparser_new(struct mux_parser *mux_parser, struct parser *child, struct proto *requestor, void const *key, struct timeval const *now)
+// caller must own shard->mutex
+static struct ip_reassembly *ip_reassembly_new(struct ip_reassembly_shard *shard, struct ip_reassembly_key const *key, struct parser *parser, struct timeval const *now)
 {
-    struct ip_subparser *ip_subparser = mux_subparser_alloc(mux_parser, sizeof(*ip_subparser));
-    if (! ip_subparser) return NULL;
+    struct ip_reassembly *reassembly = objalloc_nice(sizeof(*reassembly), "IP reassemblies");
+    if (! reassembly) return NULL;
 
-    if (0 != ip_subparser_ctor(ip_subparser, mux_parser, child, requestor, key, now)) {
-        objfree(ip_subparser);
+    reassembly->wl_proto = NULL;
+    reassembly->wl_parser = NULL;
+    if (0 != pkt_wait_list_ctor(&reassembly->wl, 0, &ip_reassembly_config, &reassembly->wl_proto, &reassembly->wl_parser, NULL)) {
+        objfree(reassembly);
         return NULL;
     }
+    reassembly->shard = shard;
+    reassembly->key = *key;
+    reassembly->got_last = false;
+    reassembly->started = *now;
+    reassembly->parser = parser_ref(parser);
+    HASH_INSERT(&shard->datagrams, reassembly, &reassembly->key, h_entry);
+    TAILQ_INSERT_HEAD(&shard->by_age, reassembly, age_entry);
+    SLOG(LOG_DEBUG, "New ip_reassembly@%p for id=%"PRIu32" for parser %s", reassembly, key->id, parser_name(parser));
 
-    return &ip_subparser->mux_subparser;
+    return reassembly;
 }
 
-static void ip_reassembly_dtor(struct ip_reassembly *reassembly)
+// caller must own reassembly->shard->mutex. Then the datagram can be deleted once the lock is released.
+static void ip_reassembly_unlink(struct ip_reassembly *reassembly, struct ip_reassemblies *dropped)
 {
-    SLOG(LOG_DEBUG, "Destructing ip_reassembly@%p", reassembly);
-    if (reassembly->constructed) {
-        pkt_wait_list_dtor(&reassembly->wl);
-        reassembly->constructed = 0;
-        reassembly->in_use = 0;
-    }
+    HASH_REMOVE(&reassembly->shard->datagrams, reassembly, h_entry);
+    TAILQ_REMOVE(&reassembly->shard->by_age, reassembly, age_entry);
+    if (dropped) TAILQ_INSERT_TAIL(dropped, reassembly, age_entry);
 }
 
-static void ip_subparser_dtor(struct ip_subparser *ip_subparser)
+// Must not be called with the shard locked, since the subscribers are called for the fragments left
+static void ip_reassembly_del(struct ip_reassembly *reassembly)
 {
-    SLOG(LOG_DEBUG, "Destruct an IP mux_subparser @%p", ip_subparser);
+    SLOG(LOG_DEBUG, "Deleting ip_reassembly@%p", reassembly);
+    pkt_wait_list_dtor(&reassembly->wl);
+    parser_unref(&reassembly->parser);
+    objfree(reassembly);
+}
 
-    for (unsigned r = 0; r < NB_ELEMS(ip_subparser->reassembly); r++) {
-        ip_reassembly_dtor(ip_subparser->reassembly+r);
+static void ip_reassemblies_del(struct ip_reassemblies *dropped)
+{
+    struct ip_reassembly *reassembly;
+    while (NULL != (reassembly = TAILQ_FIRST(dropped))) {
+        TAILQ_REMOVE(dropped, reassembly, age_entry);
+        ip_reassembly_del(reassembly);
     }
-    mux_subparser_dtor(&ip_subparser->mux_subparser);
 }
 
-static void ip_subparser_del(struct mux_subparser *mux_subparser)
+static bool ip_reassembly_expired(struct ip_reassembly const *reassembly, struct timeval const *now)
 {
-    struct ip_subparser *ip_subparser = DOWNCAST(mux_subparser, mux_subparser, ip_subparser);
-    ip_subparser_dtor(ip_subparser);
-    objfree(ip_subparser);
+    return ip_reassembly_timeout > 0 && timeval_sub(now, &reassembly->started) > ip_reassembly_timeout * 1000000LL;
 }
 
-static struct pkt_wl_config ip_reassembly_config;
+// caller must own shard->mutex
+static void ip_reassembly_timeout_locked(struct ip_reassembly_shard *shard, struct timeval const *now, struct ip_reassemblies *dropped)
+{
+    struct ip_reassembly *reassembly;
+    while (NULL != (reassembly = TAILQ_LAST(&shard->by_age, ip_reassemblies))) {
+        if (! ip_reassembly_expired(reassembly, now)) break;
+        SLOG(LOG_DEBUG, "Timeouting ip_reassembly@%p", reassembly);
+        ip_reassembly_unlink(reassembly, dropped);
+    }
+}
 
-// Really construct the waiting list
-static int ip_reassembly_ctor(struct ip_reassembly *reassembly, struct proto **proto,
-        struct parser **parser, uint16_t id)
+// Run every second by the timebounder thread
+static void ip_reassembly_timeouter_tick(struct timebound_ticker unused_ *ticker)
 {
-    SLOG(LOG_DEBUG, "Constructing ip_reassembly@%p for parser %s", reassembly, parser_name(*parser));
-    assert(! reassembly->constructed);
+    // Shards that were not used recently must not keep their datagrams for longer
+    struct timeval now;
+    timeval_reset(&now);
+    for (unsigned s = 0; s < NB_ELEMS(ip_reassembly_shards); s++) {
+        struct ip_reassembly_shard *shard = ip_reassembly_shards + s;
+        mutex_lock(&shard->mutex);
+        timeval_set_max(&now, &shard->last_now);
+        mutex_unlock(&shard->mutex);
+    }
 
-    if (0 != pkt_wait_list_ctor(&reassembly->wl, 0, &ip_reassembly_config, proto, parser, NULL)) return -1;
-    reassembly->id = id;
-    reassembly->got_last = 0;
-    reassembly->constructed = 1;
-    reassembly->in_use = 1;
+    enter_mono_region();    // since the subscribers are called for the dropped fragments
+    for (unsigned s = 0; s < NB_ELEMS(ip_reassembly_shards); s++) {
+        struct ip_reassembly_shard *shard = ip_reassembly_shards + s;
+        struct ip_reassemblies dropped;
+        TAILQ_INIT(&dropped);
+        mutex_lock(&shard->mutex);
+        if (timeval_is_set(&now)) ip_reassembly_timeout_locked(shard, &now, &dropped);
+        HASH_TRY_REHASH(&shard->datagrams, key, h_entry);
+        mutex_unlock(&shard->mutex);
+        ip_reassemblies_del(&dropped);
+    }
 
-    return 0;
+    // Then drop the oldest datagrams of each shard in turn while above the soft reassembly budget
+    bool dropped_some = true;
+    while (reassembly_excess() > 0 && dropped_some) {
+        dropped_some = false;
+        for (unsigned s = 0; s < NB_ELEMS(ip_reassembly_shards); s++) {
+            struct ip_reassembly_shard *shard = ip_reassembly_shards + s;
+            mutex_lock(&shard->mutex);
+            struct ip_reassembly *reassembly = TAILQ_LAST(&shard->by_age, ip_reassemblies);
+            if (reassembly) ip_reassembly_unlink(reassembly, NULL);
+            mutex_unlock(&shard->mutex);
+            if (! reassembly) continue;
+            SLOG(LOG_DEBUG, "Evicting ip_reassembly@%p (%u fragments, %zu bytes)", reassembly, reassembly->wl.nb_pkts, reassembly->wl.tot_payload);
+            reassembly_evicted(reassembly->wl.tot_payload);
+            ip_reassembly_del(reassembly);
+            dropped_some = true;
+        }
+    }
+    leave_protected_region();
 }
 
-static struct ip_reassembly *ip_reassembly_lookup(struct ip_subparser *ip_subparser, uint16_t id,
-        struct proto **proto, struct parser **parser)
+/* The datagram is complete (and unlinked).
+ * Construct a single payload from it, then call the subparser once for this payload.
+ * But we also want to acknowledge the several IP fragments that were received (but the
+ * last one that counts for the whole payload), so we also must call subscribers for
+ * each IP info. The pkt_wait_list_flush will do this for us. */
+static void ip_reassembly_reassemble(struct ip_reassembly *reassembly)
 {
-    SLOG(LOG_DEBUG, "Looking for ip_reassembly for id=%"PRIu16" for subparser %s", id, parser_name(*parser));
-
-    int last_unused = -1;
-    for (unsigned r = 0; r < NB_ELEMS(ip_subparser->reassembly); r++) {
-        struct ip_reassembly *const reassembly = ip_subparser->reassembly + r;
-        if (reassembly->in_use) {
-            if (reassembly->id != id) continue;
-            SLOG(LOG_DEBUG, "Found id at index %u in ip_reassembly@%p", r, reassembly);
-            if (! reassembly->constructed) {
-                if (0 != ip_reassembly_ctor(reassembly, proto, parser, id)) return NULL;
-            }
-            return reassembly;
-        } else {
-            last_unused = r;
-        }
+    SLOG(LOG_DEBUG, "Reassembling ip_reassembly@%p", reassembly);
+
+    // Now is the time to give the waiting list its parser
+    reassembly->wl_parser = reassembly->parser;
+    reassembly->parser = NULL;
+
+    /* FIXME: reassembled packet does not lie inside tot_packet, which is a problem if we use another pkt_wait_list in the subparser.
+     * we should use wait_pkt->tot_packet here, or rework pkt_wait_list so that it doesn't assume anymore that packet is within tot_packet. */
+    // may fail for instance if cap_len was not big enough
+    uint8_t *payload = pkt_wait_list_reassemble(&reassembly->wl, 0, reassembly->end_offset);
+    (void)pkt_wait_list_flush(&reassembly->wl, payload, reassembly->end_offset, reassembly->end_offset);
+    if (payload) objfree(payload);
+    ip_reassembly_del(reassembly);
+}
+
+enum proto_parse_status ip_reassembly_add(struct mux_subparser *subparser, struct ip_proto_info *info, uint32_t id, unsigned offset, bool more_frags, uint8_t const *payload, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
+{
+    SLOG(LOG_DEBUG, "IP packet is a fragment of id %"PRIu32", offset=%u", id, offset);
+
+    struct ip_reassembly_key key;
+    ip_reassembly_key_ctor(&key, info, id);
+    struct ip_reassembly_shard *shard = REASSEMBLY_SHARD_OF(&key);
+    struct ip_reassemblies dropped;
+    TAILQ_INIT(&dropped);
+    struct ip_reassembly *complete = NULL;
+    enum proto_parse_status status = PROTO_PARSE_ERR;
+
+    mutex_lock(&shard->mutex);
+    shard->last_now = *now;
+    ip_reassembly_timeout_locked(shard, now, &dropped);
+
+    struct ip_reassembly *reassembly;
+    HASH_LOOKUP(reassembly, &shard->datagrams, &key, key, h_entry);
+    if (! reassembly) reassembly = ip_reassembly_new(shard, &key, subparser->parser, now);
+    if (! reassembly) goto unlock;
+
+    if (! more_frags) {
+        reassembly->got_last = true;
+        reassembly->end_offset = offset + wire_len;
+        info->fragmentation = IP_REASSEMBLED;   // fix the info before it's copied by pkt_wait_list_add
     }
+    status = pkt_wait_list_add(&reassembly->wl, offset, offset + wire_len, false, 0, false, &info->info, info->way, payload, cap_len, wire_len, now, tot_cap_len, tot_packet);
+    if (status != PROTO_OK) goto unlock;    // should not happen
 
-    if (last_unused == -1) {
-        last_unused = 0;    // a "random" value would be better
-        SLOG(LOG_DEBUG, "No slot left on ip_reassembly, reusing slot at index %u", last_unused);
-        ip_reassembly_dtor(ip_subparser->reassembly + last_unused);
+    if (reassembly->got_last && pkt_wait_list_is_complete(&reassembly->wl, 0, reassembly->end_offset)) {
+        ip_reassembly_unlink(reassembly, NULL);
+        complete = reassembly;
     }
 
-    struct ip_reassembly *const reassembly = ip_subparser->reassembly + last_unused;
-    assert(! reassembly->in_use);
-    if (0 != ip_reassembly_ctor(reassembly, proto, parser, id)) return NULL;
-    return reassembly;
+unlock:
+    mutex_unlock(&shard->mutex);
+
+    // Parse with no lock, since the payload may well be another IP packet
+    ip_reassemblies_del(&dropped);
+    if (complete) ip_reassembly_reassemble(complete);
+    return status;
 }
 
+/*
+ * Parse
+ */
+
 unsigned ip_key_ctor(struct ip_key *k, unsigned protocol, struct ip_addr const *src, struct ip_addr const *dst)
 {
     memset(k, 0, sizeof(*k));   // this struct uses some system wide structs that are not packed
@@ -378,25 +487,6 @@ unsigned ip_key_ctor(struct ip_key *k, unsigned protocol, struct ip_addr const *
     return 1;
 }
 
-/* The pkt_wait_list is now complete.
- * Construct a single payload from it, then call the subparse once for this payload.
- * But we also want to acknoledge the several IP fragments that were received (but the
- * first one that count for the whole payload), so we also must call subscribers for
- * each IP info. The pkt_wait_list_dtor will do this for us. */
-static enum proto_parse_status reassemble(struct ip_reassembly *reassembly)
-{
-    SLOG(LOG_DEBUG, "Reassembling ip_reassembly@%p", reassembly);
-
-    /* FIXME: reassembled packet does not lie inside tot_packet, which is a problem if we use another pkt_wait_list in the subparser.
-     * we should use wait_pkt->tot_packet here, or rework pkt_wait_list so that it doesn't assume anymore that packet is within tot_packet. */
-    // may fail for instance if cap_len was not big enough
-    uint8_t *payload = pkt_wait_list_reassemble(&reassembly->wl, 0, reassembly->end_offset);
-    enum proto_parse_status status = pkt_wait_list_flush(&reassembly->wl, payload, reassembly->end_offset, reassembly->end_offset);
-    if (payload) objfree(payload);
-    ip_reassembly_dtor(reassembly);
-    return status;
-}
-
 static enum proto_parse_status ip_parse(struct parser *parser, struct proto_info *parent, unsigned unused_ way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
     struct mux_parser *mux_parser = DOWNCAST(parser, parser, mux_parser);
@@ -442,13 +532,23 @@ static enum proto_parse_status ip_parse(struct parser *parser, struct proto_info
     // Find subparser
 
     struct mux_subparser *subparser = NULL;
-    struct ip_subproto *subproto;
-    LIST_LOOKUP_LOCKED(subproto, &ip_subprotos, entry, subproto->protocol == info.key.protocol, &ip_subprotos_mutex);
-    if (subproto) {
-        // We have a subproto for this protocol value, look for a parser of this subproto in our mux_subparsers hash (or create a new one)
-        struct ip_key subparser_key;
-        info.way = ip_key_ctor(&subparser_key, info.key.protocol, info.key.addr+0, info.key.addr+1);
-        subparser = mux_subparser_lookup(mux_parser, subproto->proto, NULL, &subparser_key, now);
+    // Established TCP/UDP flows can be found in the flow cache (but not fragments, which payload have no ports)
+    struct flow_cache_ctx flow;
+    bool const cachable = ! is_fragment(iphdr);
+    if (cachable) {
+        subparser = flow_cache_ctx_ctor(&flow, mux_parser, &info.key, packet + iphdr_len, cap_payload, now);
+        if (subparser) info.way = flow.way;
+    }
+
+    if (! subparser) {
+        struct ip_subproto *subproto;
+        LIST_LOOKUP_LOCKED(subproto, &ip_subprotos, entry, subproto->protocol == info.key.protocol, &ip_subprotos_mutex);
+        if (subproto) {
+            // We have a subproto for this protocol value, look for a parser of this subproto in our mux_subparsers hash (or create a new one)
+            struct ip_key subparser_key;
+            info.way = ip_key_ctor(&subparser_key, info.key.protocol, info.key.addr+0, info.key.addr+1);
+            subparser = mux_subparser_lookup(mux_parser, subproto->proto, NULL, &subparser_key, now);
+        }
     }
 
     if (! subparser) {
@@ -459,40 +559,18 @@ static enum proto_parse_status ip_parse(struct parser *parser, struct proto_info
     enum proto_parse_status status;
 
     // If we have a fragment, maybe we can't parse payload right now
-    if (is_fragment(iphdr) && reassembly_enabled) {
-        struct ip_subparser *ip_subparser = DOWNCAST(subparser, mux_subparser, ip_subparser);
-        // Do not tolerate concurrent access from this point
-        mutex_lock(ip_subparser->mutex);
-        unsigned const offset = fragment_offset(iphdr);
-        uint16_t id = READ_U16N(&iphdr->id);
-        SLOG(LOG_DEBUG, "IP packet is a fragment of id %"PRIu16", offset=%u", id, offset);
-        struct ip_reassembly *reassembly = ip_reassembly_lookup(ip_subparser, id, &subparser->proto, &subparser->parser);
-        if (! reassembly) goto unlock_fallback;
-        assert(reassembly->in_use && reassembly->constructed);
-        if (! (READ_U8(&iphdr->flags) & IP_MORE_FRAGS_MASK)) {
-            reassembly->got_last = 1;
-            reassembly->end_offset = offset + payload;
-            info.fragmentation = IP_REASSEMBLED;    // fix the info before it's copied by pkt_wait_list_add
-        }
-        if (PROTO_OK != pkt_wait_list_add(&reassembly->wl, offset, offset + payload, false, 0, false, &info.info, info.way, packet + iphdr_len, cap_payload, payload, now, tot_cap_len, tot_packet)) {
-            goto unlock_fallback;  // should not happen
-        }
-        if (reassembly->got_last && pkt_wait_list_is_complete(&reassembly->wl, 0, reassembly->end_offset)) {
-            status = reassemble(reassembly);
-        } else {
-            status = PROTO_OK;  // for now
-        }
-        mutex_unlock(ip_subparser->mutex);
-        mux_subparser_unref(&subparser);
-        return status;
-unlock_fallback:    // Beeeerk
-        mutex_unlock(ip_subparser->mutex);
+    if (is_fragment(iphdr) && ip_reassembly_enabled) {
+        bool const more_frags = READ_U8(&iphdr->flags) & IP_MORE_FRAGS_MASK;
+        status = ip_reassembly_add(subparser, &info, READ_U16N(&iphdr->id), fragment_offset(iphdr), more_frags, packet + iphdr_len, cap_payload, payload, now, tot_cap_len, tot_packet);
         mux_subparser_unref(&subparser);
+        if (status == PROTO_OK) return PROTO_OK;
         goto fallback;
     }
 
     // Parse it at once
+    if (cachable) flow_cache_ctx_push(&flow, subparser, info.way);
     status = proto_parse(subparser->parser, &info.info, info.way, packet + iphdr_len, cap_payload, payload, now, tot_cap_len, tot_packet);
+    if (cachable) flow_cache_ctx_dtor(&flow);
     mux_subparser_unref(&subparser);
     if (status == PROTO_OK) return PROTO_OK;
 
@@ -511,12 +589,23 @@ static struct eth_subproto ip_eth_subproto;
 
 void ip_init(void)
 {
-    mutex_pool_ctor(&ip_locks, "IP subparsers");
+    flow_cache_init();
+    timebound_init();
     log_category_proto_ip_init();
-    ext_param_reassembly_enabled_init();
+    ext_param_ip_reassembly_enabled_init();
+    ext_param_ip_reassembly_timeout_init();
     mutex_ctor(&ip_subprotos_mutex, "IPv4 subprotocols");
     LIST_INIT(&ip_subprotos);
-    pkt_wl_config_ctor(&ip_reassembly_config, "IP-reassembly", 65536, 100, 65536, 5 /* FRAGMENTATION TIMEOUT (second) */, false);
+    // Datagrams are timeouted by ip_reassembly_timeouter rather than by the waiting lists ticker
+    pkt_wl_config_ctor(&ip_reassembly_config, "IP-reassembly", 65536, 100, 65536, 0, false, 0);
+    for (unsigned s = 0; s < NB_ELEMS(ip_reassembly_shards); s++) {
+        struct ip_reassembly_shard *shard = ip_reassembly_shards + s;
+        mutex_ctor(&shard->mutex, "IP reassembly");
+        TAILQ_INIT(&shard->by_age);
+        HASH_INIT(&shard->datagrams, 100 / IP_REASSEMBLY_NB_SHARDS, "IP reassembly");
+        timeval_reset(&shard->last_now);
+    }
+    timebound_ticker_ctor(&ip_reassembly_timeouter, "timeout IP reassemblies", ip_reassembly_timeouter_tick);
 
     static struct proto_ops const ops = {
         .parse       = ip_parse,
@@ -525,25 +614,39 @@ void ip_init(void)
         .info_2_str  = ip_info_2_str,
         .info_addr   = ip_info_addr
     };
-    static struct mux_proto_ops const mux_ops = {
-        .subparser_new = ip_subparser_new,
-        .subparser_del = ip_subparser_del,
-    };
-    mux_proto_ctor(&mux_proto_ip, &ops, &mux_ops, "IPv4", PROTO_CODE_IP, sizeof(struct ip_key), IP_HASH_SIZE);
+    mux_proto_ctor(&mux_proto_ip, &ops, &mux_proto_ops, "IPv4", PROTO_CODE_IP, sizeof(struct ip_key), IP_HASH_SIZE);
     eth_subproto_ctor(&ip_eth_subproto, ETH_PROTO_IPv4, proto_ip);
 }
 
 void ip_fini(void)
 {
+    timebound_ticker_dtor(&ip_reassembly_timeouter);
+
 #   ifdef DELETE_ALL_AT_EXIT
     assert(LIST_EMPTY(&ip_subprotos));
     eth_subproto_dtor(&ip_eth_subproto);
+    for (unsigned s = 0; s < NB_ELEMS(ip_reassembly_shards); s++) {
+        struct ip_reassembly_shard *shard = ip_reassembly_shards + s;
+        struct ip_reassemblies dropped;
+        TAILQ_INIT(&dropped);
+        mutex_lock(&shard->mutex);
+        struct ip_reassembly *reassembly;
+        while (NULL != (reassembly = TAILQ_FIRST(&shard->by_age))) {
+            ip_reassembly_unlink(reassembly, &dropped);
+        }
+        mutex_unlock(&shard->mutex);
+        ip_reassemblies_del(&dropped);
+        HASH_DEINIT(&shard->datagrams);
+        mutex_dtor(&shard->mutex);
+    }
     mux_proto_dtor(&mux_proto_ip);
     pkt_wl_config_dtor(&ip_reassembly_config);
     mutex_dtor(&ip_subprotos_mutex);
-    mutex_pool_dtor(&ip_locks);
 #   endif
-    ext_param_reassembly_enabled_fini();
+    ext_param_ip_reassembly_timeout_fini();
+    ext_param_ip_reassembly_enabled_fini();
 
     log_category_proto_ip_fini();
+    timebound_fini();
+    flow_cache_fini();
 }
@@ -27,12 +27,13 @@
 #include "junkie/proto/proto.h"
 #include "junkie/proto/eth.h"
 #include "junkie/proto/ip.h"
+#include "junkie/proto/flow_cache.h"
 #include "proto/ip_hdr.h"
 
 #undef LOG_CAT
 #define LOG_CAT proto_ip_log_category
 
-#define IP6_HASH_SIZE 30011 /* See ip.c */
+#define IP6_HASH_SIZE 32768 /* See ip.c */
 
 /*
  * Proto Infos (only the info ctor is different from ipv4
@@ -50,6 +51,7 @@ static void ip6_proto_info_ctor(struct ip_proto_info *info, struct parser *parse
     info->way = 0;  // will be set later
     info->traffic_class = (READ_U8(&iphdr->version_class) << 4) | (READ_U8(&iphdr->flow[0]) >> 4);
     info->id = ((READ_U8(&iphdr->flow[0]) & 0x0f) << 16U) | READ_U16N(&iphdr->flow[1]);
+    info->fragmentation = IP_NOFRAG;    // may be changed later if we meet a fragment header
 }
 
 /*
@@ -120,16 +122,44 @@ static enum proto_parse_status ip6_parse(struct parser *parser, struct proto_inf
     struct ip_proto_info info;
     ip6_proto_info_ctor(&info, parser, parent, iphdr_len, payload, version, iphdr);
 
+    // Fragments come with a fragment header right after the IPv6 header
+    size_t head_len = iphdr_len;
+    struct ipv6_frag_hdr const *fraghdr = NULL;
+    if (next == IPPROTO_FRAGMENT) {
+        if (payload < sizeof(*fraghdr)) {
+            SLOG(LOG_DEBUG, "Bogus IPv6 fragment: payload too short (%zu)", payload);
+            return PROTO_PARSE_ERR;
+        }
+        if (cap_payload < sizeof(*fraghdr)) return PROTO_TOO_SHORT;
+        fraghdr = (struct ipv6_frag_hdr const *)(packet + iphdr_len);
+        head_len += sizeof(*fraghdr);
+        info.info.head_len = head_len;
+        info.info.payload = payload - sizeof(*fraghdr);
+        info.key.protocol = READ_U8(&fraghdr->next);
+        info.fragmentation = IP_FRAGMENT;   // may be changed later after optional reassembly
+    }
+    size_t const frag_payload = payload - (head_len - iphdr_len);
+    size_t const frag_cap_payload = cap_payload - (head_len - iphdr_len);
+
     // Parse payload
 
+    // Established TCP/UDP flows can be found in the flow cache (but not fragments, which payload have no ports)
+    struct flow_cache_ctx flow;
     struct mux_subparser *subparser = NULL;
+    bool const cachable = ! fraghdr;
+    if (cachable) {
+        subparser = flow_cache_ctx_ctor(&flow, mux_parser, &info.key, packet + head_len, frag_cap_payload, now);
+        if (subparser) info.way = flow.way;
+    }
 
-    struct ip_subproto *subproto;
-    LIST_LOOKUP_LOCKED(subproto, &ip6_subprotos, entry, subproto->protocol == info.key.protocol, &ip6_subprotos_mutex);
-    if (subproto) {
-        struct ip_key subparser_key;
-        info.way = ip_key_ctor(&subparser_key, info.key.protocol, info.key.addr+0, info.key.addr+1);
-        subparser = mux_subparser_lookup(mux_parser, subproto->proto, NULL, &subparser_key, now);
+    if (! subparser) {
+        struct ip_subproto *subproto;
+        LIST_LOOKUP_LOCKED(subproto, &ip6_subprotos, entry, subproto->protocol == info.key.protocol, &ip6_subprotos_mutex);
+        if (subproto) {
+            struct ip_key subparser_key;
+            info.way = ip_key_ctor(&subparser_key, info.key.protocol, info.key.addr+0, info.key.addr+1);
+            subparser = mux_subparser_lookup(mux_parser, subproto->proto, NULL, &subparser_key, now);
+        }
     }
 
     if (! subparser) {
@@ -137,12 +167,26 @@ static enum proto_parse_status ip6_parse(struct parser *parser, struct proto_inf
         goto fallback;
     }
 
-    enum proto_parse_status status = proto_parse(subparser->parser, &info.info, info.way, packet + iphdr_len, cap_payload, payload, now, tot_cap_len, tot_packet);
+    enum proto_parse_status status;
+
+    // If we have a fragment, maybe we can't parse payload right now
+    if (fraghdr && ip_reassembly_enabled) {
+        uint16_t const offset_flags = READ_U16N(&fraghdr->offset_flags);
+        bool const more_frags = offset_flags & IP6_MORE_FRAGS_MASK;
+        status = ip_reassembly_add(subparser, &info, READ_U32N(&fraghdr->id), offset_flags & IP6_FRAG_OFFSET_MASK, more_frags, packet + head_len, frag_cap_payload, frag_payload, now, tot_cap_len, tot_packet);
+        mux_subparser_unref(&subparser);
+        if (status == PROTO_OK) return PROTO_OK;
+        goto fallback;
+    }
+
+    if (cachable) flow_cache_ctx_push(&flow, subparser, info.way);
+    status = proto_parse(subparser->parser, &info.info, info.way, packet + head_len, frag_cap_payload, frag_payload, now, tot_cap_len, tot_packet);
+    if (cachable) flow_cache_ctx_dtor(&flow);
     mux_subparser_unref(&subparser);
     if (status == PROTO_OK) return PROTO_OK;
 
 fallback:
-    (void)proto_parse(NULL, &info.info, info.way, packet + iphdr_len, cap_payload, payload, now, tot_cap_len, tot_packet);
+    (void)proto_parse(NULL, &info.info, info.way, packet + head_len, frag_cap_payload, frag_payload, now, tot_cap_len, tot_packet);
     return PROTO_OK;
 }
 
@@ -157,6 +201,7 @@ static struct ip_subproto ip6_ip_subproto;
 
 void ip6_init(void)
 {
+    flow_cache_init();
     mutex_ctor(&ip6_subprotos_mutex, "IPv6 subprotocols");
     LIST_INIT(&ip6_subprotos);
     static struct proto_ops const ops = {
@@ -180,4 +225,5 @@ void ip6_fini(void)
     mutex_dtor(&ip6_subprotos_mutex);
     mux_proto_dtor(&mux_proto_ip6);
 #   endif
+    flow_cache_fini();
 }
@@ -53,6 +53,16 @@ struct ipv6_hdr {
 #define IP6_CLASS(ip)   (READ_U8(&ip->version_class) & IP6_CLASS_MASK)
 #define IP6_VERSION(ip) (READ_U8(&ip->version_class) >> 4)
 
+// Definition of an IPv6 fragment header
+struct ipv6_frag_hdr {
+    uint8_t next;
+    uint8_t reserved;
+    uint16_t offset_flags;
+#   define IP6_FRAG_OFFSET_MASK 0xFFF8U
+#   define IP6_MORE_FRAGS_MASK  0x0001U
+    uint32_t id;
+} packed_;
+
 // Definition of an ICMP header
 struct icmp_hdr {
   uint8_t type;
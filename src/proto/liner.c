@@ -25,6 +25,13 @@
 #include "junkie/tools/miscmacs.h"
 #include "junkie/proto/proto.h"
 #include "proto/liner.h"
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#   include <immintrin.h>
+#   define WITH_AVX2
+#endif
 
 #undef LOG_CAT
 #define LOG_CAT proto_log_category
@@ -114,27 +121,124 @@ unsigned long long liner_strtoull(struct liner *liner, char const **end, int bas
  * Parse
  */
 
+/*
+ * Scan for the next char that may start a delimiter
+ *
+ * Until some delimiter starts to match there is nothing to do but look for the
+ * first char of any delimiter, which we do several bytes at a time.
+ */
+
+#define NB_MAX_DELIMS 4
+
+struct delim_firsts {
+    unsigned nb;
+    char c[NB_MAX_DELIMS];  // the distinct first chars of the delimiters
+};
+
+typedef size_t scan_fun(char const *, size_t, struct delim_firsts const *);
+
+// Returns the offset of the first char that's in firsts, or size
+static size_t scan_scalar(char const *start, size_t size, struct delim_firsts const *firsts)
+{
+    if (firsts->nb == 1) {  // memchr is already vectorized
+        char const *const found = memchr(start, firsts->c[0], size);
+        return found ? (size_t)(found - start) : size;
+    }
+
+    for (size_t o = 0; o < size; o++) {
+        for (unsigned f = 0; f < firsts->nb; f++) {
+            if (start[o] == firsts->c[f]) return o;
+        }
+    }
+    return size;
+}
+
+#if defined(__SSE2__)
+static size_t scan_sse2(char const *start, size_t size, struct delim_firsts const *firsts)
+{
+    __m128i c[NB_MAX_DELIMS];
+    for (unsigned f = 0; f < firsts->nb; f++) c[f] = _mm_set1_epi8(firsts->c[f]);
+
+    size_t o;
+    for (o = 0; o + 16 <= size; o += 16) {
+        __m128i const v = _mm_loadu_si128((__m128i const *)(start + o));
+        __m128i eq = _mm_cmpeq_epi8(v, c[0]);
+        for (unsigned f = 1; f < firsts->nb; f++) eq = _mm_or_si128(eq, _mm_cmpeq_epi8(v, c[f]));
+        unsigned const mask = _mm_movemask_epi8(eq);
+        if (mask) return o + __builtin_ctz(mask);
+    }
+
+    return o + scan_scalar(start + o, size - o, firsts);
+}
+#endif
+
+#ifdef WITH_AVX2
+__attribute__((target("avx2")))
+static size_t scan_avx2(char const *start, size_t size, struct delim_firsts const *firsts)
+{
+    __m256i c[NB_MAX_DELIMS];
+    for (unsigned f = 0; f < firsts->nb; f++) c[f] = _mm256_set1_epi8(firsts->c[f]);
+
+    size_t o;
+    for (o = 0; o + 32 <= size; o += 32) {
+        __m256i const v = _mm256_loadu_si256((__m256i const *)(start + o));
+        __m256i eq = _mm256_cmpeq_epi8(v, c[0]);
+        for (unsigned f = 1; f < firsts->nb; f++) eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(v, c[f]));
+        unsigned const mask = _mm256_movemask_epi8(eq);
+        if (mask) return o + __builtin_ctz(mask);
+    }
+
+    return o + scan_scalar(start + o, size - o, firsts);
+}
+#endif
+
+// The best scan function for this CPU (chosen at first use)
+static scan_fun *scan;
+
+static scan_fun *scan_choose(void)
+{
+#   ifdef WITH_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scan_avx2;
+#   endif
+#   if defined(__SSE2__)
+    return scan_sse2;
+#   else
+    return scan_scalar;
+#   endif
+}
+
 static int look_for_delim(size_t *tok_len, size_t *delim_len, char const *start, size_t rem_size, struct liner_delimiter_set const *delims)
 {
-#   define NB_MAX_DELIMS 4
     assert(delims->nb_delims <= NB_MAX_DELIMS);
     struct {
         unsigned matched;  // how many chars were already matched
         bool winner;
         size_t tok_len;
     } matches[NB_MAX_DELIMS];
+    struct delim_firsts firsts = { .nb = 0 };
 
     for (unsigned d = 0; d < delims->nb_delims; d++) {
         matches[d].matched = 0;
         matches[d].winner = false;
         assert(delims->delims[d].len > 0);  // or the following algo will fail
+        unsigned f;
+        for (f = 0; f < firsts.nb && firsts.c[f] != delims->delims[d].str[0]; f++) ;
+        if (f == firsts.nb) firsts.c[firsts.nb++] = delims->delims[d].str[0];
     }
 
+    if (unlikely_(! scan)) scan = scan_choose();    // racy but harmless
+
     int best_winner = -1;
     unsigned nb_matching = 0;
 
     // Now scan the buffer until a match
-    for (unsigned o = 0; o < rem_size; o++) {
+    for (size_t o = 0; o < rem_size; o++) {
+        if (best_winner == -1 && nb_matching == 0) {   // nothing started to match yet
+            o += scan(start + o, rem_size - o, &firsts);
+            if (o >= rem_size) break;
+        }
+
         char const c = start[o];
         if (best_winner != -1 && nb_matching == 0) break; // nothing left matching
 
@@ -133,11 +133,11 @@ static int mysql_parser_ctor(struct mysql_parser *mysql_parser, struct proto *pr
 
 static struct parser *mysql_parser_new(struct proto *proto)
 {
-    struct mysql_parser *mysql_parser = objalloc_nice(sizeof(*mysql_parser), "MySQL parsers");
+    struct mysql_parser *mysql_parser = parser_alloc(proto, sizeof(*mysql_parser), "MySQL parsers");
     if (! mysql_parser) return NULL;
 
     if (-1 == mysql_parser_ctor(mysql_parser, proto)) {
-        objfree(mysql_parser);
+        parser_free(mysql_parser);
         return NULL;
     }
 
@@ -155,7 +155,7 @@ static void mysql_parser_del(struct parser *parser)
 {
     struct mysql_parser *mysql_parser = DOWNCAST(parser, parser, mysql_parser);
     mysql_parser_dtor(mysql_parser);
-    objfree(mysql_parser);
+    parser_free(mysql_parser);
 }
 
 /*
@@ -743,7 +743,8 @@ void mysql_init(void)
         .parser_new  = mysql_parser_new,
         .parser_del  = mysql_parser_del,
         .info_2_str  = sql_info_2_str,
-        .info_addr   = sql_info_addr
+        .info_addr   = sql_info_addr,
+        .parser_size = sizeof(struct mysql_parser),
     };
     proto_ctor(&proto_mysql_, &ops, "MySQL", PROTO_CODE_MYSQL);
     port_muxer_ctor(&mysql_tcp_muxer, &tcp_port_muxers, 3306, 3306, proto_mysql);
@@ -64,10 +64,10 @@ static int netbios_parser_ctor(struct netbios_parser *netbios_parser, struct pro
 
 static struct parser *netbios_parser_new(struct proto *proto)
 {
-    struct netbios_parser *netbios_parser = objalloc_nice(sizeof(*netbios_parser), "Netbios parsers");
+    struct netbios_parser *netbios_parser = parser_alloc(proto, sizeof(*netbios_parser), "Netbios parsers");
     if (! netbios_parser) return NULL;
     if (-1 == netbios_parser_ctor(netbios_parser, proto)) {
-        objfree(netbios_parser);
+        parser_free(netbios_parser);
         return NULL;
     }
     return &netbios_parser->parser;
@@ -85,7 +85,7 @@ static void netbios_parser_del(struct parser *parser)
 {
     struct netbios_parser *netbios_parser = DOWNCAST(parser, parser, netbios_parser);
     netbios_parser_dtor(netbios_parser);
-    objfree(netbios_parser);
+    parser_free(netbios_parser);
 }
 
 static void const *netbios_info_addr(struct proto_info const *info_, size_t *size)
@@ -239,6 +239,7 @@ void netbios_init(void)
         .parser_del = netbios_parser_del,
         .info_2_str = proto_info_2_str,
         .info_addr  = netbios_info_addr,
+        .parser_size = sizeof(struct netbios_parser),
     };
     proto_ctor(proto_netbios, &ops, "Netbios", PROTO_CODE_NETBIOS);
     port_muxer_ctor(&tcp_port_muxer, &tcp_port_muxers, 445, 445, proto_netbios);
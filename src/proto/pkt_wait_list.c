@@ -19,6 +19,7 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include "junkie/tools/log.h"
 #include "junkie/tools/ext.h"
@@ -26,6 +27,7 @@
 #include "junkie/tools/mallocer.h"  // for overweight
 #include "junkie/tools/bench.h"
 #include "junkie/proto/pkt_wait_list.h"
+#include "junkie/proto/reassembly.h"
 
 #undef LOG_CAT
 #define LOG_CAT pkt_wait_list_log_category
@@ -45,49 +47,109 @@ static const char *pkt_2_str(struct pkt_wait const *pkt)
 }
 
 /*
- * Destruction of a pending packet
+ * Skip list of pending packets
  */
 
-/* There is no such thing as a destructor for proto_info, since they are constructed on the stack.
- * Also, notice that normaly the pointer to parser is not a counted ref since these proto_info are normaly
- * build on the stack, but for our copies on the heap we need a proper ref, so we unref them here. */
-static void proto_info_del_rec(struct proto_info *info)
+// Choose how many levels a packet at this offset will have (1 with probability 3/4, 2 with 3/16...)
+static unsigned pkt_wait_nb_levels(unsigned offset)
 {
-    void *start = (void *)info->parser->proto->ops->info_addr(info, NULL);
+    /* Segment offsets are often aligned (on MSS, page sizes...), so scramble them with
+     * murmur3 finalizer, where every output bit depends on every input bit. A mere
+     * multiplication would not do, since its low bits depend only on the low bits of
+     * offset. Then draw the levels from the (best mixed) high bits. */
+    uint32_t h = offset;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    unsigned nb_levels = 1;
+    while (nb_levels < PKT_WAIT_MAX_LEVELS && (h >> 30) == 0) {
+        nb_levels ++;
+        h <<= 2;
+    }
+    return nb_levels;
+}
 
-    parser_unref(&info->parser);
+// Returns the last packet with an offset not greater than offset (or NULL), and set for each level the link to update to insert after it
+static struct pkt_wait *pkt_wait_list_locate(struct pkt_wait_list *pkt_wl, unsigned offset, struct pkt_wait **link[PKT_WAIT_MAX_LEVELS])
+{
+    struct pkt_wait *prev = NULL;
+    struct pkt_wait **next = pkt_wl->pkts; // the next pointers of prev (or the list head)
+    for (unsigned l = PKT_WAIT_MAX_LEVELS; l--; ) {
+        while (next[l] && next[l]->offset <= offset) {
+            prev = next[l];
+            next = prev->next;
+        }
+        link[l] = next + l;
+    }
+    return prev;
+}
 
-    if (info->parent) {
-        proto_info_del_rec(info->parent);
-        info->parent = NULL;
+// caller must own list->mutex
+static void pkt_wait_list_insert(struct pkt_wait_list *pkt_wl, struct pkt_wait *pkt, struct pkt_wait **link[PKT_WAIT_MAX_LEVELS])
+{
+    for (unsigned l = 0; l < pkt->nb_levels; l++) {
+        pkt->next[l] = *link[l];
+        *link[l] = pkt;
     }
+    pkt_wl->nb_pkts ++;
+    pkt_wl->tot_payload += pkt->cap_len;
+}
 
-    objfree(start);
+// caller must own list->mutex
+static void pkt_wait_list_unlink(struct pkt_wait_list *pkt_wl, struct pkt_wait *pkt)
+{
+    struct pkt_wait **next = pkt_wl->pkts;
+    for (unsigned l = PKT_WAIT_MAX_LEVELS; l--; ) {
+        if (l >= pkt->nb_levels) {
+            // Do not go past the packets with the same offset, pkt may be any of them
+            while (next[l] && next[l]->offset < pkt->offset) next = next[l]->next;
+        } else {
+            while (next[l] != pkt) {
+                assert(next[l]);
+                next = next[l]->next;
+            }
+            next[l] = pkt->next[l];
+        }
+    }
 }
 
-static struct proto_info *copy_info_rec(struct proto_info *info)
+/*
+ * Destruction of a pending packet
+ */
+
+/* To keep the proto_infos of a waiting packet we copy its proto_info stack in a
+ * single block of memory (see proto_info_stack_copy()), which is allocated along
+ * with the pkt_wait (or on its own for temporary copies).
+ * Subscribers of the replayed packet may read any field of the infos that are kept,
+ * so each of them is copied entirely, but only the ones the deferred parser and its
+ * children are interested in are kept (see nb_kept_infos in pkt_wl_config). */
+
+// Temporary copy of a proto_info stack on its own
+static struct proto_info *copy_info_stack(struct proto_info const *info)
 {
     if (! info) return NULL;
 
-    struct proto_info *parent = copy_info_rec(info->parent);
-
-    size_t size;
-    void *start = (void *)info->parser->proto->ops->info_addr(info, &size);
-    void *copy = objalloc_nice(size, "waiting infos");
-    if (! copy) {
+    void *block = objalloc_nice(proto_info_stack_size(info, 0), "waiting infos");
+    if (! block) {
         SLOG(LOG_WARNING, "Cannot alloc for pending info");
-        if (parent) proto_info_del_rec(parent);
         return NULL;
     }
-    memcpy(copy, start, size);
 
-    struct proto_info *copy_info = (struct proto_info *)(((char *)copy) + ((char *)info - (char *)start));
-    copy_info->parent = parent;
-    copy_info->parser = parser_ref(info->parser);
+    return proto_info_stack_copy(info, block, 0);
+}
 
-    return copy_info;
+static void info_stack_del(struct proto_info *info)
+{
+    if (! info) return;
+    void *block = (void *)info->parser->proto->ops->info_addr(info, NULL);  // the first copied info starts the block
+    proto_info_stack_release(info);
+    objfree(block);
 }
 
+static __thread size_t given_back;   // total budget given back by this thread's pkt_waits (for eviction stats)
+
 // caller must own list->mutex
 static void pkt_wait_dtor(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
 {
@@ -95,14 +157,22 @@ static void pkt_wait_dtor(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
 
     assert(pkt_wl->nb_pkts > 0);
     assert(pkt_wl->tot_payload >= pkt->cap_len);
-    LIST_REMOVE(pkt, entry);
+    pkt_wait_list_unlink(pkt_wl, pkt);
     pkt_wl->nb_pkts --;
     pkt_wl->tot_payload -= pkt->cap_len;
+    if (0 == pkt_wl->nb_pkts && pkt_wl->in_lru) {
+        TAILQ_REMOVE(&pkt_wl->list->lru, pkt_wl, lru_entry);
+        pkt_wl->in_lru = false;
+    }
 
     if (pkt->parent) {
-        proto_info_del_rec(pkt->parent);
+        proto_info_stack_release(pkt->parent);  // its memory goes with the pkt
         pkt->parent = NULL;
     }
+
+    frame_buf_unref(&pkt->buf);
+    reassembly_give(pkt->budget);
+    given_back += pkt->budget;
 }
 
 // caller must own list->mutex
@@ -119,9 +189,57 @@ void pkt_wait_del(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
     supermutex_unlock(&pkt_wl->list->mutex);
 }
 
+/*
+ * Skipping
+ */
+
+static __thread struct pkt_wait_skip *pkt_wait_skip;
+
+void pkt_wait_skip_push(struct pkt_wait_skip *skip, struct parser const *parser, unsigned end_offset)
+{
+    skip->parser = parser;
+    skip->end_offset = end_offset;
+    skip->skip = false;
+    skip->prev = pkt_wait_skip;
+    pkt_wait_skip = skip;
+}
+
+bool pkt_wait_skip_pop(struct pkt_wait_skip *skip)
+{
+    assert(pkt_wait_skip == skip);
+    pkt_wait_skip = skip->prev;
+    return skip->skip;
+}
+
+void pkt_wait_list_skip(struct parser const *parser, size_t nb_bytes)
+{
+    struct pkt_wait_skip *const skip = pkt_wait_skip;
+    // Only the innermost stream is meaningful (another parser may be decoding it, for instance TLS)
+    if (! skip || skip->parser != parser || nb_bytes == 0) return;
+
+    if (nb_bytes > INT_MAX) nb_bytes = INT_MAX;   // so that offsets can still be compared
+    unsigned const skip_offset = skip->end_offset + nb_bytes;
+    if (skip->skip && (int)(skip_offset - skip->skip_offset) <= 0) return;
+    SLOG(LOG_DEBUG, "Parser %s skips %zu bytes after offset %u", parser_name(parser), nb_bytes, skip->end_offset);
+    skip->skip = true;
+    skip->skip_offset = skip_offset;
+}
+
+// Tells if the parser does not care about the missing bytes before offset
+static bool pkt_wait_list_skips(struct pkt_wait_list *pkt_wl, unsigned offset)
+{
+    if ((int)(pkt_wl->skip_offset - pkt_wl->next_offset) <= 0) {
+        // Nothing to skip any more (and keep it close so that it's never mistaken for a future one)
+        pkt_wl->skip_offset = pkt_wl->next_offset;
+        return false;
+    }
+    return (int)(offset - pkt_wl->next_offset) > 0 && (int)(pkt_wl->skip_offset - offset) >= 0;
+}
+
 // Same as proto_parse, but unref the parser if it fails and it builds the parser from proto if necessary
+// Also remembers what the parser asks to skip after end_offset (the offset following these bytes).
 // caller must own list->mutex
-static enum proto_parse_status proto_parse_or_die(struct pkt_wait_list *pkt_wl,
+static enum proto_parse_status proto_parse_or_die(struct pkt_wait_list *pkt_wl, unsigned end_offset,
         struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len,
         struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
@@ -133,12 +251,18 @@ static enum proto_parse_status proto_parse_or_die(struct pkt_wait_list *pkt_wl,
         SLOG(LOG_DEBUG, "Building parser from proto %s", proto->name);
         *pkt_wl->parser = proto->ops->parser_new(proto);
     }
+    struct pkt_wait_skip skip;
+    pkt_wait_skip_push(&skip, *pkt_wl->parser, end_offset);
     enum proto_parse_status status = proto_parse(*pkt_wl->parser, parent, way, packet, cap_len, wire_len,
             now, tot_cap_len, tot_packet);
+    if (pkt_wait_skip_pop(&skip) && (int)(skip.skip_offset - pkt_wl->skip_offset) > 0) {
+        pkt_wl->skip_offset = skip.skip_offset;
+    }
     if (status == PROTO_PARSE_ERR) {
         SLOG(LOG_DEBUG, "Error on parsing, unref parser for proto %s and advertising current stack if "
                 "not already done", proto->name);
         parser_unref(pkt_wl->parser);
+        pkt_wl->skip_offset = pkt_wl->next_offset;  // whatever comes next may be of interest to the next parser
         proto_parse(NULL, parent, way, packet, cap_len, wire_len, now, tot_cap_len, tot_packet);
     }
     return status;
@@ -150,12 +274,16 @@ static enum proto_parse_status pkt_wait_finalize(struct pkt_wait *pkt, struct pk
 {
     enum proto_parse_status status;
 
+    // So that parsers keeping this packet again merely share its frame_buf
+    struct frame_buf_ctx frame_ctx;
+    frame_buf_ctx_push(&frame_ctx, pkt->packet, pkt->tot_cap_len, frame_buf_ref(pkt->buf));
+
     if (
         pkt_wl->next_offset >= pkt->next_offset // the pkt content was completely covered
     ) {
         // forget it
         SLOG(LOG_DEBUG, "Advertize a covered packet @(%u:%u) for waiting list @%p", pkt->offset, pkt->next_offset, pkt_wl);
-        status = proto_parse_or_die(NULL, pkt->parent, pkt->way, NULL, 0, 0, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);
+        status = proto_parse_or_die(NULL, 0, pkt->parent, pkt->way, NULL, 0, 0, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);
         pkt_wait_del_nolock(pkt, pkt_wl);
     } else if (
         pkt->offset > pkt_wl->next_offset       // the pkt was supposed to come later,
@@ -166,11 +294,11 @@ static enum proto_parse_status pkt_wait_finalize(struct pkt_wait *pkt, struct pk
             SLOG(LOG_DEBUG, "Advertize a gap of %zu bytes @(%u:%u) for waiting list @%p", gap, pkt_wl->next_offset, pkt->offset, pkt_wl);
             pkt_wl->next_offset = pkt->offset;
             // We can't merely borrow pkt parent since proto_parse is going to flag it when calling subscribers (which would prevent callback of subscribers for actual packet)
-            struct proto_info *copy = copy_info_rec(pkt->parent);
-            status = proto_parse_or_die(pkt_wl, copy, pkt->way, NULL, 0, gap, &pkt->cap_tv, 0, NULL);
-            proto_info_del_rec(copy);
+            struct proto_info *copy = copy_info_stack(pkt->parent);
+            status = proto_parse_or_die(pkt_wl, pkt->offset, copy, pkt->way, NULL, 0, gap, &pkt->cap_tv, 0, NULL);
+            info_stack_del(copy);
         } else { // count it but do not parse it
-            status = proto_parse_or_die(pkt_wl, pkt->parent, pkt->way, pkt->packet + pkt->start, pkt->cap_len, pkt->wire_len, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);
+            status = proto_parse_or_die(pkt_wl, pkt->next_offset, pkt->parent, pkt->way, pkt->packet + pkt->start, pkt->cap_len, pkt->wire_len, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);
             pkt_wait_del_nolock(pkt, pkt_wl);
         }
     } else {
@@ -180,12 +308,14 @@ static enum proto_parse_status pkt_wait_finalize(struct pkt_wait *pkt, struct pk
         unsigned const trim = pkt_wl->next_offset - pkt->offset;  // This assumes that offsets _are_ bytes. If not, then there is no reason to trim.
         status =
             trim < pkt->cap_len ?
-                proto_parse_or_die(pkt_wl, pkt->parent, pkt->way, pkt->packet + pkt->start + trim, pkt->cap_len - trim, pkt->wire_len - trim, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet) :
+                proto_parse_or_die(pkt_wl, pkt->next_offset, pkt->parent, pkt->way, pkt->packet + pkt->start + trim, pkt->cap_len - trim, pkt->wire_len - trim, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet) :
                 // The parser may be able to parse this (if he just skip, for instance HTTP skipping a body)
-                proto_parse_or_die(pkt_wl, pkt->parent, pkt->way, NULL, 0, trim < pkt->wire_len ? pkt->wire_len - trim : 0, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);
+                proto_parse_or_die(pkt_wl, pkt->next_offset, pkt->parent, pkt->way, NULL, 0, trim < pkt->wire_len ? pkt->wire_len - trim : 0, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);
         pkt_wl->next_offset = pkt->next_offset;
         pkt_wait_del_nolock(pkt, pkt_wl);
     }
+
+    frame_buf_ctx_pop(&frame_ctx);
     return status;
 }
 
@@ -194,10 +324,10 @@ static enum proto_parse_status pkt_wait_finalize(struct pkt_wait *pkt, struct pk
  */
 
 // Construct it but does not insert it into the pkt_wait list yet
-static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
+// info_block is where to copy the nb_kept_infos of the parent stack (see proto_info_stack_copy())
+static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, void *info_block, unsigned nb_kept_infos, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
 {
     SLOG(LOG_DEBUG, "Construct pkt@%p", pkt);
-    CHECK_LAST_FIELD(pkt_wait, packet, uint8_t);
 
     pkt->offset = offset;
     pkt->next_offset = next_offset;
@@ -217,26 +347,41 @@ static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_of
     assert(pkt->cap_len <= pkt->tot_cap_len);
     assert(pkt->wire_len >= pkt->cap_len);
 
-    // We save the original packet, assuming packet points within it.
-    memcpy(pkt->packet, tot_packet, tot_cap_len);
+    // We keep the original packet, assuming packet points within it.
+    pkt->buf = frame_buf_hold(tot_packet, tot_cap_len, &pkt->packet);
+    if (! pkt->buf) return -1;
 
-    if (parent) {
-        pkt->parent = copy_info_rec(parent);
-        if (! pkt->parent) return -1;
-    } else {
-        pkt->parent = NULL;
-    }
+    pkt->parent = parent ? proto_info_stack_copy(parent, info_block, nb_kept_infos) : NULL;
 
     return 0;
 }
 
-static struct pkt_wait *pkt_wait_new(unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
+// Returns NULL if the reassembly budget is exhausted
+static struct pkt_wait *pkt_wait_new(unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned nb_kept_infos, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
 {
-    struct pkt_wait *pkt = objalloc(sizeof(*pkt) + tot_cap_len, "pkt_waits");
-    if (! pkt) return NULL;
+    // The pkt_wait, its skip list links and the copy of the parent stack all go in one block
+    unsigned const nb_levels = pkt_wait_nb_levels(offset);
+    size_t const info_offset = CEIL_DIV(sizeof(struct pkt_wait) + nb_levels * sizeof(struct pkt_wait *), PROTO_INFO_ALIGN) * PROTO_INFO_ALIGN;
+    size_t const size = info_offset + (parent ? proto_info_stack_size(parent, nb_kept_infos) : 0);
+
+    // We count the whole frame, although it may be shared with other packets
+    size_t const budget = size + tot_cap_len;
+    if (! reassembly_take(budget)) {
+        SLOG(LOG_DEBUG, "Reassembly budget exhausted, cannot keep packet");
+        return NULL;
+    }
 
-    if (0 != pkt_wait_ctor(pkt, offset, next_offset, sync, sync_offset, parent, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now)) {
+    struct pkt_wait *pkt = objalloc(size, "pkt_waits");
+    if (! pkt) {
+        reassembly_give(budget);
+        return NULL;
+    }
+    pkt->nb_levels = nb_levels;
+    pkt->budget = budget;
+
+    if (0 != pkt_wait_ctor(pkt, offset, next_offset, sync, sync_offset, parent, (char *)pkt + info_offset, nb_kept_infos, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now)) {
         objfree(pkt);
+        reassembly_give(budget);
         return NULL;
     }
 
@@ -248,47 +393,105 @@ static struct pkt_wait *pkt_wait_new(unsigned offset, unsigned next_offset, bool
  */
 
 static SLIST_HEAD(pkt_wl_configs, pkt_wl_config) pkt_wl_configs = SLIST_HEAD_INITIALIZER(pkt_wls_configs);
+static unsigned nb_pkt_wl_configs;  // length of pkt_wl_configs
 static struct mutex pkt_wl_configs_mutex;
 
-static struct bench_event timeouting_wl;
+// Timeout the waiting lists of list->list[next_to]
+static void pkt_wl_config_list_timeout(struct pkt_wl_config_list *list, unsigned next_to)
+{
+    if (0 != supermutex_lock(&list->mutex)) return;
+    struct pkt_wait_list *wl;
+    LIST_FOREACH(wl, &list->list[next_to], entry) {
+        enum proto_parse_status status;
+        (void)pkt_wait_list_try_both(wl, &status, &list->last_used, overweight);
+    }
+    supermutex_unlock(&list->mutex);
+}
+
+// Force the parse of the least recently used waiting lists of this list while we are above the soft reassembly budget
+static void pkt_wl_config_list_evict(struct pkt_wl_config_list *list)
+{
+    if (0 == reassembly_excess()) return;
+    if (0 != supermutex_lock(&list->mutex)) return;
+
+    // Do not loop forever on waiting lists that would be given back their packets
+    struct pkt_wait_list *const last = TAILQ_LAST(&list->lru, pkt_wait_list_lru);
+    struct pkt_wait_list *wl;
+    while (reassembly_excess() > 0 && NULL != (wl = TAILQ_FIRST(&list->lru))) {
+        bool const was_last = wl == last;
+        SLOG(LOG_DEBUG, "Evicting waiting list @%p (%u pkts, %zu bytes)", wl, wl->nb_pkts, wl->tot_payload);
+        size_t const given_before = given_back;
+        enum proto_parse_status status;
+        (void)pkt_wait_list_try_both(wl, &status, &list->last_used, true);
+        // Count only what was actually released (the parser may have failed before releasing anything)
+        if (given_back > given_before) reassembly_evicted(given_back - given_before);
+        // If it's still there (for instance because its parser failed) then try others first
+        if (wl == TAILQ_FIRST(&list->lru)) {
+            TAILQ_REMOVE(&list->lru, wl, lru_entry);
+            TAILQ_INSERT_TAIL(&list->lru, wl, lru_entry);
+        }
+        if (was_last) break;
+    }
+
+    supermutex_unlock(&list->mutex);
+}
 
-// Timeouter thread (one per wl_config)
-static void *pkt_wl_config_timeouter_thread_(void *config_)
+// Ticker (one per wl_config), run every second by the timebounder thread
+static void pkt_wl_config_tick(struct timebound_ticker *ticker)
 {
-    struct pkt_wl_config *config = config_;
+    struct pkt_wl_config *config = DOWNCAST(ticker, ticker, pkt_wl_config);
+
+    enter_mono_region();
+    // Lists owned by parser threads are timeouted by these threads
+    for (unsigned h = flow_affinity ? CPU_MAX : 0; h < NB_ELEMS(config->lists); h++) {
+        struct pkt_wl_config_list *list = config->lists + h;
+        if (! timeval_is_set(&list->last_used)) break;
+        // Timeout only next_to
+        if (config->timeout) pkt_wl_config_list_timeout(list, config->next_to);
+        pkt_wl_config_list_evict(list);
+    }
+    if (config->timeout) config->next_to = (config->next_to + 1) % NB_ELEMS(config->lists[0].list);
+    leave_protected_region();
+}
 
-    set_thread_name(tempstr_printf("J-TO-%s", config->name));
-    disable_cancel();
+void pkt_wait_lists_timeout_mine(void)
+{
+    unsigned const thread = get_parser_thread();
+    assert(thread < CPU_MAX);
 
-    while (1) {
-        enter_mono_region();
-        uint64_t start = bench_event_start();
-        for (unsigned h = 0; h < NB_ELEMS(config->lists); h++) {
-            struct pkt_wl_config_list *list = config->lists + h;
-            if (! timeval_is_set(&list->last_used)) break;
-            if (0 == supermutex_lock(&list->mutex)) {
-                struct pkt_wait_list *wl;
-                // Timeout only next_to
-                LIST_FOREACH(wl, &list->list[config->next_to], entry) {
-                    enum proto_parse_status status;
-                    (void)pkt_wait_list_try_both(wl, &status, &list->last_used, overweight);
-                }
-                supermutex_unlock(&list->mutex);
-            }
-        }
-        config->next_to = (config->next_to + 1) % NB_ELEMS(config->lists[0].list);
-        bench_event_stop(&timeouting_wl, start);
-        leave_protected_region();
+    /* Do not hold pkt_wl_configs_mutex while timing out (and thus parsing), which
+     * would serialize all parser threads. Configs are only destructed once the
+     * parser threads are gone, so we can use them after releasing the mutex. */
+    mutex_lock(&pkt_wl_configs_mutex);
+    struct pkt_wl_config *configs[nb_pkt_wl_configs + 1];
+    unsigned nb_configs = 0;
+    struct pkt_wl_config *config;
+    SLIST_FOREACH(config, &pkt_wl_configs, entry) {
+        configs[nb_configs++] = config;
+    }
+    mutex_unlock(&pkt_wl_configs_mutex);
 
-        // Wait
-        cancellable_sleep(1);
+    for (unsigned c = 0; c < nb_configs; c++) {
+        config = configs[c];
+        struct pkt_wl_config_list *list = config->lists + thread;
+        if (! timeval_is_set(&list->last_used)) continue;
+        if (config->timeout) {
+            pkt_wl_config_list_timeout(list, list->next_to);
+            list->next_to = (list->next_to + 1) % NB_ELEMS(list->list);
+        }
+        pkt_wl_config_list_evict(list);
     }
-    return NULL;
 }
 
-static void *pkt_wl_config_timeouter_thread(void *config_)
+// Choose the pkt_wl_config_list of a new pkt_wait_list
+static struct pkt_wl_config_list *pkt_wl_config_list_choose(struct pkt_wl_config *config)
 {
-    return scm_with_guile(pkt_wl_config_timeouter_thread_, config_);
+    unsigned const thread = get_parser_thread();
+    unsigned const seqnum = config->list_seqnum ++; // No need for atomicity for this usage
+
+    if (! flow_affinity) return config->lists + (seqnum % NB_ELEMS(config->lists));
+    if (thread < CPU_MAX) return config->lists + thread;
+    return config->lists + CPU_MAX + (seqnum % (NB_ELEMS(config->lists) - CPU_MAX));
 }
 
 // caller must own list->mutex
@@ -297,7 +500,7 @@ static enum proto_parse_status pkt_wait_list_empty(struct pkt_wait_list *pkt_wl)
     SLOG(LOG_DEBUG, "Emptying pkt_wl @%p", pkt_wl);
     enum proto_parse_status last_status = PROTO_OK;
     struct pkt_wait *pkt;
-    while (NULL != (pkt = LIST_FIRST(&pkt_wl->pkts))) {
+    while (NULL != (pkt = pkt_wl->pkts[0])) {
         last_status = pkt_wait_finalize(pkt, pkt_wl);
     }
     assert(pkt_wl->nb_pkts == 0);
@@ -325,8 +528,8 @@ enum proto_parse_status pkt_wait_list_flush(struct pkt_wait_list *pkt_wl, uint8_
         *pkt_wl->parser = NULL;
         *pkt_wl->proto = NULL;
         struct pkt_wait *pkt;
-        while (NULL != (pkt = LIST_FIRST(&pkt_wl->pkts))) {
-            if (LIST_IS_LAST(pkt, entry)) {
+        while (NULL != (pkt = pkt_wl->pkts[0])) {
+            if (! pkt->next[0]) {
                 last_status = proto_parse(parser, pkt->parent, pkt->way, payload, cap_len,
                         wire_len, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);   // FIXME: once again, payload not within pkt->packet !
                 pkt_wait_del_nolock(pkt, pkt_wl);
@@ -348,16 +551,17 @@ int pkt_wait_list_ctor(struct pkt_wait_list *pkt_wl, unsigned next_offset, struc
 {
     SLOG(LOG_DEBUG, "Construct pkt_wait_list @%p, origin %d", pkt_wl, next_offset);
 
-    LIST_INIT(&pkt_wl->pkts);
+    for (unsigned l = 0; l < NB_ELEMS(pkt_wl->pkts); l++) pkt_wl->pkts[l] = NULL;
     pkt_wl->nb_pkts = 0;
     pkt_wl->tot_payload = 0;
     pkt_wl->next_offset = next_offset;
+    pkt_wl->skip_offset = next_offset;
     pkt_wl->parser = parser;
     pkt_wl->proto = proto;
     pkt_wl->config = config;
     pkt_wl->sync_with = sync_with;
-    pkt_wl->list = config->lists + (config->list_seqnum % NB_ELEMS(config->lists));
-    config->list_seqnum ++; // No need for atomicity for this usage
+    pkt_wl->in_lru = false;
+    pkt_wl->list = pkt_wl_config_list_choose(config);
     if (0 != supermutex_lock(&pkt_wl->list->mutex)) return -1;
     LIST_INSERT_HEAD(&pkt_wl->list->list[config->next_to], pkt_wl, entry); // construct on the next to timeout list
     supermutex_unlock(&pkt_wl->list->mutex);
@@ -386,7 +590,7 @@ void pkt_wait_list_dtor(struct pkt_wait_list *pkt_wl)
     supermutex_unlock(mutex);
 }
 
-void pkt_wl_config_ctor(struct pkt_wl_config *config, char const *name, unsigned acceptable_gap, unsigned nb_pkts_max, size_t payload_max, unsigned timeout, bool allow_partial)
+void pkt_wl_config_ctor(struct pkt_wl_config *config, char const *name, unsigned acceptable_gap, unsigned nb_pkts_max, size_t payload_max, unsigned timeout, bool allow_partial, unsigned nb_kept_infos)
 {
     config->name = name;
     config->acceptable_gap = acceptable_gap;
@@ -394,6 +598,7 @@ void pkt_wl_config_ctor(struct pkt_wl_config *config, char const *name, unsigned
     config->payload_max = payload_max;
     config->timeout = timeout;
     config->allow_partial = allow_partial;
+    config->nb_kept_infos = nb_kept_infos;
     config->list_seqnum = 0;
 #   ifndef __GNUC__
     mutex_ctor(&config->atomic, "pkt_wl_config");
@@ -403,22 +608,17 @@ void pkt_wl_config_ctor(struct pkt_wl_config *config, char const *name, unsigned
         for (unsigned i = 0; i < NB_ELEMS(config->lists[0].list); i++) {
             LIST_INIT(&config->lists[l].list[i]);
         }
+        TAILQ_INIT(&config->lists[l].lru);
+        config->lists[l].next_to = 0;
         supermutex_ctor(&config->lists[l].mutex, "pkt wl config");
     }
     config->next_to = 0;
 
-    config->has_timeouter = false;
-    if (config->timeout > 0) {
-        int err = pthread_create(&config->timeouter_pth, NULL, pkt_wl_config_timeouter_thread, config);
-        if (! err) {
-            config->has_timeouter = true;
-        } else {
-            SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
-        }
-    }
+    timebound_ticker_ctor(&config->ticker, "timeout waiting lists", pkt_wl_config_tick);
 
     mutex_lock(&pkt_wl_configs_mutex);
     SLIST_INSERT_HEAD(&pkt_wl_configs, config, entry);
+    nb_pkt_wl_configs ++;
     mutex_unlock(&pkt_wl_configs_mutex);
 }
 
@@ -426,14 +626,11 @@ void pkt_wl_config_dtor(struct pkt_wl_config *config)
 {
     mutex_lock(&pkt_wl_configs_mutex);
     SLIST_REMOVE(&pkt_wl_configs, config, pkt_wl_config, entry);
+    assert(nb_pkt_wl_configs > 0);
+    nb_pkt_wl_configs --;
     mutex_unlock(&pkt_wl_configs_mutex);
 
-    // Kill timeouter thread
-    if (config->has_timeouter) {
-        SLOG(LOG_DEBUG, "Terminating timeouter thread for %s waiting lists...", config->name);
-        (void)pthread_cancel(config->timeouter_pth);
-        (void)pthread_join(config->timeouter_pth, NULL);
-    }
+    timebound_ticker_dtor(&config->ticker);
 
     for (unsigned l = 0; l < NB_ELEMS(config->lists); l++) {
         for (unsigned i = 0; i < NB_ELEMS(config->lists[l].list); i++) {
@@ -460,7 +657,7 @@ static bool pkt_wait_list_try_locked(struct pkt_wait_list *pkt_wl, enum proto_pa
     bool ret = false;
 
     struct pkt_wait *pkt;
-    while (NULL != (pkt = LIST_FIRST(&pkt_wl->pkts))) {
+    while (NULL != (pkt = pkt_wl->pkts[0])) {
         SLOG(LOG_DEBUG, "pkt_wait_list_try_locked pkt_wl=%s, sync_pkt_wl=%s, pkt_wait=%s, force_timeout=%s",
                 pkt_wait_list_2_str(pkt_wl), pkt_wait_list_2_str(pkt_wl->sync_with),
                 pkt_2_str(pkt), force_timeout?"yes":"no");
@@ -490,6 +687,30 @@ static bool pkt_wait_list_try_locked(struct pkt_wait_list *pkt_wl, enum proto_pa
     return ret;
 }
 
+// Advertise the missing bytes up to offset as a gap, since the parser does not care about them
+// caller must own list->mutex
+static enum proto_parse_status pkt_wait_list_skip_to(struct pkt_wait_list *pkt_wl, unsigned offset, struct proto_info *parent, unsigned way, struct timeval const *now)
+{
+    enum proto_parse_status status = PROTO_OK;
+
+    // First parse what we already have before that point (it's within the skipped range as well)
+    struct pkt_wait *pkt;
+    while (status == PROTO_OK && NULL != (pkt = pkt_wl->pkts[0]) && (int)(pkt->offset - offset) < 0) {
+        status = pkt_wait_finalize(pkt, pkt_wl);
+    }
+    if (status != PROTO_OK || (int)(offset - pkt_wl->next_offset) <= 0) return status;
+
+    size_t const gap = offset - pkt_wl->next_offset;
+    SLOG(LOG_DEBUG, "Skipping a gap of %zu bytes @(%u:%u) for waiting list @%p", gap, pkt_wl->next_offset, offset, pkt_wl);
+    pkt_wl->next_offset = offset;
+    // As in pkt_wait_finalize(), the subscribers must still be called for the actual packet
+    struct proto_info *copy = copy_info_stack(parent);
+    status = proto_parse_or_die(pkt_wl, offset, copy, way, NULL, 0, gap, now, 0, NULL);
+    info_stack_del(copy);
+
+    return status;
+}
+
 enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, bool can_parse, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
     enum proto_parse_status ret = PROTO_OK;
@@ -517,18 +738,18 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
     SLOG(LOG_DEBUG, "Add a packet of %zu bytes (%u:%zu) to waiting list @%p (currently at %u)", wire_len, offset, offset + wire_len, pkt_wl, pkt_wl->next_offset);
     if (sync) SLOG(LOG_DEBUG, "  ...waiting for reciprocal waiting list @%p to reach offset %u (currently at %u)", pkt_wl->sync_with, sync_offset, pkt_wl->sync_with->next_offset);
 
+    // If the parser does not care about what's missing before this packet, do not wait for it
+    if (can_parse && pkt_wait_list_skips(pkt_wl, offset) && (!pkt_wl->sync_with || !sync || pkt_wl->sync_with->next_offset >= sync_offset)) {
+        ret = pkt_wait_list_skip_to(pkt_wl, offset, parent, way, now);
+        if (ret != PROTO_OK) goto quit;
+    }
+
     // Find its location and the previous pkt
     /* Note that in case of equal seqnums we want the older packet first,
      * so that age of this WL, estimated from the cap_tv of its first packet, is more accurate. */
-    struct pkt_wait *prev = NULL;
-    struct pkt_wait *next;
-    LIST_FOREACH(next, &pkt_wl->pkts, entry) {
-        // Stop whenever the next packet must be sent after (try to preserve packet numbers and order of arrival for subscribers)
-        if (offset < next->offset) {
-            break;
-        }
-        prev = next;
-    }
+    // Stop whenever the next packet must be sent after (try to preserve packet numbers and order of arrival for subscribers)
+    struct pkt_wait **link[PKT_WAIT_MAX_LEVELS];
+    struct pkt_wait *prev = pkt_wait_list_locate(pkt_wl, offset, link);
 
     // if previous == NULL and pkt_wl->next_offset == offset _and_ we don't wait for another list then we can call proto_parse directly and then advance next_offset.
     if (! prev && pkt_wl->next_offset == offset && can_parse && (!pkt_wl->sync_with || !sync || pkt_wl->sync_with->next_offset >= sync_offset)) {
@@ -539,12 +760,12 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
          * For instance, when several FTP parsers create simultaneously new TCP parsers because of contracking.
          * Yes, this does happen :-( */
         SLOG(LOG_DEBUG, "Parsing packet at once since we were waiting for it");
-        ret = proto_parse_or_die(pkt_wl, parent, way, packet, cap_len, wire_len, now, tot_cap_len, tot_packet);
+        ret = proto_parse_or_die(pkt_wl, next_offset, parent, way, packet, cap_len, wire_len, now, tot_cap_len, tot_packet);
 
         // Now parse as much as we can while advancing next_offset, returning the first error we obtain
         pkt_wl->next_offset = next_offset;
         while (ret == PROTO_OK) {
-            struct pkt_wait *pkt = LIST_FIRST(&pkt_wl->pkts);
+            struct pkt_wait *pkt = pkt_wl->pkts[0];
             if (! pkt) break;
             if (pkt->offset > pkt_wl->next_offset) break;
             if (pkt_wl->sync_with && sync && pkt_wl->sync_with->next_offset < pkt->sync_offset) break;
@@ -559,36 +780,52 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
         (pkt_wl->config->acceptable_gap > 0 && (int)(offset - prev_offset) > (int)pkt_wl->config->acceptable_gap)
     ) {
         SLOG(LOG_DEBUG, "Gap too large (%d), parsing packet", offset - prev_offset);
-        ret = proto_parse_or_die(NULL, parent, way, packet, cap_len, wire_len, now, tot_cap_len, tot_packet);
+        ret = proto_parse_or_die(NULL, 0, parent, way, packet, cap_len, wire_len, now, tot_cap_len, tot_packet);
+        goto quit;
+    }
+
+    // If all of it is already waiting (for instance, a retransmission) then advertise it now as we would when reaching it
+    if (
+        prev && next_offset <= prev->next_offset &&
+        (cap_len == 0 || prev->cap_len == prev->wire_len)
+    ) {
+        SLOG(LOG_DEBUG, "Packet covered by pkt@%p, advertize it", prev);
+        ret = proto_parse_or_die(NULL, 0, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet);
+        goto quit;
+    }
+
+    // Same if all of it was already parsed (or skipped)
+    if (can_parse && (int)(next_offset - pkt_wl->next_offset) <= 0 && next_offset != offset) {
+        SLOG(LOG_DEBUG, "Packet already passed, advertize it");
+        ret = proto_parse_or_die(NULL, 0, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet);
         goto quit;
     }
 
     // In all other more complex cases, insert the packet
-    struct pkt_wait *pkt = pkt_wait_new(offset, next_offset, sync, sync_offset, parent, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now);
+    struct pkt_wait *pkt = pkt_wait_new(offset, next_offset, sync, sync_offset, parent, pkt_wl->config->nb_kept_infos, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now);
     if (! pkt) {
-        ret = proto_parse_or_die(NULL, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet); // silently discard
+        ret = proto_parse_or_die(NULL, 0, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet); // silently discard
         goto quit;
     }
 
-    if (prev) {
-        LIST_INSERT_AFTER(prev, pkt, entry);
-    } else {
-        LIST_INSERT_HEAD(&pkt_wl->pkts, pkt, entry);
-    }
-    pkt_wl->nb_pkts ++;
-    pkt_wl->tot_payload += pkt->cap_len;
+    pkt_wait_list_insert(pkt_wl, pkt, link);
+    // This waiting list is now the most recently used of its list
+    if (pkt_wl->in_lru) TAILQ_REMOVE(&pkt_wl->list->lru, pkt_wl, lru_entry);
+    TAILQ_INSERT_TAIL(&pkt_wl->list->lru, pkt_wl, lru_entry);
+    pkt_wl->in_lru = true;
     SLOG(LOG_DEBUG, "Inserting packet in wait list @%p (now at %d pkts and %zu payload)", pkt_wl, pkt_wl->nb_pkts, pkt_wl->tot_payload);
 
     // Maybe this packet content is enough to allow parsing (we end here in case its content overlap what's already there)
     if (can_parse && pkt->offset <= pkt_wl->next_offset && (! pkt_wl->sync_with || !sync || pkt_wl->sync_with->next_offset >= pkt->sync_offset)) {
         ret = pkt_wait_finalize(pkt, pkt_wl);  // may deadlock
         // On finalize, proto_parse is already called on the parent copy of pkt_wait, so mark the original as called to avoid duplicate callback call
-        parent->pkt_sbc_called = true;
+        if (parent) parent->pkt_sbc_called = true;
     }   // else just wait
 
 quit:
     if (ret == PROTO_PARSE_ERR) {
         parser_unref(pkt_wl->parser);
+        pkt_wl->skip_offset = pkt_wl->next_offset;
     }
     supermutex_unlock(&pkt_wl->list->mutex);
     return ret;
@@ -627,8 +864,8 @@ bool pkt_wait_list_try_both(struct pkt_wait_list *pkt_wl, enum proto_parse_statu
                 /* If pkt_wl ack_num is beyond pkt_wl->sync_with seq_num then we must start by pkt_wl->sync_with.
                  * In the other way around we must start by pkt_wl. If no ack_num comes after any seq_num then
                  * we don't care. */
-                struct pkt_wait *const pkt = LIST_FIRST(&pkt_wl->pkts);
-                struct pkt_wait *const sync_with_pkt = LIST_FIRST(&pkt_wl->sync_with->pkts);
+                struct pkt_wait *const pkt = pkt_wl->pkts[0];
+                struct pkt_wait *const sync_with_pkt = pkt_wl->sync_with->pkts[0];
                 if (pkt && sync_with_pkt && pkt->sync_offset > sync_with_pkt->offset) {
                     // We must start with the other direction
                     if (! pkt_wait_list_try(pkt_wl->sync_with, status, now, true)) assert(!"Low battery");
@@ -658,7 +895,7 @@ bool pkt_wait_list_is_complete(struct pkt_wait_list *pkt_wl, unsigned start_offs
     if (! pkt_wl->list) return false;
     if (0 != supermutex_lock(&pkt_wl->list->mutex)) return false;   // will retry later
 
-    LIST_FOREACH(pkt, &pkt_wl->pkts, entry) {
+    for (pkt = pkt_wl->pkts[0]; pkt; pkt = pkt->next[0]) {
         if (pkt->next_offset <= end) continue;
         if (pkt->offset > end) break;
         end = pkt->next_offset;
@@ -690,7 +927,7 @@ uint8_t *pkt_wait_list_reassemble(struct pkt_wait_list *pkt_wl, unsigned start_o
 
     unsigned end = start_offset;   // we filled payload up to there
     struct pkt_wait *pkt;
-    LIST_FOREACH(pkt, &pkt_wl->pkts, entry) {
+    for (pkt = pkt_wl->pkts[0]; pkt; pkt = pkt->next[0]) {
         if (end == end_offset) break;
         if (pkt->next_offset <= end) continue;
         if (pkt->offset > end) break;
@@ -744,6 +981,7 @@ static SCM timeout_sym;
 static SCM max_payload_sym;
 static SCM max_packets_sym;
 static SCM acceptable_gap_sym;
+static SCM kept_infos_sym;
 
 static struct ext_function sg_wait_list_stats;
 static SCM g_wait_list_stats(SCM name_)
@@ -751,11 +989,12 @@ static SCM g_wait_list_stats(SCM name_)
     struct pkt_wl_config *config = pkt_wl_config_of_scm_name(name_);
     if (! config) return SCM_UNSPECIFIED;
 
-    return scm_list_4(
+    return scm_list_5(
         scm_cons(timeout_sym,        scm_from_uint(config->timeout)),
         scm_cons(max_payload_sym,    scm_from_size_t(config->payload_max)),
         scm_cons(max_packets_sym,    scm_from_uint(config->nb_pkts_max)),
-        scm_cons(acceptable_gap_sym, scm_from_uint(config->acceptable_gap)));
+        scm_cons(acceptable_gap_sym, scm_from_uint(config->acceptable_gap)),
+        scm_cons(kept_infos_sym,     scm_from_uint(config->nb_kept_infos)));
 }
 
 static struct ext_function sg_wait_list_set_max_payload;
@@ -794,18 +1033,29 @@ static SCM g_wait_list_set_timeout(SCM name_, SCM timeout_)
     return SCM_BOOL_T;
 }
 
+static struct ext_function sg_wait_list_set_kept_infos;
+static SCM g_wait_list_set_kept_infos(SCM name_, SCM nb_kept_infos_)
+{
+    struct pkt_wl_config *config = pkt_wl_config_of_scm_name(name_);
+    if (! config) return SCM_BOOL_F;
+    config->nb_kept_infos = scm_to_uint(nb_kept_infos_);
+    return SCM_BOOL_T;
+}
+
 void pkt_wait_list_init(void)
 {
     bench_init();
+    timebound_init();
+    reassembly_init();
 
     log_category_pkt_wait_list_init();
     mutex_ctor(&pkt_wl_configs_mutex, "pkt_wls_list");
-    bench_event_ctor(&timeouting_wl, "timeout waiting lists");
 
     timeout_sym        = scm_permanent_object(scm_from_latin1_symbol("timeout"));
     max_payload_sym    = scm_permanent_object(scm_from_latin1_symbol("max-payload"));
     max_packets_sym    = scm_permanent_object(scm_from_latin1_symbol("max-packets"));
     acceptable_gap_sym = scm_permanent_object(scm_from_latin1_symbol("acceptable-gap"));
+    kept_infos_sym     = scm_permanent_object(scm_from_latin1_symbol("kept-infos"));
 
     ext_function_ctor(&sg_wait_list_names,
         "wait-list-names", 0, 0, 0, g_wait_list_names,
@@ -834,14 +1084,20 @@ void pkt_wait_list_init(void)
     ext_function_ctor(&sg_wait_list_set_timeout,
         "wait-list-set-timeout", 2, 0, 0, g_wait_list_set_timeout,
         "(wait-list-set-timeout \"name\" seconds): sets the delay after which kept packets are droped (0 for no limit - not advised!).\n");
+
+    ext_function_ctor(&sg_wait_list_set_kept_infos,
+        "wait-list-set-kept-infos", 2, 0, 0, g_wait_list_set_kept_infos,
+        "(wait-list-set-kept-infos \"name\" n): kept packets keep only the n innermost proto infos of their stack,\n"
+        "besides the capture one (0 to keep them all, for subscribers interested in the outer ones).\n");
 }
 
 void pkt_wait_list_fini(void)
 {
-    bench_event_dtor(&timeouting_wl);
     log_category_pkt_wait_list_fini();
 #   ifdef DELETE_ALL_AT_EXIT
     mutex_dtor(&pkt_wl_configs_mutex);
 #   endif
+    reassembly_fini();
+    timebound_fini();
     bench_fini();
 }
@@ -19,19 +19,113 @@
  */
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <inttypes.h>
 #include <unistd.h> // for access
 #include "junkie/tools/log.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/ref.h"
 #include "junkie/proto/port_muxer.h"
 
 #undef LOG_CAT
 #define LOG_CAT proto_log_category
 
+/*
+ * Lookup table
+ *
+ * Each port is mapped to the first muxer of the list it belongs to, so that
+ * port_muxer_find() is merely two reads in a table instead of a walk along the
+ * list under its lock. The table is rebuilt by the first lookup following a
+ * change in the list (usually, all ranges are set at startup). Since other
+ * threads may still be reading an outdated table, it's handed to the doomer
+ * thread which frees it once all parsers met at a safe point.
+ */
+
+struct port_muxer_table {
+    struct ref ref;                 // only the list refs it, so that outdated tables are freed by the doomer
+    unsigned version;               // of the list this table was built from
+    struct proto **protos;          // the proto of each muxer, in list order
+    uint16_t first[65536];          // for each port, 1 + the index in protos of the first muxer it belongs to (0 if none)
+};
+
+static void port_muxer_table_del(struct port_muxer_table *table)
+{
+    objfree(table->protos);
+    objfree(table);
+}
+
+static void port_muxer_table_del_by_ref(struct ref *ref)
+{
+    struct port_muxer_table *table = DOWNCAST(ref, ref, port_muxer_table);
+    ref_dtor(&table->ref);
+    port_muxer_table_del(table);
+}
+
+// Caller must own muxers->mutex
+static struct port_muxer_table *port_muxer_table_new(struct port_muxer_list *muxers)
+{
+    unsigned nb_muxers = 0;
+    struct port_muxer *muxer;
+    TAILQ_FOREACH(muxer, &muxers->muxers, entry) nb_muxers ++;
+    if (nb_muxers >= UINT16_MAX) {
+        SLOG(LOG_ERR, "Too many port muxers (%u) for a lookup table", nb_muxers);
+        return NULL;
+    }
+
+    struct port_muxer_table *table = objalloc(sizeof(*table), "port muxers");
+    if (! table) return NULL;
+    table->protos = objalloc(MAX(nb_muxers, 1) * sizeof(*table->protos), "port muxers");
+    if (! table->protos) {
+        objfree(table);
+        return NULL;
+    }
+
+    SLOG(LOG_DEBUG, "Building lookup table for %u port muxers", nb_muxers);
+    ref_ctor(&table->ref, port_muxer_table_del_by_ref);
+    table->version = muxers->version;
+    memset(table->first, 0, sizeof(table->first));
+    unsigned m = 0;
+    TAILQ_FOREACH(muxer, &muxers->muxers, entry) {
+        table->protos[m] = muxer->proto;
+        for (unsigned p = muxer->port_min; p <= muxer->port_max; p++) {
+            if (! table->first[p]) table->first[p] = m + 1;
+        }
+        m ++;
+    }
+
+    return table;
+}
+
+// Returns an up to date table (or NULL if it cannot be built)
+static struct port_muxer_table const *port_muxer_table_get(struct port_muxer_list *muxers)
+{
+    struct port_muxer_table *table = muxers->table;
+    if (likely_(table && table->version == muxers->version)) return table;
+
+    // Someone owning the lock is changing the list or already rebuilding the table: do without it meanwhile
+    if (0 != pthread_mutex_trylock(&muxers->mutex.mutex)) return NULL;
+
+    table = muxers->table;
+    if (! table || table->version != muxers->version) {
+        struct port_muxer_table *new = port_muxer_table_new(muxers);
+        if (new) {
+            __sync_synchronize();   // new must be complete before being visible
+            muxers->table = new;
+            if (table) unref(&table->ref);  // lookups may still be reading it
+        }
+        table = new;
+    }
+    mutex_unlock(&muxers->mutex);
+
+    return table;
+}
+
 void port_muxer_list_ctor(struct port_muxer_list *muxers, char const *name)
 {
     mutex_ctor(&muxers->mutex, name);
     TAILQ_INIT(&muxers->muxers);
+    muxers->version = 0;
+    muxers->table = NULL;
 }
 
 void port_muxer_list_dtor(struct port_muxer_list *muxers)
@@ -39,6 +133,10 @@ void port_muxer_list_dtor(struct port_muxer_list *muxers)
     if (! TAILQ_EMPTY(&muxers->muxers)) {
         SLOG(LOG_WARNING, "A protocol is still using destructed port muxer. We're going to crash if this user unsubscribe.");
     }
+    if (muxers->table) {
+        port_muxer_table_del(muxers->table);
+        muxers->table = NULL;
+    }
     mutex_dtor(&muxers->mutex);
 }
 
@@ -68,6 +166,7 @@ void port_muxer_ctor(struct port_muxer *muxer, struct port_muxer_list *muxers, u
     SLOG(LOG_DEBUG, "  at the end of port muxers list");
     TAILQ_INSERT_TAIL(&muxers->muxers, muxer, entry);
 inserted:
+    muxers->version ++;
     mutex_unlock(&muxers->mutex);
 }
 
@@ -76,6 +175,7 @@ void port_muxer_dtor(struct port_muxer *muxer, struct port_muxer_list *muxers)
     SLOG(LOG_DEBUG, "Removing proto %s for ports between %"PRIu16" and %"PRIu16, muxer->proto->name, muxer->port_min, muxer->port_max);
     mutex_lock(&muxers->mutex);
     TAILQ_REMOVE(&muxers->muxers, muxer, entry);
+    muxers->version ++;
     mutex_unlock(&muxers->mutex);
 }
 
@@ -104,6 +204,15 @@ static bool port_belongs_to_muxer(struct port_muxer const *muxer, uint16_t port)
 
 struct proto *port_muxer_find(struct port_muxer_list *muxers, uint16_t port1, uint16_t port2)
 {
+    struct port_muxer_table const *table = port_muxer_table_get(muxers);
+    if (likely_(table)) {
+        // The first muxer of the list any of these ports belongs to
+        unsigned m = table->first[port1];
+        unsigned const m2 = table->first[port2];
+        if (! m || (m2 && m2 < m)) m = m2;
+        return m ? table->protos[m-1] : NULL;
+    }
+
     struct port_muxer *muxer;
     mutex_lock(&muxers->mutex);
     TAILQ_FOREACH(muxer, &muxers->muxers, entry) {
@@ -167,11 +167,11 @@ static int pg_parser_ctor(struct pgsql_parser *pg_parser, struct proto *proto)
 
 static struct parser *pg_parser_new(struct proto *proto)
 {
-    struct pgsql_parser *pg_parser = objalloc_nice(sizeof(*pg_parser), "Pg parsers");
+    struct pgsql_parser *pg_parser = parser_alloc(proto, sizeof(*pg_parser), "Pg parsers");
     if (! pg_parser) return NULL;
 
     if (-1 == pg_parser_ctor(pg_parser, proto)) {
-        objfree(pg_parser);
+        parser_free(pg_parser);
         return NULL;
     }
 
@@ -188,7 +188,7 @@ static void pg_parser_del(struct parser *parser)
 {
     struct pgsql_parser *pg_parser = DOWNCAST(parser, parser, pgsql_parser);
     pg_parser_dtor(pg_parser);
-    objfree(pg_parser);
+    parser_free(pg_parser);
 }
 
 /*
@@ -756,7 +756,8 @@ void pgsql_init(void)
         .parser_new  = pg_parser_new,
         .parser_del  = pg_parser_del,
         .info_2_str  = sql_info_2_str,
-        .info_addr   = sql_info_addr
+        .info_addr   = sql_info_addr,
+        .parser_size = sizeof(struct pgsql_parser),
     };
     proto_ctor(&proto_pgsql_, &ops, "PostgreSQL", PROTO_CODE_PGSQL);
     port_muxer_ctor(&pg_tcp_muxer, &tcp_port_muxers, 5432, 5432, proto_pgsql);
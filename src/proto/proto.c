@@ -27,6 +27,8 @@
 #include "junkie/tools/hash.h"
 #include "junkie/tools/timeval.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/timebound.h"
+#include "junkie/tools/miscmacs.h"
 #include "junkie/proto/serialize.h"
 #include "junkie/proto/proto.h"
 #include "junkie/tools/mallocer.h"  // for overweight
@@ -65,8 +67,7 @@ void proto_ctor(struct proto *proto, struct proto_ops const *ops, char const *na
     proto->name = name;
     proto->enabled = true;
     proto->code = code;
-    proto->nb_frames = 0;
-    proto->nb_bytes = 0;
+    counters_ctor(&proto->counters);
     proto->fuzzed_times = 0;
     proto->nb_parsers = 0;
     hook_ctor(&proto->hook, name);
@@ -162,18 +163,11 @@ enum proto_parse_status proto_parse(struct parser *parser, struct proto_info *pa
 
     if (! go_deeper) return PROTO_OK;
 
-#   ifdef __GNUC__
-    (void)__sync_add_and_fetch(&parser->proto->nb_frames, 1);
-    (void)__sync_add_and_fetch(&parser->proto->nb_bytes, wire_len);
-#   else
-    mutex_lock(&parser->proto->lock);
-    parser->proto->nb_frames ++;
-    parser->proto->nb_bytes += wire_len;
-    mutex_unlock(&parser->proto->lock);
-#   endif
+    counters_add(&parser->proto->counters, PROTO_NB_FRAMES, 1);
+    counters_add(&parser->proto->counters, PROTO_NB_BYTES, wire_len);
 
-    SLOG(LOG_DEBUG, "Parse packet @%p, size %zu (%zu captured), #%"PRIu64" for %s",
-        packet, wire_len, cap_len, parser->proto->nb_frames, parser_name(parser));
+    SLOG(LOG_DEBUG, "Parse packet @%p, size %zu (%zu captured) for %s",
+        packet, wire_len, cap_len, parser_name(parser));
 
     if (unlikely_(nb_fuzzed_bits > 0)) fuzz(parser, packet, cap_len, nb_fuzzed_bits);
 
@@ -270,6 +264,62 @@ void const *proto_info_addr(struct proto_info const *info, size_t *size)
     return info;
 }
 
+// Tells if this info is kept when copying a stack, depth being its distance from the copied info
+static bool proto_info_kept(struct proto_info const *info, unsigned depth, unsigned nb_kept)
+{
+    return nb_kept == 0 || depth < nb_kept || ! info->parent;
+}
+
+static size_t proto_info_copy_size(struct proto_info const *info)
+{
+    size_t size;
+    (void)info->parser->proto->ops->info_addr(info, &size);
+    return CEIL_DIV(size, PROTO_INFO_ALIGN) * PROTO_INFO_ALIGN;
+}
+
+size_t proto_info_stack_size(struct proto_info const *info, unsigned nb_kept)
+{
+    size_t tot_size = 0;
+    for (unsigned depth = 0; info; info = info->parent, depth++) {
+        if (proto_info_kept(info, depth, nb_kept)) tot_size += proto_info_copy_size(info);
+    }
+    return tot_size;
+}
+
+/* Notice that normaly the pointer to parser is not a counted ref since proto_infos are
+ * build on the stack, but for our copies on the heap we need a proper ref. */
+struct proto_info *proto_info_stack_copy(struct proto_info const *info, void *block, unsigned nb_kept)
+{
+    struct proto_info *copy_info = NULL;
+    struct proto_info **prev_parent = &copy_info;
+    char *copy = block;
+
+    for (unsigned depth = 0; info; info = info->parent, depth++) {
+        if (! proto_info_kept(info, depth, nb_kept)) continue;
+        size_t size;
+        void const *start = info->parser->proto->ops->info_addr(info, &size);
+        memcpy(copy, start, size);
+        struct proto_info *const c = (struct proto_info *)(copy + ((char const *)info - (char const *)start));
+        c->parser = parser_ref(info->parser);
+        c->parent = NULL;
+        *prev_parent = c;
+        prev_parent = &c->parent;
+        copy += CEIL_DIV(size, PROTO_INFO_ALIGN) * PROTO_INFO_ALIGN;
+    }
+
+    return copy_info;
+}
+
+void proto_info_stack_release(struct proto_info *info)
+{
+    while (info) {
+        struct proto_info *const parent = info->parent;
+        parser_unref(&info->parser);
+        info->parent = NULL;
+        info = parent;
+    }
+}
+
 char const *proto_info_2_str(struct proto_info const *info)
 {
     char *str = tempstr();
@@ -277,10 +327,73 @@ char const *proto_info_2_str(struct proto_info const *info)
     return str;
 }
 
+/*
+ * Flow blocks
+ *
+ * A flow block is allocated by mux_subparser_and_parser_new() to hold both
+ * the subparser and its child parser, which are carved out of it (see objalloc_carve()).
+ * Its size is given by the protos at registration (see proto_ops.parser_size and
+ * mux_proto_ops.subparser_size); if one of them does not fit it's merely
+ * allocated on its own.
+ */
+
+struct flow_block {
+    size_t sub_size;            // Room reserved for the subparser (with its key)
+    size_t parser_size;         // Room reserved for the parser
+    bool sub_taken, parser_taken;
+    // Followed by the carved parts (subparser then parser)
+};
+
+// The flow block being built by this thread (see mux_subparser_and_parser_new())
+static __thread struct flow_block *flow_block;
+
+static struct flow_block *flow_block_new(size_t sub_size, size_t parser_size)
+{
+    struct flow_block *block = objalloc_carver(
+        sizeof(*block) + objalloc_carved_size(sub_size) + objalloc_carved_size(parser_size), "flow blocks");
+    if (! block) return NULL;
+    block->sub_size = sub_size;
+    block->parser_size = parser_size;
+    block->sub_taken = block->parser_taken = false;
+    return block;
+}
+
+static void *flow_block_take(struct flow_block *block, bool sub, size_t size)
+{
+    size_t offset = sizeof(*block);
+    if (sub) {
+        if (block->sub_taken || size > block->sub_size) return NULL;
+        block->sub_taken = true;
+    } else {
+        if (block->parser_taken || size > block->parser_size) return NULL;
+        block->parser_taken = true;
+        offset += objalloc_carved_size(block->sub_size);
+    }
+    return objalloc_carve(block, offset);
+}
+
+static void *flow_part_alloc(bool sub, size_t size, char const *requestor)
+{
+    void *part = flow_block ? flow_block_take(flow_block, sub, size) : NULL;
+    return part ? part : objalloc_nice(size, requestor);
+}
+
 /*
  * Parsers
  */
 
+void *parser_alloc(struct proto unused_ *proto, size_t size, char const *requestor)
+{
+    void *parser = flow_part_alloc(false, size, requestor);
+    if (unlikely_(! parser)) __sync_fetch_and_add(&denied_parsers, 1);
+    return parser;
+}
+
+void parser_free(void *parser)
+{
+    objfree(parser);
+}
+
 static void parser_del_as_ref(struct ref *ref)
 {
     struct parser *const parser = DOWNCAST(ref, ref, parser);
@@ -302,14 +415,11 @@ int parser_ctor(struct parser *parser, struct proto *proto)
 
 static struct parser *parser_new(struct proto *proto)
 {
-    struct parser *parser = objalloc_nice(sizeof(*parser), "parsers");
-    if (unlikely_(! parser)) {
-        __sync_fetch_and_add(&denied_parsers, 1);
-        return NULL;
-    }
+    struct parser *parser = parser_alloc(proto, sizeof(*parser), "parsers");
+    if (unlikely_(! parser)) return NULL;
 
     if (unlikely_(0 != parser_ctor(parser, proto))) {
-        objfree(parser);
+        parser_free(parser);
         return NULL;
     }
 
@@ -326,7 +436,7 @@ void parser_dtor(struct parser *parser)
 static void parser_del(struct parser *parser)
 {
     parser_dtor(parser);
-    objfree(parser);
+    parser_free(parser);
 }
 
 struct parser *parser_ref(struct parser *parser)
@@ -447,7 +557,7 @@ static void mux_subparser_deindex_locked(struct mux_subparser *subparser)
     mutex_unlock(&subparser->mux_proto->proto.lock);
 #   endif
     STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
-    TAILQ_REMOVE(&to_list->timeout_queue, subparser, to_entry);
+    wheel_del(&to_list->timeouts, &subparser->to_timer);
     subparser->h_idx = NOT_HASHED;
     unref(&subparser->ref);
 }
@@ -477,11 +587,16 @@ void mux_subparser_deindex(struct mux_subparser *subparser)
 // Caller must own subparsers mutex
 static void mux_subparser_index(struct mux_subparser *subparser)
 {
-    // Insert the subparser into its mux_parser hash and into the timeout_queue
+    // Insert the subparser into its mux_parser hash and into the timing wheel
     struct subparsers *const h_list = h_list_of_subparser(subparser);
     struct per_mutex *const to_list = to_list_of_subparser(subparser);
-    STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry); // most used first
-    TAILQ_INSERT_TAIL(&to_list->timeout_queue, subparser, to_entry); // most used last
+    /* Lookups walk the h_list without the mutex, so the subparser must be fully
+     * linked before being published at the head of the list. */
+    STAILQ_NEXT(subparser, h_entry) = STAILQ_FIRST(&h_list->list);
+    if (! STAILQ_NEXT(subparser, h_entry)) h_list->list.stqh_last = &STAILQ_NEXT(subparser, h_entry);
+    __sync_synchronize();
+    STAILQ_FIRST(&h_list->list) = subparser;    // most recently created first
+    wheel_add(&to_list->timeouts, &subparser->to_timer, subparser->last_used + 1);
     // inc nb_children
 #   if __GNUC__
     (void)__sync_fetch_and_add(&subparser->mux_parser->nb_children, 1);
@@ -506,7 +621,7 @@ void mux_subparser_dtor(struct mux_subparser *subparser)
 void mux_subparser_del(struct mux_subparser *subparser)
 {
     mux_subparser_dtor(subparser);
-    objfree(subparser);
+    mux_subparser_free(subparser);
 }
 
 // Caller must own subparsers mutex
@@ -520,7 +635,7 @@ static bool too_many_children(struct mux_parser *mux_parser)
 // Caller must own list->mutex
 static void try_sacrifice_child(struct mux_proto *mux_proto, struct subparsers *h_list)
 {
-    struct mux_subparser *subparser = STAILQ_LAST(&h_list->list, mux_subparser, h_entry);    // killing the least recently used child
+    struct mux_subparser *subparser = STAILQ_LAST(&h_list->list, mux_subparser, h_entry);    // killing the oldest child
     if (! subparser) return;    // empty
 
     SLOG(LOG_DEBUG, "Too many children, killing %s", mux_subparser_name(subparser));
@@ -538,35 +653,73 @@ static void try_sacrifice_child(struct mux_proto *mux_proto, struct subparsers *
 
 static unsigned hash_key(void const *key, size_t key_sz, unsigned hash_size)
 {
-    return hashfun(key, key_sz) % hash_size;
+    return HASH_IDX(hashfun(key, key_sz), hash_size);
 }
 
-// Caller must own list->mutex
-static unsigned mux_subparsers_timeout(struct mux_proto *mux_proto, struct per_mutex *to_list, unsigned const timeout_s, time_t const last_used)
+struct mux_timeout_ctx {
+    struct per_mutex *to_list;
+    time_t now;
+    unsigned timeout_s;
+    bool kill_all;
+    unsigned count;
+};
+
+// Called with the list mutex for each subparser which timer fired
+static void mux_subparser_timer_cb(struct wheel_timer *timer, void *ctx_)
 {
-    if (0 == timeout_s) return 0;
+    struct mux_timeout_ctx *ctx = ctx_;
+    struct mux_subparser *subparser = DOWNCAST(timer, to_timer, mux_subparser);
 
-    // Beware that deletion of a subparser can lead to the creation of new parsers !
-    struct mux_subparser *subparser;
-    unsigned count = 0;
-    while (NULL != (subparser = TAILQ_FIRST(&to_list->timeout_queue))) {
-        // As parsers are sorted by last_used time (least recently used first in the timeout_queue),
-        // we can stop scanning as soon as we met a survivor.
-        if (likely_(!overweight) && likely_(last_used - subparser->last_used.tv_sec <= timeout_s)) break;
+    /* Lookups merely update last_used so the subparser may have been used since its
+     * timer was armed, in which case we just arm it again.
+     * Notice that a last_used in the future counts as expired (the clock went
+     * backward, for instance when several pcap files are replayed). */
+    if (likely_(! ctx->kill_all) && (uint64_t)(ctx->now - subparser->last_used) <= ctx->timeout_s) {
+        wheel_add(&ctx->to_list->timeouts, timer, subparser->last_used + 1);
+        return;
+    }
 
-        SLOG(LOG_DEBUG, "Timeouting subparser %s", mux_subparser_name(subparser));
-        mux_subparser_deindex_locked(subparser);
+    SLOG(LOG_DEBUG, "Timeouting subparser %s", mux_subparser_name(subparser));
+    mux_subparser_deindex_locked(subparser);
+    ctx->count ++;
+}
+
+// Max number of timers we fire while holding a list mutex
+#define MUX_TIMEOUT_BATCH 1000
+
+// Caller must own list->mutex. Returns the number of fired timers.
+static unsigned mux_subparsers_timeout(struct mux_proto *mux_proto, struct per_mutex *to_list, unsigned const timeout_s, time_t const now, unsigned *count)
+{
+    if (0 == timeout_s) return 0;
+    if (now <= (time_t)timeout_s) return 0;
 
-        count ++;
+    // Beware that deletion of a subparser can lead to the creation of new parsers !
+    struct mux_timeout_ctx ctx = {
+        .to_list = to_list,
+        .now = now,
+        .timeout_s = timeout_s,
+        .kill_all = overweight,
+        .count = 0,
+    };
+    uint64_t const limit = now - timeout_s;  // subparsers last used before that must die
+    unsigned nb_fired;
+
+    if (unlikely_(overweight)) {
+        // We want to get rid of everything
+        nb_fired = wheel_reset(&to_list->timeouts, limit + 1, mux_subparser_timer_cb, &ctx);
+    } else {
+        // Tolerate the clock going backward by less than the timeout
+        nb_fired = wheel_timeout(&to_list->timeouts, limit, (uint64_t)now + timeout_s, MUX_TIMEOUT_BATCH, mux_subparser_timer_cb, &ctx);
     }
 
 #   ifdef __GNUC__
-    (void)__sync_add_and_fetch(&mux_proto->nb_timeouts, count);
+    (void)__sync_add_and_fetch(&mux_proto->nb_timeouts, ctx.count);
 #   else    // well, don't put to much trust in this then
-    mux_proto->nb_timeouts += count;
+    mux_proto->nb_timeouts += ctx.count;
 #   endif
 
-    return count;
+    *count += ctx.count;
+    return nb_fired;
 }
 
 static void mux_subparser_del_as_ref(struct ref *ref)
@@ -587,7 +740,8 @@ int mux_subparser_ctor(struct mux_subparser *subparser, struct mux_parser *mux_p
     subparser->requestor = requestor;
     subparser->mux_parser = mux_parser; // backlink
     subparser->mux_proto = mux_proto;   // another backlink, see mux_subparser_del_as_ref().
-    subparser->last_used = *now;
+    subparser->last_used = now->tv_sec;
+    wheel_timer_ctor(&subparser->to_timer);
     memcpy(subparser->key, key, mux_proto->key_size);
     ref_ctor(&subparser->ref, mux_subparser_del_as_ref);
 
@@ -611,11 +765,16 @@ int mux_subparser_ctor(struct mux_subparser *subparser, struct mux_parser *mux_p
 void *mux_subparser_alloc(struct mux_parser *mux_parser, size_t size_without_key)
 {
     struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
-    void *subparser = objalloc_nice(size_without_key + mux_proto->key_size, "subparsers");
+    void *subparser = flow_part_alloc(true, size_without_key + mux_proto->key_size, "subparsers");
     if (unlikely_(! subparser)) __sync_fetch_and_add(&denied_parsers, 1);
     return subparser;
 }
 
+void mux_subparser_free(void *subparser)
+{
+    objfree(subparser);
+}
+
 // Creates the subparser _and_ the parser, returns a ref on the subparser
 struct mux_subparser *mux_subparser_new(struct mux_parser *mux_parser, struct parser *child,
         struct proto *requestor, void const *key, struct timeval const *now)
@@ -624,7 +783,7 @@ struct mux_subparser *mux_subparser_new(struct mux_parser *mux_parser, struct pa
     if (unlikely_(! subparser)) return NULL;
 
     if (0 != mux_subparser_ctor(subparser, mux_parser, child, requestor, key, now)) {
-        objfree(subparser);
+        mux_subparser_free(subparser);
         return NULL;
     }
 
@@ -646,28 +805,38 @@ void mux_subparser_unref(struct mux_subparser **subparser)
 
 struct mux_subparser *mux_subparser_and_parser_new(struct mux_parser *mux_parser, struct proto *proto, struct proto *requestor, void const *key, struct timeval const *now)
 {
+    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
+
+    // Allocate the subparser and the parser together if we know their size
+    struct flow_block *const prev_block = flow_block;   // in case a parser_new() creates subparsers
+    struct flow_block *block = NULL;
+    if (mux_proto->ops.subparser_size > 0 && proto->ops->parser_size > 0) {
+        block = flow_block_new(mux_proto->ops.subparser_size + mux_proto->key_size, proto->ops->parser_size);
+    }
+    flow_block = block;
+
+    struct mux_subparser *subparser = NULL;
     struct parser *child = proto->ops->parser_new(proto);
-    if (unlikely_(! child)) return NULL;
+    if (likely_(child)) {
+        subparser = mux_proto->ops.subparser_new(mux_parser, child, requestor, key, now);
+        parser_unref(&child);    // whatever the outcome, no need to keep this anymore
+    }
 
-    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
-    struct mux_subparser *subparser = mux_proto->ops.subparser_new(mux_parser, child, requestor, key, now);
-    parser_unref(&child);    // whatever the outcome, no need to keep this anymore
+    flow_block = prev_block;
+    if (block) objfree(block);  // frees it if it was not used
 
     return subparser;
 }
 
-struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct proto *create_proto, struct proto *requestor, void const *key, struct timeval const *now)
+// Walk the h_list for the key. Works with or without the list mutex (see mux_subparser_index())
+static struct mux_subparser *mux_subparser_find(struct mux_proto *mux_proto, struct subparsers *h_list, struct proto *create_proto, void const *key, unsigned *nb_colls)
 {
-    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
-    unsigned h = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
-    struct mutex *mutex = mutex_of_h_idx(mux_parser, h);
-    struct subparsers *h_list = h_list_of_h_idx(mux_parser, h);
-
-    mutex_lock(mutex);
-
-    unsigned nb_colls = 0;
     struct mux_subparser *subparser;
-    STAILQ_FOREACH(subparser, &h_list->list, h_entry) {
+    for (
+        subparser = *(struct mux_subparser *volatile *)&STAILQ_FIRST(&h_list->list);
+        subparser;
+        subparser = *(struct mux_subparser *volatile *)&STAILQ_NEXT(subparser, h_entry)
+    ) {
         if (
             // Various kind of subparsers might have the same key so we should include proto in any case,
             // whether or not we intend to create the child if not found (ie. use another flag for that).
@@ -678,18 +847,52 @@ struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct
         ) {
             break;
         }
-        nb_colls ++;
+        (*nb_colls) ++;
+    }
+
+    return subparser;
+}
+
+void mux_subparser_touch(struct mux_subparser *subparser, struct timeval const *now)
+{
+    /* Recency is merely recorded with a timestamp, that the timeouter will
+     * use later on. Avoid writing the same value over and over in these shared
+     * cache lines. */
+    if (subparser->last_used != now->tv_sec) subparser->last_used = now->tv_sec;
+    struct mux_proto *mux_proto = subparser->mux_proto;
+    if (mux_proto->last_used != now->tv_sec) mux_proto->last_used = now->tv_sec;  // give time to timeouter thread (no need to lock as long as writting a time_t is atomic)
+}
+
+struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct proto *create_proto, struct proto *requestor, void const *key, struct timeval const *now)
+{
+    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
+    unsigned h = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
+    struct subparsers *h_list = h_list_of_h_idx(mux_parser, h);
+
+    // First try without the lock, which is the most common case
+    unsigned nb_colls = 0;
+    struct mux_subparser *subparser = mux_subparser_find(mux_proto, h_list, create_proto, key, &nb_colls);
+    if (subparser) {
+        // It may have been deindexed (or even unrefed) since, or its key changed under our feet
+        subparser = ref_unless_zero(&subparser->ref);
+        if (subparser && (
+            unlikely_((unsigned volatile)subparser->h_idx != h) ||
+            unlikely_(0 != memcmp(subparser->key, key, mux_proto->key_size))
+        )) {
+            mux_subparser_unref(&subparser);
+        }
     }
 
-    if (subparser && now) {
-        /* Promote this children both to the head of the h_list (for performance)
-         * and the tail of the timeout_queue (since it is used). */
-        subparser->last_used = *now;
-        struct per_mutex *const to_list = to_list_of_subparser(subparser);
-        TAILQ_REMOVE(&to_list->timeout_queue, subparser, to_entry);
-        TAILQ_INSERT_TAIL(&to_list->timeout_queue, subparser, to_entry);
-        STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
-        STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry);
+    if (! subparser) {
+        /* Then look again with the lock, since a subparser that is changing its key
+         * might have led us astray. */
+        struct mutex *mutex = mutex_of_h_idx(mux_parser, h);
+        mutex_lock(mutex);
+        nb_colls = 0;
+        subparser = mux_subparser_find(mux_proto, h_list, create_proto, key, &nb_colls);
+        // get a new ref on the subparser for our caller (*before* releasing the mutex!)
+        if (subparser) subparser = ref(&subparser->ref);
+        mutex_unlock(mutex);
     }
 
     if (nb_colls > 8) {
@@ -703,22 +906,16 @@ struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct
 #       endif
     }
 
-    // get a new ref on the subparser for our caller (*before* releasing the mutex!)
-    if (subparser) subparser = ref(&subparser->ref);
-
-    mutex_unlock(mutex);
-
-    mux_proto->last_used = now->tv_sec;  // give time to timeouter thread (no need to lock as long as writting a time_t is atomic)
+    if (now) {
+        if (subparser) {
+            mux_subparser_touch(subparser, now);
+        } else if (mux_proto->last_used != now->tv_sec) {
+            mux_proto->last_used = now->tv_sec;
+        }
+    }
 
-#   ifdef __GNUC__
-    (void)__sync_add_and_fetch(&mux_proto->nb_lookups, 1);
-    (void)__sync_add_and_fetch(&mux_proto->nb_collisions, nb_colls);
-#   else
-    mutex_lock(&mux_proto->proto.lock);
-    mux_proto->nb_lookups ++;
-    mux_proto->nb_collisions += nb_colls;
-    mutex_unlock(&mux_proto->proto.lock);
-#   endif
+    counters_add(&mux_proto->proto.counters, MUX_NB_LOOKUPS, 1);
+    if (nb_colls) counters_add(&mux_proto->proto.counters, MUX_NB_COLLISIONS, nb_colls);
 
     if (subparser || ! create_proto) return subparser;
 
@@ -848,17 +1045,15 @@ void mux_proto_ctor(struct mux_proto *mux_proto, struct proto_ops const *ops, st
 {
     proto_ctor(&mux_proto->proto, ops, name, code);
     mux_proto->ops = *mux_ops;
-    mux_proto->hash_size = hash_size;
+    mux_proto->hash_size = hash_pow2(hash_size);
     mux_proto->key_size = key_size;
     mux_proto->nb_max_children = 0;
     mux_proto->nb_infanticide = 0;
-    mux_proto->nb_collisions = 0;
-    mux_proto->nb_lookups = 0;
     mux_proto->nb_timeouts = 0;
     mux_proto->last_used = 0;
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
         mutex_ctor_recursive(&mux_proto->mutexes[m].mutex, "subparsers");
-        TAILQ_INIT(&mux_proto->mutexes[m].timeout_queue);
+        wheel_ctor(&mux_proto->mutexes[m].timeouts, 0);
     }
     LIST_INSERT_HEAD(&mux_protos, mux_proto, entry);
 }
@@ -868,53 +1063,49 @@ void mux_proto_dtor(struct mux_proto *mux_proto)
     LIST_REMOVE(mux_proto, entry);
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
         mutex_dtor(&mux_proto->mutexes[m].mutex);
-        if (! TAILQ_EMPTY(&mux_proto->mutexes[m].timeout_queue)) {
-            struct mux_subparser *subparser;
-            int left_parsers = 0;
-            TAILQ_FOREACH(subparser, &mux_proto->mutexes[m].timeout_queue, to_entry) left_parsers++;
-            SLOG(LOG_NOTICE, "While destructing proto %s, timeout_queue %u not empty (%d parsers left)",
-                    mux_proto->proto.name, m, left_parsers);
+        if (mux_proto->mutexes[m].timeouts.count > 0) {
+            SLOG(LOG_NOTICE, "While destructing proto %s, timing wheel %u not empty (%u parsers left)",
+                    mux_proto->proto.name, m, mux_proto->mutexes[m].timeouts.count);
         }
+        wheel_dtor(&mux_proto->mutexes[m].timeouts);
     }
     proto_dtor(&mux_proto->proto);
 }
 
 struct mux_proto_ops mux_proto_ops = {
-    .subparser_new = mux_subparser_new,
-    .subparser_del = mux_subparser_del,
+    .subparser_new  = mux_subparser_new,
+    .subparser_del  = mux_subparser_del,
+    .subparser_size = sizeof(struct mux_subparser),
 };
 
-static pthread_t timeouter_pth;
+static struct timebound_ticker mux_timeouter;
 
 static void mux_proto_timeout(struct mux_proto *mux_proto)
 {
     unsigned count = 0;
 
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
-        enter_mono_region();
-        mutex_lock(&mux_proto->mutexes[m].mutex);
-        count += mux_subparsers_timeout(mux_proto, mux_proto->mutexes+m, mux_timeout, mux_proto->last_used /* safe here */);
-        mutex_unlock(&mux_proto->mutexes[m].mutex);
-        leave_protected_region();
+        // Fire the timers by small batches so that we never hold the lock for long
+        unsigned nb_fired;
+        do {
+            enter_mono_region();
+            mutex_lock(&mux_proto->mutexes[m].mutex);
+            nb_fired = mux_subparsers_timeout(mux_proto, mux_proto->mutexes+m, mux_timeout, mux_proto->last_used /* safe here */, &count);
+            mutex_unlock(&mux_proto->mutexes[m].mutex);
+            leave_protected_region();
+        } while (nb_fired >= MUX_TIMEOUT_BATCH);
     }
 
     SLOG(count > 0 ? LOG_INFO:LOG_DEBUG, "Timeouted %u subparsers of proto %s", count, mux_proto->proto.name);
 }
 
-static void *timeouter_thread(void unused_ *dummy)
+// Run every second by the timebounder thread
+static void mux_timeouter_tick(struct timebound_ticker unused_ *ticker)
 {
-    set_thread_name("J-timeouter");
-    disable_cancel();
-
-    while (1) {
-        struct mux_proto *mux_proto;
-        LIST_FOREACH(mux_proto, &mux_protos, entry) {
-            mux_proto_timeout(mux_proto);
-        }
-
-        cancellable_sleep(1);
+    struct mux_proto *mux_proto;
+    LIST_FOREACH(mux_proto, &mux_protos, entry) {
+        mux_proto_timeout(mux_proto);
     }
-    return NULL;
 }
 
 /*
@@ -1009,8 +1200,8 @@ static SCM g_mux_proto_stats(SCM name_)
         scm_cons(hash_size_sym,       scm_from_uint(mux_proto->hash_size)),
         scm_cons(nb_max_children_sym, scm_from_uint(mux_proto->nb_max_children)),
         scm_cons(nb_infanticide_sym,  scm_from_uint64(mux_proto->nb_infanticide)),
-        scm_cons(nb_collisions_sym,   scm_from_uint64(mux_proto->nb_collisions)),
-        scm_cons(nb_lookups_sym,      scm_from_uint64(mux_proto->nb_lookups)),
+        scm_cons(nb_collisions_sym,   scm_from_uint64(counters_read(&mux_proto->proto.counters, MUX_NB_COLLISIONS))),
+        scm_cons(nb_lookups_sym,      scm_from_uint64(counters_read(&mux_proto->proto.counters, MUX_NB_LOOKUPS))),
         scm_cons(nb_timeouts_sym,     scm_from_uint64(mux_proto->nb_timeouts)),
         SCM_UNDEFINED);
     return alist;
@@ -1030,8 +1221,8 @@ static SCM g_proto_stats(SCM name_)
 
     return scm_list_5(
         scm_cons(enabled_sym,    scm_from_bool(proto->enabled)),
-        scm_cons(nb_frames_sym,  scm_from_int64(proto->nb_frames)),
-        scm_cons(nb_bytes_sym,   scm_from_int64(proto->nb_bytes)),
+        scm_cons(nb_frames_sym,  scm_from_int64(counters_read(&proto->counters, PROTO_NB_FRAMES))),
+        scm_cons(nb_bytes_sym,   scm_from_int64(counters_read(&proto->counters, PROTO_NB_BYTES))),
         scm_cons(nb_parsers_sym, scm_from_uint(proto->nb_parsers)),
         scm_cons(nb_fuzzed_sym,  scm_from_uint(proto->fuzzed_times)));
 }
@@ -1056,11 +1247,11 @@ static SCM g_mux_proto_set_hash_size(SCM name_, SCM hash_size_)
     struct mux_proto *mux_proto = mux_proto_of_scm_name(name_);
     if (! mux_proto) return SCM_UNSPECIFIED;
 
-    unsigned const hash_size = scm_to_uint(hash_size_);
+    unsigned const hash_size = hash_pow2(scm_to_uint(hash_size_));
     mutex_lock(&mux_proto->proto.lock);
     mux_proto->hash_size = hash_size;
-    mux_proto->nb_collisions = 0;
-    mux_proto->nb_lookups = 0;
+    counters_reset(&mux_proto->proto.counters, MUX_NB_COLLISIONS);
+    counters_reset(&mux_proto->proto.counters, MUX_NB_LOOKUPS);
     mutex_unlock(&mux_proto->proto.lock);
 
     return SCM_BOOL_T;
@@ -1089,11 +1280,9 @@ void proto_init(void)
 
     hook_ctor(&pkt_hook, "pkt hook");
 
-    // A thread to timeout all mux_subparsers
-    int err = pthread_create(&timeouter_pth, NULL, timeouter_thread, NULL);
-    if (err) {
-        SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
-    }
+    // Timeout all mux_subparsers every second
+    timebound_init();
+    timebound_ticker_ctor(&mux_timeouter, "timeout mux subparsers", mux_timeouter_tick);
 
     hash_size_sym       = scm_permanent_object(scm_from_latin1_symbol("hash-size"));
     nb_max_children_sym = scm_permanent_object(scm_from_latin1_symbol("nb-max-children"));
@@ -1137,6 +1326,7 @@ void proto_init(void)
     ext_function_ctor(&sg_mux_proto_set_hash_size,
         "set-mux-hash-size", 2, 0, 0, g_mux_proto_set_hash_size,
         "(set-mux-hash-size \"proto-name\" n): sets the hash size for newly created parsers of this protocol.\n"
+        "n is rounded up to the next power of 2.\n"
         "Beware of max allowed childrens whenever you change this value.\n"
         "See also (? 'set-max-children) for setting the max number of allowed child for newly created parsers of a protocol.\n"
         "         (? 'mux-names) for a list of protocol names that are multiplexers.\n");
@@ -1152,9 +1342,7 @@ void proto_init(void)
 
 void proto_fini(void)
 {
-    SLOG(LOG_DEBUG, "Terminating timeouter thread...");
-    (void)pthread_cancel(timeouter_pth);
-    (void)pthread_join(timeouter_pth, NULL);
+    timebound_ticker_dtor(&mux_timeouter);
 
 #   ifdef DELETE_ALL_AT_EXIT
     hook_dtor(&pkt_hook);
@@ -1165,6 +1353,7 @@ void proto_fini(void)
     ext_param_mux_timeout_fini();
     ext_param_nb_fuzzed_bits_fini();
     log_category_proto_fini();
+    timebound_fini();
     mutex_fini();
     bench_fini();
 }
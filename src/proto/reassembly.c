@@ -0,0 +1,116 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2014, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <assert.h>
+#include "junkie/tools/ext.h"
+#include "junkie/tools/log.h"
+#include "junkie/proto/reassembly.h"
+
+#undef LOG_CAT
+#define LOG_CAT reassembly_log_category
+
+LOG_CATEGORY_DEF(reassembly);
+
+static unsigned reassembly_budget = 512;
+EXT_PARAM_RW(reassembly_budget, "reassembly-budget", uint, "Max number of megabytes kept by all the waiting lists and streambufs (0 for no limit).")
+
+// Statistics (read without lock)
+static size_t held;             // what's currently taken from the budget
+static size_t held_peak;        // max value reached by held (not protected, don't care)
+static uint64_t nb_denied;      // number of requests that would have exceeded the budget
+static uint64_t nb_evicted;     // number of holders forced to release their memory
+static uint64_t evicted_bytes;  // how much memory they released
+
+static size_t budget_bytes(void)
+{
+    return (size_t)reassembly_budget << 20;
+}
+
+bool reassembly_take(size_t size)
+{
+    size_t const budget = budget_bytes();
+    size_t const new_held = __sync_add_and_fetch(&held, size);
+    if (budget && new_held > budget) {
+        (void)__sync_sub_and_fetch(&held, size);
+        (void)__sync_add_and_fetch(&nb_denied, 1);
+        SLOG(LOG_DEBUG, "Cannot keep %zu more bytes for reassembly (%zu already kept)", size, new_held - size);
+        return false;
+    }
+    if (new_held > held_peak) held_peak = new_held;
+    return true;
+}
+
+void reassembly_give(size_t size)
+{
+    assert(held >= size);
+    (void)__sync_sub_and_fetch(&held, size);
+}
+
+size_t reassembly_excess(void)
+{
+    size_t const soft = budget_bytes() / 4 * 3;
+    size_t const h = held;  // no need for atomicity for this usage
+    return soft && h > soft ? h - soft : 0;
+}
+
+void reassembly_evicted(size_t size)
+{
+    (void)__sync_add_and_fetch(&nb_evicted, 1);
+    (void)__sync_add_and_fetch(&evicted_bytes, size);
+}
+
+/*
+ * Extensions
+ */
+
+static struct ext_function sg_reassembly_stats;
+static SCM g_reassembly_stats(void)
+{
+    return scm_list_5(
+        scm_cons(scm_from_latin1_symbol("held"),          scm_from_size_t(held)),
+        scm_cons(scm_from_latin1_symbol("peak"),          scm_from_size_t(held_peak)),
+        scm_cons(scm_from_latin1_symbol("denied"),        scm_from_uint64(nb_denied)),
+        scm_cons(scm_from_latin1_symbol("evicted"),       scm_from_uint64(nb_evicted)),
+        scm_cons(scm_from_latin1_symbol("evicted-bytes"), scm_from_uint64(evicted_bytes)));
+}
+
+static unsigned inited;
+void reassembly_init(void)
+{
+    if (inited++) return;
+    ext_init();
+    log_category_reassembly_init();
+    ext_param_reassembly_budget_init();
+
+    ext_function_ctor(&sg_reassembly_stats,
+        "reassembly-stats", 0, 0, 0, g_reassembly_stats,
+        "(reassembly-stats): get the memory currently kept by the waiting lists and streambufs,\n"
+        "the peak value, how many times a packet or a buffer could not be kept because of the budget,\n"
+        "and how many waiting lists were forced to release their packets (and how much memory they released).\n"
+        "See also (? 'reassembly-budget).\n");
+}
+
+void reassembly_fini(void)
+{
+    if (--inited) return;
+    ext_param_reassembly_budget_fini();
+    log_category_reassembly_fini();
+    ext_fini();
+}
@@ -350,35 +350,30 @@ static void conntrack_via(struct sip_proto_info const *info, struct timeval cons
     (void)cnxtrack_ip_new(info->via.protocol, &info->via.addr, info->via.port, ADDR_UNKNOWN, PORT_UNKNOWN, false /* only one cnx */, proto_sip, now, NULL);
 }
 
-static enum proto_parse_status sip_parse(struct parser *parser, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
-{
-    static struct httper_command const commands[] = {
-        [SIP_CMD_REGISTER] = { STRING_AND_LEN("REGISTER"), sip_set_command },
-        [SIP_CMD_INVITE] =   { STRING_AND_LEN("INVITE"),   sip_set_command },
-        [SIP_CMD_ACK] =      { STRING_AND_LEN("ACK"),      sip_set_command },
-        [SIP_CMD_CANCEL] =   { STRING_AND_LEN("CANCEL"),   sip_set_command },
-        [SIP_CMD_OPTIONS] =  { STRING_AND_LEN("OPTIONS"),  sip_set_command },
-        [SIP_CMD_BYE] =      { STRING_AND_LEN("BYE"),      sip_set_command },
-        [SIP_CMD_BYE+1] =    { STRING_AND_LEN("SIP/2.0"),  sip_set_response },
-    };
+static struct httper_command const commands[] = {
+    [SIP_CMD_REGISTER] = { STRING_AND_LEN("REGISTER"), sip_set_command },
+    [SIP_CMD_INVITE] =   { STRING_AND_LEN("INVITE"),   sip_set_command },
+    [SIP_CMD_ACK] =      { STRING_AND_LEN("ACK"),      sip_set_command },
+    [SIP_CMD_CANCEL] =   { STRING_AND_LEN("CANCEL"),   sip_set_command },
+    [SIP_CMD_OPTIONS] =  { STRING_AND_LEN("OPTIONS"),  sip_set_command },
+    [SIP_CMD_BYE] =      { STRING_AND_LEN("BYE"),      sip_set_command },
+    [SIP_CMD_BYE+1] =    { STRING_AND_LEN("SIP/2.0"),  sip_set_response },
+};
 
-    static struct httper_field const fields[] = {
-        { STRING_AND_LEN("content-length"), sip_extract_content_length },
-        { STRING_AND_LEN("content-type"),   sip_extract_content_type },
-        { STRING_AND_LEN("cseq"),           sip_extract_cseq },
-        { STRING_AND_LEN("call-id"),        sip_extract_callid },
-        { STRING_AND_LEN("from"),           sip_extract_from },
-        { STRING_AND_LEN("to"),             sip_extract_to },
-        { STRING_AND_LEN("via"),            sip_extract_via },
-    };
+static struct httper_field const fields[] = {
+    { STRING_AND_LEN("content-length"), sip_extract_content_length },
+    { STRING_AND_LEN("content-type"),   sip_extract_content_type },
+    { STRING_AND_LEN("cseq"),           sip_extract_cseq },
+    { STRING_AND_LEN("call-id"),        sip_extract_callid },
+    { STRING_AND_LEN("from"),           sip_extract_from },
+    { STRING_AND_LEN("to"),             sip_extract_to },
+    { STRING_AND_LEN("via"),            sip_extract_via },
+};
 
-    static struct httper const httper = {
-        .nb_commands = NB_ELEMS(commands),
-        .commands = commands,
-        .nb_fields = NB_ELEMS(fields),
-        .fields = fields
-    };
+static struct httper httper;   // lookup tables built at init
 
+static enum proto_parse_status sip_parse(struct parser *parser, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
+{
     SLOG(LOG_DEBUG, "Starting SIP analysis");
 
     /* Parse */
@@ -460,6 +455,7 @@ void sip_init(void)
     hash_init();
     mutex_ctor(&callids_2_sdps_mutex, "callids_2_sdps");
     HASH_INIT(&callids_2_sdps, 67, "SIP->SDP");
+    httper_ctor(&httper, NB_ELEMS(commands), commands, NB_ELEMS(fields), fields);
 
     static struct proto_ops const ops = {
         .parse       = sip_parse,
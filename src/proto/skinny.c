@@ -276,11 +276,11 @@ static int skinny_parser_ctor(struct skinny_parser *skinny_parser, struct proto
 
 static struct parser *skinny_parser_new(struct proto *proto)
 {
-    struct skinny_parser *skinny_parser = objalloc_nice(sizeof(*skinny_parser), "SKINNY parsers");
+    struct skinny_parser *skinny_parser = parser_alloc(proto, sizeof(*skinny_parser), "SKINNY parsers");
     if (! skinny_parser) return NULL;
 
     if (-1 == skinny_parser_ctor(skinny_parser, proto)) {
-        objfree(skinny_parser);
+        parser_free(skinny_parser);
         return NULL;
     }
 
@@ -299,7 +299,7 @@ static void skinny_parser_del(struct parser *parser)
 {
     struct skinny_parser *skinny_parser = DOWNCAST(parser, parser, skinny_parser);
     skinny_parser_dtor(skinny_parser);
-    objfree(skinny_parser);
+    parser_free(skinny_parser);
 }
 
 static void try_cnxtrack(struct skinny_parser *parser, struct timeval const *now)
@@ -501,7 +501,8 @@ void skinny_init(void)
         .parser_new  = skinny_parser_new,
         .parser_del  = skinny_parser_del,
         .info_2_str  = skinny_info_2_str,
-        .info_addr   = skinny_info_addr
+        .info_addr   = skinny_info_addr,
+        .parser_size = sizeof(struct skinny_parser),
     };
     proto_ctor(&proto_skinny_, &ops, "SKINNY", PROTO_CODE_SKINNY);
     port_muxer_ctor(&tcp_port_muxer, &tcp_port_muxers, SKINNY_PORT, SKINNY_PORT, proto_skinny);
@@ -23,6 +23,8 @@
 #include "junkie/tools/log.h"
 #include "junkie/tools/objalloc.h"
 #include "junkie/proto/streambuf.h"
+#include "junkie/proto/pkt_wait_list.h"
+#include "junkie/proto/reassembly.h"
 
 #undef LOG_CAT
 #define LOG_CAT streambuf_log_category
@@ -35,6 +37,41 @@ LOG_CATEGORY_DEF(streambuf);
 
 static struct mutex_pool streambuf_locks;
 
+/*
+ * Buffers
+ *
+ * Owned copies small enough are stored in the inline buffer of the streambuf
+ * (unless it's the current buffer, that we are copying from), which saves
+ * a malloc for most of the header fragments that are waiting for completion.
+ * Others are taken from the reassembly budget (see reassembly.h).
+ * Owned buffers may be larger than their content (see streambuf_append()), so
+ * alloc_size tells the actual size.
+ */
+
+static uint8_t *streambuf_alloc(struct streambuf_unidir *dir, size_t size, size_t *alloc_size)
+{
+    if (size <= sizeof(dir->inline_buf) && dir->buffer != dir->inline_buf) {
+        *alloc_size = sizeof(dir->inline_buf);
+        return dir->inline_buf;
+    }
+    if (! reassembly_take(size)) return NULL;
+    uint8_t *buf = objalloc_nice(size, "streambufs");
+    if (! buf) {
+        reassembly_give(size);
+        return NULL;
+    }
+    *alloc_size = size;
+    return buf;
+}
+
+static void streambuf_free(struct streambuf_unidir *dir)
+{
+    if (dir->buffer_is_malloced && dir->buffer != dir->inline_buf) {
+        reassembly_give(dir->alloc_size);
+        objfree((void*)dir->buffer);
+    }
+}
+
 /*
  * Construction
  */
@@ -46,6 +83,7 @@ int streambuf_ctor(struct streambuf *sbuf, parse_fun *parse, size_t max_size, st
     sbuf->parse = parse;
     sbuf->max_size = max_size;
     sbuf->mutex = mutex_pool_anyone(pool ? pool : &streambuf_locks);
+    flow_owner_ctor(&sbuf->owner);
 
     for (unsigned d = 0; d < 2; d++) {
         sbuf->dir[d].buffer = NULL;
@@ -54,6 +92,7 @@ int streambuf_ctor(struct streambuf *sbuf, parse_fun *parse, size_t max_size, st
         sbuf->dir[d].restart_offset = 0;
         sbuf->dir[d].wait_offset = 0;
         sbuf->dir[d].buffer_is_malloced = 0;
+        sbuf->dir[d].alloc_size = 0;
         timeval_reset(&sbuf->dir[d].last_received_tv);
     }
 
@@ -66,7 +105,7 @@ void streambuf_dtor(struct streambuf *sbuf)
 
     for (unsigned d = 0; d < 2; d++) {
         if (sbuf->dir[d].buffer) {
-            if (sbuf->dir[d].buffer_is_malloced) objfree((void*)sbuf->dir[d].buffer);
+            streambuf_free(sbuf->dir+d);
             sbuf->dir[d].buffer = NULL;
         }
     }
@@ -107,7 +146,7 @@ void streambuf_set_restart(struct streambuf *sbuf, unsigned way, uint8_t const *
 static void streambuf_empty(struct streambuf_unidir *dir)
 {
     if (dir->buffer) {
-        if (dir->buffer_is_malloced) objfree((void*)dir->buffer);
+        streambuf_free(dir);
         dir->buffer = NULL;
         dir->cap_len = 0;
         dir->wire_len = 0;
@@ -131,12 +170,15 @@ static enum proto_parse_status streambuf_shrink(struct streambuf *sbuf, unsigned
         }
         size_t uncap_bytes = wire_len - cap_len;
         size_t copied_bytes = MIN(sbuf->max_size, num_bytes - uncap_bytes);
-        uint8_t *new_buffer = objalloc_nice(copied_bytes, "streambufs");
+        size_t alloc_size;
+        uint8_t *new_buffer = streambuf_alloc(dir, copied_bytes, &alloc_size);
+        if (! new_buffer) return PROTO_PARSE_ERR;
         memcpy(new_buffer, packet + pkt_offset, copied_bytes);
-        if (dir->buffer_is_malloced) objfree((void*)dir->buffer);
+        streambuf_free(dir);
         dir->buffer = new_buffer;
         dir->cap_len = copied_bytes;
         dir->buffer_is_malloced = true;
+        dir->alloc_size = alloc_size;
         dir->restart_offset = 0;
         dir->wire_len = wire_len - pkt_offset;
         return PROTO_OK;
@@ -150,9 +192,11 @@ static enum proto_parse_status streambuf_append(struct streambuf *sbuf, unsigned
 {
     assert(way < 2);
     SLOG(LOG_DEBUG, "Append %zu bytes (%zu captured) to %s", wire_len, cap_len, streambuf_2_str(sbuf, way));
-    // Naive implementation : each time we add some bytes we realloc buffer
-    // FIXME: use a redim_array ?
-    // FIXME: better yet, rewrite everything using pkt-lists from end to end
+    /* We want the kept bytes followed by the new ones in a single buffer.
+     * If the buffer we own is large enough we merely move the kept bytes to its
+     * start and copy the new ones after them, otherwise we build a new buffer,
+     * twice as large as required (up to max_size) when we are accumulating, so
+     * that a message received in many packets is not copied over and over. */
 
     struct streambuf_unidir *dir = sbuf->dir+way;
     if (cap_len > 0) {
@@ -188,18 +232,30 @@ static enum proto_parse_status streambuf_append(struct streambuf *sbuf, unsigned
     SLOG(LOG_DEBUG, "Buffer keep size %zu, size_append %zu, keep initial %d, append pkt %d, new_size %zu, new_wire_len %zu",
             keep_size, size_append, keep_initial_buffer, append_pkt, new_size, new_wire_len);
     if (new_size > 0) {
-        uint8_t *new_buffer = objalloc_nice(new_size, "streambufs");
-        if (! new_buffer) return PROTO_PARSE_ERR;
-        if (keep_initial_buffer) {
-            SLOG(LOG_DEBUG, "Assemble kept buffer (%zu bytes) and new payload", keep_size);
-            memcpy(new_buffer, dir->buffer + dir->restart_offset, keep_size);
+        uint8_t *new_buffer;
+        if (dir->buffer_is_malloced && (size_t)new_size <= dir->alloc_size) {
+            SLOG(LOG_DEBUG, "Assemble kept buffer (%zu bytes) and new payload in place", keep_size);
+            new_buffer = (uint8_t *)dir->buffer;
+            if (keep_initial_buffer && dir->restart_offset > 0) {
+                memmove(new_buffer, dir->buffer + dir->restart_offset, keep_size);
+            }
+        } else {
+            size_t alloc_size = new_size;
+            if (keep_initial_buffer && append_pkt) alloc_size = MAX(alloc_size, MIN(2 * alloc_size, sbuf->max_size));
+            new_buffer = streambuf_alloc(dir, alloc_size, &alloc_size);
+            if (! new_buffer) return PROTO_PARSE_ERR;
+            if (keep_initial_buffer) {
+                SLOG(LOG_DEBUG, "Assemble kept buffer (%zu bytes) and new payload", keep_size);
+                memcpy(new_buffer, dir->buffer + dir->restart_offset, keep_size);
+            }
+            assert(dir->buffer);
+            streambuf_free(dir);
+            dir->alloc_size = alloc_size;
         }
         if (append_pkt) {
             ssize_t const max_copied_cap_len = MIN(sbuf->max_size - keep_size, cap_len);
             memcpy(new_buffer + keep_size, packet, max_copied_cap_len);
         }
-        assert(dir->buffer);
-        if (dir->buffer_is_malloced) objfree((void*)dir->buffer);
         dir->buffer = new_buffer;
         dir->cap_len = new_size;
         dir->buffer_is_malloced = true;
@@ -246,7 +302,8 @@ static int streambuf_keep(struct streambuf *sbuf, unsigned way)
     SLOG(LOG_DEBUG, "Keeping only %zu bytes of streambuf_unidir@%p", keep, dir);
 
     if (keep > 0) {
-        uint8_t *buf = objalloc_nice(keep, "streambufs");
+        size_t alloc_size;
+        uint8_t *buf = streambuf_alloc(dir, keep, &alloc_size);
         if (! buf) {
             dir->buffer = NULL; // never escape from here with buffer referencing a non malloced packet
             return -1;
@@ -254,6 +311,7 @@ static int streambuf_keep(struct streambuf *sbuf, unsigned way)
         memcpy(buf, dir->buffer + dir->restart_offset, keep);
         dir->buffer = buf;
         dir->buffer_is_malloced = true;
+        dir->alloc_size = alloc_size;
         dir->cap_len = keep;
         dir->wire_len -= dir->restart_offset;
         dir->restart_offset = 0;
@@ -286,7 +344,7 @@ enum proto_parse_status streambuf_add(struct streambuf *sbuf, struct parser *par
         unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now,
         size_t tot_cap_len, uint8_t const *tot_packet)
 {
-    mutex_lock(sbuf->mutex);
+    flow_lock(sbuf->mutex, &sbuf->owner);
 
     assert(way < 2);
     struct streambuf_unidir *dir = sbuf->dir+way;
@@ -311,7 +369,7 @@ enum proto_parse_status streambuf_add(struct streambuf *sbuf, struct parser *par
             SLOG(LOG_DEBUG, "Restart from the buffer with offset %zu", offset);
         } else if (offset_in_last_packet(dir, wire_len, cap_len)) {
             // Restart is after truncated packet but in the middle of current packet, we can parse
-            if (dir->buffer_is_malloced) objfree((void*)dir->buffer);
+            streambuf_free(dir);
             offset -= dir->wire_len - wire_len;
             SLOG(LOG_DEBUG, "We restart after %zu of the last packet (cap_len %zu, wire_len %zu) for %s, use packet on stack",
                     offset, cap_len, wire_len, streambuf_2_str(sbuf, way));
@@ -329,6 +387,8 @@ enum proto_parse_status streambuf_add(struct streambuf *sbuf, struct parser *par
             SLOG(LOG_DEBUG, "%s was totally parsed removing %zu from restart offset", streambuf_2_str(sbuf, way), dir->wire_len);
             dir->restart_offset -= dir->wire_len;
             streambuf_empty(dir);
+            // Whoever gave us these bytes need not wait for the ones we are going to skip
+            pkt_wait_list_skip(parser, dir->restart_offset);
             goto quit;
         }
 
@@ -384,7 +444,7 @@ quit:
         dir->restart_offset = 0;
         streambuf_empty(dir);
     }
-    mutex_unlock(sbuf->mutex);
+    flow_unlock(sbuf->mutex);
     return status;
 }
 
@@ -394,6 +454,7 @@ quit:
 
 void streambuf_init(void)
 {
+    reassembly_init();
     log_category_streambuf_init();
     mutex_init();
     mutex_pool_ctor(&streambuf_locks, "streambuf");
@@ -405,5 +466,6 @@ void streambuf_fini(void)
     mutex_pool_dtor(&streambuf_locks);
 #   endif
     mutex_fini();
+    reassembly_fini();
     log_category_streambuf_fini();
 }
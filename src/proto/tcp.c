@@ -33,6 +33,8 @@
 #include "junkie/proto/pkt_wait_list.h"
 #include "junkie/proto/ip.h"
 #include "junkie/proto/tcp.h"
+#include "junkie/proto/flow_cache.h"
+#include "junkie/proto/discovery.h"
 #include "proto/ip_hdr.h"
 
 #undef LOG_CAT
@@ -40,7 +42,7 @@
 
 LOG_CATEGORY_DEF(proto_tcp);
 
-#define TCP_HASH_SIZE 67
+#define TCP_HASH_SIZE 64
 
 /*
  * Proto Infos
@@ -206,18 +208,26 @@ static SCM g_tcp_del_port(SCM name, SCM port_min, SCM port_max)
 
 static struct pkt_wl_config tcp_wl_config;
 
-// We overload the mux_subparser in order to store a waiting list.
+/* We overload the mux_subparser in order to store a waiting list per direction.
+ * Many connections never need them (scans, failed handshakes, or all segments received
+ * in order), so they are built only when a segment has to wait. Until then, we merely
+ * track the next expected offset of each direction. */
 struct tcp_subparser {
     uint32_t fin_seqnum[2];     // indice = way
     uint32_t max_acknum[2];
-    struct pkt_wait_list wl[2]; // for packets reordering.
-    struct mutex mutex;         // protects pkt_wait_lists, proto and parser since they can be erased by waiting list
+    uint32_t next_offset[2];    // next expected seqnum for each way (unless wl is set)
+    uint32_t skip_offset[2];    // the parser does not care about the payload before this seqnum (unless wl is set, see pkt_wait_list_skip())
+    struct pkt_wait_list *wl;   // for packets reordering (wl[0] and wl[1], once needed)
+    struct mutex mutex;         // protects pkt_wait_lists, proto and parser since they can be erased by waiting list (unless flow_affinity)
+    struct flow_owner owner;    // to check flow affinity
+    struct discovery_flow discovery;    // to give up the discovery once it failed too often
 #   define SET_FOR_WAY(way, field) (field |= (1U<<way))
 #   define RESET_FOR_WAY(way, field) (field &= ~(1U<<way))
 #   define IS_SET_FOR_WAY(way, field) (!!(field & (1U<<way)))
     uint8_t fin:2, ack:2, syn:2, wl_set:2;
     uint8_t srv_way:1;          // is srv the peer[0] when way==0 or peer[0] when way==1 ? (UNSET if !srv_set)
     uint8_t srv_set:2;          // 0 -> UNSET, 1 -> UNSURE, 2 -> CERTAIN (and 3 -> BUG)
+    uint8_t gave_up:1;          // no proto could be found for this flow, stop looking for one
     struct mux_subparser mux_subparser; // must be the last member of this struct since mux_subparser is variable in size
 };
 
@@ -262,32 +272,82 @@ static int tcp_subparser_ctor(struct tcp_subparser *tcp_sub, struct mux_parser *
     tcp_sub->syn = 0;
     tcp_sub->wl_set = 0;
     tcp_sub->srv_set = 0;   // will be set later
+    tcp_sub->gave_up = 0;
+    discovery_flow_ctor(&tcp_sub->discovery);
+    tcp_sub->next_offset[0] = tcp_sub->next_offset[1] = 0;
+    tcp_sub->skip_offset[0] = tcp_sub->skip_offset[1] = 0;
+    tcp_sub->wl = NULL;     // will be built when needed
 
-    if (0 != pkt_wait_list_ctor(tcp_sub->wl+0, 0, &tcp_wl_config, &tcp_sub->mux_subparser.proto,
-                &tcp_sub->mux_subparser.parser, tcp_sub->wl+1)) {
+    mutex_ctor(&tcp_sub->mutex, "TCP subparser");
+    flow_owner_ctor(&tcp_sub->owner);
+    flow_lock(&tcp_sub->mutex, &tcp_sub->owner);
+
+    // Now that everything is ready, make this subparser public
+    if (0 != mux_subparser_ctor(&tcp_sub->mux_subparser, mux_parser, child, requestor, key, now)) {
+        flow_unlock(&tcp_sub->mutex);
         return -1;
     }
 
-    if (0 != pkt_wait_list_ctor(tcp_sub->wl+1, 0, &tcp_wl_config, &tcp_sub->mux_subparser.proto,
-                &tcp_sub->mux_subparser.parser, tcp_sub->wl+0)) {
-        pkt_wait_list_dtor(tcp_sub->wl+0);
+    return 0;
+}
+
+/*
+ * Build the waiting lists
+ *
+ * tcp_subparser->mutex should be locked
+ */
+static int tcp_subparser_wl_ctor(struct tcp_subparser *tcp_sub)
+{
+    assert(! tcp_sub->wl);
+    struct pkt_wait_list *wl = objalloc(2 * sizeof(*wl), "TCP waiting lists");
+    if (! wl) return -1;
+
+    SLOG(LOG_DEBUG, "Building waiting lists @%p for TCP subparser @%p", wl, tcp_sub);
+
+    if (0 != pkt_wait_list_ctor(wl+0, tcp_sub->next_offset[0], &tcp_wl_config, &tcp_sub->mux_subparser.proto,
+                &tcp_sub->mux_subparser.parser, wl+1)) {
+        objfree(wl);
         return -1;
     }
 
-    mutex_ctor(&tcp_sub->mutex, "TCP subparser");
-    mutex_lock(&tcp_sub->mutex);
-
-    // Now that everything is ready, make this subparser public
-    if (0 != mux_subparser_ctor(&tcp_sub->mux_subparser, mux_parser, child, requestor, key, now)) {
-        pkt_wait_list_dtor(tcp_sub->wl+0);
-        pkt_wait_list_dtor(tcp_sub->wl+1);
-        mutex_unlock(&tcp_sub->mutex);
+    if (0 != pkt_wait_list_ctor(wl+1, tcp_sub->next_offset[1], &tcp_wl_config, &tcp_sub->mux_subparser.proto,
+                &tcp_sub->mux_subparser.parser, wl+0)) {
+        pkt_wait_list_dtor(wl+0);
+        objfree(wl);
         return -1;
     }
 
+    wl[0].skip_offset = tcp_sub->skip_offset[0];
+    wl[1].skip_offset = tcp_sub->skip_offset[1];
+    tcp_sub->wl = wl;
     return 0;
 }
 
+static uint32_t tcp_next_offset(struct tcp_subparser const *tcp_sub, unsigned way)
+{
+    return tcp_sub->wl ? tcp_sub->wl[way].next_offset : tcp_sub->next_offset[way];
+}
+
+static uint32_t tcp_skip_offset(struct tcp_subparser const *tcp_sub, unsigned way)
+{
+    return tcp_sub->wl ? tcp_sub->wl[way].skip_offset : tcp_sub->skip_offset[way];
+}
+
+static void tcp_set_skip_offset(struct tcp_subparser *tcp_sub, unsigned way, uint32_t skip_offset)
+{
+    if (tcp_sub->wl) tcp_sub->wl[way].skip_offset = skip_offset;
+    else tcp_sub->skip_offset[way] = skip_offset;
+}
+
+static void tcp_set_next_offset(struct tcp_subparser *tcp_sub, unsigned way, uint32_t next_offset)
+{
+    uint32_t const skip_offset = tcp_skip_offset(tcp_sub, way);
+    if (tcp_sub->wl) tcp_sub->wl[way].next_offset = next_offset;
+    else tcp_sub->next_offset[way] = next_offset;
+    // Once passed, the skip offset follows so that it's never mistaken for a future one after wrapping
+    if (! seqnum_gt(skip_offset, next_offset)) tcp_set_skip_offset(tcp_sub, way, next_offset);
+}
+
 /*
  * Allocate and construct a tcp subparser
  *
@@ -299,7 +359,7 @@ static struct mux_subparser *tcp_subparser_new(struct mux_parser *mux_parser, st
     if (! tcp_subparser) return NULL;
 
     if (0 != tcp_subparser_ctor(tcp_subparser, mux_parser, child, requestor, key, now)) {
-        objfree(tcp_subparser);
+        mux_subparser_free(tcp_subparser);
         return NULL;
     }
 
@@ -309,7 +369,7 @@ static struct mux_subparser *tcp_subparser_new(struct mux_parser *mux_parser, st
 /*
  * Create a tcp subparser
  *
- * tcp_subparser->mutex is locked after call
+ * tcp_subparser->mutex is locked after call (and returned in *mutex, or NULL if the lock was elided)
  */
 struct mux_subparser *tcp_subparser_and_parser_new(struct parser *parser, struct proto *proto,
         struct proto *requestor, uint16_t src, uint16_t dst, unsigned way, struct timeval const *now,
@@ -322,7 +382,7 @@ struct mux_subparser *tcp_subparser_and_parser_new(struct parser *parser, struct
     struct mux_subparser *mux_subparser = mux_subparser_and_parser_new(mux_parser, proto, requestor, &key, now);
     if (likely_(mux_subparser)) {
         struct tcp_subparser *tcp_subparser = DOWNCAST(mux_subparser, mux_subparser, tcp_subparser);
-        *mutex = &tcp_subparser->mutex;
+        *mutex = flow_affinity ? NULL : &tcp_subparser->mutex;
     }
     return mux_subparser;
 }
@@ -333,8 +393,12 @@ static void tcp_subparser_dtor(struct tcp_subparser *tcp_subparser)
 
     mutex_dtor(&tcp_subparser->mutex);
 
-    pkt_wait_list_dtor(tcp_subparser->wl+0);
-    pkt_wait_list_dtor(tcp_subparser->wl+1);
+    if (tcp_subparser->wl) {
+        pkt_wait_list_dtor(tcp_subparser->wl+0);
+        pkt_wait_list_dtor(tcp_subparser->wl+1);
+        objfree(tcp_subparser->wl);
+        tcp_subparser->wl = NULL;
+    }
 
     mux_subparser_dtor(&tcp_subparser->mux_subparser);
 }
@@ -343,12 +407,14 @@ static void tcp_subparser_del(struct mux_subparser *mux_subparser)
 {
     struct tcp_subparser *tcp_subparser = DOWNCAST(mux_subparser, mux_subparser, tcp_subparser);
     tcp_subparser_dtor(tcp_subparser);
-    objfree(tcp_subparser);
+    mux_subparser_free(tcp_subparser);
 }
 
+// Sets *gave_up if we know better than running the discovery on this flow
 static struct proto *lookup_subproto(struct tcp_proto_info const *tcp, struct timeval const *now,
-        struct proto **requestor)
+        struct proto **requestor, bool *gave_up)
 {
+    *gave_up = false;
     struct proto *sub_proto = NULL;
     ASSIGN_INFO_OPT2(ip, ip6, &tcp->info);
     if (! ip) ip = ip6;
@@ -359,6 +425,11 @@ static struct proto *lookup_subproto(struct tcp_proto_info const *tcp, struct ti
     }
     if (! sub_proto) { // Then try predefined ports
         sub_proto = port_muxer_find(&tcp_port_muxers, tcp->key.port[0], tcp->key.port[1]);
+        // Unless the discovery already gave up on this server
+        if (sub_proto == proto_discovery && ip && discovery_skip(IPPROTO_TCP, ip->key.addr, tcp->key.port, now)) {
+            sub_proto = NULL;
+            *gave_up = true;
+        }
     }
     return sub_proto;
 }
@@ -375,6 +446,10 @@ static void tcp_mux_subparser_reset_proto(struct tcp_subparser *tcp_subparser)
     mux_subparser->requestor = NULL;
     parser_unref(&mux_subparser->parser);
     mux_subparser->proto = NULL;
+    // Whatever comes next may be of interest to the next parser
+    for (unsigned way = 0; way < 2; way++) {
+        tcp_set_skip_offset(tcp_subparser, way, tcp_next_offset(tcp_subparser, way));
+    }
 }
 
 /*
@@ -403,23 +478,76 @@ static void tcp_mux_subparser_spawn_parser(struct tcp_subparser *tcp_subparser,
 static void set_wl_list(struct tcp_subparser *tcp_sub, struct tcp_proto_info const *info, unsigned way)
 {
     if (!IS_SET_FOR_WAY(way, tcp_sub->wl_set)) {
-        SLOG(LOG_DEBUG, "First packet, set wl @%p[%d] offset to %"PRIu32, tcp_sub->wl, way, info->seq_num);
-        tcp_sub->wl[way].next_offset = info->seq_num;
+        SLOG(LOG_DEBUG, "First packet, set offset of way %u to %"PRIu32, way, info->seq_num);
+        tcp_set_next_offset(tcp_sub, way, info->seq_num);
+        tcp_set_skip_offset(tcp_sub, way, info->seq_num);
         SET_FOR_WAY(way, tcp_sub->wl_set);
     }
     if (!IS_SET_FOR_WAY(!way, tcp_sub->wl_set) && info->ack) {
-        SLOG(LOG_DEBUG, "First Sync list ack, set wl @%p[%d] offset to %"PRIu32, tcp_sub->wl, way,
-                info->ack_num);
-        tcp_sub->wl[!way].next_offset = info->ack_num;
+        SLOG(LOG_DEBUG, "First Sync list ack, set offset of way %u to %"PRIu32, !way, info->ack_num);
+        tcp_set_next_offset(tcp_sub, !way, info->ack_num);
+        tcp_set_skip_offset(tcp_sub, !way, info->ack_num);
         SET_FOR_WAY(!way, tcp_sub->wl_set);
     }
 }
 
+/*
+ * Tells if a segment can be parsed at once, ie. if it's the expected one and, for want of
+ * waiting lists, nothing can be pending in either direction.
+ *
+ * tcp_subparser->mutex should be locked
+ */
+static bool can_parse_at_once(struct tcp_subparser const *tcp_sub, struct tcp_proto_info const *info, unsigned way)
+{
+    if (tcp_sub->wl) return false;  // pkt_wait_list_add() will parse it at once if it can
+    if (info->seq_num != tcp_sub->next_offset[way]) return false;
+    // Same condition than pkt_wait_list_add() for parsing at once
+    return !info->ack || tcp_sub->next_offset[!way] >= info->ack_num;
+}
+
+/*
+ * Same as pkt_wait_list_add() for a segment that can be parsed at once.
+ * Returns false (and parse nothing) if the segment must go through the waiting lists.
+ *
+ * Until the waiting lists are built nothing else can reach this subparser (the timebounder
+ * only knows about the lists), so the tcp_subparser->mutex is all we need. Once they are,
+ * pkt_wait_list_add() performs the very same check under the lock of the list in use.
+ *
+ * tcp_subparser->mutex should be locked
+ */
+static bool tcp_parse_at_once(struct tcp_subparser *tcp_sub, struct tcp_proto_info *info,
+        unsigned way, uint32_t next_offset, uint8_t const *packet, size_t cap_len, size_t wire_len,
+        struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet, enum proto_parse_status *status)
+{
+    if (! can_parse_at_once(tcp_sub, info, way)) return false;
+
+    /* Most segments (pure ACKs to begin with) arrive in order, and the waiting lists
+     * would then merely parse them at once. */
+    SLOG(LOG_DEBUG, "Nothing pending, parsing at once");
+    struct mux_subparser *mux_subparser = &tcp_sub->mux_subparser;
+    // The parser may not be built yet if no payload was seen so far
+    if (! mux_subparser->parser && mux_subparser->proto && wire_len > 0) {
+        SLOG(LOG_DEBUG, "Building parser from proto %s", mux_subparser->proto->name);
+        mux_subparser->parser = mux_subparser->proto->ops->parser_new(mux_subparser->proto);
+    }
+    struct pkt_wait_skip skip;
+    pkt_wait_skip_push(&skip, mux_subparser->parser, next_offset);
+    *status = proto_parse(mux_subparser->parser, &info->info, way, packet,
+            cap_len, wire_len, now, tot_cap_len, tot_packet);
+    tcp_set_next_offset(tcp_sub, way, next_offset);
+    // Like proto_parse_or_die(), never move the skip offset backward
+    if (pkt_wait_skip_pop(&skip) && seqnum_gt(skip.skip_offset, tcp_skip_offset(tcp_sub, way))) {
+        tcp_set_skip_offset(tcp_sub, way, skip.skip_offset);
+    }
+
+    return true;
+}
+
 static struct tcp_subparser *downcast_and_lock_subparser(struct mux_subparser *mux_subparser)
 {
     assert(mux_subparser);
     struct tcp_subparser *tcp_subparser = DOWNCAST(mux_subparser, mux_subparser, tcp_subparser);
-    mutex_lock(&tcp_subparser->mutex);
+    flow_lock(&tcp_subparser->mutex, &tcp_subparser->owner);
     return tcp_subparser;
 }
 
@@ -438,32 +566,45 @@ static struct tcp_subparser *lookup_or_create_tcp_subparser(struct mux_parser *m
     port_key_init(&key, tcp->key.port[0], tcp->key.port[1], way);
     SLOG(LOG_DEBUG, "Look tcp subparser for way %d with key %"PRIu16", %"PRIu16, way, key.port[0], key.port[1]);
 
-    struct mux_subparser *mux_subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &key, now);
+    // Established connections are usually in the flow cache
+    struct mux_subparser *mux_subparser = flow_cache_lookup(mux_parser, tcp->key.port[0], tcp->key.port[1], now);
+    bool const cached = mux_subparser != NULL;
+    if (! cached) mux_subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &key, now);
     struct tcp_subparser *tcp_subparser = NULL;
     if (mux_subparser) {
         tcp_subparser = downcast_and_lock_subparser(mux_subparser);
     }
 
-    // Got a subparser with a ready parser, end of lookup
-    if (mux_subparser && mux_subparser->parser) {
+    // Got a subparser with a ready parser (or which parser is to be built once payload shows up), end of lookup
+    if (mux_subparser && (mux_subparser->parser || mux_subparser->proto)) {
         SLOG(LOG_DEBUG, "Found mux_subparser@%p for this cnx, for proto %s", mux_subparser,
-                mux_subparser->parser->proto->name);
+                mux_subparser->proto->name);
+        if (! cached) flow_cache_store(mux_parser, tcp->key.port[0], tcp->key.port[1], mux_subparser, &key);
         return tcp_subparser;
     }
 
+    // We gave up finding a parser for this one
+    if (tcp_subparser && tcp_subparser->gave_up) return tcp_subparser;
+
     struct proto *requestor = NULL;
-    struct proto *sub_proto = lookup_subproto(tcp, now, &requestor);
+    bool gave_up;
+    struct proto *sub_proto = lookup_subproto(tcp, now, &requestor, &gave_up);
     // No subparser, spawn a new one
     if (! mux_subparser) {
-        if (sub_proto && sub_proto->enabled) {
+        bool const with_proto = sub_proto && sub_proto->enabled;
+        // Many connections carry no payload at all, so we build their parser only once some payload shows up
+        if (with_proto && tcp->info.payload > 0) {
             mux_subparser = mux_subparser_and_parser_new(mux_parser, sub_proto, requestor, &key, now);
         }
         // We might hit the proto child limit
         if (!mux_subparser) {
             // Even if we have no child parser to send payload to, we want to submit payload in stream order to our plugins
-            mux_subparser = tcp_subparser_new(mux_parser, NULL, NULL, &key, now);
+            mux_subparser = tcp_subparser_new(mux_parser, NULL, with_proto ? requestor : NULL, &key, now);
+            if (! mux_subparser) return NULL;
+            if (with_proto && tcp->info.payload == 0) mux_subparser->proto = sub_proto;
         }
         tcp_subparser = DOWNCAST(mux_subparser, mux_subparser, tcp_subparser);
+        tcp_subparser->gave_up = gave_up;
         set_wl_list(tcp_subparser, tcp, way);
         return tcp_subparser;
     }
@@ -475,6 +616,7 @@ static struct tcp_subparser *lookup_or_create_tcp_subparser(struct mux_parser *m
     }
 
     // No luck, got a subparser without parser and without subproto
+    tcp_subparser->gave_up = gave_up;
     return tcp_subparser;
 }
 
@@ -532,6 +674,23 @@ static enum proto_parse_status parse_tcp_proto_info(struct tcp_proto_info *info,
     return PROTO_OK;
 }
 
+/*
+ * Account for a payload the discovery could not classify, and give up if it failed too often
+ *
+ * tcp_subparser->mutex should be locked
+ */
+static void tcp_discovery_failed(struct tcp_subparser *tcp_sub, struct tcp_proto_info const *info, struct timeval const *now)
+{
+    ASSIGN_INFO_OPT2(ip, ip6, &info->info);
+    if (! ip) ip = ip6;
+    if (! ip) return;
+    unsigned const srv = info->to_srv;
+    if (discovery_failed(&tcp_sub->discovery, IPPROTO_TCP, ip->key.addr+srv, info->key.port[srv], info->info.payload, now)) {
+        SLOG(LOG_DEBUG, "Giving up discovery for this flow");
+        tcp_sub->gave_up = 1;
+    }
+}
+
 static enum proto_parse_status tcp_parse(struct parser *parser, struct proto_info *parent, unsigned way,
         uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len,
         uint8_t const *tot_packet)
@@ -599,17 +758,33 @@ static enum proto_parse_status tcp_parse(struct parser *parser, struct proto_inf
     unsigned const offset = info.seq_num;
     unsigned const next_offset = offset + packet_len + info.syn + info.fin;
     unsigned sync_offset = info.ack_num;
-    if (tcp_seqnum_cmp(info.seq_num, tcp_sub->wl[way].next_offset) < 0) {
+    bool waiting_lists = false;
+    if (
+        next_offset == offset &&    // no payload, SYN nor FIN: nothing to reorder nor to parse
+        LIST_EMPTY(&proto_tcp->hook.subscribers) && LIST_EMPTY(&pkt_hook.subscribers) // racy reads, but that's only a hint
+    ) {
+        // Then the only effect of parsing this segment would be to call subscribers
+        SLOG(LOG_DEBUG, "Empty segment and nobody to tell, skipping it");
+    } else if (tcp_seqnum_cmp(info.seq_num, tcp_next_offset(tcp_sub, way)) < 0) {
         SLOG(LOG_DEBUG, "Got a packet starting before current offset (%"PRIu32" < %"PRIu32")",
-                info.seq_num, tcp_sub->wl[way].next_offset);
+                info.seq_num, tcp_next_offset(tcp_sub, way));
         status = proto_parse(NULL, &info.info, way, NULL, 0, 0, now, tot_cap_len, packet);
+    } else if (tcp_parse_at_once(tcp_sub, &info, way, next_offset, packet + tcphdr_len,
+                cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet, &status)) {
+        // Nothing was pending: parsed already
+    } else if (! tcp_sub->wl && 0 != tcp_subparser_wl_ctor(tcp_sub)) {
+        status = proto_parse(NULL, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len,
+                packet_len, now, tot_cap_len, tot_packet);
     } else {
+        waiting_lists = true;
         status = pkt_wait_list_add(tcp_sub->wl+way, offset, next_offset, info.ack,
                 sync_offset, true, &info.info, way, packet + tcphdr_len,
                 cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet);
     }
 
-    if (status == PROTO_OK) {
+    /* Only the timebounder may concurrently remove pending packets (adding some requires
+     * tcp_sub->mutex), so if we see none then there is nothing to advance. */
+    if (status == PROTO_OK && waiting_lists && (tcp_sub->wl[0].pkts[0] || tcp_sub->wl[1].pkts[0])) {
         // Try advancing each WL until we are stuck or met an error
         pkt_wait_list_try_both(tcp_sub->wl+!way, &status, now, false);
     }
@@ -621,9 +796,10 @@ static enum proto_parse_status tcp_parse(struct parser *parser, struct proto_inf
         mux_subparser_deindex(subparser);
     } else if (status == PROTO_PARSE_ERR) {
         SLOG(LOG_DEBUG, "No suitable subparser for this payload, deref it");
+        if (subparser->proto == proto_discovery) tcp_discovery_failed(tcp_sub, &info, now);
         tcp_mux_subparser_reset_proto(tcp_sub);
     }
-    mutex_unlock(&tcp_sub->mutex);
+    flow_unlock(&tcp_sub->mutex);
 
     mux_subparser_unref(&subparser);
 
@@ -643,8 +819,9 @@ static struct ip_subproto ip_subproto, ip6_subproto;
 
 void tcp_init(void)
 {
+    flow_cache_init();
     log_category_proto_tcp_init();
-    pkt_wl_config_ctor(&tcp_wl_config, "TCP-reordering", 100000, 20, 100000, 3 /* REORDERING TIMEOUT (second) */, true);
+    pkt_wl_config_ctor(&tcp_wl_config, "TCP-reordering", 100000, 20, 100000, 3 /* REORDERING TIMEOUT (second) */, true, 2 /* TCP and IP */);
 
     static struct proto_ops const ops = {
         .parse       = tcp_parse,
@@ -654,8 +831,9 @@ void tcp_init(void)
         .info_addr   = tcp_info_addr
     };
     static struct mux_proto_ops const mux_ops = {
-        .subparser_new = tcp_subparser_new,
-        .subparser_del = tcp_subparser_del,
+        .subparser_new  = tcp_subparser_new,
+        .subparser_del  = tcp_subparser_del,
+        .subparser_size = sizeof(struct tcp_subparser),
     };
     mux_proto_ctor(&mux_proto_tcp, &ops, &mux_ops, "TCP", PROTO_CODE_TCP, sizeof(struct port_key), TCP_HASH_SIZE);
     port_muxer_list_ctor(&tcp_port_muxers, "TCP muxers");
@@ -689,5 +867,6 @@ void tcp_fini(void)
 #   endif
 
     log_category_proto_tcp_fini();
+    flow_cache_fini();
 }
 
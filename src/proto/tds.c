@@ -176,11 +176,11 @@ static int tds_parser_ctor(struct tds_parser *tds_parser, struct proto *proto)
 
 static struct parser *tds_parser_new(struct proto *proto)
 {
-    struct tds_parser *tds_parser = objalloc_nice(sizeof(*tds_parser), "TDS(transp) parsers");
+    struct tds_parser *tds_parser = parser_alloc(proto, sizeof(*tds_parser), "TDS(transp) parsers");
     if (! tds_parser) return NULL;
 
     if (-1 == tds_parser_ctor(tds_parser, proto)) {
-        objfree(tds_parser);
+        parser_free(tds_parser);
         return NULL;
     }
 
@@ -199,7 +199,7 @@ static void tds_parser_del(struct parser *parser)
 {
     struct tds_parser *tds_parser = DOWNCAST(parser, parser, tds_parser);
     tds_parser_dtor(tds_parser);
-    objfree(tds_parser);
+    parser_free(tds_parser);
 }
 
 /*
@@ -450,7 +450,8 @@ void tds_init(void)
         .parser_new  = tds_parser_new,
         .parser_del  = tds_parser_del,
         .info_2_str  = tds_info_2_str,
-        .info_addr   = tds_info_addr
+        .info_addr   = tds_info_addr,
+        .parser_size = sizeof(struct tds_parser),
     };
     proto_ctor(&proto_tds_, &ops, "TDS", PROTO_CODE_TDS);
     port_muxer_ctor(&tds_tcp_muxer, &tcp_port_muxers, 1433, 1433, proto_tds);
@@ -20,6 +20,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
 #include "junkie/config.h"
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
@@ -29,6 +32,10 @@
 #include "junkie/tools/miscmacs.h"
 #include "junkie/tools/ip_addr.h"
 #include "junkie/tools/hash.h"
+#include "junkie/tools/bench.h"
+#include "junkie/tools/tempstr.h"
+#include "junkie/tools/timebound.h"
+#include "junkie/tools/frame_buf.h"
 #include "junkie/proto/streambuf.h"
 #include "junkie/proto/port_muxer.h"
 #include "junkie/proto/cursor.h"
@@ -575,10 +582,18 @@ struct tls_parser {
     } spec[2];   // current or next
     // If we manage to decrypt, then we handle content to this parser
     struct parser *subparser;
+    // While the pre master secret is decrypted by an RSA thread, the following records are kept here
+    struct tls_rsa_job *rsa_job;
+    STAILQ_HEAD(tls_held_records, tls_held_record) held_records;
+    unsigned nb_held_records;
+    bool holding;   // if set then we are on tls_holding_parsers
+    LIST_ENTRY(tls_parser) holding_entry;
 };
 
 
 static parse_fun tls_sbuf_parse;
+static void tls_flush_held_records(struct tls_parser *, bool wait);
+static void tls_forget_rsa_job(struct tls_parser *);
 static int tls_parser_ctor(struct tls_parser *tls_parser, struct proto *proto)
 {
     SLOG(LOG_DEBUG, "Constructing tls_parser@%p", tls_parser);
@@ -597,6 +612,10 @@ static int tls_parser_ctor(struct tls_parser *tls_parser, struct proto *proto)
     }
     tls_parser->spec[0].cipher = tls_parser->spec[1].cipher = TLS_NULL_WITH_NULL_NULL;
     tls_parser->subparser = NULL;
+    tls_parser->rsa_job = NULL;
+    STAILQ_INIT(&tls_parser->held_records);
+    tls_parser->nb_held_records = 0;
+    tls_parser->holding = false;
 #   define MAX_TLS_BUFFER (16383 + 5)
     if (0 != streambuf_ctor(&tls_parser->sbuf, tls_sbuf_parse, MAX_TLS_BUFFER, &streambuf_locks)) return -1;
 
@@ -605,11 +624,11 @@ static int tls_parser_ctor(struct tls_parser *tls_parser, struct proto *proto)
 
 static struct parser *tls_parser_new(struct proto *proto)
 {
-    struct tls_parser *tls_parser = objalloc_nice(sizeof(*tls_parser), "TLS parsers");
+    struct tls_parser *tls_parser = parser_alloc(proto, sizeof(*tls_parser), "TLS parsers");
     if (! tls_parser) return NULL;
 
     if (-1 == tls_parser_ctor(tls_parser, proto)) {
-        objfree(tls_parser);
+        parser_free(tls_parser);
         return NULL;
     }
 
@@ -620,10 +639,15 @@ static void tls_parser_dtor(struct tls_parser *tls_parser)
 {
     SLOG(LOG_DEBUG, "Destructing tls_parser@%p", tls_parser);
 
+    // Parse the records that are still waiting for the pre master secret (while we still have a subparser)
+    tls_flush_held_records(tls_parser, true);
+
     if (tls_parser->subparser) {
         parser_unref(&tls_parser->subparser);
     }
 
+    tls_forget_rsa_job(tls_parser);
+
     parser_dtor(&tls_parser->parser);
     streambuf_dtor(&tls_parser->sbuf);
     for (unsigned current = 0; current < 2; current ++) {
@@ -638,7 +662,7 @@ static void tls_parser_del(struct parser *parser)
 {
     struct tls_parser *tls_parser = DOWNCAST(parser, parser, tls_parser);
     tls_parser_dtor(tls_parser);
-    objfree(tls_parser);
+    parser_free(tls_parser);
 }
 
 /*
@@ -849,6 +873,79 @@ static int prf(struct tls_version version, SSL *ssl, uint8_t *secret, char const
     return (is_tls(version) ? tls_prf : ssl3_prf)(ssl, secret, label, r1, r2, out_len, out);
 }
 
+// Derive the keys from the master secret and prepare the decoders of the next spec (and the subparser)
+static int tls_setup_decoders(struct tls_keyfile *keyfile, struct tls_parser *parser, SSL *ssl, uint8_t *master_secret)
+{
+    struct tls_cipher_spec *clt_next_spec = &parser->spec[!parser->current[parser->c2s_way]];
+    struct tls_decoder *clt_next_decoder = &clt_next_spec->decoder[parser->c2s_way];
+    struct tls_decoder *srv_next_decoder = &parser->spec[!parser->current[!parser->c2s_way]].decoder[!parser->c2s_way];
+
+    if (clt_next_spec->cipher >= NB_ELEMS(tls_cipher_infos)) {
+unknown_cipher:
+        SLOG(LOG_DEBUG, "Don't know the characteristics of cipher %s", tls_cipher_suite_2_str(clt_next_spec->cipher));
+        return -1;
+    }
+    struct tls_cipher_info const *cipher_info = tls_cipher_infos + clt_next_spec->cipher;
+    if (! cipher_info->defined) goto unknown_cipher;
+
+    unsigned const needed =
+        tls_digest_len(cipher_info->dig)*2 +
+        cipher_info->bits/4 +
+        (cipher_info->block > 1 ? cipher_info->block*2 : 0);
+    assert(needed <= sizeof(clt_next_spec->key_block));
+
+    if (0 != prf(clt_next_spec->version, ssl,
+                 master_secret, "key expansion",
+                 srv_next_decoder->random,
+                 clt_next_decoder->random,
+                 needed, clt_next_spec->key_block))
+        return -1;
+    SLOG(LOG_DEBUG, "key_block:");
+    SLOG_HEX(LOG_DEBUG, clt_next_spec->key_block, needed);
+
+    // Save cryptographic material from the key_block
+    // TODO: handle export ciphers?
+    uint8_t *ptr = clt_next_spec->key_block;
+    clt_next_decoder->mac_key = ptr; ptr += tls_digest_len(cipher_info->dig);
+    srv_next_decoder->mac_key = ptr; ptr += tls_digest_len(cipher_info->dig);
+    clt_next_decoder->write_key = ptr; ptr += cipher_info->eff_bits/8;
+    srv_next_decoder->write_key = ptr; ptr += cipher_info->eff_bits/8;
+    if (cipher_info->block > 1) {
+        clt_next_decoder->init_vector = ptr; ptr += cipher_info->block;
+        srv_next_decoder->init_vector = ptr; ptr += cipher_info->block;
+    }
+
+    // prepare a cipher for both directions
+    for (unsigned dir = 0; dir < 2; dir ++) {
+        if (clt_next_spec->decoder[dir].decoder_ready) {
+            EVP_CIPHER_CTX_cleanup(&clt_next_spec->decoder[dir].evp);
+            clt_next_spec->decoder[dir].decoder_ready = false;
+        }
+        if (!clt_next_spec->decoder[dir].write_key)
+            continue;
+
+        EVP_CIPHER_CTX_init(&clt_next_spec->decoder[dir].evp);
+        if (1 != EVP_CipherInit(&clt_next_spec->decoder[dir].evp, cipher_info->ciph, clt_next_spec->decoder[dir].write_key, clt_next_spec->decoder[dir].init_vector, 0)) {
+            // Error
+            SLOG(LOG_INFO, "Cannot initialize cipher suite 0x%x: %s", clt_next_spec->cipher, openssl_errors_2_str());
+            return -1;
+        }
+        clt_next_spec->decoder[dir].decoder_ready = true;
+    }
+
+    // Prepare a subparser (if we haven't one yet)
+    if (! parser->subparser && keyfile->proto) {
+        SLOG(LOG_DEBUG, "Spawn new TLS subparser for proto %s", keyfile->proto->name);
+        parser->subparser = keyfile->proto->ops->parser_new(keyfile->proto);
+        if (! parser->subparser) {
+            SLOG(LOG_WARNING, "Cannot create TLS subparser for proto %s", keyfile->proto->name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 // decrypt the pre_master_secret using server's private key (or saved session_id).
 // Note: we follow ssldump footpath from there!
 // Note2: way is clt->srv way
@@ -929,75 +1026,305 @@ static int decrypt_master_secret_with_keyfile(struct tls_keyfile *keyfile, struc
     }
 
     assert(master_secret);
+    if (0 != tls_setup_decoders(keyfile, parser, ssl, master_secret)) goto quit1;
 
-    if (clt_next_spec->cipher >= NB_ELEMS(tls_cipher_infos)) {
-unknown_cipher:
-        SLOG(LOG_DEBUG, "Don't know the characteristics of cipher %s", tls_cipher_suite_2_str(clt_next_spec->cipher));
-        goto quit1;
+    err = 0;
+quit1:
+    SSL_free(ssl);
+quit0:
+    return err;
+}
+
+/*
+ * Asynchronous RSA decryption
+ *
+ * Decrypting the pre master secret with the server private key is way slower
+ * than anything else we do with a packet. So when tls-rsa-threads is set, the
+ * encrypted pre master secret is handed to a pool of threads, and the records
+ * that follow on this connection are kept aside (up to tls-rsa-max-held-records
+ * of them) until the master secret is known. They are then parsed, in order,
+ * with the next record of the connection, or by a ticker if none comes, or at
+ * the latest when the parser is deleted.
+ */
+
+static unsigned max_held_records = 32;
+EXT_PARAM_RW(max_held_records, "tls-rsa-max-held-records", uint, "How many records of a TLS connection can wait for its pre master secret to be decrypted (this connection will not be decrypted if more are received).")
+static unsigned nb_rsa_jobs;
+EXT_PARAM_RO(nb_rsa_jobs, "tls-rsa-jobs", uint, "How many pre master secrets were handed to the RSA threads.")
+static unsigned nb_rsa_dropped;
+EXT_PARAM_RO(nb_rsa_dropped, "tls-rsa-dropped", uint, "How many pre master secrets were not decrypted because the RSA threads were lagging behind.")
+static unsigned nb_held_overflows;
+EXT_PARAM_RO(nb_held_overflows, "tls-rsa-held-overflows", uint, "How many TLS connections were not decrypted because too many records were waiting for their pre master secret.")
+static struct bench_event rsa_decrypting;
+
+#define RSA_MAX_KEYS 8  // how many matching keyfiles we try
+struct tls_rsa_job {
+    unsigned nb_owners;     // the parser and the RSA threads: the last one frees the job
+    unsigned done;          // set by the RSA thread once the job is over
+    int keyfile_id;         // the keyfile that worked (or -1)
+    unsigned nb_keys;
+    struct tls_rsa_key {
+        RSA *rsa;
+        int keyfile_id;
+    } keys[RSA_MAX_KEYS];
+    struct tls_version version;
+    uint8_t clt_random[RANDOM_LEN], srv_random[RANDOM_LEN];
+    uint8_t master_secret[SECRET_LEN];
+    size_t enc_pms_len;
+    uint8_t encrypted_pms[];
+};
+
+static void tls_rsa_job_unref(struct tls_rsa_job *job)
+{
+    if (0 != __sync_sub_and_fetch(&job->nb_owners, 1)) return;
+
+    for (unsigned k = 0; k < job->nb_keys; k++) RSA_free(job->keys[k].rsa);
+    OPENSSL_cleanse(job->master_secret, sizeof(job->master_secret));
+    objfree(job);
+}
+
+static void tls_rsa_job_run(struct tls_rsa_job *job)
+{
+    uint64_t const start = bench_event_start();
+
+    for (unsigned k = 0; k < job->nb_keys; k++) {
+        SLOG(LOG_DEBUG, "Try to decrypt Master Secret using keyfile %d", job->keys[k].keyfile_id);
+        uint8_t pre_master_secret[RSA_size(job->keys[k].rsa)];
+        int const pms_len = RSA_private_decrypt(job->enc_pms_len, job->encrypted_pms, pre_master_secret, job->keys[k].rsa, RSA_PKCS1_PADDING);
+        if (pms_len != SECRET_LEN) continue;
+        if (! check_version(pre_master_secret[0], pre_master_secret[1])) continue;
+        int const err = prf(job->version, NULL,
+                            pre_master_secret, "master secret",
+                            job->clt_random, job->srv_random,
+                            sizeof(job->master_secret), job->master_secret);
+        OPENSSL_cleanse(pre_master_secret, sizeof(pre_master_secret));
+        if (err) continue;
+        job->keyfile_id = job->keys[k].keyfile_id;
+        break;
     }
-    struct tls_cipher_info const *cipher_info = tls_cipher_infos + clt_next_spec->cipher;
-    if (! cipher_info->defined) goto unknown_cipher;
 
-    unsigned const needed =
-        tls_digest_len(cipher_info->dig)*2 +
-        cipher_info->bits/4 +
-        (cipher_info->block > 1 ? cipher_info->block*2 : 0);
-    assert(needed <= sizeof(clt_next_spec->key_block));
+    bench_event_stop(&rsa_decrypting, start);
+    __sync_synchronize();   // master_secret before done
+    job->done = 1;
+}
 
-    if (0 != prf(clt_next_spec->version, ssl,
-                 master_secret, "key expansion",
-                 srv_next_decoder->random,
-                 clt_next_decoder->random,
-                 needed, clt_next_spec->key_block))
-        goto quit1;
-    SLOG(LOG_DEBUG, "key_block:");
-    SLOG_HEX(LOG_DEBUG, clt_next_spec->key_block, needed);
+static struct rsa_threads {
+    pthread_mutex_t mutex;  // protects everything below (cannot use a struct mutex with a condition)
+    pthread_cond_t not_empty;
+#   define RSA_QUEUE_LEN 256
+    struct tls_rsa_job *queue[RSA_QUEUE_LEN];
+    unsigned head, length;
+    unsigned nb_threads;    // number of threads taking jobs (the ones with a greater index are quitting)
+    pthread_t pth[CPU_MAX];
+} rsa_threads = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+};
 
-    // Save cryptographic material from the key_block
-    // TODO: handle export ciphers?
-    uint8_t *ptr = clt_next_spec->key_block;
-    clt_next_decoder->mac_key = ptr; ptr += tls_digest_len(cipher_info->dig);
-    srv_next_decoder->mac_key = ptr; ptr += tls_digest_len(cipher_info->dig);
-    clt_next_decoder->write_key = ptr; ptr += cipher_info->eff_bits/8;
-    srv_next_decoder->write_key = ptr; ptr += cipher_info->eff_bits/8;
-    if (cipher_info->block > 1) {
-        clt_next_decoder->init_vector = ptr; ptr += cipher_info->block;
-        srv_next_decoder->init_vector = ptr; ptr += cipher_info->block;
+static void *rsa_thread(void *idx_)
+{
+    unsigned const idx = (uintptr_t)idx_;
+    set_thread_name(tempstr_printf("J-rsa[%u]", idx));
+
+    while (1) {
+        struct tls_rsa_job *job = NULL;
+        WITH_PTH_MUTEX(&rsa_threads.mutex) {
+            while (rsa_threads.length == 0 && idx < rsa_threads.nb_threads) {
+                pthread_cond_wait(&rsa_threads.not_empty, &rsa_threads.mutex);
+            }
+            if (idx < rsa_threads.nb_threads) {
+                job = rsa_threads.queue[rsa_threads.head];
+                rsa_threads.head = (rsa_threads.head + 1) % NB_ELEMS(rsa_threads.queue);
+                rsa_threads.length --;
+            }
+        }
+        if (! job) break;   // quitting
+        tls_rsa_job_run(job);
+        tls_rsa_job_unref(job);
     }
 
-    // prepare a cipher for both directions
-    for (unsigned dir = 0; dir < 2; dir ++) {
-        if (clt_next_spec->decoder[dir].decoder_ready) {
-            EVP_CIPHER_CTX_cleanup(&clt_next_spec->decoder[dir].evp);
-            clt_next_spec->decoder[dir].decoder_ready = false;
+    return NULL;
+}
+
+/* Start or stop RSA threads so that nb of them are running.
+ * Callers are serialized by the tls-rsa-threads parameter lock. */
+static void rsa_threads_resize(unsigned nb)
+{
+    if (nb > NB_ELEMS(rsa_threads.pth)) nb = NB_ELEMS(rsa_threads.pth);
+
+    unsigned prev_nb;
+    WITH_PTH_MUTEX(&rsa_threads.mutex) {
+        prev_nb = rsa_threads.nb_threads;
+        // The new threads wait for the mutex before looking at nb_threads
+        while (rsa_threads.nb_threads < nb) {
+            int err = pthread_create(rsa_threads.pth + rsa_threads.nb_threads, NULL, rsa_thread, (void *)(uintptr_t)rsa_threads.nb_threads);
+            if (err) {
+                SLOG(LOG_ERR, "Cannot start RSA thread: %s", strerror(err));
+                break;
+            }
+            rsa_threads.nb_threads ++;
         }
-        if (!clt_next_spec->decoder[dir].write_key)
-            continue;
+        if (nb < prev_nb) {
+            rsa_threads.nb_threads = nb;
+            pthread_cond_broadcast(&rsa_threads.not_empty);
+        }
+    }
 
-        EVP_CIPHER_CTX_init(&clt_next_spec->decoder[dir].evp);
-        if (1 != EVP_CipherInit(&clt_next_spec->decoder[dir].evp, cipher_info->ciph, clt_next_spec->decoder[dir].write_key, clt_next_spec->decoder[dir].init_vector, 0)) {
-            // Error
-            SLOG(LOG_INFO, "Cannot initialize cipher suite 0x%x: %s", clt_next_spec->cipher, openssl_errors_2_str());
-            goto quit1;
+    if (nb == prev_nb) return;
+    SLOG(LOG_INFO, "Now running %u RSA threads (was %u)", rsa_threads.nb_threads, prev_nb);
+
+    for (unsigned t = nb; t < prev_nb; t++) {
+        pthread_join(rsa_threads.pth[t], NULL);
+    }
+
+    if (nb > 0) return;
+    // Nobody will queue anything anymore, but the parsers are still waiting for what's queued
+    while (1) {
+        struct tls_rsa_job *job = NULL;
+        WITH_PTH_MUTEX(&rsa_threads.mutex) {
+            if (rsa_threads.length > 0) {
+                job = rsa_threads.queue[rsa_threads.head];
+                rsa_threads.head = (rsa_threads.head + 1) % NB_ELEMS(rsa_threads.queue);
+                rsa_threads.length --;
+            }
         }
-        clt_next_spec->decoder[dir].decoder_ready = true;
+        if (! job) break;
+        tls_rsa_job_run(job);
+        tls_rsa_job_unref(job);
     }
+}
 
-    // Prepare a subparser (if we haven't one yet)
-    if (! parser->subparser && keyfile->proto) {
-        SLOG(LOG_DEBUG, "Spawn new TLS subparser for proto %s", keyfile->proto->name);
-        parser->subparser = keyfile->proto->ops->parser_new(keyfile->proto);
-        if (! parser->subparser) {
-            SLOG(LOG_WARNING, "Cannot create TLS subparser for proto %s", keyfile->proto->name);
-            goto quit1;
+// tls-rsa-threads starts or stops RSA threads when set, thus its custom setter
+static unsigned nb_rsa_threads = 0;
+EXT_PARAM_GET(nb_rsa_threads, uint)
+static SCM g_ext_param_set_nb_rsa_threads(SCM v)
+{
+    SLOG(LOG_DEBUG, "Setting value for nb_rsa_threads");
+    unsigned const nb = scm_to_uint(v);
+    WITH_EXT_LOCK(nb_rsa_threads, {
+        rsa_threads_resize(nb);
+        nb_rsa_threads = rsa_threads.nb_threads;
+    });
+    return SCM_UNSPECIFIED;
+}
+EXT_PARAM_STRUCT_RW(nb_rsa_threads, "tls-rsa-threads", "Number of threads decrypting TLS pre master secrets (0 to decrypt them from the parser threads).")
+EXT_PARAM_CTORDTOR(nb_rsa_threads)
+
+/* Hand the decryption of this pre master secret to the RSA threads.
+ * Returns -1 if there are no RSA threads (then the caller must decrypt it itself). */
+static int decrypt_master_secret_async(struct tls_parser *parser, struct ip_addr const *srv_addr, size_t enc_pms_len, uint8_t const *encrypted_pms)
+{
+    /* Do not bother with the lock when there are no RSA threads (the usual case).
+     * If they are stopped meanwhile we will notice when queuing the job. */
+    if (0 == rsa_threads.nb_threads) return -1;
+
+    if (parser->rsa_job) {
+        SLOG(LOG_DEBUG, "Already waiting for a pre master secret, give up this one");
+        return 0;
+    }
+
+    struct tls_rsa_job *job = objalloc(sizeof(*job) + enc_pms_len, "TLS RSA jobs");
+    if (! job) return 0;
+    job->nb_owners = 2;
+    job->done = 0;
+    job->keyfile_id = -1;
+    job->nb_keys = 0;
+
+    // Take a ref to the private keys of the relevant keyfiles (which can be deleted in the meantime)
+    struct tls_keyfile *keyfile;
+    WITH_LOCK(&tls_keyfiles_lock) {
+        LIST_FOREACH(keyfile, &tls_keyfiles, entry) {
+            if (job->nb_keys >= NB_ELEMS(job->keys)) break;
+            if (! ip_match_keyfile(srv_addr, keyfile)) continue;
+            SSL *ssl = SSL_new(keyfile->ssl_ctx);
+            if (! ssl) {
+                SLOG(LOG_ERR, "Cannot create SSL from SSL_CTX: %s", openssl_errors_2_str());
+                continue;
+            }
+            EVP_PKEY *pk = SSL_get_privatekey(ssl);
+            RSA *rsa = pk ? EVP_PKEY_get1_RSA(pk) : NULL;
+            SSL_free(ssl);
+            if (! rsa) {
+                SLOG(LOG_ERR, "Private key of keyfile %d is not a RSA key.", keyfile->id);
+                continue;
+            }
+            job->keys[job->nb_keys].rsa = rsa;
+            job->keys[job->nb_keys].keyfile_id = keyfile->id;
+            job->nb_keys ++;
         }
     }
+    if (job->nb_keys == 0) {
+        SLOG(LOG_DEBUG, "No keyfile found for %s", ip_addr_2_str(srv_addr));
+        objfree(job);
+        return 0;
+    }
 
-    err = 0;
-quit1:
-    SSL_free(ssl);
-quit0:
-    return err;
+    struct tls_cipher_spec *clt_next_spec = &parser->spec[!parser->current[parser->c2s_way]];
+    job->version = clt_next_spec->version;
+    memcpy(job->clt_random, clt_next_spec->decoder[parser->c2s_way].random, sizeof(job->clt_random));
+    memcpy(job->srv_random, parser->spec[!parser->current[!parser->c2s_way]].decoder[!parser->c2s_way].random, sizeof(job->srv_random));
+    job->enc_pms_len = enc_pms_len;
+    memcpy(job->encrypted_pms, encrypted_pms, enc_pms_len);
+
+    bool queued = false, stopped = false;
+    WITH_PTH_MUTEX(&rsa_threads.mutex) {
+        if (rsa_threads.nb_threads == 0) {
+            stopped = true;
+        } else if (rsa_threads.length < NB_ELEMS(rsa_threads.queue)) {
+            rsa_threads.queue[(rsa_threads.head + rsa_threads.length) % NB_ELEMS(rsa_threads.queue)] = job;
+            rsa_threads.length ++;
+            pthread_cond_signal(&rsa_threads.not_empty);
+            queued = true;
+        }
+    }
+
+    if (stopped) {
+        job->nb_owners = 1;
+        tls_rsa_job_unref(job);
+        return -1;
+    }
+
+    if (! queued) {
+        SLOG(LOG_DEBUG, "RSA threads are lagging behind, give up this pre master secret");
+        __sync_fetch_and_add(&nb_rsa_dropped, 1);
+        job->nb_owners = 1;
+        tls_rsa_job_unref(job);
+        return 0;
+    }
+
+    __sync_fetch_and_add(&nb_rsa_jobs, 1);
+    parser->rsa_job = job;
+    return 0;
+}
+
+// Once the RSA thread is done with it, use the master secret of parser->rsa_job
+static void tls_rsa_job_finish(struct tls_parser *parser)
+{
+    struct tls_rsa_job *job = parser->rsa_job;
+    assert(job && job->done);
+    __sync_synchronize();   // done before master_secret
+
+    if (job->keyfile_id >= 0) {
+        struct tls_keyfile *keyfile;
+        WITH_LOCK(&tls_keyfiles_lock) {
+            LIST_LOOKUP(keyfile, &tls_keyfiles, entry, keyfile->id == job->keyfile_id);
+            if (keyfile) {
+                memcpy(parser->master_secret, job->master_secret, sizeof(parser->master_secret));
+                parser->keyfile = keyfile;
+                if (0 != tls_setup_decoders(keyfile, parser, NULL, parser->master_secret)) {
+                    SLOG(LOG_DEBUG, "Cannot setup decoders from keyfile %d, give up decryption", keyfile->id);
+                    parser->keyfile = NULL;
+                }
+            } else {
+                SLOG(LOG_DEBUG, "Keyfile %d was deleted meanwhile, give up decryption", job->keyfile_id);
+            }
+        }
+    } else {
+        SLOG(LOG_DEBUG, "No (working) keyfile found for this pre master secret");
+    }
+
+    parser->rsa_job = NULL;
+    tls_rsa_job_unref(job);
 }
 
 static int decrypt_master_secret(struct tls_parser *parser, unsigned way, struct tls_proto_info const *info, size_t enc_pms_len, uint8_t const *encrypted_pms)
@@ -1010,6 +1337,9 @@ static int decrypt_master_secret(struct tls_parser *parser, unsigned way, struct
     if (! tcp) return -1;
     ASSIGN_INFO_OPT(ip, &tcp->info);
     if (! ip) return -1;
+
+    if (encrypted_pms && 0 == decrypt_master_secret_async(parser, &ip->key.addr[srv_idx], enc_pms_len, encrypted_pms)) return 0;
+
     struct tls_keyfile *keyfile;
     WITH_LOCK(&tls_keyfiles_lock) {
         LIST_FOREACH(keyfile, &tls_keyfiles, entry) {
@@ -1457,6 +1787,231 @@ static enum proto_parse_status tls_parse_record(struct tls_parser *parser, unsig
     return PROTO_PARSE_ERR;
 }
 
+/*
+ * Records waiting for the pre master secret
+ */
+
+#define TLS_RECORD_HEAD 5
+
+/* A record received while the RSA threads were decrypting the pre master secret.
+ * It keeps what it needs to be parsed later on as if it were parsed at once: its
+ * timestamp, a copy of its parent infos (the innermost ones, see
+ * proto_info_stack_copy()) and a ref to the packet that carried it. */
+#define TLS_HELD_INFOS 2    // TCP and IP
+struct tls_held_record {
+    STAILQ_ENTRY(tls_held_record) entry;
+    unsigned way;
+    struct timeval now;         // when the record was received
+    struct tls_version version;
+    enum tls_content_type content_type;
+    size_t cap_len, wire_len;   // of the record content
+    struct proto_info *parent;  // our copy of the parent infos (that follows the content)
+    struct frame_buf *buf;      // holds the packet that carried the record (if any)
+    uint8_t const *tot_packet;  // within buf
+    size_t tot_cap_len;
+    uint8_t content[];
+};
+
+/* The parsers holding records, so that the ticker can parse them once their
+ * pre master secret is known even if no other record comes. */
+static LIST_HEAD(tls_holding_parsers, tls_parser) tls_holding_parsers;
+static struct mutex tls_holding_parsers_lock;
+static struct timebound_ticker tls_held_replayer;
+
+// Keep parser on tls_holding_parsers for as long as it holds some records
+static void tls_update_holding(struct tls_parser *parser)
+{
+    bool const holding = ! STAILQ_EMPTY(&parser->held_records);
+    if (holding == parser->holding) return;
+
+    WITH_LOCK(&tls_holding_parsers_lock) {
+        if (holding) {
+            LIST_INSERT_HEAD(&tls_holding_parsers, parser, holding_entry);
+        } else {
+            LIST_REMOVE(parser, holding_entry);
+        }
+    }
+    parser->holding = holding;
+}
+
+static void tls_held_record_del(struct tls_held_record *rec)
+{
+    if (rec->parent) proto_info_stack_release(rec->parent);
+    frame_buf_unref(&rec->buf);
+    objfree(rec);
+}
+
+static void tls_forget_rsa_job(struct tls_parser *parser)
+{
+    struct tls_held_record *rec;
+    while (NULL != (rec = STAILQ_FIRST(&parser->held_records))) {
+        STAILQ_REMOVE_HEAD(&parser->held_records, entry);
+        tls_held_record_del(rec);
+    }
+    parser->nb_held_records = 0;
+    tls_update_holding(parser);
+
+    if (parser->rsa_job) {
+        tls_rsa_job_unref(parser->rsa_job);
+        parser->rsa_job = NULL;
+    }
+}
+
+static int tls_hold_record(struct tls_parser *parser, unsigned way, struct tls_proto_info const *info, size_t cap_len, size_t wire_len, uint8_t const *content, struct proto_info *parent, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
+{
+    if (parser->nb_held_records >= max_held_records) return -1;
+
+    // The record, its content and the copy of the parent infos all go in one block
+    size_t const info_offset = CEIL_DIV(sizeof(struct tls_held_record) + cap_len, PROTO_INFO_ALIGN) * PROTO_INFO_ALIGN;
+    struct tls_held_record *rec = objalloc(info_offset + (parent ? proto_info_stack_size(parent, TLS_HELD_INFOS) : 0), "TLS held records");
+    if (! rec) return -1;
+
+    rec->buf = NULL;
+    rec->tot_packet = NULL;
+    rec->tot_cap_len = 0;
+    if (tot_packet) {
+        rec->buf = frame_buf_hold(tot_packet, tot_cap_len, &rec->tot_packet);
+        if (! rec->buf) {
+            objfree(rec);
+            return -1;
+        }
+        rec->tot_cap_len = tot_cap_len;
+    }
+
+    rec->way = way;
+    rec->now = *now;
+    rec->version = info->version;
+    rec->content_type = info->content_type;
+    rec->cap_len = cap_len;
+    rec->wire_len = wire_len;
+    memcpy(rec->content, content, cap_len);
+    rec->parent = NULL;
+    if (parent) {
+        rec->parent = proto_info_stack_copy(parent, (char *)rec + info_offset, TLS_HELD_INFOS);
+        // This packet was given to the per packet subscribers when the record was held
+        rec->parent->pkt_sbc_called = true;
+    }
+
+    STAILQ_INSERT_TAIL(&parser->held_records, rec, entry);
+    parser->nb_held_records ++;
+    tls_update_holding(parser);
+    SLOG(LOG_DEBUG, "Holding record until the pre master secret is known (%u held)", parser->nb_held_records);
+    return 0;
+}
+
+static enum proto_parse_status tls_parse_record(struct tls_parser *, unsigned way, struct tls_proto_info *, size_t cap_len, size_t wire_len, uint8_t const *payload, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet);
+
+// Parse an held record as it would have been parsed when received, with its own parent infos and packet
+static void tls_parse_held_record(struct tls_parser *parser, struct tls_held_record *rec)
+{
+    SLOG(LOG_DEBUG, "Parsing held record of %zu bytes", rec->wire_len);
+
+    // Our subparsers may want to keep this packet as well
+    struct frame_buf_ctx frame_ctx;
+    frame_buf_ctx_push(&frame_ctx, rec->tot_packet, rec->tot_cap_len, frame_buf_ref(rec->buf));
+
+    struct tls_proto_info info;
+    proto_info_ctor(&info.info, &parser->parser, rec->parent, TLS_RECORD_HEAD + rec->wire_len, 0);
+    info.version = rec->version;
+    info.content_type = rec->content_type;
+    info.set_values = 0;
+    if (PROTO_OK == tls_parse_record(parser, rec->way, &info, rec->cap_len, rec->wire_len, rec->content, &rec->now, rec->tot_cap_len, rec->tot_packet)) {
+        (void)proto_parse(NULL, &info.info, rec->way, NULL, 0, 0, &rec->now, rec->tot_cap_len, rec->tot_packet);
+    }
+
+    frame_buf_ctx_pop(&frame_ctx);
+}
+
+// Parse the held records in order, unless we have to wait for another pre master secret
+static void tls_parse_held_records(struct tls_parser *parser)
+{
+    struct tls_held_record *rec;
+    while (! parser->rsa_job && NULL != (rec = STAILQ_FIRST(&parser->held_records))) {
+        STAILQ_REMOVE_HEAD(&parser->held_records, entry);
+        parser->nb_held_records --;
+        tls_parse_held_record(parser, rec);
+        tls_held_record_del(rec);
+    }
+    tls_update_holding(parser);
+}
+
+static bool tls_rsa_job_done(struct tls_rsa_job *job)
+{
+    return __sync_fetch_and_add(&job->done, 0);
+}
+
+/* Parse the held records if the pre master secret is known (or, if wait is set,
+ * once it is known: RSA threads never drop a job they took). */
+static void tls_flush_held_records(struct tls_parser *parser, bool wait)
+{
+    while (! STAILQ_EMPTY(&parser->held_records)) {
+        if (parser->rsa_job) {
+            if (! tls_rsa_job_done(parser->rsa_job)) {
+                if (! wait) return;
+                sched_yield();
+                continue;
+            }
+            tls_rsa_job_finish(parser);
+        }
+        tls_parse_held_records(parser);
+    }
+}
+
+// Parse the held records of the parsers which pre master secret became known since their last record
+static void tls_held_replay_tick(struct timebound_ticker unused_ *ticker)
+{
+    // No parser thread (nor the doomer) may use these parsers meanwhile
+    enter_mono_region();
+
+    struct tls_parser *ready[64];
+    unsigned nb_ready;
+    do {
+        nb_ready = 0;
+        WITH_LOCK(&tls_holding_parsers_lock) {
+            struct tls_parser *parser;
+            LIST_FOREACH(parser, &tls_holding_parsers, holding_entry) {
+                if (nb_ready >= NB_ELEMS(ready)) break;
+                if (parser->rsa_job && ! tls_rsa_job_done(parser->rsa_job)) continue;
+                if (! ref_unless_zero(&parser->parser.ref)) continue;
+                ready[nb_ready++] = parser;
+            }
+        }
+        // Parse them without tls_holding_parsers_lock, that parsing takes
+        for (unsigned p = 0; p < nb_ready; p++) {
+            struct parser *parser = &ready[p]->parser;
+            flow_lock(ready[p]->sbuf.mutex, &ready[p]->sbuf.owner);
+            tls_flush_held_records(ready[p], false);
+            flow_unlock(ready[p]->sbuf.mutex);
+            parser_unref(&parser);
+        }
+    } while (nb_ready == NB_ELEMS(ready));
+
+    leave_protected_region();
+}
+
+/* Before a record is parsed, use the pre master secret if it's ready, then parse the records that were waiting for it.
+ * Returns true if this record must wait as well (then it's held). */
+static bool tls_wait_rsa_job(struct tls_parser *parser, unsigned way, struct tls_proto_info const *info, size_t cap_len, size_t wire_len, uint8_t const *content, struct proto_info *parent, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
+{
+    while (parser->rsa_job || ! STAILQ_EMPTY(&parser->held_records)) {
+        if (parser->rsa_job) {
+            if (tls_rsa_job_done(parser->rsa_job)) {
+                tls_rsa_job_finish(parser);
+            } else {
+                if (0 == tls_hold_record(parser, way, info, cap_len, wire_len, content, parent, now, tot_cap_len, tot_packet)) return true;
+                // Parse what we have without decrypting it, so that we keep track of the cipher specs at least
+                SLOG(LOG_DEBUG, "Too many records waiting for the pre master secret, give up decryption");
+                __sync_fetch_and_add(&nb_held_overflows, 1);
+                tls_rsa_job_unref(parser->rsa_job);
+                parser->rsa_job = NULL;
+            }
+        }
+        tls_parse_held_records(parser);
+    }
+
+    return false;
+}
+
 static enum proto_parse_status tls_sbuf_parse(struct parser *parser, struct proto_info *parent, unsigned way, uint8_t const *payload, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
     struct tls_parser *tls_parser = DOWNCAST(parser, parser, tls_parser);
@@ -1468,7 +2023,6 @@ static enum proto_parse_status tls_sbuf_parse(struct parser *parser, struct prot
     }
 
     // Wait for a full record before proceeding
-#   define TLS_RECORD_HEAD 5
     if (wire_len < TLS_RECORD_HEAD) {
         proto_parse(NULL, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet);
         streambuf_set_restart(&tls_parser->sbuf, way, payload, wire_len + 1);
@@ -1506,7 +2060,12 @@ static enum proto_parse_status tls_sbuf_parse(struct parser *parser, struct prot
     // Parse the rest of the record according to the content_type
     streambuf_set_restart(&tls_parser->sbuf, way, payload + TLS_RECORD_HEAD + length, 0);
 
-    enum proto_parse_status status = tls_parse_record(tls_parser, way, &info, MIN(cap_len - TLS_RECORD_HEAD, length), length, payload + TLS_RECORD_HEAD, now, tot_cap_len, tot_packet);
+    size_t const content_cap_len = MIN(cap_len - TLS_RECORD_HEAD, length);
+    if (tls_wait_rsa_job(tls_parser, way, &info, content_cap_len, length, payload + TLS_RECORD_HEAD, parent, now, tot_cap_len, tot_packet)) {
+        // The subscribers will receive this record once it's parsed
+        return proto_parse(NULL, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet);
+    }
+    enum proto_parse_status const status = tls_parse_record(tls_parser, way, &info, content_cap_len, length, payload + TLS_RECORD_HEAD, now, tot_cap_len, tot_packet);
 
     if (status != PROTO_OK) return PROTO_PARSE_ERR;
 
@@ -1537,6 +2096,7 @@ void tls_init(void)
 {
     log_category_proto_tls_init();
     hash_init();
+    timebound_init();
 
     LIST_INIT(&tls_keyfiles);
     mutex_ctor(&tls_keyfiles_lock, "TLS keyfiles");
@@ -1544,6 +2104,15 @@ void tls_init(void)
     X509V3_add_standard_extensions();   // ssldump does this
 
     ext_param_max_sessions_per_key_init();
+    ext_param_nb_rsa_threads_init();
+    ext_param_max_held_records_init();
+    ext_param_nb_rsa_jobs_init();
+    ext_param_nb_rsa_dropped_init();
+    ext_param_nb_held_overflows_init();
+    bench_event_ctor(&rsa_decrypting, "RSA decryption of pre master secrets");
+    LIST_INIT(&tls_holding_parsers);
+    mutex_ctor(&tls_holding_parsers_lock, "TLS holding parsers");
+    timebound_ticker_ctor(&tls_held_replayer, "replay TLS held records", tls_held_replay_tick);
 
     // Initialize all ciphers
     for (unsigned c = 0; c < NB_ELEMS(tls_cipher_infos); c++) {
@@ -1567,7 +2136,8 @@ void tls_init(void)
         .parser_new  = tls_parser_new,
         .parser_del  = tls_parser_del,
         .info_2_str  = tls_info_2_str,
-        .info_addr   = tls_info_addr
+        .info_addr   = tls_info_addr,
+        .parser_size = sizeof(struct tls_parser),
     };
     proto_ctor(&proto_tls_, &ops, "TLS", PROTO_CODE_TLS);
     port_muxer_ctor(&tcp_port_muxer_https, &tcp_port_muxers, 443, 443, proto_tls);
@@ -1598,7 +2168,11 @@ void tls_init(void)
 
 void tls_fini(void)
 {
+    timebound_ticker_dtor(&tls_held_replayer);
+
 #   ifdef DELETE_ALL_AT_EXIT
+    WITH_EXT_LOCK(nb_rsa_threads, rsa_threads_resize(0));
+
     port_muxer_dtor(&tcp_port_muxer_ftps, &tcp_port_muxers);
     port_muxer_dtor(&tcp_port_muxer_skinny, &tcp_port_muxers);
     port_muxer_dtor(&tcp_port_muxer_https, &tcp_port_muxers);
@@ -1610,11 +2184,19 @@ void tls_fini(void)
         tls_keyfile_del(keyfile);
     }
     mutex_dtor(&tls_keyfiles_lock);
+    mutex_dtor(&tls_holding_parsers_lock);
     mutex_pool_dtor(&streambuf_locks);
 #   endif
 
+    bench_event_dtor(&rsa_decrypting);
+    ext_param_nb_held_overflows_fini();
+    ext_param_nb_rsa_dropped_fini();
+    ext_param_nb_rsa_jobs_fini();
+    ext_param_max_held_records_fini();
+    ext_param_nb_rsa_threads_fini();
     ext_param_max_sessions_per_key_fini();
 
+    timebound_fini();
     hash_fini();
     log_category_proto_tls_fini();
 }
@@ -99,11 +99,11 @@ static int tns_parser_ctor(struct tns_parser *tns_parser, struct proto *proto)
 
 static struct parser *tns_parser_new(struct proto *proto)
 {
-    struct tns_parser *tns_parser = objalloc_nice(sizeof(*tns_parser), "TNS parsers");
+    struct tns_parser *tns_parser = parser_alloc(proto, sizeof(*tns_parser), "TNS parsers");
     if (! tns_parser) return NULL;
 
     if (-1 == tns_parser_ctor(tns_parser, proto)) {
-        objfree(tns_parser);
+        parser_free(tns_parser);
         return NULL;
     }
 
@@ -120,7 +120,7 @@ static void tns_parser_del(struct parser *parser)
 {
     struct tns_parser *tns_parser = DOWNCAST(parser, parser, tns_parser);
     tns_parser_dtor(tns_parser);
-    objfree(tns_parser);
+    parser_free(tns_parser);
 }
 
 /*
@@ -1195,7 +1195,8 @@ void tns_init(void)
         .parser_new  = tns_parser_new,
         .parser_del  = tns_parser_del,
         .info_2_str  = sql_info_2_str,
-        .info_addr   = sql_info_addr
+        .info_addr   = sql_info_addr,
+        .parser_size = sizeof(struct tns_parser),
     };
     proto_ctor(&proto_tns_, &ops, "TNS", PROTO_CODE_TNS);
     port_muxer_ctor(&tns_tcp_muxer, &tcp_port_muxers, 1521, 1521, proto_tns);
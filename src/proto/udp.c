@@ -28,6 +28,9 @@
 #include "junkie/proto/cnxtrack.h"
 #include "junkie/proto/ip.h"
 #include "junkie/proto/udp.h"
+#include "junkie/proto/flow_cache.h"
+#include "junkie/proto/discovery.h"
+#include "junkie/proto/port_muxer.h"
 #include "proto/ip_hdr.h"
 
 #undef LOG_CAT
@@ -35,7 +38,7 @@
 
 LOG_CATEGORY_DEF(proto_udp);
 
-#define UDP_HASH_SIZE 67
+#define UDP_HASH_SIZE 64
 
 /*
  * Proto Infos
@@ -140,18 +143,25 @@ static enum proto_parse_status udp_parse(struct parser *parser, struct proto_inf
     // Search an already spawned subparser
     struct port_key key;
     port_key_init(&key, sport, dport, way);
-    struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &key, now);
+    struct mux_subparser *subparser = flow_cache_lookup(mux_parser, sport, dport, now);
+    if (! subparser) {
+        subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &key, now);
+        if (subparser) flow_cache_store(mux_parser, sport, dport, subparser, &key);
+    }
     if (subparser) SLOG(LOG_DEBUG, "Found subparser for this cnx, for proto %s", subparser->parser->proto->name);
 
+    ASSIGN_INFO_OPT2(ip, ip6, parent);
+    if (! ip) ip = ip6;
+
     if (! subparser) {
         struct proto *requestor = NULL;
         struct proto *sub_proto = NULL;
         // Use connection tracking first
-        ASSIGN_INFO_OPT2(ip, ip6, parent);
-        if (! ip) ip = ip6;
         if (ip) sub_proto = cnxtrack_ip_lookup(IPPROTO_UDP, ip->key.addr+0, sport, ip->key.addr+1, dport, now, &requestor);
         if (! sub_proto) { // Then try predefined ports first
             sub_proto = port_muxer_find(&udp_port_muxers, info.key.port[0], info.key.port[1]);
+            // Unless the discovery already gave up on this server
+            if (sub_proto == proto_discovery && ip && discovery_skip(IPPROTO_UDP, ip->key.addr, info.key.port, now)) sub_proto = NULL;
         }
         if (sub_proto) subparser = mux_subparser_and_parser_new(mux_parser, sub_proto, requestor, &key, now);
     }
@@ -161,6 +171,11 @@ static enum proto_parse_status udp_parse(struct parser *parser, struct proto_inf
     enum proto_parse_status status = proto_parse(subparser->parser, &info.info, way, packet + sizeof(*udphdr), cap_len - sizeof(*udphdr), wire_len - sizeof(*udphdr), now, tot_cap_len, tot_packet);
     if (status == PROTO_PARSE_ERR) {
         SLOG(LOG_DEBUG, "No suitable subparser for this payload");
+        if (subparser->proto == proto_discovery && ip) {
+            // We keep no state per flow, so it's the server that's given up on
+            unsigned const srv = comes_from_client(info.key.port, false, false);
+            (void)discovery_failed(NULL, IPPROTO_UDP, ip->key.addr+srv, info.key.port[srv], payload, now);
+        }
         mux_subparser_deindex(subparser);
     }
     mux_subparser_unref(&subparser);
@@ -181,6 +196,7 @@ static struct ip_subproto ip_subproto, ip6_subproto;
 
 void udp_init(void)
 {
+    flow_cache_init();
     log_category_proto_udp_init();
 
     static struct proto_ops const ops = {
@@ -222,4 +238,5 @@ void udp_fini(void)
 #   endif
 
     log_category_proto_udp_fini();
+    flow_cache_fini();
 }
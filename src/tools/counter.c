@@ -0,0 +1,104 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2014, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "junkie/tools/miscmacs.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/counter.h"
+
+__thread unsigned counters_my_slot;
+
+/* Slots of exiting threads are given back (with their values, which still count
+ * in the sums) so that short lived threads do not end up sharing the last one. */
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool slot_used[CPU_MAX];    // protected by slots_mutex
+static pthread_key_t slot_key;     // to be told when a thread owning a slot exits
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static void counters_slot_free(void *slot_)
+{
+    unsigned const slot = (uintptr_t)slot_ - 1;
+    assert(slot < CPU_MAX);
+    counters_my_slot = 0;   // in case another destructor of this thread adds to a counter
+    WITH_PTH_MUTEX(&slots_mutex) {
+        slot_used[slot] = false;
+    }
+}
+
+static void slot_key_ctor(void)
+{
+    (void)pthread_key_create(&slot_key, counters_slot_free);
+}
+
+void counters_ctor(struct counters *counters)
+{
+    for (unsigned c = 0; c < COUNTERS_MAX; c++) {
+        for (unsigned s = 0; s < NB_ELEMS(counters->slots); s++) {
+            counters->slots[s].values[c] = 0;
+        }
+        counters->base[c] = 0;
+    }
+}
+
+unsigned counters_slot_alloc(void)
+{
+    if (! counters_my_slot) {
+        unsigned slot = CPU_MAX;    // share the last one unless another one is free
+        WITH_PTH_MUTEX(&slots_mutex) {
+            for (unsigned s = 0; s < CPU_MAX; s++) {
+                if (slot_used[s]) continue;
+                slot_used[s] = true;
+                slot = s;
+                break;
+            }
+        }
+        if (slot < CPU_MAX) {
+            (void)pthread_once(&slot_key_once, slot_key_ctor);
+            (void)pthread_setspecific(slot_key, (void *)(uintptr_t)(slot + 1));
+        }
+        counters_my_slot = slot + 1;
+    }
+    return counters_my_slot - 1;
+}
+
+extern inline void counters_add(struct counters *, unsigned, uint64_t);
+
+static uint64_t counters_sum(struct counters const *counters, unsigned c)
+{
+    assert(c < COUNTERS_MAX);
+    uint64_t sum = 0;
+    for (unsigned s = 0; s < NB_ELEMS(counters->slots); s++) {
+        sum += counters->slots[s].values[c];
+    }
+    return sum;
+}
+
+uint64_t counters_read(struct counters const *counters, unsigned c)
+{
+    return counters_sum(counters, c) - counters->base[c];
+}
+
+void counters_reset(struct counters *counters, unsigned c)
+{
+    // We cannot write into other thread's slots
+    counters->base[c] = counters_sum(counters, c);
+}
@@ -0,0 +1,104 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2014, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <assert.h>
+#include "junkie/tools/objalloc.h"
+#include "junkie/tools/frame_buf.h"
+
+struct frame_buf *frame_buf_new(uint8_t const *data, size_t size)
+{
+    struct frame_buf *buf = objalloc_nice(sizeof(*buf) + size, "frame bufs");
+    if (! buf) return NULL;
+    buf->ref_count = 1;
+    buf->size = size;
+    memcpy(buf->data, data, size);
+    return buf;
+}
+
+struct frame_buf *frame_buf_ref(struct frame_buf *buf)
+{
+    if (! buf) return NULL;
+#   ifdef __GNUC__
+    (void)__sync_add_and_fetch(&buf->ref_count, 1);
+#   else
+    buf->ref_count ++;
+#   endif
+    return buf;
+}
+
+void frame_buf_unref(struct frame_buf **buf_)
+{
+    struct frame_buf *buf = *buf_;
+    if (! buf) return;
+    *buf_ = NULL;
+
+    assert(buf->ref_count > 0);
+    if (0 ==
+#       ifdef __GNUC__
+        __sync_sub_and_fetch(&buf->ref_count, 1)
+#       else
+        --buf->ref_count
+#       endif
+    ) objfree(buf);
+}
+
+/*
+ * Contexts
+ */
+
+static __thread struct frame_buf_ctx *frame_buf_ctx;
+
+void frame_buf_ctx_push(struct frame_buf_ctx *ctx, uint8_t const *data, size_t size, struct frame_buf *buf)
+{
+    assert(! buf || (data >= buf->data && data + size <= buf->data + buf->size));
+    ctx->data = data;
+    ctx->size = size;
+    ctx->buf = buf;
+    ctx->in_buf = data;
+    ctx->prev = frame_buf_ctx;
+    frame_buf_ctx = ctx;
+}
+
+void frame_buf_ctx_pop(struct frame_buf_ctx *ctx)
+{
+    assert(frame_buf_ctx == ctx);
+    frame_buf_ctx = ctx->prev;
+    frame_buf_unref(&ctx->buf);
+}
+
+struct frame_buf *frame_buf_hold(uint8_t const *data, size_t size, uint8_t const **copy)
+{
+    for (struct frame_buf_ctx *ctx = frame_buf_ctx; ctx; ctx = ctx->prev) {
+        if (data < ctx->data || data + size > ctx->data + ctx->size) continue;
+
+        if (! ctx->buf) {   // first holder of this frame
+            ctx->buf = frame_buf_new(ctx->data, ctx->size);
+            if (! ctx->buf) return NULL;
+            ctx->in_buf = ctx->buf->data;
+        }
+        *copy = ctx->in_buf + (data - ctx->data);
+        return frame_buf_ref(ctx->buf);
+    }
+
+    // Not within a known frame
+    struct frame_buf *buf = frame_buf_new(data, size);
+    if (buf) *copy = buf->data;
+    return buf;
+}
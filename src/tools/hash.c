@@ -22,6 +22,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
 #include "junkie/tools/ext.h"
 #include "junkie/tools/objalloc.h"
 #include "junkie/tools/log.h"
@@ -30,6 +33,8 @@
 
 struct hashes hashes = LIST_HEAD_INITIALIZER(hashes);
 
+uint64_t hash_seed;
+
 /*
  * Extensions
  */
@@ -76,6 +81,19 @@ static SCM g_hash_stats(SCM name_)
 
 extern inline uint_least32_t hashfun(void const *key, size_t len);
 
+static void hash_seed_init(void)
+{
+    FILE *f = fopen("/dev/urandom", "r");
+    if (f) {
+        if (1 != fread(&hash_seed, sizeof(hash_seed), 1, f)) hash_seed = 0;
+        fclose(f);
+    }
+    if (! hash_seed) {
+        SLOG(LOG_NOTICE, "Cannot read /dev/urandom, seeding hashes from time and pid");
+        hash_seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid() ^ (uint64_t)(uintptr_t)&hash_seed;
+    }
+}
+
 static unsigned inited;
 void hash_init(void)
 {
@@ -83,6 +101,9 @@ void hash_init(void)
     ext_init();
     objalloc_init();
 
+    // Must be done before any hash is filled, and never changed afterward
+    hash_seed_init();
+
     nb_lists_sym       = scm_permanent_object(scm_from_latin1_symbol("nb-lists"));
     nb_lists_min_sym   = scm_permanent_object(scm_from_latin1_symbol("nb-lists-min"));
     nb_entries_sym     = scm_permanent_object(scm_from_latin1_symbol("nb-entries"));
@@ -159,28 +159,19 @@ void mutex_dtor(struct mutex *mutex)
  * Supermutexes
  */
 
+/* Serializes the threads about to block on a supermutex, so that the last one
+ * closing a cycle sees all the others waiting. */
 static struct mutex supermutex_meta_lock;
 
 /* We cannot use thread local storage for the supermutex_user structure since
  * we want to access them from other threads as well.  Instead, we use thread
  * local storage to store the address of the current thread supermutex_user. */
 struct supermutex_user {
-    unsigned nb_locks;  /// how many locks I own or wait for
-#   define NB_MAX_LOCKED_SUPERMUTEX_PER_THREAD 16
-    struct supermutex_user_lock locks[NB_MAX_LOCKED_SUPERMUTEX_PER_THREAD];
+    struct supermutex *waiting_for; /// the supermutex I'm blocking on, if any. Protected by supermutex_meta_lock
 };
 
 static __thread struct supermutex_user *my_supermutex_user;
 
-
-static void supermutex_user_ctor(struct supermutex_user *usr)
-{
-    usr->nb_locks = 0;
-    for (unsigned l = 0; l < NB_ELEMS(usr->locks); l ++) {
-        usr->locks[l].user = usr;
-    }
-}
-
 static struct supermutex_user *supermutex_user_new(void)
 {
     struct supermutex_user *usr = malloc(sizeof(*usr)); // we do not use objalloc to avoid circular dependancy here
@@ -188,20 +179,10 @@ static struct supermutex_user *supermutex_user_new(void)
         SLOG(LOG_CRIT, "Cannot allocate for a supermutex_user! I'm sorry there's no alternative!");
         abort();
     }
-    supermutex_user_ctor(usr);
+    usr->waiting_for = NULL;
     return usr;
 }
 
-// This will never get called, but hopefully no thread will quit with some supermutex locked.
-// FIXME: use TLS pthread API to register a finalizer?
-#if 0
-static void supermutex_user_dtor(struct supermutex_user *usr)
-{
-    // We are supposed to release our locks first
-    assert(usr->nb_locks == 0);
-}
-#endif
-
 static char const *supermutex_name(struct supermutex const *super)
 {
     return tempstr_printf("%s@%p", super->mutex.name, super);
@@ -210,38 +191,30 @@ static char const *supermutex_name(struct supermutex const *super)
 void supermutex_ctor(struct supermutex *super, char const *name)
 {
     SLOG(LOG_DEBUG, "Construct supermutex %s@%p", name, super);
-    mutex_lock(&supermutex_meta_lock);
     mutex_ctor(&super->mutex, name);
-    LIST_INIT(&super->holders);
-    mutex_unlock(&supermutex_meta_lock);
+    super->owner = NULL;
+    super->rec_count = 0;
 }
 
 void supermutex_dtor(struct supermutex *super)
 {
     SLOG(LOG_DEBUG, "Destruct supermutex %s", supermutex_name(super));
-    mutex_lock(&supermutex_meta_lock);
-    assert(LIST_EMPTY(&super->holders));
+    assert(! super->owner);
     mutex_dtor(&super->mutex);
-    mutex_unlock(&supermutex_meta_lock);
-}
-
-/* Starting from the mutex super owned by user usr, try all other threads owning it, and look for cycle back to target.
- * Caller must own supermutex_meta_lock. */
-static bool supermutex_is_cycling(struct supermutex_user *usr, struct supermutex *super, struct supermutex_user *target)
-{
-    // Look for all other threads owning/waiting this supermutex
-    struct supermutex_user_lock *sul;
-    LIST_FOREACH(sul, &super->holders, entry) {
-        struct supermutex_user *const usr_ = sul->user;
-        if (usr_ == usr) continue;  // in the special case where usr == target dont report a cycle
-        if (usr_ == target) return true;
-        // Now look over all *other* locks owned by this other thread
-        for (unsigned l = 0; l < usr_->nb_locks; l++) {
-            if (! usr_->locks[l].supermutex) continue;
-            if (usr_->locks[l].supermutex == super) continue;
-            // Can I reach target from this one?
-            if (supermutex_is_cycling(usr_, usr_->locks[l].supermutex, target)) return true;
-        }
+}
+
+/* Starting from the owner of super, follow the supermutexes the owners are waiting for, looking for usr.
+ * Caller must own supermutex_meta_lock, so that waiting_for are stable. Owners may change meanwhile,
+ * but only threads that are not blocked can do that, and these cannot be part of a cycle. */
+static bool supermutex_is_cycling(struct supermutex const *super, struct supermutex_user const *usr)
+{
+    // Bound the walk in case we meet a stale owner that's waiting for us no more
+#   define MAX_WAIT_CHAIN 1000
+    for (unsigned n = 0; super && n < MAX_WAIT_CHAIN; n++) {
+        struct supermutex_user const *const owner = super->owner;
+        if (! owner) return false;  // it's being released
+        if (owner == usr) return true;
+        super = owner->waiting_for;
     }
 
     return false;
@@ -253,55 +226,50 @@ int supermutex_lock(struct supermutex *super)
         my_supermutex_user = supermutex_user_new();
     }
 
-    assert(my_supermutex_user->nb_locks <= NB_ELEMS(my_supermutex_user->locks));
-
-    // Easy case: maybe I already own it?
-    unsigned l;
-    unsigned free_l = UNSET;
-    for (l = 0; l < my_supermutex_user->nb_locks; l++) {
-        if (my_supermutex_user->locks[l].supermutex == super) break;
-        if (my_supermutex_user->locks[l].supermutex == NULL) free_l = l;
-    }
-    if (l < my_supermutex_user->nb_locks) {
+    // Easy case: maybe I already own it? (only I can set the owner to me)
+    if (super->owner == my_supermutex_user) {
         SLOG(LOG_DEBUG, "Locking again supermutex %s", supermutex_name(super));
-        assert(my_supermutex_user->locks[l].rec_count > 0);
+        assert(super->rec_count > 0);
 
-        if (my_supermutex_user->locks[l].rec_count == UINT_MAX) {
+        if (super->rec_count == UINT_MAX) {
             SLOG(LOG_CRIT, "Too many recursive locking of supermutex %s", supermutex_name(super));
             return MUTEX_TOO_MANY_RECURS;
         }
-        my_supermutex_user->locks[l].rec_count ++;
+        super->rec_count ++;
         return 0;
     }
 
-    mutex_lock(&supermutex_meta_lock);
-
-    // From this lock (supposed I go for it), look for a circular dependancy
-    if (supermutex_is_cycling(my_supermutex_user, super, my_supermutex_user)) {
-        SLOG(LOG_INFO, "Locking supermutex %s may deadlock!", supermutex_name(super));
-        mutex_unlock(&supermutex_meta_lock);
-        return MUTEX_DEADLOCK;
-    }
-
-    // Adding me in the list of holders
-    if (free_l != UNSET) {
-        l = free_l;
+    // Usual case: it's free, and since we do not wait we cannot deadlock
+    int const err = pthread_mutex_trylock(&super->mutex.mutex);
+    if (err == 0) {
+        bench_event_fire(&super->mutex.lock_for_free);
+    } else if (err != EBUSY) {
+        SLOG(LOG_ERR, "Cannot lock supermutex %s: %s", supermutex_name(super), strerror(err));
+        return MUTEX_SYS_ERROR;
     } else {
-        if (my_supermutex_user->nb_locks == NB_ELEMS(my_supermutex_user->locks)) {
-            SLOG(LOG_ERR, "Cannot lock supermutex %s since I'm holding too many locks already!?", supermutex_name(super));
+        mutex_lock(&supermutex_meta_lock);
+
+        // From this lock (supposed I go for it), look for a circular dependancy
+        if (supermutex_is_cycling(super, my_supermutex_user)) {
+            SLOG(LOG_INFO, "Locking supermutex %s may deadlock!", supermutex_name(super));
             mutex_unlock(&supermutex_meta_lock);
-            return MUTEX_SYS_ERROR;
+            return MUTEX_DEADLOCK;
         }
-        l = my_supermutex_user->nb_locks++;
-    }
-    my_supermutex_user->locks[l].rec_count = 1;
-    my_supermutex_user->locks[l].supermutex = super;
-    LIST_INSERT_HEAD(&super->holders, my_supermutex_user->locks+l, entry);
+        my_supermutex_user->waiting_for = super;
 
-    mutex_unlock(&supermutex_meta_lock);
+        mutex_unlock(&supermutex_meta_lock);
+
+        // Wait for the lock
+        mutex_lock(&super->mutex);
+
+        // Stop waiting before becoming the owner, so that nobody sees me waiting for what I own
+        mutex_lock(&supermutex_meta_lock);
+        my_supermutex_user->waiting_for = NULL;
+        mutex_unlock(&supermutex_meta_lock);
+    }
 
-    // Wait for the lock
-    mutex_lock(&super->mutex);
+    super->owner = my_supermutex_user;
+    super->rec_count = 1;
 
     return 0;
 }
@@ -325,29 +293,14 @@ void supermutex_unlock(struct supermutex *super)
 {
     SLOG(LOG_DEBUG, "Unlocking supermutex %s", supermutex_name(super));
 
-    assert(my_supermutex_user->nb_locks <= NB_ELEMS(my_supermutex_user->locks));
-    assert(my_supermutex_user->nb_locks > 0);
+    assert(my_supermutex_user);
+    assert(super->owner == my_supermutex_user);  // Or I'm releasing something I do not own?
+    assert(super->rec_count > 0);
 
-    unsigned l;
-    for (l = 0; l < my_supermutex_user->nb_locks; l++) {
-        if (my_supermutex_user->locks[l].supermutex == super) break;
-    }
-    assert(l < my_supermutex_user->nb_locks);  // Or I'm releasing something I do not own?
+    if (--super->rec_count > 0) return;
 
-    if (--my_supermutex_user->locks[l].rec_count > 0) return;
-
-    mutex_lock(&supermutex_meta_lock);
-
-    LIST_REMOVE(my_supermutex_user->locks+l, entry);
-    my_supermutex_user->locks[l].supermutex = NULL;
+    super->owner = NULL;
     mutex_unlock(&super->mutex);
-
-    mutex_unlock(&supermutex_meta_lock);
-
-    // Compact nb_locks
-    while (my_supermutex_user->nb_locks > 0 && my_supermutex_user->locks[my_supermutex_user->nb_locks-1].supermutex == NULL) {
-        my_supermutex_user->nb_locks--;
-    }
 }
 
 /*
@@ -381,6 +334,45 @@ static SCM g_set_thread_name(SCM name_)
     return SCM_UNSPECIFIED;
 }
 
+/*
+ * Flow affinity
+ */
+
+bool flow_affinity;
+
+static __thread unsigned parser_thread = UNSET;
+
+void set_parser_thread(unsigned idx)
+{
+    SLOG(LOG_DEBUG, "This is parser thread %u", idx);
+    parser_thread = idx;
+}
+
+unsigned get_parser_thread(void)
+{
+    return parser_thread;
+}
+
+void flow_owner_ctor(struct flow_owner *owner)
+{
+    owner->thread = UNSET;
+}
+
+bool flow_owner_check(struct flow_owner *owner)
+{
+    if (! flow_affinity || parser_thread == UNSET) return true;
+
+    // No need for atomicity: if flows are affine no other parser thread can race us here
+    if (owner->thread == UNSET) owner->thread = parser_thread;
+    if (owner->thread == parser_thread) return true;
+
+    SLOG(LOG_ERR, "Flow owned by parser thread %u is parsed by parser thread %u", owner->thread, parser_thread);
+    return false;
+}
+
+extern inline void flow_lock(struct mutex *, struct flow_owner *);
+extern inline void flow_unlock(struct mutex *);
+
 /*
  * RW locks
  */
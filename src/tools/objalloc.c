@@ -150,7 +150,7 @@ static struct redim_array *preset_objalloc_for_size(size_t entry_size, char cons
  *   between the free and the alloc we might have changed the policy
  *   regarding this size!) */
 struct obj {
-    struct redim_array *ra; // where bit 0 is set to 1 if it's not specialized
+    struct redim_array *ra; // where bit 0 is set to 1 if it's not specialized (and bit 1 if carved, see below)
     char userdata[];
 };
 
@@ -203,10 +203,58 @@ void *objalloc_nice(size_t entry_size, char const *requestor)
     return objalloc(entry_size, requestor);
 }
 
+/*
+ * Carved objects
+ *
+ * A carver is allocated like any object, prefixed with its number of residents.
+ * Objects carved out of it (the carver itself to begin with) only have a struct obj
+ * which ra points to the carver, with bit 1 set.
+ */
+
+#define CARVED 2
+
+struct carver {
+    unsigned nb_residents;  // the carver itself and the objects carved out of it that are not freed yet
+    struct obj obj;         // the carver as seen by the user
+};
+
+void *objalloc_carver(size_t size, char const *requestor)
+{
+    CHECK_LAST_FIELD(carver, obj, struct obj);
+
+    struct carver *carver = objalloc_nice(sizeof(*carver) + size, requestor);
+    if (! carver) return NULL;
+    carver->nb_residents = 1;
+    carver->obj.ra = (void *)((intptr_t)carver | CARVED);
+    return carver->obj.userdata;
+}
+
+size_t objalloc_carved_size(size_t size)
+{
+    // Keep carved objects as aligned as the carver
+    return sizeof(struct obj) + CEIL_DIV(size, sizeof(struct obj)) * sizeof(struct obj);
+}
+
+void *objalloc_carve(void *carver_, size_t offset)
+{
+    struct carver *carver = DOWNCAST(DOWNCAST(carver_, userdata, obj), obj, carver);
+    assert((intptr_t)carver->obj.ra & CARVED);
+    assert(offset % sizeof(struct obj) == 0);
+    (void)__sync_add_and_fetch(&carver->nb_residents, 1);
+    struct obj *obj = (struct obj *)((char *)carver_ + offset);
+    obj->ra = carver->obj.ra;
+    return obj->userdata;
+}
+
 void objfree(void *ptr)
 {
     struct obj *obj = DOWNCAST(ptr, userdata, obj);
     assert(obj->ra);
+    if ((intptr_t)obj->ra & CARVED) {
+        struct carver *carver = (void *)((intptr_t)obj->ra ^ CARVED);
+        if (0 == __sync_sub_and_fetch(&carver->nb_residents, 1)) objfree(carver);
+        return;
+    }
     if ((intptr_t)obj->ra & 1) {    // unspecialized redim_array
         struct preset_obj *p_obj = DOWNCAST(obj, obj, preset_obj);
         if (p_obj->spec_size < NB_ELEMS(spec_objallocs)) {
@@ -50,16 +50,44 @@ void timebound_pool_ctor(struct timebound_pool *pool, char const *name, unsigned
     pool->timeout = timeout;
     pool->del = del;
     pool->next_bucket = 0;    // to please valgrind, but any value would do
+    pool->nb_timeouts = 0;
+    bench_event_ctor(&pool->timeouting, "timeout timebound objects");
     for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
         struct timebound_bucket *const bucket = pool->buckets + p;
         mutex_ctor_recursive(&bucket->mutex, "timebound_pool bucket");
-        TAILQ_INIT(&bucket->list);
+        wheel_ctor(&bucket->wheel, 0);
     }
     WITH_LOCK(&timebound_pools_mutex) {
         LIST_INSERT_HEAD(&timebound_pools, pool, entry);
     }
 }
 
+struct timebound_timeout_ctx {
+    struct timebound_pool *pool;
+    struct timebound_bucket *bucket;
+    time_t now;
+    unsigned timeout;
+    bool kill_all;
+    unsigned count;
+};
+
+// Called with the bucket mutex for each object which timer fired
+static void timebound_timer_cb(struct wheel_timer *timer, void *ctx_)
+{
+    struct timebound_timeout_ctx *ctx = ctx_;
+    struct timebound *t = DOWNCAST(timer, timer, timebound);
+
+    // A last_used in the future counts as expired (the clock went backward)
+    if (! ctx->kill_all && (uint64_t)(ctx->now - t->last_used) < ctx->timeout) {
+        wheel_add(&ctx->bucket->wheel, timer, t->last_used);
+        return;
+    }
+
+    SLOG(LOG_DEBUG, "Timeouting timebound object@%p", t);
+    ctx->pool->del(t);
+    ctx->count ++;
+}
+
 void timebound_pool_dtor(struct timebound_pool *pool)
 {
     SLOG(LOG_DEBUG, "Destruct timebound_pool@%p (%s)", pool, pool->name);
@@ -70,12 +98,41 @@ void timebound_pool_dtor(struct timebound_pool *pool)
 
     for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
         struct timebound_bucket *const bucket = pool->buckets + p;
-        struct timebound *t;
-        while (NULL != (t = TAILQ_LAST(&bucket->list, timebounds))) {
-            pool->del(t);
+        struct timebound_timeout_ctx ctx = {
+            .pool = pool, .bucket = bucket, .kill_all = true, .count = 0,
+        };
+        WITH_LOCK(&bucket->mutex) {
+            (void)wheel_reset(&bucket->wheel, 0, timebound_timer_cb, &ctx);
         }
+        wheel_dtor(&bucket->wheel);
         mutex_dtor(&bucket->mutex);
     }
+    bench_event_dtor(&pool->timeouting);
+}
+
+// Caller must own timebound_pools_mutex
+static void timebound_pool_timeout(struct timebound_pool *pool, time_t now)
+{
+    unsigned const timeout = *pool->timeout;
+    if (! timeout) return;
+    if (now < (time_t)timeout) return;
+
+    SLOG(LOG_DEBUG, "Timeouting timebound_pool@%p (%s), which timeout=%u", pool, pool->name, timeout);
+    uint64_t start = bench_event_start();
+    uint64_t const cutoff = now - timeout;  // objects last used at or before that must die
+
+    for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
+        struct timebound_bucket *const bucket = pool->buckets + p;
+        struct timebound_timeout_ctx ctx = {
+            .pool = pool, .bucket = bucket, .now = now, .timeout = timeout, .kill_all = false, .count = 0,
+        };
+        WITH_LOCK(&bucket->mutex) {
+            (void)wheel_timeout(&bucket->wheel, cutoff, (uint64_t)now + timeout, 0, timebound_timer_cb, &ctx);
+        }
+        pool->nb_timeouts += ctx.count;
+    }
+
+    bench_event_stop(&pool->timeouting, start);
 }
 
 void timebound_ctor(struct timebound *t, struct timebound_pool *pool, struct timeval const *now)
@@ -85,11 +142,11 @@ void timebound_ctor(struct timebound *t, struct timebound_pool *pool, struct tim
     unsigned const b = pool->next_bucket ++;
     struct timebound_bucket *const bucket = pool->buckets + (b % NB_ELEMS(pool->buckets));
     t->bucket = bucket;
-    t->monitored = true;
     SLOG(LOG_DEBUG, "...bucket=%p", bucket);
-    t->last_used = now->tv_sec;
+    last_used = t->last_used = now->tv_sec;
+    wheel_timer_ctor(&t->timer);
     WITH_LOCK(&bucket->mutex) {
-        TAILQ_INSERT_HEAD(&bucket->list, t, entry);
+        wheel_add(&bucket->wheel, &t->timer, t->last_used);
     }
 }
 
@@ -98,37 +155,51 @@ void timebound_dtor(struct timebound *t)
     SLOG(LOG_DEBUG, "Destruct timebound object@%p", t);
     SLOG(LOG_DEBUG, "...bucket=%p", t->bucket);
 
-    t->monitored = false;
-#   ifdef __GNUC__
-    __sync_synchronize();   // flush this *before* unlisting
-#   else
-    // ?
-#   endif
     struct mutex *mutex = &t->bucket->mutex;
     WITH_LOCK(mutex) {
-        TAILQ_REMOVE(&t->bucket->list, t, entry);
+        wheel_del(&t->bucket->wheel, &t->timer);  // no-op if called from the deletor
         t->bucket = NULL;   // will catch double destruction
     }
 }
 
 void timebound_touch(struct timebound *t, struct timeval const *now)
 {
-#   ifdef __GNUC__
-    __sync_synchronize();   // read actual t->monitored
-#   else
-    // ?
-#   endif
-    if (! t->monitored) return;
-    // TODO timebound can be destroyed between the monitored check and the mutex lock
-
-    SLOG(LOG_DEBUG, "Touching timebound object @%p", t);
-    WITH_LOCK(&t->bucket->mutex) {
-        if (t->monitored) {
-            TAILQ_REMOVE(&t->bucket->list, t, entry);
-            TAILQ_INSERT_HEAD(&t->bucket->list, t, entry);
-        }
+    /* The timer is not moved: when it fires the timebounder will notice that the
+     * object was used since, and will merely arm it again. */
+    if (t->last_used != now->tv_sec) last_used = t->last_used = now->tv_sec;
+}
+
+/*
+ * Tickers
+ */
+
+static struct mutex tickers_mutex;  // protects tickers and their running flags (but is not held while they run)
+static pthread_cond_t ticker_done = PTHREAD_COND_INITIALIZER;  // signaled (with tickers_mutex) whenever a ticker returns
+static LIST_HEAD(timebound_tickers, timebound_ticker) tickers;
+
+void timebound_ticker_ctor(struct timebound_ticker *ticker, char const *name, void (*tick)(struct timebound_ticker *))
+{
+    SLOG(LOG_DEBUG, "Construct timebound_ticker@%p for %s", ticker, name);
+
+    ticker->name = name;
+    ticker->tick = tick;
+    ticker->running = false;
+    bench_event_ctor(&ticker->ticking, name);
+    WITH_LOCK(&tickers_mutex) {
+        LIST_INSERT_HEAD(&tickers, ticker, entry);
     }
-    last_used = t->last_used = now->tv_sec;
+}
+
+void timebound_ticker_dtor(struct timebound_ticker *ticker)
+{
+    SLOG(LOG_DEBUG, "Destruct timebound_ticker@%p (%s)", ticker, ticker->name);
+
+    WITH_LOCK(&tickers_mutex) {
+        // Wait for the timebounder to be done with it
+        while (ticker->running) pthread_cond_wait(&ticker_done, &tickers_mutex.mutex);
+        LIST_REMOVE(ticker, entry);
+    }
+    bench_event_dtor(&ticker->ticking);
 }
 
 /*
@@ -136,7 +207,6 @@ void timebound_touch(struct timebound *t, struct timeval const *now)
  */
 
 static pthread_t timebounder_pth;
-static struct bench_event timebounding;
 
 static void *timebounder_thread_(void unused_ *dummy)
 {
@@ -144,31 +214,33 @@ static void *timebounder_thread_(void unused_ *dummy)
     disable_cancel();
 
     while (1) {
-        uint64_t start = bench_event_start();
         WITH_LOCK(&timebound_pools_mutex) {
+            time_t const now = last_used;
             struct timebound_pool *pool;
             LIST_FOREACH(pool, &timebound_pools, entry) {
-                unsigned const timeout = *pool->timeout;
-                if (! timeout) continue;
-                time_t max_last_used = last_used - timeout;
-
-                SLOG(LOG_DEBUG, "Timeouting timebound_pool@%p (%s), which timeout=%u", pool, pool->name, timeout);
-                for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
-                    struct timebound_bucket *const bucket = pool->buckets + p;
-                    WITH_LOCK(&bucket->mutex) {
-                        // from last to first
-                        struct timebound *t, *tmp;
-                        TAILQ_FOREACH_REVERSE_SAFE(t, &bucket->list, timebounds, entry, tmp) {
-                            if (t->last_used > max_last_used) break;
-
-                            SLOG(LOG_DEBUG, "Timeouting timebound object@%p", t);
-                            pool->del(t);
-                        }
-                    }
-                }
+                timebound_pool_timeout(pool, now);
             }
         }
-        bench_event_stop(&timebounding, start);
+
+        /* Run each ticker without tickers_mutex, so that a slow one does not block
+         * the construction or destruction of the others. A running ticker cannot be
+         * destructed, so that we can then go on with the next one. */
+        mutex_lock(&tickers_mutex);
+        struct timebound_ticker *ticker = LIST_FIRST(&tickers);
+        while (ticker) {
+            ticker->running = true;
+            mutex_unlock(&tickers_mutex);
+
+            uint64_t start = bench_event_start();
+            ticker->tick(ticker);
+            bench_event_stop(&ticker->ticking, start);
+
+            mutex_lock(&tickers_mutex);
+            ticker->running = false;
+            pthread_cond_broadcast(&ticker_done);
+            ticker = LIST_NEXT(ticker, entry);
+        }
+        mutex_unlock(&tickers_mutex);
 
         // Wait
         cancellable_sleep(1);
@@ -191,11 +263,13 @@ void timebound_init(void)
 {
     if (inited++) return;
     mutex_init();
+    bench_init();
 
     mutex_ctor(&timebound_pools_mutex, "timebound pools");
+    mutex_ctor(&tickers_mutex, "timebound tickers");
     LIST_INIT(&timebound_pools);
+    LIST_INIT(&tickers);
     log_category_timebound_init();
-    bench_event_ctor(&timebounding, "timeout timebound objects");
 
     int err = pthread_create(&timebounder_pth, NULL, timebounder_thread, NULL);
 
@@ -213,13 +287,13 @@ void timebound_fini(void)
     (void)pthread_cancel(timebounder_pth);
     (void)pthread_join(timebounder_pth, NULL);
 
-    bench_event_dtor(&timebounding);
-
 #   ifdef DELETE_ALL_AT_EXIT
     // timebound_pools?
     mutex_dtor(&timebound_pools_mutex);
+    mutex_dtor(&tickers_mutex);
 #   endif
     log_category_timebound_fini();
 
+    bench_fini();
     mutex_fini();
 }
@@ -18,6 +18,8 @@
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "junkie/cpp.h"
+#include "junkie/tools/miscmacs.h"
 #include "junkie/tools/timeouter.h"
 
 void timeouter_pool_ctor(struct timeouter_pool *timeouter_pool,
@@ -28,47 +30,63 @@ void timeouter_pool_ctor(struct timeouter_pool *timeouter_pool,
     timeouter_pool->timeout = timeout;
     timeouter_pool->del = del;
     timeouter_pool->userdata = userdata;
-    TAILQ_INIT(&timeouter_pool->list);
+    wheel_ctor(&timeouter_pool->wheel, 0);
 }
 
-void timeouter_pool_dtor(struct timeouter_pool *timeouter_pool)
+struct timeouter_ctx {
+    struct timeouter_pool *timeouter_pool;
+    time_t now;
+    bool kill_all;
+};
+
+static void timeouter_timer_cb(struct wheel_timer *timer, void *ctx_)
 {
-    struct timeouter *t;
-    while (NULL != (t = TAILQ_FIRST(&timeouter_pool->list))) {
-        timeouter_pool->del(timeouter_pool, t);
+    struct timeouter_ctx *ctx = ctx_;
+    struct timeouter *t = DOWNCAST(timer, timer, timeouter);
+
+    // A last_used in the future counts as expired (the clock went backward)
+    if (! ctx->kill_all && (uint64_t)(ctx->now - t->last_used) <= *ctx->timeouter_pool->timeout) {
+        wheel_add(&ctx->timeouter_pool->wheel, timer, t->last_used + 1);
+        return;
     }
+
+    ctx->timeouter_pool->del(ctx->timeouter_pool, t);
+}
+
+void timeouter_pool_dtor(struct timeouter_pool *timeouter_pool)
+{
+    struct timeouter_ctx ctx = { .timeouter_pool = timeouter_pool, .kill_all = true };
+    (void)wheel_reset(&timeouter_pool->wheel, 0, timeouter_timer_cb, &ctx);
+    wheel_dtor(&timeouter_pool->wheel);
 }
 
 void timeouter_pool_timeout(struct timeouter_pool *timeouter_pool, struct timeval const *now)
 {
-    struct timeouter *t;
-    unsigned const timeout_time = now->tv_sec - *timeouter_pool->timeout;
-    while (NULL != (t = TAILQ_LAST(&timeouter_pool->list, timeouters))) {
-        if (t->last_used < timeout_time) {
-            timeouter_pool->del(timeouter_pool, t);
-        } else {
-            break;
-        }
-    }
+    unsigned const timeout = *timeouter_pool->timeout;
+    if (now->tv_sec <= (time_t)timeout) return;
+
+    struct timeouter_ctx ctx = { .timeouter_pool = timeouter_pool, .now = now->tv_sec, .kill_all = false };
+    // Objects last used before cutoff must die
+    uint64_t const cutoff = now->tv_sec - timeout;
+    (void)wheel_timeout(&timeouter_pool->wheel, cutoff, (uint64_t)now->tv_sec + timeout + 1, 0, timeouter_timer_cb, &ctx);
 }
 
 void timeouter_ctor(struct timeouter_pool *timeouter_pool
         , struct timeouter *timeouter, struct timeval const *now)
 {
-    TAILQ_INSERT_HEAD(&timeouter_pool->list, timeouter, entry);
     timeouter->last_used = now->tv_sec;
+    wheel_timer_ctor(&timeouter->timer);
+    wheel_add(&timeouter_pool->wheel, &timeouter->timer, timeouter->last_used + 1);
 }
 
 void timeouter_dtor(struct timeouter_pool *timeouter_pool, struct timeouter *timeouter)
 {
-    TAILQ_REMOVE(&timeouter_pool->list, timeouter, entry);
+    wheel_del(&timeouter_pool->wheel, &timeouter->timer);
 }
 
-void timeouter_touch(struct timeouter_pool *timeouter_pool
+void timeouter_touch(struct timeouter_pool unused_ *timeouter_pool
         , struct timeouter *timeouter, struct timeval const *now)
 {
-    TAILQ_REMOVE(&timeouter_pool->list, timeouter, entry);
-    TAILQ_INSERT_HEAD(&timeouter_pool->list, timeouter, entry);
+    // The timer will be armed again when it fires
     timeouter->last_used = now->tv_sec;
 }
-
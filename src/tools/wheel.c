@@ -0,0 +1,227 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2014, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include "junkie/tools/wheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1U)
+
+static unsigned level_shift(unsigned level)
+{
+    return WHEEL_SLOT_BITS * level;
+}
+
+static unsigned slot_idx(uint64_t tick, unsigned level)
+{
+    return (tick >> level_shift(level)) & SLOT_MASK;
+}
+
+void wheel_ctor(struct wheel *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->cascaded = false;
+    wheel->firing = false;
+    wheel->count = 0;
+    wheel->max_expiry = 0;
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++) {
+        wheel->level_count[l] = 0;
+        for (unsigned s = 0; s < WHEEL_SLOTS; s++) {
+            LIST_INIT(&wheel->slots[l][s]);
+        }
+    }
+}
+
+void wheel_dtor(struct wheel *wheel)
+{
+    // Forget all timers
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++) {
+        for (unsigned s = 0; s < WHEEL_SLOTS; s++) {
+            struct wheel_timer *timer;
+            while (NULL != (timer = LIST_FIRST(&wheel->slots[l][s]))) {
+                LIST_REMOVE(timer, entry);
+                timer->entry.le_prev = NULL;
+            }
+        }
+    }
+    wheel->count = 0;
+}
+
+extern inline void wheel_timer_ctor(struct wheel_timer *);
+extern inline bool wheel_timer_is_armed(struct wheel_timer const *);
+
+void wheel_add(struct wheel *wheel, struct wheel_timer *timer, uint64_t expiry)
+{
+    assert(! wheel_timer_is_armed(timer));
+
+    timer->expiry = expiry;
+    if (expiry > wheel->max_expiry) wheel->max_expiry = expiry;
+
+    // Where to store it
+    uint64_t when = expiry;
+    if (when < wheel->now) when = wheel->now;
+    if (wheel->firing && when <= wheel->now) when = wheel->now + 1;  // the slot for now is being fired
+    if (when - wheel->now > WHEEL_MAX_DELAY) when = wheel->now + WHEEL_MAX_DELAY;
+
+    uint64_t const delta = when - wheel->now;
+    unsigned level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> level_shift(level + 1)) level ++;
+
+    timer->level = level;
+    LIST_INSERT_HEAD(&wheel->slots[level][slot_idx(when, level)], timer, entry);
+    wheel->level_count[level] ++;
+    wheel->count ++;
+}
+
+void wheel_del(struct wheel *wheel, struct wheel_timer *timer)
+{
+    if (! wheel_timer_is_armed(timer)) return;
+
+    LIST_REMOVE(timer, entry);
+    timer->entry.le_prev = NULL;
+    assert(wheel->count > 0);
+    assert(wheel->level_count[timer->level] > 0);
+    wheel->level_count[timer->level] --;
+    wheel->count --;
+}
+
+// Move all timers of a slot into another list head
+static void slot_move(struct wheel_slot *to, struct wheel_slot *from)
+{
+    LIST_INIT(to);
+    struct wheel_timer *timer;
+    while (NULL != (timer = LIST_FIRST(from))) {
+        LIST_REMOVE(timer, entry);
+        LIST_INSERT_HEAD(to, timer, entry);
+    }
+}
+
+// Move the timers of the higher levels slots that starts at wheel->now into the lower levels
+static void cascade(struct wheel *wheel)
+{
+    for (unsigned l = 1; l < WHEEL_LEVELS; l++) {
+        if (wheel->now & ((1ULL << level_shift(l)) - 1)) break;  // not at the start of a slot of this level
+
+        struct wheel_slot todo;
+        slot_move(&todo, &wheel->slots[l][slot_idx(wheel->now, l)]);
+        struct wheel_timer *timer;
+        while (NULL != (timer = LIST_FIRST(&todo))) {
+            wheel_del(wheel, timer);
+            wheel_add(wheel, timer, timer->expiry);
+        }
+    }
+}
+
+// Jump over the ticks for which there is nothing to do, up to limit
+static void fast_forward(struct wheel *wheel, uint64_t limit)
+{
+    if (wheel->level_count[0] > 0) return;
+
+    uint64_t next = limit;
+    for (unsigned l = 1; l < WHEEL_LEVELS; l++) {
+        if (wheel->level_count[l] == 0) continue;
+        // Next time a slot of this level will cascade
+        uint64_t const step = 1ULL << level_shift(l);
+        uint64_t const start = (wheel->now + step - 1) & ~(step - 1);
+        if (start < next) next = start;
+        break;
+    }
+
+    if (next > wheel->now) {
+        wheel->now = next;
+        wheel->cascaded = false;
+    }
+}
+
+unsigned wheel_advance(struct wheel *wheel, uint64_t now, unsigned max_fired, wheel_cb *cb, void *userdata)
+{
+    unsigned nb_fired = 0;
+
+    while (wheel->now <= now) {
+        fast_forward(wheel, now + 1);
+        if (wheel->now > now) break;
+
+        if (! wheel->cascaded) {
+            cascade(wheel);
+            wheel->cascaded = true;
+        }
+
+        struct wheel_slot *slot = &wheel->slots[0][slot_idx(wheel->now, 0)];
+        if (! LIST_EMPTY(slot)) {
+            struct wheel_slot todo;
+            slot_move(&todo, slot);
+            wheel->firing = true;
+            struct wheel_timer *timer;
+            while (NULL != (timer = LIST_FIRST(&todo))) {
+                if (max_fired && nb_fired >= max_fired) break;
+                assert(timer->expiry <= wheel->now);
+                wheel_del(wheel, timer);
+                cb(timer, userdata);
+                nb_fired ++;
+            }
+            wheel->firing = false;
+            if (! LIST_EMPTY(&todo)) {
+                // Put back what's left for next time
+                slot_move(slot, &todo);
+                return nb_fired;
+            }
+        }
+
+        wheel->now ++;
+        wheel->cascaded = false;
+    }
+
+    return nb_fired;
+}
+
+unsigned wheel_reset(struct wheel *wheel, uint64_t now, wheel_cb *cb, void *userdata)
+{
+    // Detach all timers first, so that the ones armed again by the callback are not fired twice
+    struct wheel_slot todo;
+    LIST_INIT(&todo);
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++) {
+        for (unsigned s = 0; s < WHEEL_SLOTS; s++) {
+            struct wheel_timer *timer;
+            while (NULL != (timer = LIST_FIRST(&wheel->slots[l][s]))) {
+                LIST_REMOVE(timer, entry);
+                LIST_INSERT_HEAD(&todo, timer, entry);
+            }
+        }
+    }
+    wheel->max_expiry = 0;
+    wheel->now = now;
+    wheel->cascaded = false;
+
+    unsigned nb_fired = 0;
+    struct wheel_timer *timer;
+    while (NULL != (timer = LIST_FIRST(&todo))) {
+        wheel_del(wheel, timer);
+        cb(timer, userdata);
+        nb_fired ++;
+    }
+
+    return nb_fired;
+}
+
+unsigned wheel_timeout(struct wheel *wheel, uint64_t cutoff, uint64_t horizon, unsigned max_fired, wheel_cb *cb, void *userdata)
+{
+    if (wheel->max_expiry > horizon || wheel->now + WHEEL_MAX_DELAY < cutoff) {
+        return wheel_reset(wheel, cutoff + 1, cb, userdata);
+    }
+    return wheel_advance(wheel, cutoff, max_fired, cb, userdata);
+}
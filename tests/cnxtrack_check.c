@@ -159,6 +159,38 @@ static void check_last_proto(struct proto_subscriber unused_ *s, struct proto_in
     assert(0 == strcmp(last->parser->proto->name, tests[current_test].last_proto_name));
 }
 
+// Check lookups of exact and wildcard expectations directly, and their precedence
+static void lookup_check(void)
+{
+    struct timeval now;
+    timeval_set_now(&now);
+    struct ip_addr const srv = IP4(10, 0, 0, 1), cli = IP4(10, 0, 0, 2), other = IP4(10, 0, 0, 3);
+    struct proto *requestor;
+
+    // Exact matches are found in both directions
+    (void)cnxtrack_ip_new(IPPROTO_TCP, &srv, 20, &cli, 1024, true, proto_ftp, &now, proto_http);
+    assert(proto_ftp == cnxtrack_ip_lookup(IPPROTO_TCP, &srv, 20, &cli, 1024, &now, &requestor));
+    assert(requestor == proto_http);
+    assert(proto_ftp == cnxtrack_ip_lookup(IPPROTO_TCP, &cli, 1024, &srv, 20, &now, NULL));
+    assert(NULL == cnxtrack_ip_lookup(IPPROTO_UDP, &cli, 1024, &srv, 20, &now, NULL));
+    assert(NULL == cnxtrack_ip_lookup(IPPROTO_TCP, &cli, 1025, &srv, 20, &now, NULL));
+
+    // Wildcards, from the least to the most specific, all used only once
+    (void)cnxtrack_ip_new(IPPROTO_UDP, &srv, 5060, ADDR_UNKNOWN, PORT_UNKNOWN, false, proto_http, &now, NULL);
+    (void)cnxtrack_ip_new(IPPROTO_UDP, &srv, 5060, &cli, PORT_UNKNOWN, false, proto_ftp, &now, NULL);
+    (void)cnxtrack_ip_new(IPPROTO_UDP, &srv, 5060, ADDR_UNKNOWN, 2000, false, proto_tcp, &now, NULL);
+    assert(NULL == cnxtrack_ip_lookup(IPPROTO_UDP, &srv, 5061, &cli, 2000, &now, NULL));
+    assert(proto_tcp == cnxtrack_ip_lookup(IPPROTO_UDP, &cli, 2000, &srv, 5060, &now, NULL));
+    assert(proto_ftp == cnxtrack_ip_lookup(IPPROTO_UDP, &cli, 2000, &srv, 5060, &now, NULL));
+    assert(proto_http == cnxtrack_ip_lookup(IPPROTO_UDP, &srv, 5060, &cli, 2000, &now, NULL));
+    assert(NULL == cnxtrack_ip_lookup(IPPROTO_UDP, &other, 2000, &srv, 5060, &now, NULL));
+
+    // Expired entries are not found
+    struct timeval later = now;
+    timeval_add_usec(&later, 2 * 1000000);
+    assert(NULL == cnxtrack_ip_lookup(IPPROTO_TCP, &srv, 20, &cli, 1024, &later, NULL));
+}
+
 static void cnxtrack_check(void)
 {
     struct timeval now;
@@ -202,6 +234,7 @@ int main(void)
     log_set_level(LOG_DEBUG, NULL);
     log_set_file("cnxtrack_check.log");
 
+    lookup_check();
     cnxtrack_check();
 
     doomer_stop();
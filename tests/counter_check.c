@@ -0,0 +1,78 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <pthread.h>
+#undef NDEBUG
+#include <assert.h>
+#include "tools/counter.c"
+
+static struct counters counters;
+
+#define NB_THREADS (CPU_MAX + 8)    // so that some threads have to share the last slot
+#define NB_ADDS 100000
+
+static void *adder(void *dummy)
+{
+    (void)dummy;
+    for (unsigned i = 0; i < NB_ADDS; i++) {
+        counters_add(&counters, 0, 1);
+        counters_add(&counters, 1, 2);
+    }
+    return NULL;
+}
+
+static void threads_check(void)
+{
+    counters_ctor(&counters);
+    pthread_t threads[NB_THREADS];
+    for (unsigned t = 0; t < NB_ELEMS(threads); t++) {
+        assert(0 == pthread_create(threads+t, NULL, adder, NULL));
+    }
+    for (unsigned t = 0; t < NB_ELEMS(threads); t++) {
+        assert(0 == pthread_join(threads[t], NULL));
+    }
+    assert(counters_read(&counters, 0) == (uint64_t)NB_THREADS * NB_ADDS);
+    assert(counters_read(&counters, 1) == (uint64_t)NB_THREADS * NB_ADDS * 2);
+    assert(counters_read(&counters, 2) == 0);
+}
+
+static void *slot_getter(void *slot)
+{
+    counters_add(&counters, 0, 1);
+    *(unsigned *)slot = counters_my_slot - 1;
+    return NULL;
+}
+
+static void recycling_check(void)
+{
+    counters_ctor(&counters);
+    // Threads running one after the other must never run out of slots
+    for (unsigned t = 0; t < NB_THREADS; t++) {
+        pthread_t thread;
+        unsigned slot;
+        assert(0 == pthread_create(&thread, NULL, slot_getter, &slot));
+        assert(0 == pthread_join(thread, NULL));
+        assert(slot < CPU_MAX);
+    }
+    assert(counters_read(&counters, 0) == NB_THREADS);
+}
+
+static void reset_check(void)
+{
+    counters_ctor(&counters);
+    counters_add(&counters, 3, 42);
+    assert(counters_read(&counters, 3) == 42);
+    counters_reset(&counters, 3);
+    assert(counters_read(&counters, 3) == 0);
+    counters_add(&counters, 3, 1);
+    assert(counters_read(&counters, 3) == 1);
+}
+
+int main(void)
+{
+    assert(sizeof(struct counters_slot) == CACHE_LINE_SIZE);
+    threads_check();
+    recycling_check();
+    reset_check();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,449 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/cpp.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/objalloc.h>
+#include <junkie/tools/files.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/timeval.h>
+#include <junkie/proto/cap.h>
+#include <junkie/proto/eth.h>
+#include <junkie/proto/proto.h>
+#include <junkie/proto/ip.h>
+#include <junkie/proto/tcp.h>
+#include <junkie/proto/udp.h>
+#include <junkie/proto/pkt_wait_list.h>
+#include <junkie/netmatch.h>
+// We cannot compile netmatch filters here, so signatures get fake ones (see below)
+static int fake_filter_ctor(struct netmatch_filter *, char const *);
+static void fake_filter_dtor(struct netmatch_filter *);
+#define netmatch_filter_ctor fake_filter_ctor
+#define netmatch_filter_dtor fake_filter_dtor
+#include "proto/discovery.c"
+#undef netmatch_filter_ctor
+#undef netmatch_filter_dtor
+
+/*
+ * Reading signatures.scm
+ *
+ * We only need the name, id and prefixes of each add-proto-signature form.
+ */
+
+#define NB_MAX_PREFIXES 16
+#define NB_MAX_TEST_SIGS 128
+
+static struct test_sig {
+    char name[32];
+    unsigned id;
+    unsigned salt;  // so that the several copies of a signature do not match the same payloads
+    char libname[16];
+    unsigned nb_prefixes;
+    struct sig_prefix prefixes[NB_MAX_PREFIXES];
+    uint8_t prefix_bytes[NB_MAX_PREFIXES][32];
+} test_sigs[NB_MAX_TEST_SIGS];
+static unsigned nb_test_sigs;
+
+static char const *skip_blanks(char const *c)
+{
+    while (*c) {
+        if (isspace(*c)) c++;
+        else if (*c == ';') while (*c && *c != '\n') c++;
+        else break;
+    }
+    return c;
+}
+
+// Returns the end of the string starting at c (on the opening quote), decoding it into bytes if not NULL
+static char const *read_string(char const *c, uint8_t *bytes, size_t max_len, size_t *len)
+{
+    assert(*c == '"');
+    size_t l = 0;
+    for (c++; *c != '"'; c++) {
+        assert(*c);
+        uint8_t byte = *c;
+        if (*c == '\\') {
+            c++;
+            if (*c == 'x') {
+                char hex[3] = { c[1], c[2], '\0' };
+                byte = strtoul(hex, NULL, 16);
+                c += 2;
+            } else if (*c == 'n') {
+                byte = '\n';
+            } else {
+                byte = *c;
+            }
+        }
+        if (bytes) {
+            assert(l < max_len);
+            bytes[l] = byte;
+        }
+        l ++;
+    }
+    if (len) *len = l;
+    return c + 1;
+}
+
+// Returns the end of the sexpr starting at c
+static char const *skip_sexpr(char const *c)
+{
+    c = skip_blanks(c);
+    if (*c == '\'') return skip_sexpr(c+1);
+    if (*c == '"') return read_string(c, NULL, 0, NULL);
+    if (*c == '(' || (c[0] == '#' && c[1] == '(')) {
+        c = strchr(c, '(') + 1;
+        while (*(c = skip_blanks(c)) != ')') {
+            assert(*c);
+            c = skip_sexpr(c);
+        }
+        return c + 1;
+    }
+    while (*c && !isspace(*c) && *c != '(' && *c != ')' && *c != ';') c++;
+    return c;
+}
+
+static void read_signature(char const *form)
+{
+    assert(nb_test_sigs < NB_MAX_TEST_SIGS);
+    struct test_sig *ts = test_sigs + nb_test_sigs++;
+    memset(ts, 0, sizeof(*ts));
+
+    // (add-proto-signature "name" id 'trust (nm:compile ...) ['("prefix" ...)])
+    char const *c = skip_sexpr(form + 1);
+    c = skip_blanks(c);
+    size_t len;
+    read_string(c, (uint8_t *)ts->name, sizeof(ts->name)-1, &len);
+    ts->name[len] = '\0';
+    c = skip_blanks(skip_sexpr(c));
+    ts->id = strtoul(c, NULL, 10);
+    c = skip_sexpr(c);  // id
+    c = skip_sexpr(c);  // trust
+    c = skip_sexpr(c);  // filter
+    c = skip_blanks(c);
+    if (*c == ')') return;
+
+    assert(c[0] == '\'' && c[1] == '(');
+    for (c = skip_blanks(c+2); *c != ')'; c = skip_blanks(c)) {
+        assert(ts->nb_prefixes < NB_MAX_PREFIXES);
+        uint8_t *const bytes = ts->prefix_bytes[ts->nb_prefixes];
+        struct sig_prefix *const prefix = ts->prefixes + ts->nb_prefixes++;
+        c = read_string(c, bytes, sizeof(ts->prefix_bytes[0]), &prefix->len);
+        prefix->bytes = bytes;
+    }
+}
+
+static unsigned read_signatures(char const *file_name)
+{
+    char *scm = file_load(file_name, NULL);
+    assert(scm);
+    static char const form[] = "\n(add-proto-signature ";
+    unsigned nb_sigs = 0;
+    for (char const *c = scm; NULL != (c = strstr(c, form)); c++) {
+        read_signature(c + 1);
+        nb_sigs ++;
+    }
+    free(scm);
+    return nb_sigs;
+}
+
+/*
+ * Fake filters
+ *
+ * A real filter never matches a payload that does not start with one of its
+ * prefixes, but may not match one that does. So does ours, reproducibly
+ * dropping some payloads according to the salt of the signature.
+ */
+
+static bool match_all_anchored;   // then match all payloads starting with a prefix (and none if there are no prefixes)
+
+static uintptr_t fake_match(struct proto_info const unused_ *info, struct npc_register const rest, struct npc_register const *regfile, struct npc_register unused_ *new_regfile)
+{
+    struct test_sig const *ts = (struct test_sig const *)regfile;
+    uint8_t const *payload = (uint8_t const *)rest.value;
+    size_t const len = rest.size;
+
+    bool anchored = ts->nb_prefixes == 0;
+    for (unsigned p = 0; p < ts->nb_prefixes; p++) {
+        if (len >= ts->prefixes[p].len && 0 == memcmp(payload, ts->prefixes[p].bytes, ts->prefixes[p].len)) anchored = true;
+    }
+    if (! anchored) return 0;
+    if (match_all_anchored) return ts->nb_prefixes > 0;
+
+    uint32_t h = 2166136261U ^ ts->salt;
+    for (size_t b = 0; b < len; b++) h = (h ^ payload[b]) * 16777619U;
+    return ts->nb_prefixes > 0 ? h % 2 == 0 : h % 256 == 0;
+}
+
+static int fake_filter_ctor(struct netmatch_filter *netmatch, char const *libname)
+{
+    struct test_sig *ts = test_sigs + strtoul(libname, NULL, 10);
+    netmatch->libname = ts->libname;
+    netmatch->nb_registers = 0;
+    netmatch->regfile = (struct npc_register *)ts;
+    netmatch->handle = NULL;
+    netmatch->match_fun = fake_match;
+    return 0;
+}
+
+static void fake_filter_dtor(struct netmatch_filter unused_ *netmatch)
+{
+}
+
+/*
+ * Prefilter
+ */
+
+// What discovery_parse used to do
+static struct proto_signature *linear_lookup(uint8_t const *packet, size_t cap_len)
+{
+    struct proto_signature *sig;
+    struct npc_register rest = { .size = cap_len, .value = (uintptr_t)packet };
+    LIST_LOOKUP(sig, &proto_signatures, entry, 0 != sig->filter.match_fun(NULL, rest, sig->filter.regfile, sig->filter.regfile));
+    return sig;
+}
+
+static struct proto_signature *check_lookup(uint8_t const *packet, size_t cap_len)
+{
+    struct proto_signature *sig = prefilter_lookup(prefilter, NULL, packet, cap_len);
+    assert(sig == linear_lookup(packet, cap_len));
+    return sig;
+}
+
+#define PAYLOAD(s) (uint8_t const *)(s), sizeof(s)-1
+
+static char const *lookup_name(uint8_t const *payload, size_t len)
+{
+    struct proto_signature *sig = check_lookup(payload, len);
+    return sig ? sig->protocol.name : NULL;
+}
+
+static void prefilter_check(void)
+{
+    // Register all signatures thrice, so that candidates span several words
+    unsigned nb_sigs = 0;
+    for (unsigned copy = 0; copy < 3; copy++) {
+        unsigned const first = nb_test_sigs;
+        unsigned const nb = read_signatures(STRIZE(SRCDIR) "/../guile/junkie/signatures.scm");
+        assert(nb > 20);
+        for (unsigned s = first; s < first + nb; s++) {
+            struct test_sig *ts = test_sigs + s;
+            ts->salt = s;
+            snprintf(ts->libname, sizeof(ts->libname), "%u", s);
+            assert(proto_signature_new(ts->id, ts->name, DISC_MEDIUM, ts->libname, ts->nb_prefixes, ts->prefixes));
+        }
+        nb_sigs += nb;
+    }
+    assert(prefilter && prefilter->nb_sigs == nb_sigs);
+    assert(prefilter->nb_words > 1);
+
+    // Signatures sharing a prefix (or which prefix is a prefix of another) are tried in the former order,
+    // that is the last added first.
+    match_all_anchored = true;
+    struct proto_signature *sig = check_lookup(PAYLOAD("OPTIONS sip:foo SIP/2.0\r\n"));
+    assert(0 == strcmp(sig->protocol.name, "SIP"));   // rather than HTTP
+    assert(((struct test_sig *)sig->filter.regfile)->salt >= nb_sigs * 2/3);   // from the last copy
+    assert(0 == strcmp(lookup_name(PAYLOAD("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x00\x13")), "BGP"));
+    assert(0 == strcmp(lookup_name(PAYLOAD("\xff\xfb\x18")), "Telnet"));
+    assert(0 == strcmp(lookup_name(PAYLOAD("GET / HTTP/1.1\r\n")), "HTTP"));
+    assert(0 == strcmp(lookup_name(PAYLOAD("get /uri-res/n2r?urn:sha1:")), "Gnutella"));
+    assert(NULL == lookup_name(PAYLOAD("GE")));    // too short for any prefix
+    assert(NULL == lookup_name(PAYLOAD("")));
+    assert(NULL == lookup_name(PAYLOAD("OPTION")));
+
+    // Now with filters that match only some of the anchored payloads, and some of the others
+    match_all_anchored = false;
+    unsigned nb_matches = 0, nb_payloads = 0;
+    for (unsigned s = 0; s < nb_test_sigs; s++) {
+        struct test_sig const *ts = test_sigs + s;
+        for (unsigned p = 0; p < ts->nb_prefixes; p++) {
+            struct sig_prefix const *prefix = ts->prefixes + p;
+            uint8_t payload[64];
+            memcpy(payload, prefix->bytes, prefix->len);
+            for (unsigned tail = 0; tail < 8; tail++) {
+                payload[prefix->len + tail] = 'a' + s + tail;
+                // The prefix itself, truncated, and followed by some bytes
+                if (tail == 0 && prefix->len > 0) nb_matches += !!check_lookup(payload, prefix->len - 1);
+                nb_matches += !!check_lookup(payload, prefix->len + tail + 1);
+                nb_payloads += 2;
+            }
+        }
+    }
+    srandom(42);
+    for (unsigned r = 0; r < 10000; r++) {
+        uint8_t payload[40];
+        size_t const len = random() % sizeof(payload);
+        for (size_t b = 0; b < len; b++) payload[b] = random();
+        // Start some of them with the first byte of a prefix
+        static uint8_t const firsts[] = "\x16\x17gGHPCOTDNSRIMEA*+<\x80\x00\xff";
+        if (len > 0 && r % 2) payload[0] = firsts[random() % (sizeof(firsts)-1)];
+        nb_matches += !!check_lookup(payload, len);
+        nb_payloads ++;
+    }
+    SLOG(LOG_INFO, "%u payloads matched out of %u", nb_matches, nb_payloads);
+    assert(nb_matches > 0 && nb_matches < nb_payloads);
+}
+
+/*
+ * Unknown servers
+ */
+
+static void fail_many(struct discovery_flow *flow, struct ip_addr const *addr, uint16_t port, unsigned nb, size_t payload, struct timeval const *now)
+{
+    while (nb--) assert(! discovery_failed(flow, IPPROTO_TCP, addr, port, payload, now));
+}
+
+static void unknown_servers_check(void)
+{
+    struct timeval now;
+    timeval_set_now(&now);
+    struct ip_addr addr[2];
+    ip_addr_ctor_from_ip4(addr+0, 0x0a000001);
+    ip_addr_ctor_from_ip4(addr+1, 0x0a000002);
+    uint16_t port[2] = { 40000, 5000 };
+    assert(discovery_max_packets == 10 && discovery_max_bytes == 10000);
+
+    // Packet limit: the server is given up after 10 small payloads, whatever the flows
+    struct discovery_flow flow;
+    discovery_flow_ctor(&flow);
+    fail_many(&flow, addr+1, port[1], 5, 10, &now);
+    assert(! discovery_skip(IPPROTO_TCP, addr, port, &now));
+    fail_many(NULL, addr+1, port[1], 4, 10, &now);
+    assert(discovery_failed(NULL, IPPROTO_TCP, addr+1, port[1], 10, &now));
+
+    // Cache hits: new flows from any client skip the discovery, but one out of UNKNOWN_SERVERS_PROBE
+    uint64_t const hits = counters_read(&unknown_servers_counters, UNKNOWN_SERVERS_HITS);
+    unknown_servers_nb_skips = 0;
+    unsigned nb_probes = 0;
+    for (unsigned f = 0; f < 4 * UNKNOWN_SERVERS_PROBE; f++) {
+        port[0] = 40000 + f;
+        // the server may be at either end
+        if (f % 2) {
+            if (! discovery_skip(IPPROTO_TCP, addr, port, &now)) nb_probes ++;
+        } else {
+            struct ip_addr const rev_addr[2] = { addr[1], addr[0] };
+            uint16_t const rev_port[2] = { port[1], port[0] };
+            if (! discovery_skip(IPPROTO_TCP, rev_addr, rev_port, &now)) nb_probes ++;
+        }
+    }
+    assert(nb_probes == 4);
+    assert(counters_read(&unknown_servers_counters, UNKNOWN_SERVERS_HITS) == hits + 4 * (UNKNOWN_SERVERS_PROBE - 1));
+
+    // Other servers are not concerned
+    uint16_t const other_port[2] = { 40000, 5001 };
+    assert(! discovery_skip(IPPROTO_TCP, addr, other_port, &now));
+    assert(! discovery_skip(IPPROTO_UDP, addr, port, &now));
+
+    // Until the timeout
+    struct timeval later = now;
+    later.tv_sec += unknown_servers_timeout + 1;
+    unknown_servers_nb_skips = 1;   // so that we do not probe
+    assert(discovery_skip(IPPROTO_TCP, addr, port, &now));
+    assert(! discovery_skip(IPPROTO_TCP, addr, port, &later));
+
+    // Byte limit, while the flow remembers its own payloads
+    discovery_flow_ctor(&flow);
+    fail_many(&flow, addr+1, 6000, 1, 6000, &now);
+    assert(discovery_failed(&flow, IPPROTO_TCP, addr+1, 6000, 4000, &now));
+    assert(flow.nb_fails == 2 && flow.nb_bytes == 10000);
+
+    // Eviction: another server hashing to the same slot takes it over, so that the first one is not skipped anymore
+    unsigned const slot = unknown_server_slot(IPPROTO_TCP, addr+1, port[1]);
+    uint16_t evict_port;
+    for (evict_port = 1; evict_port == port[1] || unknown_server_slot(IPPROTO_TCP, addr+1, evict_port) != slot; evict_port++) {
+        assert(evict_port < 65535);
+    }
+    assert(discovery_skip(IPPROTO_TCP, addr, port, &now));
+    fail_many(NULL, addr+1, evict_port, 1, 10, &now);
+    assert(! discovery_skip(IPPROTO_TCP, addr, port, &now));
+    // and the evicting one starts from scratch
+    fail_many(NULL, addr+1, evict_port, 8, 10, &now);
+    assert(discovery_failed(NULL, IPPROTO_TCP, addr+1, evict_port, 10, &now));
+    uint16_t const evict_ports[2] = { 40000, evict_port };
+    assert(discovery_skip(IPPROTO_TCP, addr, evict_ports, &now));
+
+    // Flows have limits of their own even when their server keeps being evicted (and then the server is given up again)
+    discovery_flow_ctor(&flow);
+    for (unsigned f = 0; f < 9; f++) {
+        assert(! discovery_failed(&flow, IPPROTO_TCP, addr+1, port[1], 10, &now));
+        fail_many(NULL, addr+1, evict_port, 1, 10, &now);
+    }
+    assert(discovery_failed(&flow, IPPROTO_TCP, addr+1, port[1], 10, &now));
+
+    // A server that was given up on but is classified later on is a false negative
+    struct parser *ip_parser = proto_ip->ops->parser_new(proto_ip);
+    struct parser *tcp_parser = proto_tcp->ops->parser_new(proto_tcp);
+    assert(ip_parser && tcp_parser);
+    struct ip_proto_info ip;
+    proto_info_ctor(&ip.info, ip_parser, NULL, 20, 0);
+    ip.key.addr[0] = addr[0];
+    ip.key.addr[1] = addr[1];
+    ip.key.protocol = IPPROTO_TCP;
+    struct tcp_proto_info tcp;
+    proto_info_ctor(&tcp.info, tcp_parser, &ip.info, 20, 10);
+    tcp.key.port[0] = 40000;
+    tcp.key.port[1] = port[1];
+    tcp.to_srv = 1;
+    uint64_t const false_negatives = counters_read(&unknown_servers_counters, UNKNOWN_SERVERS_FALSE_NEGATIVES);
+    server_classified(&tcp.info, &now);
+    assert(counters_read(&unknown_servers_counters, UNKNOWN_SERVERS_FALSE_NEGATIVES) == false_negatives + 1);
+    assert(! discovery_skip(IPPROTO_TCP, addr, port, &now));
+    server_classified(&tcp.info, &now);  // no more
+    assert(counters_read(&unknown_servers_counters, UNKNOWN_SERVERS_FALSE_NEGATIVES) == false_negatives + 1);
+    parser_unref(&tcp_parser);
+    parser_unref(&ip_parser);
+
+    // No timeout, no cache
+    unsigned const timeout = unknown_servers_timeout;
+    unknown_servers_timeout = 0;
+    fail_many(NULL, addr+1, 7000, 20, 10, &now);
+    uint16_t const unk_ports[2] = { 40000, 7000 };
+    assert(! discovery_skip(IPPROTO_TCP, addr, unk_ports, &now));
+    unknown_servers_timeout = timeout;
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    objalloc_init();
+    pkt_wait_list_init();
+    ref_init();
+    hash_init();
+    proto_init();
+    cap_init();
+    eth_init();
+    ip_init();
+    ip6_init();
+    tcp_init();
+    udp_init();
+    log_set_level(LOG_DEBUG, NULL);
+    log_set_level(LOG_WARNING, "mutex");
+    log_set_file("discovery_check.log");
+    scm_init_guile();
+    discovery_init();
+
+    prefilter_check();
+    unknown_servers_check();
+
+    doomer_stop();
+    discovery_fini();
+    udp_fini();
+    tcp_fini();
+    ip6_fini();
+    ip_fini();
+    eth_fini();
+    cap_fini();
+    proto_fini();
+    hash_fini();
+    ref_fini();
+    pkt_wait_list_fini();
+    objalloc_fini();
+    ext_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
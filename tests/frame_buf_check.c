@@ -0,0 +1,81 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <string.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/tools/objalloc.h>
+#include "tools/frame_buf.c"
+
+static uint8_t const frame[] = "Maitre corbeau, sur un arbre perche";
+
+// Without context, each holder gets its own copy
+static void no_ctx_check(void)
+{
+    uint8_t const *copy1, *copy2;
+    struct frame_buf *buf1 = frame_buf_hold(frame + 7, 7, &copy1);
+    struct frame_buf *buf2 = frame_buf_hold(frame + 7, 7, &copy2);
+    assert(buf1 && buf2 && buf1 != buf2);
+    assert(0 == memcmp(copy1, "corbeau", 7));
+    assert(0 == memcmp(copy2, "corbeau", 7));
+    frame_buf_unref(&buf1);
+    assert(! buf1);
+    frame_buf_unref(&buf2);
+}
+
+// Within a transient frame, the frame is copied once for all holders
+static void lazy_ctx_check(void)
+{
+    struct frame_buf_ctx ctx;
+    frame_buf_ctx_push(&ctx, frame, sizeof(frame), NULL);
+
+    uint8_t const *copy1, *copy2;
+    struct frame_buf *buf1 = frame_buf_hold(frame + 7, 7, &copy1);
+    struct frame_buf *buf2 = frame_buf_hold(frame, sizeof(frame), &copy2);
+    assert(buf1 && buf1 == buf2);
+    assert(copy1 == copy2 + 7);
+    assert(copy2 != frame);
+    assert(0 == memcmp(copy2, frame, sizeof(frame)));
+    assert(buf1->ref_count == 3);
+
+    frame_buf_ctx_pop(&ctx);
+    assert(buf1->ref_count == 2);
+    frame_buf_unref(&buf1);
+    frame_buf_unref(&buf2);
+}
+
+// Within a frame that's already in a frame_buf, holders share it, even from nested frames
+static void shared_ctx_check(void)
+{
+    struct frame_buf *frame_buf = frame_buf_new(frame, sizeof(frame));
+    assert(frame_buf->ref_count == 1);
+
+    struct frame_buf_ctx ctx;
+    frame_buf_ctx_push(&ctx, frame_buf->data, frame_buf->size, frame_buf_ref(frame_buf));
+
+    static uint8_t const inner[] = "tenait en son bec un fromage";
+    struct frame_buf_ctx inner_ctx;
+    frame_buf_ctx_push(&inner_ctx, inner, sizeof(inner), NULL);
+
+    uint8_t const *copy;
+    struct frame_buf *buf = frame_buf_hold(frame_buf->data + 16, 3, &copy);
+    assert(buf == frame_buf);
+    assert(copy == frame_buf->data + 16);
+    assert(! inner_ctx.buf);    // the inner frame was not copied
+    frame_buf_unref(&buf);
+
+    frame_buf_ctx_pop(&inner_ctx);
+    frame_buf_ctx_pop(&ctx);
+    assert(frame_buf->ref_count == 1);
+    frame_buf_unref(&frame_buf);
+}
+
+int main(void)
+{
+    objalloc_init();
+    no_ctx_check();
+    lazy_ctx_check();
+    shared_ctx_check();
+    objalloc_fini();
+    return EXIT_SUCCESS;
+}
@@ -4,8 +4,11 @@
 #include <stdio.h>
 #undef NDEBUG
 #include <assert.h>
+#include <limits.h>
 #include <time.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 #include <sys/time.h>
 #include <junkie/cpp.h>
 #include <junkie/tools/ext.h>
@@ -120,6 +123,108 @@ static void rehash_check(void)
 
 }
 
+/*
+ * Distribution and speed of hashfun, compared to the former DJB hash
+ */
+
+static uint_least32_t djb_hashfun(void const *k_, size_t len)
+{
+    uint8_t const *k = k_;
+    uint_least32_t h = 5381;
+    while (len --) {
+        h = (h << 5) + h + *k++; /* h*33 + *k++; */
+    }
+    return h;
+}
+
+// Looks like the mux keys of TCP/IPv6 (ports and addresses)
+struct flow_key {
+    uint16_t port[2];
+    uint8_t addr[2][16];
+};
+
+static void flow_key_ctor(struct flow_key *k, unsigned i)
+{
+    memset(k, 0, sizeof(*k));
+    k->port[0] = 80;
+    k->port[1] = 1024 + (i & 0xfff);
+    k->addr[0][15] = 1;
+    k->addr[1][14] = i >> 12;
+    k->addr[1][15] = i >> 20;
+}
+
+static void distribution_check(void)
+{
+    // Sequential keys were the worse case of the DJB hash
+    static unsigned buckets[4096];
+    unsigned const nb_keys = 16 * NB_ELEMS(buckets);
+    for (unsigned i = 0; i < nb_keys; i++) {
+        struct flow_key k;
+        flow_key_ctor(&k, i);
+        buckets[HASH_IDX(hashfun(&k, sizeof(k)), NB_ELEMS(buckets))] ++;
+    }
+    unsigned max = 0;
+    for (unsigned b = 0; b < NB_ELEMS(buckets); b++) {
+        if (buckets[b] > max) max = buckets[b];
+    }
+    SLOG(LOG_INFO, "Max bucket length is %u for %u keys in %zu buckets", max, nb_keys, NB_ELEMS(buckets));
+    assert(max < 48);   // expected is 16
+}
+
+static void seed_check(void)
+{
+    struct flow_key k;
+    flow_key_ctor(&k, 42);
+    uint64_t const prev_seed = hash_seed;
+    uint_least32_t const h1 = hashfun(&k, sizeof(k));
+    hash_seed ^= 1;
+    uint_least32_t const h2 = hashfun(&k, sizeof(k));
+    hash_seed = prev_seed;
+    assert(h1 != h2);
+    assert(h1 == hashfun(&k, sizeof(k)));
+
+    // All lengths must be supported
+    uint8_t buf[64] = { 1 };
+    for (size_t len = 0; len <= sizeof(buf); len++) {
+        (void)hashfun(buf, len);
+    }
+}
+
+static void pow2_check(void)
+{
+    assert(hash_pow2(0) == 1);
+    assert(hash_pow2(1) == 1);
+    assert(hash_pow2(3) == 4);
+    assert(hash_pow2(1024) == 1024);
+    assert(hash_pow2(0x7fffffffU) == 0x80000000U);
+    assert(hash_pow2(0x80000001U) == 0x80000000U);
+    assert(hash_pow2(UINT_MAX) == 0x80000000U);
+}
+
+static void speed_check(void)
+{
+    unsigned const nb_keys = 1000000;
+    struct flow_key k;
+    uint_least32_t sum = 0;
+
+    clock_t start = clock();
+    for (unsigned i = 0; i < nb_keys; i++) {
+        flow_key_ctor(&k, i);
+        sum += djb_hashfun(&k, sizeof(k));
+    }
+    clock_t const djb_dur = clock() - start;
+
+    start = clock();
+    for (unsigned i = 0; i < nb_keys; i++) {
+        flow_key_ctor(&k, i);
+        sum += hashfun(&k, sizeof(k));
+    }
+    clock_t const dur = clock() - start;
+
+    printf("Hashing %u keys of %zu bytes: DJB: %.3fs, hashfun: %.3fs (%"PRIuLEAST32")\n",
+        nb_keys, sizeof(k), (double)djb_dur / CLOCKS_PER_SEC, (double)dur / CLOCKS_PER_SEC, sum);
+}
+
 int main(void)
 {
     log_init();
@@ -132,6 +237,10 @@ int main(void)
     hash_check(1);
     hash_check(10000);
     rehash_check();
+    distribution_check();
+    seed_check();
+    pow2_check();
+    speed_check();
 
     hash_fini();
     objalloc_fini();
@@ -0,0 +1,175 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <string.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/cpp.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/log.h>
+#include "proto/httper.c"
+
+/*
+ * What the callbacks saw
+ */
+
+#define NB_MAX_SEEN 8
+
+static struct seen {
+    unsigned nb_commands;
+    int command;                // index of the last command found
+    unsigned nb_fields;
+    struct seen_field {
+        int field;
+        char value[32];
+    } fields[NB_MAX_SEEN];
+} seen;
+
+static int command_cb(unsigned cmd, struct liner unused_ *liner, void *user_data)
+{
+    struct seen *s = user_data;
+    s->nb_commands ++;
+    s->command = cmd;
+    return 0;
+}
+
+static int field_cb(unsigned field, struct liner *liner, void *user_data)
+{
+    struct seen *s = user_data;
+    assert(s->nb_fields < NB_MAX_SEEN);
+    struct seen_field *f = s->fields + s->nb_fields++;
+    f->field = field;
+    size_t const len = MIN(liner_tok_length(liner), sizeof(f->value)-1);
+    memcpy(f->value, liner->start, len);
+    f->value[len] = '\0';
+    return 0;
+}
+
+/* Commands sharing a common prefix must be ordered longest first,
+ * and several commands share the same first char. */
+static struct httper_command const commands[] = {
+    { STRING_AND_LEN("SUBSCRIBE"), command_cb },
+    { STRING_AND_LEN("SUB"),       command_cb },
+    { STRING_AND_LEN("GET"),       command_cb },
+    { STRING_AND_LEN("SEND"),      command_cb },
+};
+
+/* Some fields are prefixes of others, and "Host" is there twice
+ * (then the first one wins). */
+static struct httper_field const fields[] = {
+    { STRING_AND_LEN("content-length"), field_cb },
+    { STRING_AND_LEN("content-type"),   field_cb },
+    { STRING_AND_LEN("content"),        field_cb },
+    { STRING_AND_LEN("host"),           field_cb },
+    { STRING_AND_LEN("HOST"),           field_cb },
+};
+
+enum { CMD_SUBSCRIBE, CMD_SUB, CMD_GET, CMD_SEND };
+enum { F_CONTENT_LENGTH, F_CONTENT_TYPE, F_CONTENT, F_HOST };
+
+/*
+ * Commands
+ */
+
+static void command_check(struct httper const *httper)
+{
+    static struct command_test {
+        char const *msg;
+        enum proto_parse_status status;
+        int command;
+    } const tests[] = {
+        { "SUBSCRIBE sip:foo SIP/2.0\r\n\r\n", PROTO_OK, CMD_SUBSCRIBE },
+        { "SUB foo\r\n\r\n",                   PROTO_OK, CMD_SUB },
+        { "SEND foo\r\n\r\n",                  PROTO_OK, CMD_SEND },
+        { "GET / HTTP/1.1\r\n\r\n",            PROTO_OK, CMD_GET },
+        { "SUBSCRIBEX foo\r\n\r\n",            PROTO_PARSE_ERR, -1 },  // neither SUBSCRIBE nor SUB
+        { "SUBS foo\r\n\r\n",                  PROTO_PARSE_ERR, -1 },
+        { "get / HTTP/1.1\r\n\r\n",            PROTO_PARSE_ERR, -1 },  // commands are case sensitive
+        { "PUT / HTTP/1.1\r\n\r\n",            PROTO_PARSE_ERR, -1 },  // no command starting with this char
+        { "SUBSC",                             PROTO_TOO_SHORT, -1 },
+    };
+
+    for (unsigned t = 0; t < NB_ELEMS(tests); t++) {
+        struct command_test const *test = tests + t;
+        memset(&seen, 0, sizeof(seen));
+        seen.command = -1;
+        size_t const len = strlen(test->msg);
+        enum proto_parse_status status = httper_parse(httper, NULL, (uint8_t const *)test->msg, len, &seen, NULL);
+        assert(status == test->status);
+        assert(seen.command == test->command);
+        assert(seen.nb_commands == (test->command >= 0 ? 1U : 0U));
+    }
+}
+
+/*
+ * Fields
+ */
+
+static void field_check(struct httper const *httper)
+{
+    // Lookups alone
+    static struct lookup_test {
+        char const *name;
+        int field;
+    } const lookups[] = {
+        { "content-length", F_CONTENT_LENGTH }, { "Content-Length", F_CONTENT_LENGTH },
+        { "CONTENT-LENGTH", F_CONTENT_LENGTH }, { "content-type", F_CONTENT_TYPE },
+        { "Content", F_CONTENT }, { "Host", F_HOST }, { "hOsT", F_HOST },
+        { "content-", -1 }, { "content-lengths", -1 }, { "content-typo", -1 },
+        { "conten", -1 }, { "hosts", -1 }, { "", -1 }, { "X-Forwarded-For", -1 },
+    };
+    for (unsigned t = 0; t < NB_ELEMS(lookups); t++) {
+        assert(field_lookup(httper, lookups[t].name, strlen(lookups[t].name)) == lookups[t].field);
+    }
+
+    // And while parsing a whole header
+    static char const msg[] =
+        "GET / HTTP/1.1\r\n"
+        "HOST: www.example.com\r\n"
+        "Content-Typo: nope\r\n"
+        "content-LENGTH: 42\r\n"
+        "Content: text\r\n"
+        "X-Unknown: nope\r\n"
+        "Content-Type: text/html\r\n"
+        "\r\n";
+    static struct seen_field const expected[] = {
+        { F_HOST, "www.example.com" }, { F_CONTENT_LENGTH, "42" },
+        { F_CONTENT, "text" }, { F_CONTENT_TYPE, "text/html" },
+    };
+    memset(&seen, 0, sizeof(seen));
+    size_t head_sz;
+    assert(PROTO_OK == httper_parse(httper, &head_sz, (uint8_t const *)msg, sizeof(msg)-1, &seen, NULL));
+    assert(head_sz == sizeof(msg)-1);
+    assert(seen.nb_fields == NB_ELEMS(expected));
+    for (unsigned f = 0; f < NB_ELEMS(expected); f++) {
+        assert(seen.fields[f].field == expected[f].field);
+        assert(0 == strcmp(seen.fields[f].value, expected[f].value));
+    }
+}
+
+static void httper_check(void)
+{
+    struct httper httper;
+    httper_ctor(&httper, NB_ELEMS(commands), commands, NB_ELEMS(fields), fields);
+    assert(httper.fields_hashed);
+    command_check(&httper);
+    field_check(&httper);
+
+    // The fields must be found the same when they are looked for one by one
+    httper.fields_hashed = false;
+    field_check(&httper);
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    log_set_level(LOG_DEBUG, NULL);
+    log_set_file("httper_check.log");
+
+    httper_check();
+
+    ext_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
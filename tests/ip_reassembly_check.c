@@ -1,6 +1,7 @@
 // -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
 // vim:sw=4 ts=4 sts=4 expandtab
 #include <stdlib.h>
+#include <stdio.h>
 #include <time.h>
 #include <stdbool.h>
 #undef NDEBUG
@@ -15,8 +16,11 @@
 #include <junkie/proto/eth.h>
 #include <junkie/proto/ip.h>
 #include <junkie/proto/udp.h>
+#include <junkie/proto/gre.h>
+#include <junkie/proto/icmp.h>
 #include <junkie/proto/cnxtrack.h>
 #include "lib_test_junkie.h"
+#include "proto/ip.c"
 
 /*
  * These are 13 eth frames for a single UDP packet, fragmented at IP level
@@ -343,6 +347,200 @@ static void random_check(void)
     teardown();
 }
 
+// Fragments received more than the reassembly timeout apart must not be reassembled together
+static void timeout_check(void)
+{
+    setup();
+
+    unsigned const last = NB_ELEMS(pkts) - 1;
+    for (unsigned p = 0 ; p < last; p++) {
+        assert(PROTO_OK == proto_parse(eth_parser, NULL, 0, pkts[p], sizeof(pkts[p]), sizeof(pkts[p]), &now, sizeof(pkts[p]), pkts[p]));
+    }
+    now.tv_sec += 10;
+    assert(PROTO_OK == proto_parse(eth_parser, NULL, 0, pkts[last], sizeof(pkts[last]), sizeof(pkts[last]), &now, sizeof(pkts[last]), pkts[last]));
+    assert(! had_udp);
+    assert(nb_okfn_calls == last);  // the expired fragments were advertised
+
+    // But the last fragment is the start of a new reassembly
+    nb_okfn_calls = 0;
+    for (unsigned p = 0 ; p < last; p++) {
+        assert(PROTO_OK == proto_parse(eth_parser, NULL, 0, pkts[p], sizeof(pkts[p]), sizeof(pkts[p]), &now, sizeof(pkts[p]), pkts[p]));
+    }
+    check_result();
+
+    teardown();
+}
+
+// Datagrams that are not completed in time must also be dropped by the ticker
+static void ticker_check(void)
+{
+    setup();
+
+    unsigned const last = NB_ELEMS(pkts) - 1;
+    for (unsigned p = 0 ; p < last; p++) {
+        assert(PROTO_OK == proto_parse(eth_parser, NULL, 0, pkts[p], sizeof(pkts[p]), sizeof(pkts[p]), &now, sizeof(pkts[p]), pkts[p]));
+    }
+    assert(nb_okfn_calls == 0);
+
+    // Pretend some shard received a fragment much later
+    now.tv_sec += 10;
+    ip_reassembly_shards[0].last_now = now;
+    ip_reassembly_timeouter_tick(NULL);
+    assert(! had_udp);
+    assert(nb_okfn_calls == last);  // the expired fragments were advertised
+    for (unsigned s = 0; s < NB_ELEMS(ip_reassembly_shards); s++) {
+        assert(TAILQ_EMPTY(&ip_reassembly_shards[s].by_age));
+    }
+
+    teardown();
+}
+
+/*
+ * A GRE tunnel which IPv4 packets are fragmented (with an ICMP echo reply inside)
+ */
+
+static unsigned nb_gre_calls;
+
+static void gre_okfn(struct proto_subscriber unused_ *s, struct proto_info const *last, size_t unused_ cap_len, uint8_t const unused_ *packet, struct timeval const unused_ *now)
+{
+    struct proto_info const *ip = proto_info_get(proto_ip, last);
+    assert(ip);
+    if (nb_gre_calls++ < 2) {
+        assert(last == ip);
+        assert(DOWNCAST(ip, info, ip_proto_info)->fragmentation == IP_FRAGMENT);
+        assert(ip->payload == 1480);
+        return;
+    }
+
+    // The whole tunneled packet is revealed with the last fragment
+    assert(last->parser->proto == proto_icmp);
+    assert(DOWNCAST(ip, info, ip_proto_info)->fragmentation == IP_NOFRAG);
+    assert(ip->payload == 4104);
+    struct proto_info const *gre = ip->parent;
+    assert(gre->parser->proto == proto_gre);
+    assert(gre->payload == 4124);
+    struct ip_proto_info const *outer = DOWNCAST(gre->parent, info, ip_proto_info);
+    assert(outer->info.parser->proto == proto_ip);
+    assert(outer->fragmentation == IP_REASSEMBLED);
+    assert(outer->info.payload == 1168);
+}
+
+// Send each frame of a pcap file to the given parser
+static void pcap_parse(char const *fname, struct parser *parser)
+{
+    FILE *file = fopen(fname, "r");
+    assert(file);
+    uint8_t hdr[24];
+    assert(1 == fread(hdr, sizeof(hdr), 1, file));
+    assert(READ_U32LE(hdr) == 0xa1b2c3d4U);    // little endian, microseconds
+    assert(READ_U32LE(hdr+20) == 1);            // Ethernet
+
+    uint8_t rec[16];
+    while (1 == fread(rec, sizeof(rec), 1, file)) {
+        struct timeval tv = { .tv_sec = READ_U32LE(rec), .tv_usec = READ_U32LE(rec+4) };
+        size_t const cap_len = READ_U32LE(rec+8);
+        size_t const wire_len = READ_U32LE(rec+12);
+        static uint8_t frame[65536];
+        assert(cap_len <= sizeof(frame));
+        assert(1 == fread(frame, cap_len, 1, file));
+        assert(PROTO_OK == proto_parse(parser, NULL, 0, frame, cap_len, wire_len, &tv, cap_len, frame));
+    }
+
+    fclose(file);
+}
+
+static void gre_check(void)
+{
+    struct parser *parser = proto_eth->ops->parser_new(proto_eth);
+    assert(parser);
+    nb_gre_calls = 0;
+    hook_subscriber_ctor(&pkt_hook, &sub, gre_okfn);
+
+    pcap_parse(STRIZE(SRCDIR) "/pcap/gre/fragmented.pcap", parser);
+    assert(nb_gre_calls == 3);
+
+    hook_subscriber_dtor(&pkt_hook, &sub);
+    parser_unref(&parser);
+}
+
+/*
+ * An IPv6 UDP datagram, in fragments of 80, 80 and 48 bytes
+ */
+
+#define IP6_UDP_PAYLOAD 200
+#define IP6_HDRS_SIZE (14 + 40 + 8)
+
+static unsigned nb_ip6_calls;
+static bool had_ip6_udp;
+
+static void ip6_okfn(struct proto_subscriber unused_ *s, struct proto_info const *last, size_t unused_ cap_len, uint8_t const unused_ *packet, struct timeval const unused_ *now)
+{
+    nb_ip6_calls ++;
+    struct ip_proto_info const *ip = DOWNCAST(proto_info_get(proto_ip6, last), info, ip_proto_info);
+    assert(ip->key.protocol == IPPROTO_UDP);
+    assert(ip->info.head_len == 40 + 8);
+    if (last->parser->proto == proto_udp) {
+        assert(! had_ip6_udp);
+        had_ip6_udp = true;
+        assert(nb_ip6_calls == 3);  // revealed last
+        assert(last->payload == IP6_UDP_PAYLOAD);
+        assert(ip->fragmentation == IP_REASSEMBLED);
+    } else {
+        assert(last == &ip->info);
+        assert(ip->fragmentation == IP_FRAGMENT);
+    }
+}
+
+static size_t ip6_fragment(uint8_t *frame, uint8_t const *datagram, unsigned offset, size_t len, bool more_frags)
+{
+    static uint8_t const hdrs[IP6_HDRS_SIZE] = {
+        // Ethernet
+        0x46, 0x01, 0xc8, 0x63, 0xad, 0x64, 0x46, 0x01, 0xc8, 0x63, 0xad, 0x65, 0x86, 0xdd,
+        // IPv6 (payload length at offset 18)
+        0x60, 0x00, 0x00, 0x00, 0x00, 0x00, IPPROTO_FRAGMENT, 0x40,
+        0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x2a,
+        0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x2b,
+        // Fragment header (offset and flags at offset 56)
+        IPPROTO_UDP, 0x00, 0x00, 0x00, 0xde, 0xad, 0xbe, 0xef,
+    };
+    memcpy(frame, hdrs, sizeof(hdrs));
+    frame[18] = (8 + len) >> 8;
+    frame[19] = (8 + len) & 0xff;
+    unsigned const offset_flags = offset | (more_frags ? 1 : 0);
+    frame[56] = offset_flags >> 8;
+    frame[57] = offset_flags & 0xff;
+    memcpy(frame + sizeof(hdrs), datagram + offset, len);
+    return sizeof(hdrs) + len;
+}
+
+static void ip6_check(void)
+{
+    uint8_t datagram[8 + IP6_UDP_PAYLOAD] = {
+        0xae, 0x6d, 0x30, 0x39, (8 + IP6_UDP_PAYLOAD) >> 8, (8 + IP6_UDP_PAYLOAD) & 0xff, 0x00, 0x00,
+    };
+    for (unsigned i = 8; i < sizeof(datagram); i++) datagram[i] = i;
+    static struct { unsigned offset; size_t len; bool more_frags; } const frags[] = {
+        { 160, 48, false }, { 0, 80, true }, { 80, 80, true },
+    };
+
+    struct parser *parser = proto_eth->ops->parser_new(proto_eth);
+    assert(parser);
+    nb_ip6_calls = 0;
+    had_ip6_udp = false;
+    hook_subscriber_ctor(&pkt_hook, &sub, ip6_okfn);
+
+    for (unsigned f = 0; f < NB_ELEMS(frags); f++) {
+        uint8_t frame[IP6_HDRS_SIZE + 80];
+        size_t const len = ip6_fragment(frame, datagram, frags[f].offset, frags[f].len, frags[f].more_frags);
+        assert(PROTO_OK == proto_parse(parser, NULL, 0, frame, len, len, &now, len, frame));
+    }
+    assert(had_ip6_udp);
+    assert(nb_ip6_calls == NB_ELEMS(frags));
+
+    hook_subscriber_dtor(&pkt_hook, &sub);
+    parser_unref(&parser);
+}
+
 int main(void)
 {
     log_init();
@@ -359,6 +557,8 @@ int main(void)
     ip_init();
     ip6_init();
     udp_init();
+    gre_init();
+    icmp_init();
     log_set_level(LOG_DEBUG, NULL);
     log_set_level(LOG_INFO, "mutex");
     log_set_file("ip_reassembly_check.log");
@@ -367,8 +567,14 @@ int main(void)
     simple_check();
     reverse_check();
     for (unsigned nb_rand = 0; nb_rand < 100; nb_rand++) random_check();
+    timeout_check();
+    ticker_check();
+    gre_check();
+    ip6_check();
 
     doomer_stop();
+    icmp_fini();
+    gre_fini();
     udp_fini();
     ip6_fini();
     ip_fini();
@@ -4,10 +4,13 @@
 #undef NDEBUG
 #include <assert.h>
 #include <limits.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <junkie/tools/timeval.h>
 #include <junkie/tools/miscmacs.h>
 #include "proto/liner.c"
 
-static unsigned nb_tokens(char const *buf, size_t buf_sz, struct liner_delimiter_set *delims)
+static unsigned nb_tokens(char const *buf, size_t buf_sz, struct liner_delimiter_set const *delims)
 {
     struct liner liner;
     liner_init(&liner, delims, buf, buf_sz);
@@ -154,6 +157,101 @@ static void check_strtoull(void)
     }
 }
 
+static bool scan_supported(scan_fun *fun)
+{
+#   ifdef WITH_AVX2
+    if (fun == scan_avx2) return __builtin_cpu_supports("avx2");
+#   endif
+    (void)fun;
+    return true;
+}
+
+// Check that all scan functions find the same delimiters than the byte by byte scan
+static void check_scans(void)
+{
+    scan_fun *const scans[] = {
+        scan_scalar,
+#       if defined(__SSE2__)
+        scan_sse2,
+#       endif
+#       ifdef WITH_AVX2
+        scan_avx2,
+#       endif
+    };
+    struct liner_delimiter_set const *sets[] = { &delim_lines, &delim_blanks, &delim_spaces, &delim_colons, &delim_semicolons };
+    static char const alphabet[] = "abc \r\n:;";
+
+    for (unsigned t = 0; t < 10000; t++) {
+        char buf[200];
+        size_t const len = rand() % sizeof(buf);
+        unsigned const sparse = 1 + rand() % 50;  // so that we have long runs without delimiters as well
+        for (size_t c = 0; c < len; c++) {
+            buf[c] = rand() % sparse ? 'x' : alphabet[rand() % (sizeof(alphabet)-1)];
+        }
+        struct liner_delimiter_set const *delims = sets[rand() % NB_ELEMS(sets)];
+
+        scan = scan_scalar;
+        size_t exp_tok, exp_delim;
+        int const exp_ret = look_for_delim(&exp_tok, &exp_delim, buf, len, delims);
+        for (unsigned s = 0; s < NB_ELEMS(scans); s++) {
+            if (! scan_supported(scans[s])) continue;
+            scan = scans[s];
+            size_t tok, delim;
+            int const ret = look_for_delim(&tok, &delim, buf, len, delims);
+            assert(ret == exp_ret);
+            if (ret == 0) {
+                assert(tok == exp_tok);
+                assert(delim == exp_delim);
+            }
+        }
+    }
+
+    scan = NULL;
+}
+
+// Time the parse of some HTTP headers with each scan function (only when JUNKIE_BENCH is set)
+static void bench_scans(void)
+{
+    static char const header[] =
+        "GET /images/branding/product/1x/googlelogo_color_272x92dp.png?some=query&with=parameters HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101 Firefox/68.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Referer: https://www.example.com/search?q=some+rather+long+search+terms&source=hp&ei=AbCdEfGhIjKlMnOp\r\n"
+        "Cookie: SID=aBcDeFgHiJkLmNoPqRsTuVwXyZ0123456789; HSID=AbCdEfGhIjKlMnOpQ; SSID=AbCdEfGhIjKlMnOpQ; APISID=aBcDeFgHiJkLmNo/AbCdEfGhIjKlMnOpQ\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "\r\n";
+
+    struct { char const *name; scan_fun *fun; } const scans[] = {
+        { "scalar", scan_scalar },
+#       if defined(__SSE2__)
+        { "SSE2", scan_sse2 },
+#       endif
+#       ifdef WITH_AVX2
+        { "AVX2", scan_avx2 },
+#       endif
+    };
+
+    for (unsigned s = 0; s < NB_ELEMS(scans); s++) {
+        if (! scan_supported(scans[s].fun)) continue;
+        scan = scans[s].fun;
+        struct timeval start, stop;
+        timeval_set_now(&start);
+        unsigned nb_lines = 0;
+        for (unsigned r = 0; r < 100000; r++) {
+            nb_lines += nb_tokens(header, sizeof(header)-1, &delim_lines);
+        }
+        timeval_set_now(&stop);
+        assert(nb_lines == 100000 * 11);
+        printf("Splitting HTTP headers in lines with %s scan: %"PRId64"us\n", scans[s].name, timeval_sub(&stop, &start));
+    }
+
+    scan = NULL;
+}
+
 int main(void)
 {
     log_set_level(LOG_DEBUG, NULL);
@@ -166,6 +264,11 @@ int main(void)
     check_restart();
     check_termination();
     check_strtoull();
+    check_scans();
+    if (getenv("JUNKIE_BENCH")) {
+        log_set_level(LOG_INFO, NULL);  // DEBUG would make the bench meaningless
+        bench_scans();
+    }
 
     return EXIT_SUCCESS;
 }
@@ -1,9 +1,11 @@
 // -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
 // vim:sw=4 ts=4 sts=4 expandtab
 #include <stdlib.h>
+#include <inttypes.h>
 #undef NDEBUG
 #include <assert.h>
 #include <junkie/tools/log.h>
+#include <junkie/tools/timeval.h>
 #include "tools/mutex.c"
 
 static struct supermutex super1, super2;
@@ -36,7 +38,7 @@ static void supermutex_check(void)
     supermutex_unlock(&super1);
     supermutex_unlock(&super1);
     supermutex_unlock(&super1);
-    assert(my_supermutex_user->nb_locks == 0);
+    assert(! super1.owner);
 
     // Now check deadlock
     assert(0 == supermutex_lock(&super1));  // take super1
@@ -50,6 +52,119 @@ static void supermutex_check(void)
     supermutex_dtor(&super1);
 }
 
+/*
+ * Contention bench: each thread locks its own supermutex, as parser threads do with their waiting lists
+ */
+
+#define BENCH_NB_THREADS 4
+#define BENCH_NB_LOCKS 200000
+static struct supermutex bench_supers[BENCH_NB_THREADS];
+static bool bench_with_meta;    // emulate the former implementation, which took supermutex_meta_lock to lock and unlock
+
+static void *bench_thread(void *super_)
+{
+    struct supermutex *super = super_;
+    for (unsigned n = 0; n < BENCH_NB_LOCKS; n++) {
+        if (bench_with_meta) {
+            mutex_lock(&supermutex_meta_lock);
+            mutex_unlock(&supermutex_meta_lock);
+        }
+        assert(0 == supermutex_lock(super));
+        if (bench_with_meta) {
+            mutex_lock(&supermutex_meta_lock);
+            mutex_unlock(&supermutex_meta_lock);
+        }
+        supermutex_unlock(super);
+    }
+    return NULL;
+}
+
+static int64_t bench_run(bool with_meta)
+{
+    bench_with_meta = with_meta;
+    struct timeval start, stop;
+    timeval_set_now(&start);
+    pthread_t threads[BENCH_NB_THREADS];
+    for (unsigned t = 0; t < NB_ELEMS(threads); t++) {
+        pthread_create(threads+t, NULL, bench_thread, bench_supers+t);
+    }
+    for (unsigned t = 0; t < NB_ELEMS(threads); t++) {
+        pthread_join(threads[t], NULL);
+    }
+    timeval_set_now(&stop);
+    return timeval_sub(&stop, &start);
+}
+
+static void contention_bench(void)
+{
+    for (unsigned t = 0; t < NB_ELEMS(bench_supers); t++) {
+        supermutex_ctor(bench_supers+t, "bench");
+    }
+
+    int64_t const with_meta = bench_run(true);
+    int64_t const without_meta = bench_run(false);
+    printf("%u threads locking %u times their own supermutex: %"PRId64"us with a global lock, %"PRId64"us without\n",
+            BENCH_NB_THREADS, BENCH_NB_LOCKS, with_meta, without_meta);
+
+    for (unsigned t = 0; t < NB_ELEMS(bench_supers); t++) {
+        assert(! bench_supers[t].owner);
+        supermutex_dtor(bench_supers+t);
+    }
+}
+
+static struct flow_owner owner;
+static struct mutex flow_mutex;
+
+static void *other_parser(void *dummy)
+{
+    (void)dummy;
+    set_parser_thread(1);
+    assert(get_parser_thread() == 1);
+    assert(! flow_owner_check(&owner));
+    return NULL;
+}
+
+static void *not_a_parser(void *dummy)
+{
+    (void)dummy;
+    assert(get_parser_thread() == UNSET);
+    assert(flow_owner_check(&owner));
+    return NULL;
+}
+
+static void flow_owner_check_(void)
+{
+    mutex_ctor(&flow_mutex, "flow");
+    flow_owner_ctor(&owner);
+
+    // Without flow affinity the lock is taken and ownership is not checked
+    flow_lock(&flow_mutex, &owner);
+    PTHREAD_ASSERT_LOCK(&flow_mutex.mutex);
+    flow_unlock(&flow_mutex);
+    assert(owner.thread == UNSET);
+
+    // With flow affinity the lock is elided and the first parser thread becomes the owner
+    flow_affinity = true;
+    set_parser_thread(0);
+    flow_lock(&flow_mutex, &owner);
+    assert(0 == pthread_mutex_trylock(&flow_mutex.mutex));
+    assert(0 == pthread_mutex_unlock(&flow_mutex.mutex));
+    flow_unlock(&flow_mutex);
+    assert(owner.thread == 0);
+    assert(flow_owner_check(&owner));
+
+    // Another parser thread must not touch this flow, while other threads may
+    pthread_t other_thread;
+    pthread_create(&other_thread, NULL, other_parser, NULL);
+    pthread_join(other_thread, NULL);
+    pthread_create(&other_thread, NULL, not_a_parser, NULL);
+    pthread_join(other_thread, NULL);
+    assert(owner.thread == 0);
+
+    flow_affinity = false;
+    mutex_dtor(&flow_mutex);
+}
+
 int main(void)
 {
     log_init();
@@ -58,6 +173,9 @@ int main(void)
     mutex_init();
 
     supermutex_check();
+    flow_owner_check_();
+    log_set_level(LOG_INFO, NULL);  // DEBUG would make the bench meaningless
+    contention_bench();
 
     mutex_fini();
     log_fini();
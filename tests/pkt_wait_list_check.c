@@ -13,6 +13,28 @@
 #undef LOG_CAT
 #define LOG_CAT global_log_category
 
+/*
+ * Check that skip list levels are well distributed even for aligned offsets
+ */
+
+static void levels_check(void)
+{
+    static unsigned const strides[] = { 1, 2, 4, 1024, 1460, 4096, 65536, 1U<<20 };
+    for (unsigned s = 0; s < NB_ELEMS(strides); s++) {
+        unsigned nb_per_level[PKT_WAIT_MAX_LEVELS+1] = {};
+        unsigned const nb_offsets = 4096;
+        for (unsigned o = 0; o < nb_offsets; o++) {
+            unsigned const nb_levels = pkt_wait_nb_levels(12345 + o * strides[s]);
+            assert(nb_levels >= 1 && nb_levels <= PKT_WAIT_MAX_LEVELS);
+            nb_per_level[nb_levels] ++;
+        }
+        // Expect 3/4 of offsets at level 1, 3/16 at level 2, and few above
+        assert(nb_per_level[1] > nb_offsets * 70 / 100 && nb_per_level[1] < nb_offsets * 80 / 100);
+        assert(nb_per_level[2] > nb_offsets * 15 / 100 && nb_per_level[2] < nb_offsets * 23 / 100);
+        assert(nb_per_level[PKT_WAIT_MAX_LEVELS] < nb_offsets / 100);
+    }
+}
+
 /*
  * Check that we do not leak memory nor destroy anything by creating and destructing a pkt_wait_list
  */
@@ -20,7 +42,7 @@
 static void ctor_dtor_check(void)
 {
     struct pkt_wl_config config;
-    pkt_wl_config_ctor(&config, "test1", 0, 0, 0, 0, true);
+    pkt_wl_config_ctor(&config, "test1", 0, 0, 0, 0, true, 0);
 
     struct parser *dummy = proto_dummy->ops->parser_new(proto_dummy);
     assert(dummy);
@@ -59,7 +81,7 @@ static enum proto_parse_status test_parse(struct parser *parser, struct proto_in
 
 static void wl_check_setup(void)
 {
-    pkt_wl_config_ctor(&config, "test", 1000, 0, 0, 0, true);
+    pkt_wl_config_ctor(&config, "test", 1000, 0, 0, 0, true, 0);
 
     static struct proto_ops const ops = {
         .parse      = test_parse,
@@ -83,6 +105,7 @@ static void wl_check_teardown(void)
 {
     parser_unref(&test_parser);
     uniq_proto_dtor(&test_proto);
+    doomer_run();   // so that the old parser is deleted before test_proto is reused
     pkt_wl_config_dtor(&config);
 }
 
@@ -102,7 +125,7 @@ static void simple_check(void)
         int len = strlen(packets[p]) + 1;
         assert(PROTO_OK == pkt_wait_list_add(&wl, offset, offset+len, false, 0, true, NULL, 0, (uint8_t *)packets[p], len, len, &now, len, (uint8_t *)packets[p]));
         offset += len;
-        assert(LIST_EMPTY(&wl.pkts));
+        assert(! wl.pkts[0]);
     }
 
     // Check we parsed everything
@@ -131,7 +154,7 @@ static void reorder_check(void)
     }
 
     // Check we parsed everything
-    assert(LIST_EMPTY(&wl.pkts));
+    assert(! wl.pkts[0]);
     assert(next_msg == 4);
 
     wl_check_teardown();
@@ -147,12 +170,135 @@ static void gap_check(void)
     char packet[] = "0. Maitre corbeau sur un arbre perche tenait en son bec un fromage";
     int const len = strlen(packet) + 1;
     assert(PROTO_OK == pkt_wait_list_add(&wl, 0, 0+len, false, 0, true, NULL, 0, (uint8_t *)packet, len, len, &now, len, (uint8_t *)packet));
-    assert(LIST_EMPTY(&wl.pkts));
+    assert(! wl.pkts[0]);
     assert(next_msg == 1);
 
     wl_check_teardown();
 }
 
+/*
+ * Large window: many segments received in random order, with retransmissions
+ */
+
+static uint8_t stream[20000];
+static unsigned stream_next;
+
+static enum proto_parse_status stream_parse(struct parser unused_ *parser, struct proto_info unused_ *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t unused_ wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
+{
+    assert(cap_len > 0);
+    assert(stream_next + cap_len <= sizeof(stream));
+    assert(0 == memcmp(packet, stream + stream_next, cap_len));
+    stream_next += cap_len;
+    return proto_parse(NULL, NULL, way, NULL, 0, 0, now, tot_cap_len, tot_packet);
+}
+
+static void window_check(void)
+{
+    pkt_wl_config_ctor(&config, "window", 0, 0, 0, 0, true, 0);
+    static struct proto_ops const ops = {
+        .parse      = stream_parse,
+        .parser_new = uniq_parser_new,
+        .parser_del = uniq_parser_del,
+    };
+    uniq_proto_ctor(&test_proto, &ops, "Stream", PROTO_CODE_DUMMY);
+    test_parser = test_proto.proto.ops->parser_new(&test_proto.proto);
+    struct proto *proto = &test_proto.proto;
+    assert(0 == pkt_wait_list_ctor(&wl, 0, &config, &proto, &test_parser, NULL));
+
+    for (unsigned c = 0; c < sizeof(stream); c++) stream[c] = rand();
+    stream_next = 0;
+
+#   define SEG_SIZE 10
+    unsigned order[sizeof(stream) / SEG_SIZE];
+    for (unsigned s = 0; s < NB_ELEMS(order); s++) order[s] = s;
+    for (unsigned s = NB_ELEMS(order) - 1; s > 0; s--) {   // shuffle
+        unsigned const o = rand() % (s + 1);
+        unsigned const tmp = order[s];
+        order[s] = order[o];
+        order[o] = tmp;
+    }
+
+    for (unsigned s = 0; s < NB_ELEMS(order); s++) {
+        unsigned const offset = order[s] * SEG_SIZE;
+        assert(PROTO_OK == pkt_wait_list_add(&wl, offset, offset + SEG_SIZE, false, 0, true, NULL, 0, stream + offset, SEG_SIZE, SEG_SIZE, &now, SEG_SIZE, stream + offset));
+        if (rand() % 4 == 0) {  // retransmit some, possibly with another segmentation
+            unsigned const len = 1 + rand() % SEG_SIZE;
+            assert(PROTO_OK == pkt_wait_list_add(&wl, offset, offset + len, false, 0, true, NULL, 0, stream + offset, len, len, &now, len, stream + offset));
+        }
+    }
+
+    assert(! wl.pkts[0]);
+    assert(wl.nb_pkts == 0);
+    assert(stream_next == sizeof(stream));
+
+    pkt_wait_list_dtor(&wl);
+    wl_check_teardown();
+}
+
+/*
+ * Skipping: a parser that does not care about some bytes receives a gap at once instead of waiting for them
+ */
+
+static size_t skip_received;    // how many bytes (including gaps) the parser received
+static unsigned skip_nb_gaps;
+
+static enum proto_parse_status skip_parse(struct parser *parser, struct proto_info unused_ *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
+{
+    if (! packet) {
+        assert(cap_len == 0);
+        skip_nb_gaps ++;
+    }
+    if (skip_received == 0) pkt_wait_list_skip(parser, 5000);  // not interested in what follows the first packet
+    skip_received += wire_len;
+    return proto_parse(NULL, NULL, way, NULL, 0, 0, now, tot_cap_len, tot_packet);
+}
+
+static void skip_check(void)
+{
+    pkt_wl_config_ctor(&config, "skip", 1000, 0, 0, 0, true, 0);
+    static struct proto_ops const ops = {
+        .parse      = skip_parse,
+        .parser_new = uniq_parser_new,
+        .parser_del = uniq_parser_del,
+    };
+    uniq_proto_ctor(&test_proto, &ops, "Skip", PROTO_CODE_DUMMY);
+    test_parser = test_proto.proto.ops->parser_new(&test_proto.proto);
+    struct proto *proto = &test_proto.proto;
+    assert(0 == pkt_wait_list_ctor(&wl, 0, &config, &proto, &test_parser, NULL));
+    skip_received = 0;
+    skip_nb_gaps = 0;
+
+    uint8_t payload[10] = { 0, };
+#   define ADD(offset) assert(PROTO_OK == pkt_wait_list_add(&wl, offset, offset + sizeof(payload), false, 0, true, NULL, 0, payload, sizeof(payload), sizeof(payload), &now, sizeof(payload), payload))
+    ADD(0);
+    assert(wl.skip_offset == 5010);
+
+    // Within the skipped range: parsed at once after a gap (although the gap is larger than acceptable)
+    ADD(3000);
+    assert(! wl.pkts[0]);
+    assert(wl.next_offset == 3010);
+    assert(skip_received == 3010);
+    assert(skip_nb_gaps == 1);
+
+    // The missing bytes are merely advertised
+    ADD(10);
+    assert(! wl.pkts[0]);
+    assert(skip_received == 3010);
+
+    ADD(4990);
+    assert(wl.next_offset == 5000);
+    assert(skip_nb_gaps == 2);
+
+    // After the skipped range we wait again
+    ADD(5500);
+    assert(wl.pkts[0]);
+    assert(wl.next_offset == 5000);
+#   undef ADD
+
+    pkt_wait_list_dtor(&wl);
+    wl_check_teardown();
+}
+
 /*
  * Reassembly checks
  */
@@ -249,10 +395,13 @@ int main(void)
     log_set_level(LOG_INFO, NULL);  // DEBUG make the test too slow
     log_set_file("pkt_wait_list_check.log");
 
+    levels_check();
     ctor_dtor_check();
     simple_check();
     reorder_check();
     gap_check();
+    window_check();
+    skip_check();
     for (unsigned t = 0; t < 1000; t++) {
         reassembly_check();
     }
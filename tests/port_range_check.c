@@ -4,6 +4,10 @@
 #include <stdio.h>
 #undef NDEBUG
 #include <assert.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/objalloc.h>
+#include <junkie/tools/ref.h>
+#include <junkie/tools/miscmacs.h>
 #include <junkie/proto/ip.h>
 #include <junkie/proto/port_muxer.h>
 
@@ -27,13 +31,83 @@ static void port_muxer_check(void)
     }
 }
 
+static bool in_range(struct port_muxer const *muxer, uint16_t port)
+{
+    return port >= muxer->port_min && port <= muxer->port_max;
+}
+
+// What port_muxer_find() is supposed to return
+static struct proto *find_in_list(struct port_muxer_list *muxers, uint16_t port1, uint16_t port2)
+{
+    struct port_muxer *muxer;
+    TAILQ_FOREACH(muxer, &muxers->muxers, entry) {
+        if (in_range(muxer, port1) || in_range(muxer, port2)) return muxer->proto;
+    }
+    return NULL;
+}
+
+static void check_lookups(struct port_muxer_list *muxers)
+{
+    for (unsigned t = 0; t < 10000; t++) {
+        uint16_t const port1 = rand() % 2200;
+        uint16_t const port2 = t & 1 ? rand() % 65536 : rand() % 2200;
+        assert(port_muxer_find(muxers, port1, port2) == find_in_list(muxers, port1, port2));
+    }
+}
+
+static void lookup_check(void)
+{
+    static struct proto protos[50];
+    struct port_muxer *muxers_added[NB_ELEMS(protos)];
+    struct port_muxer_list muxers;
+
+    port_muxer_list_ctor(&muxers, "test");
+    check_lookups(&muxers);
+
+    // A few large overlapping ranges and many small ones
+    for (unsigned p = 0; p < NB_ELEMS(protos); p++) {
+        protos[p].name = "test";
+        uint16_t const port_min = rand() % 2000;
+        uint16_t const port_max = port_min + rand() % (p < 5 ? 60000 : 100);
+        muxers_added[p] = port_muxer_new(&muxers, port_min, port_max, protos+p);
+        assert(muxers_added[p]);
+        check_lookups(&muxers);
+    }
+
+    // Lookups must not return deleted ranges
+    for (unsigned p = 0; p < NB_ELEMS(protos); p += 2) {
+        port_muxer_del(muxers_added[p], &muxers);
+        check_lookups(&muxers);
+    }
+    for (unsigned p = 1; p < NB_ELEMS(protos); p += 2) {
+        port_muxer_del(muxers_added[p], &muxers);
+    }
+    assert(NULL == port_muxer_find(&muxers, 10, 1000));
+
+    // Outdated tables are freed by the doomer, while the current one is still usable
+    doomer_run();
+    assert(NULL == port_muxer_find(&muxers, 10, 1000));
+
+    port_muxer_list_dtor(&muxers);
+}
+
 int main(void)
 {
     log_init();
     log_set_level(LOG_DEBUG, NULL);
     log_set_file("port_range_check.log");
 
+    ext_init();
+    objalloc_init();
+    ref_init();
+
     port_muxer_check();
+    lookup_check();
+
+    doomer_stop();
+    ref_fini();
+    objalloc_fini();
+    ext_fini();
 
     log_fini();
     return EXIT_SUCCESS;
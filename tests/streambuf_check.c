@@ -354,6 +354,30 @@ static int check_cap_after_gap(void)
     return 0;
 }
 
+// Check that a message received byte per byte is not copied over and over
+static int check_in_place(void)
+{
+    struct streambuf_unidir *dir = sbuf.dir + 0;
+    unsigned nb_buffers = 0;
+    uint8_t const *prev_buffer = NULL;
+
+    for (unsigned c = 0; c < 2000; c++) {
+        enum proto_parse_status status = streambuf_add(&sbuf, (struct parser *)&sbuf, NULL, 0,
+                (uint8_t *)long_payload, 1, 1, &now, 1, (uint8_t *)long_payload);
+        CHECK_INT(status, PROTO_OK);
+        CHECK_INT(dir->cap_len, c + 1);
+        CHECK_INT(dir->wire_len, c + 1);
+        assert(dir->buffer[c] == 'T');
+        if (dir->buffer != prev_buffer) {
+            nb_buffers ++;
+            prev_buffer = dir->buffer;
+        }
+    }
+    assert(nb_buffers < 20);
+
+    return 0;
+}
+
 typedef int test_fun(void);
 
 int main(void)
@@ -376,6 +400,10 @@ int main(void)
     assert(0 == check_max_keep());
     teardown();
 
+    setup(parse_max_keep, 3000);
+    assert(0 == check_in_place());
+    teardown();
+
     setup(parse_last_packet, 80);
     assert(0 == check_last_packet_use());
     teardown();
@@ -11,6 +11,8 @@
 #include <junkie/proto/eth.h>
 #include <junkie/proto/proto.h>
 #include <junkie/proto/ip.h>
+#include <junkie/proto/udp.h>
+#include <junkie/proto/discovery.h>
 #include "lib_test_junkie.h"
 #include "proto/pkt_wait_list.c"
 #include "proto/tcp.c"
@@ -265,6 +267,240 @@ static void pkt_wl_check(void)
     assert(parser->ref.count == 0);
 }
 
+/*
+ * Lazy allocation of the waiting lists and of the parser
+ */
+
+static unsigned nb_lazy_parses;
+
+static enum proto_parse_status lazy_parse(struct parser unused_ *parser, struct proto_info unused_ *parent,
+        unsigned unused_ way, uint8_t const unused_ *packet, size_t unused_ cap_len, size_t unused_ wire_len,
+        struct timeval const unused_ *now, size_t unused_ tot_cap_len, uint8_t const unused_ *tot_packet)
+{
+    nb_lazy_parses ++;
+    return PROTO_OK;
+}
+
+static void lazy_send(struct parser *tcp_parser, struct ip_proto_info *ip, uint16_t const port[2], unsigned way,
+        uint32_t seq, uint32_t ack, bool syn, size_t payload, struct timeval const *now)
+{
+    uint8_t packet[sizeof(struct tcp_hdr) + 10];
+    assert(payload <= sizeof(packet) - sizeof(struct tcp_hdr));
+    size_t const len = sizeof(struct tcp_hdr) + payload;
+    assert(0 == tcph_ctor(packet, len, port[way], port[!way], seq, ack, syn, false, false, ack != 0));
+    memset(packet + sizeof(struct tcp_hdr), 'x', payload);
+    proto_info_ctor(&ip->info, ip->info.parser, NULL, sizeof(struct ip_hdr), len);
+    assert(PROTO_OK == tcp_parse(tcp_parser, &ip->info, way, packet, len, len, now, len, packet));
+}
+
+static struct tcp_subparser *lazy_subparser(struct parser *tcp_parser, uint16_t const port[2], struct timeval const *now)
+{
+    struct port_key key;
+    port_key_init(&key, port[0], port[1], 0);
+    struct mux_subparser *mux_subparser = mux_subparser_lookup(DOWNCAST(tcp_parser, parser, mux_parser), NULL, NULL, &key, now);
+    assert(mux_subparser);
+    struct tcp_subparser *tcp_sub = DOWNCAST(mux_subparser, mux_subparser, tcp_subparser);
+    mux_subparser_unref(&mux_subparser);    // still owned by tcp_parser
+    return tcp_sub;
+}
+
+static void ip_info_ctor(struct ip_proto_info *ip, struct parser *ip_parser)
+{
+    proto_info_ctor(&ip->info, ip_parser, NULL, sizeof(struct ip_hdr), 0);
+    ip_addr_ctor_from_ip4(ip->key.addr+0, 0x0a000001);
+    ip_addr_ctor_from_ip4(ip->key.addr+1, 0x0a000002);
+    ip->key.protocol = IPPROTO_TCP;
+    ip->version = 4;
+    ip->ttl = 64;
+    ip->way = 0;
+    ip->fragmentation = IP_NOFRAG;
+    ip->id = 0;
+    ip->traffic_class = 0;
+}
+
+static void lazy_check(void)
+{
+    struct timeval now;
+    timeval_set_now(&now);
+    struct parser *ip_parser = proto_ip->ops->parser_new(proto_ip);
+    struct parser *tcp_parser = proto_tcp->ops->parser_new(proto_tcp);
+    assert(ip_parser && tcp_parser);
+    struct ip_proto_info ip;
+    ip_info_ctor(&ip, ip_parser);
+
+    static struct proto_ops const ops = {
+        .parse      = lazy_parse,
+        .parser_new = uniq_parser_new,
+        .parser_del = uniq_parser_del,
+        .info_2_str = proto_info_2_str,
+    };
+    static struct uniq_proto uniq_proto_lazy;
+    static struct port_muxer tcp_port_muxer;
+    uniq_proto_ctor(&uniq_proto_lazy, &ops, "Lazy", 43);
+    port_muxer_ctor(&tcp_port_muxer, &tcp_port_muxers, 12345, 12345, &uniq_proto_lazy.proto);
+    nb_lazy_parses = 0;
+
+    uint16_t const port[2] = { 40000, 12345 };
+    lazy_send(tcp_parser, &ip, port, 0, 100, 0, true, 0, &now);
+    lazy_send(tcp_parser, &ip, port, 1, 200, 101, true, 0, &now);
+    lazy_send(tcp_parser, &ip, port, 0, 101, 201, false, 0, &now);
+    lazy_send(tcp_parser, &ip, port, 1, 201, 101, false, 0, &now);
+    struct tcp_subparser *tcp_sub = lazy_subparser(tcp_parser, port, &now);
+    // Handshake and pure ACKs need neither waiting lists nor parser
+    assert(! tcp_sub->wl);
+    assert(! tcp_sub->mux_subparser.parser);
+    assert(tcp_sub->mux_subparser.proto == &uniq_proto_lazy.proto);
+    assert(nb_lazy_parses == 0);
+
+    // The parser is built with the first payload
+    lazy_send(tcp_parser, &ip, port, 0, 101, 201, false, 10, &now);
+    assert(tcp_sub->mux_subparser.parser);
+    assert(nb_lazy_parses == 1);
+    lazy_send(tcp_parser, &ip, port, 1, 201, 111, false, 10, &now);
+    assert(nb_lazy_parses == 2);
+    assert(! tcp_sub->wl);
+    SLOG(LOG_INFO, "In order connection took %zu bytes (instead of %zu with the waiting lists)",
+            sizeof(*tcp_sub), sizeof(*tcp_sub) + 2*sizeof(*tcp_sub->wl));
+
+    // The waiting lists are built once a segment has to wait
+    lazy_send(tcp_parser, &ip, port, 0, 121, 211, false, 10, &now);
+    assert(tcp_sub->wl);
+    assert(nb_lazy_parses == 2);
+    lazy_send(tcp_parser, &ip, port, 0, 111, 211, false, 10, &now);
+    assert(nb_lazy_parses == 4);
+    assert(! tcp_sub->wl[0].pkts[0] && ! tcp_sub->wl[1].pkts[0]);
+    assert(tcp_next_offset(tcp_sub, 0) == 131);
+    assert(tcp_next_offset(tcp_sub, 1) == 211);
+
+    port_muxer_dtor(&tcp_port_muxer, &tcp_port_muxers);
+    assert(tcp_parser->ref.count == 1);
+    parser_unref(&tcp_parser);
+    parser_unref(&ip_parser);
+    uniq_proto_dtor(&uniq_proto_lazy);
+}
+
+/*
+ * Giving up the discovery
+ */
+
+static void gave_up_check(void)
+{
+    struct timeval now;
+    timeval_set_now(&now);
+    struct parser *ip_parser = proto_ip->ops->parser_new(proto_ip);
+    struct parser *tcp_parser = proto_tcp->ops->parser_new(proto_tcp);
+    assert(ip_parser && tcp_parser);
+    struct ip_proto_info ip;
+    ip_info_ctor(&ip, ip_parser);
+
+    // No signature is loaded, so the discovery fails on every payload
+    uint16_t const port[2] = { 40000, 12346 };
+    lazy_send(tcp_parser, &ip, port, 0, 100, 0, true, 0, &now);
+    lazy_send(tcp_parser, &ip, port, 1, 200, 101, true, 0, &now);
+    struct tcp_subparser *tcp_sub = lazy_subparser(tcp_parser, port, &now);
+    assert(tcp_sub->mux_subparser.proto == proto_discovery);
+    assert(! tcp_sub->mux_subparser.parser);
+
+    uint32_t seq = 101;
+    unsigned nb_payloads = 0;
+    while (! tcp_sub->gave_up) {
+        assert(nb_payloads < 100);
+        lazy_send(tcp_parser, &ip, port, 0, seq, 201, false, 10, &now);
+        seq += 10;
+        nb_payloads ++;
+    }
+    SLOG(LOG_DEBUG, "Gave up after %u payloads", nb_payloads);
+    assert(nb_payloads > 1);
+    assert(! tcp_sub->mux_subparser.parser);
+    assert(! tcp_sub->mux_subparser.proto);
+
+    // Once given up, payloads are still advertised in order but no parser is built anymore
+    for (unsigned p = 0; p < 3; p++) {
+        lazy_send(tcp_parser, &ip, port, 0, seq, 201, false, 10, &now);
+        seq += 10;
+    }
+    assert(tcp_sub->gave_up);
+    assert(! tcp_sub->mux_subparser.parser);
+    assert(! tcp_sub->wl);
+    assert(tcp_next_offset(tcp_sub, 0) == seq);
+
+    /* New connections to that server skip the discovery, but for the first one which
+     * is probed (one out of UNKNOWN_SERVERS_PROBE) */
+    uint16_t const port2[2] = { 40001, 12346 };
+    lazy_send(tcp_parser, &ip, port2, 0, 100, 0, true, 0, &now);
+    tcp_sub = lazy_subparser(tcp_parser, port2, &now);
+    assert(! tcp_sub->gave_up);
+    assert(tcp_sub->mux_subparser.proto == proto_discovery);
+    uint16_t const port3[2] = { 40002, 12346 };
+    lazy_send(tcp_parser, &ip, port3, 0, 100, 0, true, 0, &now);
+    tcp_sub = lazy_subparser(tcp_parser, port3, &now);
+    assert(tcp_sub->gave_up);
+    assert(! tcp_sub->mux_subparser.proto);
+    assert(! tcp_sub->mux_subparser.parser);
+
+    assert(tcp_parser->ref.count == 1);
+    parser_unref(&tcp_parser);
+    parser_unref(&ip_parser);
+}
+
+/*
+ * Check that waiting packets keep only the infos TCP subparsers read
+ */
+
+static void kept_infos_check(void)
+{
+    struct parser *cap_parser = proto_cap->ops->parser_new(proto_cap);
+    struct parser *eth_parser = proto_eth->ops->parser_new(proto_eth);
+    struct parser *ip_parser = proto_ip->ops->parser_new(proto_ip);
+    struct parser *tcp_parser = proto_tcp->ops->parser_new(proto_tcp);
+    assert(cap_parser && eth_parser && ip_parser && tcp_parser);
+
+    struct cap_proto_info cap;
+    proto_info_ctor(&cap.info, cap_parser, NULL, 0, 60);
+    cap.dev_id = 1;
+    timeval_set_now(&cap.tv);
+    struct eth_proto_info eth;
+    proto_info_ctor(&eth.info, eth_parser, &cap.info, 14, 46);
+    eth.vlan_id = VLAN_UNSET;
+    eth.protocol = 0x0800;
+    struct ip_proto_info ip;
+    ip_info_ctor(&ip, ip_parser);
+    ip.info.parent = &eth.info;
+    struct tcp_proto_info tcp;
+    proto_info_ctor(&tcp.info, tcp_parser, &ip.info, sizeof(struct tcp_hdr), 6);
+
+    // With 2 kept infos (as configured for TCP) the eth info is dropped
+    size_t const full_size = proto_info_stack_size(&tcp.info, 0);
+    size_t const kept_size = proto_info_stack_size(&tcp.info, 2);
+    assert(full_size == proto_info_stack_size(&tcp.info, 4));
+    assert(kept_size == proto_info_stack_size(&tcp.info, 3) - CEIL_DIV(sizeof(eth), PROTO_INFO_ALIGN) * PROTO_INFO_ALIGN);
+    assert(kept_size < full_size);
+    SLOG(LOG_INFO, "Waiting TCP packets keep %zu bytes of infos instead of %zu", kept_size, full_size);
+
+    void *block = malloc(kept_size);
+    assert(block);
+    struct proto_info *copy = proto_info_stack_copy(&tcp.info, block, 2);
+    assert(copy == block);
+    assert(copy->parser == tcp_parser && copy->payload == 6);
+    assert(copy->parent && copy->parent->parser == ip_parser);
+    struct ip_proto_info const *ip_copy = DOWNCAST(copy->parent, info, ip_proto_info);
+    assert(0 == ip_addr_cmp(ip_copy->key.addr+0, ip.key.addr+0));
+    struct proto_info const *root = copy->parent->parent;
+    assert(root && root->parser == cap_parser && ! root->parent);
+    struct cap_proto_info const *cap_copy = DOWNCAST(root, info, cap_proto_info);
+    assert(cap_copy->dev_id == 1 && 0 == timeval_cmp(&cap_copy->tv, &cap.tv));
+    assert(eth_parser->ref.count == 1);
+    assert(tcp_parser->ref.count == 2);
+    proto_info_stack_release(copy);
+    assert(tcp_parser->ref.count == 1);
+    free(block);
+
+    parser_unref(&tcp_parser);
+    parser_unref(&ip_parser);
+    parser_unref(&eth_parser);
+    parser_unref(&cap_parser);
+}
+
 int main(void)
 {
     log_init();
@@ -280,6 +516,7 @@ int main(void)
     ip_init();
     ip6_init();
     tcp_init();
+    udp_init();
     log_set_level(LOG_DEBUG, NULL);
     log_set_level(LOG_WARNING, "mutex");
     log_set_level(LOG_WARNING, "redim_array");
@@ -288,10 +525,17 @@ int main(void)
     seqnum_test();
     parse_check();
     pkt_wl_check();
+    lazy_check();
+    scm_init_guile();
+    discovery_init();
+    gave_up_check();
+    kept_infos_check();
 
     stress_check(proto_tcp);
 
     doomer_stop();
+    discovery_fini();
+    udp_fini();
     tcp_fini();
     ip6_fini();
     ip_fini();
@@ -10,6 +10,7 @@
 #include <junkie/proto/cap.h>
 #include <junkie/proto/eth.h>
 #include <junkie/proto/ip.h>
+#include <junkie/proto/tcp.h>
 #include "lib_test_junkie.h"
 #include "proto/tls.c"
 
@@ -26,6 +27,159 @@ static void tls_check(void)
     assert(TLS_OK == tls_keyfile_new(3, passphrase_key, "toto", &net, &mask, false, &proto));
 }
 
+// Records are held while a pre master secret is pending, up to tls-rsa-max-held-records
+static void held_records_check(void)
+{
+    struct parser *parser = tls_parser_new(proto_tls);
+    assert(parser);
+    struct tls_parser *tls_parser = DOWNCAST(parser, parser, tls_parser);
+
+    struct tls_rsa_job *job = objalloc(sizeof(*job), "test");
+    job->nb_owners = 1;
+    job->done = 0;
+    job->keyfile_id = -1;
+    job->nb_keys = 0;
+    tls_parser->rsa_job = job;
+
+    struct tls_proto_info info = { .version = { 3, 1 }, .content_type = tls_application_data };
+    uint8_t const content[] = { 1, 2, 3, 4 };
+    for (unsigned r = 0; r < max_held_records; r++) {
+        struct timeval const now = { .tv_sec = 1000 + r, .tv_usec = 0 };
+        assert(0 == tls_hold_record(tls_parser, 0, &info, sizeof(content), sizeof(content), content, NULL, &now, 0, NULL));
+    }
+    assert(tls_parser->nb_held_records == max_held_records);
+    struct timeval const now = { .tv_sec = 2000, .tv_usec = 0 };
+    assert(0 != tls_hold_record(tls_parser, 0, &info, sizeof(content), sizeof(content), content, NULL, &now, 0, NULL));
+
+    struct tls_held_record *rec = STAILQ_FIRST(&tls_parser->held_records);
+    assert(rec && rec->wire_len == sizeof(content) && 0 == memcmp(rec->content, content, sizeof(content)));
+    assert(rec->now.tv_sec == 1000);    // each record keeps its own timestamp
+
+    tls_forget_rsa_job(tls_parser);
+    assert(tls_parser->nb_held_records == 0);
+    assert(! tls_parser->rsa_job);
+
+    parser_unref(&parser);
+}
+
+/* Once the pre master secret is known the held records are parsed by the ticker,
+ * each with its own parent infos, packet and timestamp, and in order. */
+static struct replayed {
+    unsigned nb;
+    struct {
+        time_t sec;
+        uint16_t port;
+        uint8_t first_byte;
+        struct proto_info const *parent;
+    } recs[4];
+} replayed;
+
+static void replay_cb(struct proto_subscriber unused_ *s, struct proto_info const *info, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
+{
+    assert(replayed.nb < NB_ELEMS(replayed.recs));
+    assert(info->parser->proto == proto_tls);
+    ASSIGN_INFO_CHK(tcp, info, );
+    ASSIGN_INFO_CHK(ip, &tcp->info, );
+    assert(tot_cap_len > 0);
+    replayed.recs[replayed.nb].sec = now->tv_sec;
+    replayed.recs[replayed.nb].port = tcp->key.port[0];
+    replayed.recs[replayed.nb].first_byte = tot_packet[0];
+    replayed.recs[replayed.nb].parent = info->parent;
+    replayed.nb ++;
+}
+
+static struct tls_rsa_job *fake_rsa_job(void)
+{
+    struct tls_rsa_job *job = objalloc(sizeof(*job), "test");
+    job->nb_owners = 1;
+    job->done = 0;
+    job->keyfile_id = -1;
+    job->nb_keys = 0;
+    return job;
+}
+
+// Send a whole application data record, coming from this port in a packet starting with this byte
+static void send_record(struct parser *parser, struct parser *ip_parser, struct parser *tcp_parser, uint16_t port, uint8_t first_byte, time_t sec)
+{
+    uint8_t packet[TLS_RECORD_HEAD + 4] = { tls_application_data, 3, 1, 0, 4, 1, 2, 3, 4 };
+    uint8_t tot_packet[64];
+    memset(tot_packet, first_byte, sizeof(tot_packet));
+    struct timeval const now = { .tv_sec = sec, .tv_usec = 0 };
+
+    struct ip_proto_info ip;
+    proto_info_ctor(&ip.info, ip_parser, NULL, 20, sizeof(packet) + 20);
+    ip_addr_ctor_from_ip4(ip.key.addr+0, 0x0a000001);
+    ip_addr_ctor_from_ip4(ip.key.addr+1, 0x0a000002);
+    ip.key.protocol = IPPROTO_TCP;
+    struct tcp_proto_info tcp;
+    proto_info_ctor(&tcp.info, tcp_parser, &ip.info, 20, sizeof(packet));
+    tcp.key.port[0] = port;
+    tcp.key.port[1] = 443;
+
+    assert(PROTO_OK == tls_parse(parser, &tcp.info, 0, packet, sizeof(packet), sizeof(packet), &now, sizeof(tot_packet), tot_packet));
+    // The held record must not depend on any of these
+    memset(tot_packet, 0, sizeof(tot_packet));
+    memset(&tcp, 0, sizeof(tcp));
+}
+
+static void held_records_replay_check(void)
+{
+    struct parser *parser = tls_parser_new(proto_tls);
+    struct parser *ip_parser = proto_ip->ops->parser_new(proto_ip);
+    struct parser *tcp_parser = proto_tcp->ops->parser_new(proto_tcp);
+    assert(parser && ip_parser && tcp_parser);
+    struct tls_parser *tls_parser = DOWNCAST(parser, parser, tls_parser);
+    struct proto_subscriber sub;
+    hook_subscriber_ctor(&proto_tls->hook, &sub, replay_cb);
+
+    // Records are held while the job is running, and nothing is replayed yet
+    struct tls_rsa_job *job = fake_rsa_job();
+    tls_parser->rsa_job = job;
+    send_record(parser, ip_parser, tcp_parser, 1001, 'a', 1000);
+    send_record(parser, ip_parser, tcp_parser, 1002, 'b', 1001);
+    assert(tls_parser->nb_held_records == 2);
+    assert(tls_parser->holding);
+    assert(replayed.nb == 0);
+    tls_held_replay_tick(NULL);
+    assert(replayed.nb == 0);
+    assert(tls_parser->nb_held_records == 2);
+
+    // Then the job finishes and no more record comes: the ticker replays them
+    job->done = 1;
+    tls_held_replay_tick(NULL);
+    assert(replayed.nb == 2);
+    assert(tls_parser->nb_held_records == 0);
+    assert(! tls_parser->rsa_job);
+    assert(! tls_parser->holding);
+    assert(LIST_EMPTY(&tls_holding_parsers));
+    for (unsigned r = 0; r < 2; r++) {
+        assert(replayed.recs[r].sec == 1000 + (time_t)r);
+        assert(replayed.recs[r].port == 1001 + r);
+        assert(replayed.recs[r].first_byte == 'a' + r);
+    }
+    assert(replayed.recs[0].parent != replayed.recs[1].parent);
+    // The copies of the parent infos were released
+    assert(tcp_parser->ref.count == 1);
+    assert(ip_parser->ref.count == 1);
+
+    // Records held when the parser is deleted are parsed as well
+    job = fake_rsa_job();
+    tls_parser->rsa_job = job;
+    send_record(parser, ip_parser, tcp_parser, 1003, 'c', 1002);
+    assert(tls_parser->nb_held_records == 1);
+    assert(replayed.nb == 2);
+    job->done = 1;
+    parser_unref(&parser);
+    doomer_run();
+    assert(replayed.nb == 3);
+    assert(replayed.recs[2].port == 1003 && replayed.recs[2].first_byte == 'c');
+    assert(LIST_EMPTY(&tls_holding_parsers));
+
+    hook_subscriber_dtor(&proto_tls->hook, &sub);
+    parser_unref(&tcp_parser);
+    parser_unref(&ip_parser);
+}
+
 int main(void)
 {
     log_init();
@@ -49,6 +203,8 @@ int main(void)
     log_set_file("tls_check.log");
 
     tls_check();
+    held_records_check();
+    held_records_replay_check();
 
     tls_fini();
     tcp_fini();
@@ -0,0 +1,183 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/tools/miscmacs.h>
+#include "tools/wheel.c"
+
+struct w_timer {
+    struct wheel_timer timer;
+    unsigned nb_fired;
+    uint64_t fired_at;
+};
+
+static void fire_cb(struct wheel_timer *timer, void *now_)
+{
+    uint64_t const *now = now_;
+    struct w_timer *t = DOWNCAST(timer, timer, w_timer);
+    assert(! wheel_timer_is_armed(timer));
+    t->nb_fired ++;
+    t->fired_at = *now;
+}
+
+static void simple_check(void)
+{
+    struct wheel wheel;
+    wheel_ctor(&wheel, 1000);
+
+    struct w_timer t = { .nb_fired = 0 };
+    wheel_timer_ctor(&t.timer);
+    assert(! wheel_timer_is_armed(&t.timer));
+
+    uint64_t now = 1000;
+    wheel_add(&wheel, &t.timer, 1010);
+    assert(wheel_timer_is_armed(&t.timer));
+    assert(wheel.count == 1);
+    assert(wheel.max_expiry == 1010);
+
+    now = 1009;
+    assert(0 == wheel_advance(&wheel, now, 0, fire_cb, &now));
+    assert(t.nb_fired == 0);
+    now = 1010;
+    assert(1 == wheel_advance(&wheel, now, 0, fire_cb, &now));
+    assert(t.nb_fired == 1);
+    assert(wheel.count == 0);
+
+    // Deleted timers do not fire
+    wheel_add(&wheel, &t.timer, 2000);
+    wheel_del(&wheel, &t.timer);
+    wheel_del(&wheel, &t.timer);    // twice is OK
+    now = 3000;
+    assert(0 == wheel_advance(&wheel, now, 0, fire_cb, &now));
+
+    // Expiry in the past fires on next tick
+    wheel_add(&wheel, &t.timer, 10);
+    assert(0 == wheel_advance(&wheel, now, 0, fire_cb, &now));
+    now ++;
+    assert(1 == wheel_advance(&wheel, now, 0, fire_cb, &now));
+    assert(t.nb_fired == 2);
+
+    wheel_dtor(&wheel);
+}
+
+// Arm many timers at random times, then advance by random steps and check that each timer fires once and in time
+static void random_check(unsigned nb_timers, uint64_t max_delay)
+{
+    struct wheel wheel;
+    uint64_t now = 123456;
+    wheel_ctor(&wheel, now);
+
+    struct w_timer *timers = malloc(nb_timers * sizeof(*timers));
+    assert(timers);
+    for (unsigned i = 0; i < nb_timers; i++) {
+        timers[i].nb_fired = 0;
+        wheel_timer_ctor(&timers[i].timer);
+        wheel_add(&wheel, &timers[i].timer, now + (uint64_t)rand() % max_delay);
+    }
+    assert(wheel.count == nb_timers);
+
+    uint64_t const end = now + max_delay;
+    while (now < end) {
+        uint64_t const prev = now;
+        now += 1 + (uint64_t)rand() % (max_delay / 100);
+        (void)wheel_advance(&wheel, now, 0, fire_cb, &now);
+        for (unsigned i = 0; i < nb_timers; i++) {
+            if (timers[i].timer.expiry <= now) {
+                assert(timers[i].nb_fired == 1);
+                // fired by the first advance reaching its expiry
+                if (timers[i].timer.expiry > prev) assert(timers[i].fired_at == now);
+            } else {
+                assert(timers[i].nb_fired == 0);
+            }
+        }
+    }
+    assert(wheel.count == 0);
+
+    free(timers);
+    wheel_dtor(&wheel);
+}
+
+// The callback rearms the timer: it must wait for next advance
+static void rearm_cb(struct wheel_timer *timer, void *wheel_)
+{
+    struct wheel *wheel = wheel_;
+    struct w_timer *t = DOWNCAST(timer, timer, w_timer);
+    t->nb_fired ++;
+    wheel_add(wheel, timer, timer->expiry); // same expiry
+}
+
+static void rearm_check(void)
+{
+    struct wheel wheel;
+    wheel_ctor(&wheel, 0);
+    struct w_timer t[10];
+    for (unsigned i = 0; i < NB_ELEMS(t); i++) {
+        t[i].nb_fired = 0;
+        wheel_timer_ctor(&t[i].timer);
+        wheel_add(&wheel, &t[i].timer, 5);
+    }
+
+    // With a budget
+    assert(4 == wheel_advance(&wheel, 5, 4, rearm_cb, &wheel));
+    assert(4 == wheel_advance(&wheel, 5, 4, rearm_cb, &wheel));
+    assert(2 == wheel_advance(&wheel, 5, 4, rearm_cb, &wheel));
+    assert(0 == wheel_advance(&wheel, 5, 4, rearm_cb, &wheel));
+    for (unsigned i = 0; i < NB_ELEMS(t); i++) assert(t[i].nb_fired == 1);
+
+    // Rearmed ones fire on next tick
+    assert(10 == wheel_advance(&wheel, 6, 0, rearm_cb, &wheel));
+    assert(wheel.count == NB_ELEMS(t));
+
+    // Reset fires everything
+    uint64_t now = 0;
+    assert(10 == wheel_reset(&wheel, 0, fire_cb, &now));
+    assert(wheel.count == 0);
+    assert(wheel.now == 0);
+
+    wheel_dtor(&wheel);
+}
+
+static void timeout_check(void)
+{
+    struct wheel wheel;
+    wheel_ctor(&wheel, 0);
+    struct w_timer t = { .nb_fired = 0 };
+    wheel_timer_ctor(&t.timer);
+
+    // First run: the wheel lags far behind and is reset
+    uint64_t now = 1000000000;
+    wheel_add(&wheel, &t.timer, now + 10);
+    assert(1 == wheel_timeout(&wheel, now, now + 100, 0, fire_cb, &now));
+    assert(wheel.now == now + 1);
+    assert(t.nb_fired == 1);
+
+    // Normal operation
+    wheel_add(&wheel, &t.timer, now + 10);
+    assert(0 == wheel_timeout(&wheel, now + 9, now + 100, 0, fire_cb, &now));
+    assert(1 == wheel_timeout(&wheel, now + 10, now + 100, 0, fire_cb, &now));
+    assert(t.nb_fired == 2);
+
+    // Clock going backward
+    wheel_add(&wheel, &t.timer, now + 50);
+    now = 1000;
+    assert(1 == wheel_timeout(&wheel, now, now + 100, 0, fire_cb, &now));
+    assert(wheel.now == now + 1);
+    assert(wheel.count == 0);
+
+    wheel_dtor(&wheel);
+}
+
+int main(void)
+{
+    srand(42);
+    simple_check();
+    random_check(1000, 100);
+    random_check(1000, 10000);
+    random_check(1000, 1000000);
+    random_check(100, WHEEL_MAX_DELAY * 3);
+    rearm_check();
+    timeout_check();
+    return EXIT_SUCCESS;
+}